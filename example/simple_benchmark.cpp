@@ -14,7 +14,8 @@ inline void sleep_ms(long long val) {
   std::this_thread::sleep_for(std::chrono::milliseconds(val));
 }
 
-void algorithm1() {
+void algorithm1(int index) {
+  R_THREAD_NAME("worker " + std::to_string(index)); // name for View::threads
   R_BENCHMARK_SCOPED_L("algo_1");
   for (int i = 0; i < 10; i++) {
     R_BENCHMARK_SCOPED("step_1_1");
@@ -43,6 +44,7 @@ void algorithm2() {
   R_BENCHMARK_START("algo_2");
   for (int i = 0; i < 50; i++) {
     R_BENCHMARK_START("step_2_1");
+    R_COUNTER("sleep_ms", i);
     sleep_ms((long long)i);
     R_BENCHMARK_STOP("step_2_1");
   }
@@ -51,11 +53,16 @@ void algorithm2() {
 
 int main(int argc, const char * argv[]) {
   std::cout << "Program started" << std::endl;
-  std::thread t1(algorithm1);
-  std::thread t2(algorithm1);
-  std::thread t3(algorithm1);
-  std::thread t4(algorithm1);
+  std::thread t1(algorithm1, 1);
+  std::thread t2(algorithm1, 2);
+  std::thread t3(algorithm1, 3);
+  std::thread t4(algorithm1, 4);
   std::thread t5(algorithm2);
+
+  // live threads are listed one by one, so a straggler is easy to spot
+  sleep_ms(300);
+  R_BENCHMARK_LOG(roadar::Field::lastAverage, roadar::Format::table, &std::cout, roadar::View::threads);
+
   t1.join();
   t2.join();
   t3.join();
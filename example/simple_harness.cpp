@@ -0,0 +1,32 @@
+//
+// Harness usage: same identifiers in lab runs and in production
+//
+
+
+#include <iostream>
+#include <vector>
+#include <numeric>
+#include <roadar/benchmark.hpp>
+
+static std::vector<int> frame(1 << 16, 1);
+
+int decodeFrame() {
+  R_BENCHMARK_SCOPED("sum");
+  return std::accumulate(frame.begin(), frame.end(), 0);
+}
+
+int main(int argc, const char * argv[]) {
+  volatile int sink = 0;
+  R_BENCHMARK_REGISTER("decode", [&sink] { sink = decodeFrame(); });
+  R_BENCHMARK_REGISTER("resize", [&sink] {
+    std::vector<int> resized(frame.begin(), frame.begin() + frame.size() / 2);
+    sink = resized.back();
+  });
+
+  roadar::HarnessOptions options;
+  options.minTimeMs = 20;
+  roadar::benchmarkRunRegistered(options, "", &std::cout);
+  // repetitions are also recorded into the regular measurement tree
+  std::cout << R_BENCHMARK_LOG(roadar::Field::lastAverage) << std::endl;
+  return 0;
+}
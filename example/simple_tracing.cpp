@@ -27,6 +27,7 @@ public:
         cv_.wait_for(lock, std::chrono::milliseconds(interruptWaitMs_));
 //      cv_.wait(lock, [&] { return count_ < maxCount_; });
       count_++;
+      R_COUNTER("queue_depth", count_);
     }
     cv_.notify_one();
   }
@@ -36,6 +37,7 @@ public:
       cv_.wait_for(lock, std::chrono::milliseconds(interruptWaitMs_));
 //    cv_.wait(lock, [&] { return count_ > 0; });
     count_--;
+    R_COUNTER("queue_depth", count_);
   }
 private:
   std::mutex mtx_;
@@ -50,6 +52,7 @@ void produceLoop(int threadId, SimpleSemaphore *semaphore, int count, long long
   R_TRACING_THREAD_NAME("produce_"+ std::to_string(threadId));
   for (int i = 0; i < count; i++) {
     R_BENCHMARK_SCOPED_L("produce");
+    R_BENCHMARK_ARG("frame", i);
     R_BENCHMARK("prepare") {
       sleep_ms(delay);
     }
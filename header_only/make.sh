@@ -1,7 +1,27 @@
 #!/bin/bash
+# Generate H-only file from hpp and cpp files
+#
+# Все функции и глобальные переменные становятся inline (нужен C++17): в программе одно
+# состояние библиотеки на все единицы трансляции, а start/stop могут встраиваться в место вызова.
 
-# Generate H-only file from hpp
-sed "s/define R_FUNC/define R_FUNC static/g" ../include/roadar/benchmark.hpp > rbenchmark.hpp
+cd "$(dirname "$0")"
 
-# Append cpp with remove unnecessary include
-grep -v "\<roadar\/benchmark.hpp\>" ../src/benchmark.cpp >> ./rbenchmark.hpp
\ No newline at end of file
+OUT=rbenchmark.hpp
+
+# R_FUNC объявлен во всех публичных функциях, inline переходит и на их определения
+sed "s/^#define R_FUNC$/#define R_FUNC inline/" ../include/roadar/benchmark.hpp > $OUT
+
+# Заголовки без #pragma once, они уже внутри одного файла
+for header in ../include/roadar/tracing.hpp ../src/trace_compression.hpp ../src/binary_trace.hpp ../src/json_reader.hpp ../src/trace_stats.hpp; do
+  echo "" >> $OUT
+  grep -v "^#pragma once\|#include <roadar/" $header >> $OUT
+done
+
+# Файловые static -> inline, определения методов вне класса (Class::method) -> inline
+for source in ../src/trace_compression.cpp ../src/binary_trace.cpp ../src/tracing.cpp ../src/json_reader.cpp ../src/trace_stats.cpp ../src/benchmark.cpp ../src/harness.cpp; do
+  echo "" >> $OUT
+  grep -v "#include <roadar/\|#include \"" $source \
+    | sed -e "s/^static /inline /" -e "s/^static$/inline/" \
+          -e "s/^\(const \)\?\([A-Za-z_][A-Za-z0-9_:<>]* \**\)\?\([A-Za-z_][A-Za-z0-9_]*::~\?[A-Za-z_][A-Za-z0-9_]*(\)/inline \1\2\3/" \
+    >> $OUT
+done
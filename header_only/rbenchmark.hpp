@@ -6,12 +6,25 @@
 #pragma once
 
 #include <string>
+#include <type_traits>
+#include <functional>
+#include <vector>
+#include <ostream>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define R_BENCHMARK_COROUTINES
+#endif
+#endif
 
-#define R_FUNC static
+#define R_FUNC inline
 
 #ifndef BENCHMARK_DISABLED
 #define R_BENCHMARK_START(_identifier_) roadar::benchmarkStart(_identifier_, __FILE__, __LINE__)
 #define R_BENCHMARK_STOP(_identifier_) roadar::benchmarkStop(_identifier_, __FILE__, __LINE__)
+//-V:R_BENCHMARK:1044
 #define R_BENCHMARK(_identifier_)                                  \
  for (bool _r_bench_bool = R_BENCHMARK_START(_identifier_); _r_bench_bool; _r_bench_bool = false, R_BENCHMARK_STOP(_identifier_))
 
@@ -23,13 +36,45 @@
 #define R_BENCHMARK_SCOPED_RESET(_identifier_) r_bench.reset(_identifier_)
 #define R_BENCHMARK_SCOPED_L(_identifier_) R_HIDDEN_SCOPED_L_(_identifier_, __LINE__)
 
+// замеры по категориям: политика категории выбирается при компиляции, см. CategoryPolicy
+#define R_BENCHMARK_CATEGORY(_category_, _mode_, _sample_every_)                                  \
+ namespace roadar { namespace category { struct _category_; }                                     \
+ template <> struct CategoryPolicy<category::_category_> {                                        \
+   static constexpr CategoryMode mode = CategoryMode::_mode_;                                     \
+   static constexpr unsigned sampleEvery = (_sample_every_) > 0 ? (_sample_every_) : 1;           \
+ }; }
+// идентификатор вычисляется только если категория записывается
+#define R_HIDDEN_CAT_L__(_category_, _identifier_, line)                                          \
+ roadar::CategoryScopedBenchmark<roadar::category::_category_> r_bench_cat##line(                 \
+   [&]() -> decltype((_identifier_)) { return (_identifier_); })
+#define R_HIDDEN_CAT_L_(_category_, _identifier_, line) R_HIDDEN_CAT_L__(_category_, _identifier_, line)
+#define R_BENCHMARK_CAT(_category_, _identifier_) R_HIDDEN_CAT_L_(_category_, _identifier_, __LINE__)
+
+// замер внутри C++20 корутины, см. CoroutineSpan
+#define R_BENCHMARK_COROUTINE(_identifier_) roadar::CoroutineSpan r_bench_co(_identifier_)
+#define R_CO_AWAIT(...) (co_await r_bench_co.await(__VA_ARGS__))
+
 #define R_BENCHMARK_LOG(_without_fields_, ...) roadar::benchmarkLog(_without_fields_, ##__VA_ARGS__)
 #define R_BENCHMARK_RESET() roadar::benchmarkReset()
 
+#define R_COUNTER(_identifier_, _value_) roadar::benchmarkCounter(_identifier_, _value_)
+#define R_BENCHMARK_REGISTER(_identifier_, _callable_) roadar::benchmarkRegister(_identifier_, _callable_)
+#define R_BENCHMARK_ARG(_key_, _value_) roadar::benchmarkSpanArg(_key_, _value_)
+#define R_BENCHMARK_BUDGET(_identifier_, _max_ms_) roadar::benchmarkSetBudget(_identifier_, _max_ms_)
+
 // To view result of tracing use https://ui.perfetto.dev/
 #define R_TRACING_START(_file_name_) roadar::benchmarkStartTracing(_file_name_, __FILE__, __LINE__)
 #define R_TRACING_STOP() roadar::benchmarkStopTracing()
+#define R_TRACING_START_BINARY(_file_name_, _capacity_mb_) roadar::benchmarkStartBinaryTracing(_file_name_, _capacity_mb_, __FILE__, __LINE__)
 #define R_TRACING_THREAD_NAME(_thread_name_) roadar::benchmarkTracingThreadName(_thread_name_)
+#define R_THREAD_NAME(_thread_name_) roadar::benchmarkThreadName(_thread_name_)
+
+#define R_FLIGHT_RECORDER_START(_dump_file_name_, _keep_seconds_) roadar::benchmarkStartFlightRecorder(_dump_file_name_, _keep_seconds_)
+#define R_FLIGHT_RECORDER_STOP() roadar::benchmarkStopFlightRecorder()
+#define R_FLIGHT_RECORDER_DUMP() roadar::benchmarkDumpFlightRecorder()
+
+#define R_SAMPLER_START(_frequency_hz_) roadar::benchmarkStartSampler(_frequency_hz_)
+#define R_SAMPLER_STOP() roadar::benchmarkStopSampler()
 
 #else
 #define R_BENCHMARK_START(_identifier_)
@@ -38,11 +83,26 @@
 #define R_BENCHMARK_SCOPED(_identifier_)
 #define R_BENCHMARK_SCOPED_RESET(_identifier_)
 #define R_BENCHMARK_SCOPED_L(_identifier_)
+#define R_BENCHMARK_CATEGORY(_category_, _mode_, _sample_every_)
+#define R_BENCHMARK_CAT(_category_, _identifier_)
+#define R_BENCHMARK_COROUTINE(_identifier_)
+#define R_CO_AWAIT(...) (co_await (__VA_ARGS__))
 #define R_BENCHMARK_LOG(_without_fields_) "Benchmark disabled"
 #define R_BENCHMARK_RESET()
+#define R_COUNTER(_identifier_, _value_)
+#define R_BENCHMARK_REGISTER(_identifier_, _callable_)
+#define R_BENCHMARK_ARG(_key_, _value_)
+#define R_BENCHMARK_BUDGET(_identifier_, _max_ms_)
 #define R_TRACING_START(_file_name_)
 #define R_TRACING_STOP()
+#define R_TRACING_START_BINARY(_file_name_, _capacity_mb_)
 #define R_TRACING_THREAD_NAME(_name_)
+#define R_THREAD_NAME(_name_)
+#define R_FLIGHT_RECORDER_START(_dump_file_name_, _keep_seconds_)
+#define R_FLIGHT_RECORDER_STOP()
+#define R_FLIGHT_RECORDER_DUMP()
+#define R_SAMPLER_START(_frequency_hz_)
+#define R_SAMPLER_STOP()
 #endif
 
 //!
@@ -64,14 +124,145 @@ namespace roadar {
 * \return Всегда возвращает `true`
 */
   R_FUNC
-  bool benchmarkStart(const std::string &identifier, const std::string &file = "", int line = 0);
+  bool benchmarkStart(const std::string &identifier, const char *file = "", int line = 0);
+  R_FUNC
+  bool benchmarkStart(const char *identifier, const char *file = "", int line = 0);
 
 /*!
 * \brief Конец бенчмарка.
 * \param[in] identifier Идентификатор.
 */
   R_FUNC
-  void benchmarkStop(const std::string &identifier, const std::string &file = "", int line = 0);
+  void benchmarkStop(const std::string &identifier, const char *file = "", int line = 0);
+  R_FUNC
+  void benchmarkStop(const char *identifier, const char *file = "", int line = 0);
+
+/*!
+* \brief Начало замера для `ScopedBenchmark`.
+* \return Описатель открытого замера для `benchmarkStopScoped`, `nullptr` если замер не открыт
+* (поток на паузе или ошибка). Повторный запуск того же замера не выделяет память.
+*/
+  R_FUNC
+  void *benchmarkStartScoped(const std::string &identifier);
+  R_FUNC
+  void *benchmarkStartScoped(const char *identifier);
+
+/*!
+* \brief Конец замера, открытого `benchmarkStartScoped`: без поиска и сравнения строк.
+*/
+  R_FUNC
+  void benchmarkStopScoped(void *handle);
+
+  /// Состояние замера, который прерывается и продолжается, возможно в другом потоке (корутины)
+  struct SuspendableSpan {
+    void *handle = nullptr;             ///< открытый отрезок, `nullptr` пока замер приостановлен
+    unsigned long long startTime = 0;   ///< начало первого отрезка
+    unsigned long long activeTime = 0;  ///< сумма закрытых отрезков
+  };
+
+/*!
+* \brief Открывает очередной отрезок прерываемого замера внутри последнего открытого замера текущего потока.
+*/
+  R_FUNC
+  void benchmarkSpanResume(SuspendableSpan &span, const std::string &identifier);
+
+/*!
+* \brief Закрывает отрезок прерываемого замера, каждый отрезок попадает в трейс отдельно.
+* \param[in] finish Последний отрезок: исполнение засчитывается со временем всех отрезков,
+* а время от начала до конца вместе с приостановками выводится в колонке `elapsed`.
+*/
+  R_FUNC
+  void benchmarkSpanSuspend(SuspendableSpan &span, bool finish = false);
+
+/*!
+* \brief Записывает значение счетчика (глубина очереди, размер кадра и т.п.).
+* В логе выводятся last/min/max/avg, при записи трейсинга сохраняется как counter трек.
+* \param[in] identifier Идентификатор счетчика.
+* \param[in] value Текущее значение.
+*/
+  R_FUNC
+  void benchmarkCounter(const std::string &identifier, double value);
+
+/*!
+* \brief Добавляет аргумент к последнему запущенному замеру текущего потока.
+* Аргументы хранятся в бинарном виде и форматируются только при записи трейсинга (`args` в Perfetto).
+* \param[in] key Имя аргумента, строковый литерал или результат `benchmarkIntern`.
+* \param[in] value Значение.
+*/
+  R_FUNC
+  void benchmarkSpanArg(const char *key, long long value);
+  R_FUNC
+  void benchmarkSpanArg(const char *key, double value);
+/*!
+* \param[in] value Строковый литерал или результат `benchmarkIntern`, строка не копируется.
+*/
+  R_FUNC
+  void benchmarkSpanArg(const char *key, const char *value);
+
+  template<typename T>
+  inline typename std::enable_if<std::is_integral<T>::value>::type
+  benchmarkSpanArg(const char *key, T value) {
+    benchmarkSpanArg(key, static_cast<long long>(value));
+  }
+  template<typename T>
+  inline typename std::enable_if<std::is_floating_point<T>::value>::type
+  benchmarkSpanArg(const char *key, T value) {
+    benchmarkSpanArg(key, static_cast<double>(value));
+  }
+
+/*!
+* \brief Сохраняет строку на все время работы программы.
+* \return Указатель, который можно передавать в `benchmarkSpanArg` без копирования.
+*/
+  R_FUNC
+  const char *benchmarkIntern(const std::string &value);
+
+/*!
+* \brief Конец бенчмарка, за время которого код был исполнен `times` раз (например, цикл из `times` итераций).
+* В статистику попадает `times` исполнений со средним временем.
+*/
+  R_FUNC
+  void benchmarkStopBatch(const std::string &identifier, unsigned long times);
+
+/*!
+* \brief Временно отключает запись замеров в текущем потоке (вызовы start/stop игнорируются).
+* Переключать только вне открытых замеров.
+*/
+  R_FUNC
+  void benchmarkPauseThread(bool paused);
+
+/*!
+* \brief Измеряет стоимость пустой пары start/stop на этой машине (в отдельном потоке).
+* Измеряются только таймер и дерево замеров: калибровка не пишется в трейсинг, flight recorder и лог.
+* После калибровки стоимость выводится в заголовке лога.
+* \return Время пары в микросекундах.
+*/
+  R_FUNC
+  double benchmarkCalibrate(int iterations = 100000);
+
+/*!
+* \brief Вычитать стоимость вложенных замеров из total, avg и missed родителей.
+* Если калибровка не проводилась, она выполнится при первом `benchmarkLog`.
+*/
+  R_FUNC
+  void benchmarkSetOverheadCompensation(bool enabled);
+
+/*!
+* \brief Сколько идентификаторов с наибольшим собственным временем выводит `View::flat`.
+* \param[in] top Число строк, 0 - все. По умолчанию 30.
+*/
+  R_FUNC
+  void benchmarkSetFlatViewTop(size_t top);
+
+/*!
+* \brief Лимиты числа узлов дерева замеров, защищают от идентификаторов вида `"request_" + std::to_string(id)`.
+* Новые идентификаторы сверх лимита записываются в общий узел `(other)` того же уровня,
+* уровни с переполнением выводятся в логе в разделе "Cardinality overflow".
+* \param[in] maxChildren Разных идентификаторов внутри одного замера (и на верхнем уровне), 0 - по умолчанию (1000).
+* \param[in] maxTotalNodes Разных путей замеров всего, 0 - по умолчанию (100000).
+*/
+  R_FUNC
+  void benchmarkSetCardinalityLimits(size_t maxChildren, size_t maxTotalNodes = 0);
 
   enum class Field {
     none          = 0,
@@ -79,8 +270,11 @@ namespace roadar {
     times         = 1<<1,   // 0x02
     average       = 1<<2,   // 0x04
     lastAverage   = 1<<3,   // 0x08
-    percent       = 1<<4,   // 0x10
-    percentMissed = 1<<5    // 0x20
+    running       = 1<<4,   // 0x10
+    percent       = 1<<5,   // 0x20
+    percentMissed = 1<<6,   // 0x40
+    budget        = 1<<7,   // 0x80
+    drift         = 1<<8    // 0x100
   };
   R_BENCHMARK_ENUM_FLAG_OPERATORS(Field)
 
@@ -89,13 +283,95 @@ namespace roadar {
     json = 1
   };
 
+  enum class TraceCompression {
+    none = 0,
+    gzip = 1,     ///< zlib, если библиотека собрана с ним, иначе lz
+    lz = 2        ///< встроенный LZ-формат, распаковка - `trace_unpack`
+  };
+
+  enum class View {
+    tree = 0,     ///< все потоки объединены в одно дерево
+    threads = 1,  ///< дерево + замеры каждого потока и разброс между потоками (min/avg/max, imbalance = max/avg)
+    flat = 2      ///< идентификаторы по собственному времени (без вложенных замеров), сложенные по всем путям и потокам
+  };
+
+  struct BudgetViolation {
+    std::string identifier;
+    std::string path;   ///< полный путь замера, через " » "
+    double timeMs;
+    double budgetMs;
+  };
+
+/*!
+* \brief Задает бюджет времени для всех замеров с идентификатором `identifier`.
+* Превышения считаются в `benchmarkStop` (одно сравнение с порогом, сохраненным в узле),
+* выводятся в логе колонками budget/over/max и отдельным списком нарушителей.
+* \param[in] maxMs Допустимое время в миллисекундах, `<= 0` снимает бюджет.
+*/
+  R_FUNC
+  void benchmarkSetBudget(const std::string &identifier, double maxMs);
+/*!
+* \brief Callback при превышении бюджета, вызывается в потоке замера. Пустая функция отключает.
+*/
+  R_FUNC
+  void benchmarkSetBudgetCallback(std::function<void(const BudgetViolation &)> callback);
+
+  struct RegressionInfo {
+    std::string identifier;
+    std::string path;   ///< полный путь замера, через " » "
+    double baselineMs;  ///< среднее время в baseline
+    double currentMs;   ///< среднее время последних замеров
+    double drift;       ///< относительное замедление, 0.25 = на 25% медленнее
+    double score;       ///< значимость замедления (Welch t-test)
+  };
+
+/*!
+* \brief Сохраняет текущую статистику как baseline (JSON) для сравнения в следующих запусках.
+*/
+  R_FUNC
+  bool benchmarkSaveBaseline(const std::string &path, std::string *outError = nullptr);
+/*!
+* \brief Загружает baseline: файл из `benchmarkSaveBaseline` или JSON из `benchmarkLog(..., Format::json)`.
+* Последние замеры каждого узла постоянно сравниваются с baseline, в логе выводится колонка drift
+* (значимое замедление помечается `!`), при появлении замедления вызывается callback.
+*/
+  R_FUNC
+  bool benchmarkLoadBaseline(const std::string &path, std::string *outError = nullptr);
+/*!
+* \brief Пороги регрессии: замедление считается значимым, если оно не меньше `minDrift` (0.1 = 10%)
+* и отличается от baseline не меньше чем на `minScore` стандартных ошибок.
+*/
+  R_FUNC
+  void benchmarkSetRegressionThreshold(double minScore = 3.0, double minDrift = 0.1);
+/*!
+* \brief Callback при обнаружении замедления, вызывается в потоке замера. Пустая функция отключает.
+*/
+  R_FUNC
+  void benchmarkSetRegressionCallback(std::function<void(const RegressionInfo &)> callback);
+
 /*!
 * \brief Бенчмарк-лог.
+* \param[in] view `View::threads` - для каждого узла вывести замеры по потокам,
+* имена потоков задаются через `R_TRACING_THREAD_NAME` (работает и без трейсинга).
 * \return Текст лога.
 */
   R_FUNC
   std::string benchmarkLog(Field withoutFields = Field::none, Format format = Format::table,
-                           std::ostream *out = nullptr);
+                           std::ostream *out = nullptr, View view = View::tree);
+
+/*!
+* \brief Бенчмарк-лог по файлу трейсинга (`R_TRACING_START`, в том числе сжатому), например записанному не на этой машине.
+* Вложенность замеров восстанавливается в каждом потоке по началу и длительности, файл читается по одному событию.
+* \param[in] fromSec, toSec Окно в секундах от самого раннего события трейса, `toSec <= 0` - до конца.
+* Замеры на границе окна учитываются только своей частью внутри окна.
+* \param[out] outError Ошибка чтения, пусто если лог построен. Предупреждения (файл оборван,
+* вложенность части замеров приблизительна) выводятся в заголовке таблицы.
+* \return Текст лога, при ошибке чтения - текст ошибки в формате `format`.
+*/
+  R_FUNC
+  std::string benchmarkLogFromTrace(const std::string &tracePath, double fromSec = 0, double toSec = 0,
+                                    Field withoutFields = Field::none, Format format = Format::table,
+                                    std::ostream *out = nullptr, View view = View::tree, std::string *outError = nullptr);
 
 /*!
 * \brief Очищает все завершенные замеры
@@ -104,770 +380,6060 @@ namespace roadar {
   void benchmarkReset();
 
 
+  /// Хранит только описатель открытого замера, идентификатор не копируется
   class ScopedBenchmark {
   public:
-    explicit ScopedBenchmark(const std::string& identifier): m_identifier(identifier) {
+    explicit ScopedBenchmark(const char *identifier) {
+#ifndef BENCHMARK_DISABLED
+      m_handle = benchmarkStartScoped(identifier);
+#endif
+    }
+    explicit ScopedBenchmark(const std::string& identifier) {
+#ifndef BENCHMARK_DISABLED
+      m_handle = benchmarkStartScoped(identifier);
+#endif
+    }
+    ScopedBenchmark(const ScopedBenchmark &) = delete;
+    ScopedBenchmark &operator=(const ScopedBenchmark &) = delete;
+
+    void reset(const char *newIdentifier) {
 #ifndef BENCHMARK_DISABLED
-      benchmarkStart(identifier);
+      benchmarkStopScoped(m_handle);
+      m_handle = benchmarkStartScoped(newIdentifier);
 #endif
     }
     void reset(const std::string& newIdentifier) {
 #ifndef BENCHMARK_DISABLED
-      benchmarkStop(m_identifier);
-      m_identifier = newIdentifier;
-      benchmarkStart(m_identifier);
+      benchmarkStopScoped(m_handle);
+      m_handle = benchmarkStartScoped(newIdentifier);
 #endif
     }
     ~ScopedBenchmark() {
 #ifndef BENCHMARK_DISABLED
-      benchmarkStop(m_identifier);
+      benchmarkStopScoped(m_handle);
 #endif
     }
   private:
-    std::string m_identifier;
+    void *m_handle = nullptr;
+  };
+
+  enum class CategoryMode {
+    full = 0,     ///< записывается каждый вызов
+    sampled = 1,  ///< записывается каждый `sampleEvery`-й вызов в потоке
+    off = 2       ///< замер не попадает в бинарник
   };
 
-//
 /*!
-* \brief Use this function when you want to start capture tracing.
- * To view result of tracing use https://ui.perfetto.dev/
-* \param[in] writeJsonPath Save results of
-*
+* \brief Политика категории замеров, задается через `R_BENCHMARK_CATEGORY(name, mode, sampleEvery)`.
+* Например, подробные замеры внутренних циклов можно выключить в release сборке,
+* оставив верхнеуровневые этапы:
+* \code
+* #ifdef NDEBUG
+* R_BENCHMARK_CATEGORY(inner, off, 1)
+* #else
+* R_BENCHMARK_CATEGORY(inner, sampled, 100)
+* #endif
+* ...
+* R_BENCHMARK_CAT(inner, "decode");
+* \endcode
 */
-  R_FUNC
-  void benchmarkStartTracing(const std::string &writeJsonPath, const std::string &file = "", int line = 0);
-  R_FUNC
-  void benchmarkStopTracing();
-  R_FUNC
-  void benchmarkTracingThreadName(const std::string &name);
-} // namespace RoadarNumbers
-#include <algorithm>
-#include <fstream>
-#include <iostream>
-#include <unordered_map>
-#include <mutex>
-#include <vector>
-#include <sstream>
-#include <thread>
-#include <iomanip>
-#include <chrono>
-#include <memory> // unique_ptr
-
-#ifndef _WIN32
-#include <sys/time.h>
-#endif
-
-#ifndef CAPTURE_LAST_N_TIMES
-#define CAPTURE_LAST_N_TIMES 10
-#endif
-
-
-// -------------------------------------------------
-
-namespace roadar {
-static const std::string kNestingString = " » ";
-
-
-typedef unsigned long long timestamp_t;
-
-#ifndef BENCHMARK_DISABLED
-  static timestamp_t get_timestamp() {
-  //TODO Тут отличие от github версии
-  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
-      .count();
-}
-#endif
-
-namespace Tracing {
-  struct TraceInfo {
-    std::string name;
-    std::thread::id tid; // thread id
-    timestamp_t startTime;
-    timestamp_t duration;
-    int stackDepth;
+  template <typename Category>
+  struct CategoryPolicy {
+    static constexpr CategoryMode mode = CategoryMode::full;
+    static constexpr unsigned sampleEvery = 1;
   };
 
-  class Serializer {
+  /// Замер в текущем скопе, `identifier` - функция, возвращающая идентификатор
+  template <typename Category, CategoryMode Mode = CategoryPolicy<Category>::mode>
+  class CategoryScopedBenchmark {
   public:
-    Serializer(const Serializer&) = delete;
-    Serializer(Serializer&&) = delete;
-
-    Serializer(const std::string& filepath, bool flushOnMeasure, std::string &outErrMsg)
-            : flushOnMeasure_(flushOnMeasure) {
-      std::lock_guard<std::mutex> lock(mut_);
-      outStream_.open(filepath);
-
-      if (outStream_.is_open()) {
-        writeHeader();
-      } else {
-        outErrMsg = "RBenchmark::Tracing::Serializer could not open results file:\n" + filepath;
-      }
-    }
-    ~Serializer() {
-      end();
+    template <typename Identifier>
+    explicit CategoryScopedBenchmark(Identifier &&identifier): m_handle(benchmarkStartScoped(identifier())) {}
+    CategoryScopedBenchmark(const CategoryScopedBenchmark &) = delete;
+    CategoryScopedBenchmark &operator=(const CategoryScopedBenchmark &) = delete;
+    ~CategoryScopedBenchmark() {
+      benchmarkStopScoped(m_handle);
     }
+  private:
+    void *m_handle;
+  };
 
-    void end() {
-      std::lock_guard<std::mutex> lock(mut_);
-      if (!outStream_.is_open()) return;
-      sort(data_.begin(), data_.end(), [](const TraceInfo &a, const TraceInfo &b) -> bool {
-        if (a.startTime == b.startTime) {
-          if (a.duration == b.duration) {
-            return a.stackDepth < b.stackDepth;
-          } else {
-            return a.duration > b.duration;
-          }
-        } else {
-          return a.startTime < b.startTime;
-        }
-      });
-      {
-        std::lock_guard<std::mutex> lock(threadIdMutex_);
-        for (const auto &d: data_) {
-          write(d, true);
-        }
+  /// Записывается только каждый `sampleEvery`-й вызов; avg и max по выборке, times и total - примерно 1/sampleEvery от полных
+  template <typename Category>
+  class CategoryScopedBenchmark<Category, CategoryMode::sampled> {
+  public:
+    template <typename Identifier>
+    explicit CategoryScopedBenchmark(Identifier &&identifier) {
+      if (counter()++ % CategoryPolicy<Category>::sampleEvery == 0) {
+        m_handle = benchmarkStartScoped(identifier());
       }
-      data_.clear();
-      writeFooter();
-      outStream_.close();
     }
-
-
-    void saveTrace(TraceInfo info) {
-      std::lock_guard<std::mutex> lock(mut_);
-      data_.push_back(std::move(info));
+    CategoryScopedBenchmark(const CategoryScopedBenchmark &) = delete;
+    CategoryScopedBenchmark &operator=(const CategoryScopedBenchmark &) = delete;
+    ~CategoryScopedBenchmark() {
+      if (m_handle) benchmarkStopScoped(m_handle);
     }
+  private:
+    void *m_handle = nullptr;
 
-    void write(const TraceInfo& info, bool threadSafe = false) {
-      std::stringstream json;
-
-      auto tidIdx = getThreadIdx(info.tid, false);
-      json << std::setprecision(3) << std::fixed;
-      json << ",{";
-      json << "\"cat\":\"function\",";
-      json << "\"dur\":" << (info.duration) << ',';
-      json << "\"name\":\"" << info.name << "\",";
-      json << "\"ph\":\"X\",";
-      json << "\"pid\":0,";
-      json << "\"tid\":" << tidIdx << ",";
-      json << "\"ts\":" << info.startTime;
-      json << "}";
-
-      if (threadSafe) {
-        write(json.str(), flushOnMeasure_);
-      } else {
-        std::lock_guard<std::mutex> lock(mut_);
-        write(json.str(), flushOnMeasure_);
-      }
+    static unsigned &counter() {
+      static thread_local unsigned value = 0;
+      return value;
     }
+  };
 
-    void writeThreadName(const std::thread::id &tid, const std::string &name) {
-      std::stringstream json;
-
-      auto tidIdx = getThreadIdx(tid, true);
-      json << std::setprecision(3) << std::fixed;
-      json << ",{";
-      json << "\"cat\":\"function\",";
-      json << "\"name\":\"thread_name\",";
-      json << "\"ph\":\"M\",";
-      json << "\"pid\":0,";
-      json << "\"tid\":" << tidIdx << ",";
-      json << "\"args\":{\"name\":\"" << name << "\"}";
-      json << "}";
+  /// Выключенная категория: ни вызовов, ни вычисления идентификатора
+  template <typename Category>
+  class CategoryScopedBenchmark<Category, CategoryMode::off> {
+  public:
+    template <typename Identifier>
+    explicit CategoryScopedBenchmark(Identifier &&) {}
+  };
 
-      std::lock_guard<std::mutex> lock(mut_);
-      write(json.str(), flushOnMeasure_);
+#if defined(R_BENCHMARK_COROUTINES) && !defined(BENCHMARK_DISABLED)
+/*!
+* \brief Замер внутри корутины (C++20): приостановки в `co_await` не входят во время замера.
+* \code
+* R_BENCHMARK_COROUTINE("read");
+* auto data = co_await r_bench_co.await(socket.read());   // или R_CO_AWAIT(socket.read())
+* \endcode
+* Замер не держит открытых замеров потока во время приостановки, поэтому корутина может
+* продолжиться в другом потоке. ScopedBenchmark через `co_await` внутри такой корутины использовать нельзя.
+*/
+  class CoroutineSpan {
+  public:
+    explicit CoroutineSpan(std::string identifier): m_identifier(std::move(identifier)) {
+      benchmarkSpanResume(m_span, m_identifier);
     }
-
-  private:
-    std::mutex mut_;
-    std::mutex threadIdMutex_;
-    std::ofstream outStream_;
-    bool flushOnMeasure_;
-    std::vector<TraceInfo> data_;
-    std::unordered_map<std::thread::id, int32_t> threadIdxMap_;
-    int32_t lastThreadIdx_ = 0;
-
-    void writeHeader() {
-      outStream_ << R"({"otherData": {},"traceEvents":[{})";
-      outStream_.flush();
+    CoroutineSpan(const CoroutineSpan &) = delete;
+    CoroutineSpan &operator=(const CoroutineSpan &) = delete;
+    ~CoroutineSpan() {
+      benchmarkSpanSuspend(m_span, true);
     }
 
-    void writeFooter() {
-      outStream_ << "]}";
-      outStream_.flush();
+    void suspend() {
+      if (m_span.handle) benchmarkSpanSuspend(m_span, false);
     }
-
-    void write(const std::string &str, bool flush) {
-      if (!outStream_.is_open()) return;
-      outStream_ << str;
-      if(flush) outStream_.flush();
+    void resume() {
+      if (!m_span.handle) benchmarkSpanResume(m_span, m_identifier);
     }
 
-    int32_t getThreadIdx(const std::thread::id &id, bool lock) {
-      if (lock) threadIdMutex_.lock();
-      if (threadIdxMap_.count(id) == 0) {
-        threadIdxMap_[id] = lastThreadIdx_++;
-      }
-      auto result = threadIdxMap_.at(id);
-      if (lock) threadIdMutex_.unlock();
-      return result;
+    /// Обертка ожидания: замер приостанавливается, только если корутина действительно уходит в ожидание
+    template <typename Awaitable>
+    auto await(Awaitable &&awaitable) {
+      // временный awaiter переносится в обертку, на lvalue храним ссылку
+      using Inner = decltype(getAwaiter(std::forward<Awaitable>(awaitable)));
+      using Stored = typename std::conditional<std::is_lvalue_reference<Inner>::value, Inner,
+                                               typename std::remove_reference<Inner>::type>::type;
+      return Awaiter<Stored>{*this, getAwaiter(std::forward<Awaitable>(awaitable))};
     }
-  };
-}
-
-/*!
- * \brief Информация о замерах.
- */
-struct MeasurmentInfo {
-  double totalTime = 0;
-  double childrenTime = 0;
-  unsigned long timesExecuted = 0;
-  timestamp_t lastStartTime = 0;
-  double lastNTimes[CAPTURE_LAST_N_TIMES] = {};
-  unsigned long startNTimesIdx = 0;
-  uint16_t level = 0;
-};
 
-struct MeasurementGroup {
-  MeasurementGroup() = default;
-  MeasurementGroup(MeasurementGroup const &val) {
-    map = val.map;
-  };
-  std::unordered_map<std::string, MeasurmentInfo> map = {};
-  std::thread::id tid;
-  std::string parentKey;
-};
+  private:
+    std::string m_identifier;
+    SuspendableSpan m_span;
 
-class ErrorMsg {
-public:
-  ErrorMsg() = default;
-  void update(const std::string &msg, const std::string &file, int line) {
-    std::lock_guard<std::mutex> lock(mut_);
-    if (msg_.empty()) {
-      msg_ = msg;
-      if (!file.empty()) {
-        msg_ += "\nLocation: " + std::string(file) + " > line: " + std::to_string(line);
+    template <typename Awaitable>
+    static decltype(auto) getAwaiter(Awaitable &&awaitable) {
+      if constexpr (requires { std::forward<Awaitable>(awaitable).operator co_await(); }) {
+        return std::forward<Awaitable>(awaitable).operator co_await();
+      } else if constexpr (requires { operator co_await(std::forward<Awaitable>(awaitable)); }) {
+        return operator co_await(std::forward<Awaitable>(awaitable));
+      } else {
+        return std::forward<Awaitable>(awaitable);
       }
     }
-  }
-
-  bool popError(std::string &outMsg) {
-    std::lock_guard<std::mutex> lock(mut_);
-    if (msg_.empty()) {
-      return false;
-    }
-    outMsg = msg_;
-    msg_ = "";
-    return true;
-  }
-private:
-  std::mutex mut_;
-  std::string msg_;
-};
 
-inline bool stringHasSuffix(std::string const &value, std::string const &suffix) {
-  if (suffix.size() > value.size()) return false;
-  return std::equal(suffix.rbegin(), suffix.rend(), value.rbegin());
-}
+    template <typename Inner>
+    struct Awaiter {
+      CoroutineSpan &span;
+      Inner inner;
 
-inline bool stringHasPrefix(const std::string& str, const std::string& prefix) {
-    if (prefix.size() > str.size()) return false;
+      bool await_ready() {
+        return inner.await_ready();
+      }
+      template <typename Promise>
+      auto await_suspend(std::coroutine_handle<Promise> handle) {
+        // после inner.await_suspend корутина может уже продолжиться в другом потоке
+        span.suspend();
+        return inner.await_suspend(handle);
+      }
+      decltype(auto) await_resume() {
+        span.resume();
+        return inner.await_resume();
+      }
+    };
+  };
+#endif
 
-    auto res = mismatch(prefix.begin(), prefix.end(), str.begin());
-    return res.first == prefix.end();
-}
+  // Harness: изолированный запуск участков кода с теми же идентификаторами, что и в работе системы
 
-// without shared_ptr this map fails on Win machine
-static std::unordered_map<std::thread::id, std::unique_ptr<MeasurementGroup>> measurmentThreadMap;
-static std::mutex mut;
-static ErrorMsg errorMsg;
-static std::unique_ptr<Tracing::Serializer> tracing;
+  struct HarnessOptions {
+    double minTimeMs = 100;      ///< минимальное время одного повтора, по нему подбирается число итераций
+    int repetitions = 10;        ///< число повторов для статистики
+    int warmupRepetitions = 1;   ///< прогревочные повторы, не попадают в статистику
+    double outlierIqr = 1.5;     ///< выбросы за границами Тьюки (Q1 - k*IQR, Q3 + k*IQR), 0 - не отбрасывать
+    double confidence = 0.95;    ///< доверительный интервал: 0.9, 0.95 или 0.99
+  };
 
-inline MeasurementGroup &getMeasurmentGroup() {
-  auto tid = std::this_thread::get_id();
-  std::lock_guard<std::mutex> lock(mut);
-  if (measurmentThreadMap.count(tid) == 0) {
-    measurmentThreadMap.emplace(tid, std::unique_ptr<MeasurementGroup>(new MeasurementGroup()));
-    measurmentThreadMap[tid]->tid = tid;
-  }
-  return *measurmentThreadMap[tid].get();
-}
+  struct HarnessResult {
+    std::string identifier;
+    unsigned long iterations;    ///< итераций в одном повторе
+    int repetitions;             ///< повторов в статистике (без выбросов)
+    int outliers;
+    double meanMs;               ///< время одной итерации
+    double medianMs;
+    double stdMs;
+    double ciLowMs;
+    double ciHighMs;
+  };
 
-bool benchmarkStart(const std::string &identifier, const std::string &file, int line) {
-#ifndef BENCHMARK_DISABLED
+/*!
+* \brief Регистрирует участок кода для запуска через `benchmarkRunRegistered`.
+*/
+  R_FUNC
+  void benchmarkRegister(const std::string &identifier, std::function<void()> callable);
 
-  auto &measurmentGroup = getMeasurmentGroup();
-  auto &measurmentMap = measurmentGroup.map;
-  if (measurmentGroup.parentKey.empty()) {
-    measurmentGroup.parentKey += identifier;
-  } else {
-    measurmentGroup.parentKey += kNestingString + identifier;
-  }
+/*!
+* \brief Запускает зарегистрированные участки кода в текущем потоке.
+* Каждый повтор записывается в общее дерево замеров под своим идентификатором (вложенные замеры - его дети),
+* поэтому результат виден и в `benchmarkLog`. Прогрев и подбор числа итераций не записываются.
+* \param[in] filter Запускаются только идентификаторы, содержащие эту подстроку.
+* \param[in] out Куда вывести таблицу результатов, `nullptr` - не выводить.
+*/
+  R_FUNC
+  std::vector<HarnessResult> benchmarkRunRegistered(const HarnessOptions &options = HarnessOptions(),
+                                                    const std::string &filter = "", std::ostream *out = nullptr);
 
-  MeasurmentInfo &info = measurmentMap[measurmentGroup.parentKey];
-  if (info.lastStartTime > 0) {
-    errorMsg.update("Benchmark already run for \"" + measurmentGroup.parentKey + "\" key", file, line);
-    return true;
-  }
+//
+/*!
+* \brief Use this function when you want to start capture tracing.
+ * To view result of tracing use https://ui.perfetto.dev/
+* \param[in] writeJsonPath Save results of
+*
+*/
+  R_FUNC
+  void benchmarkStartTracing(const std::string &writeJsonPath, const std::string &file = "", int line = 0);
+  R_FUNC
+  void benchmarkStopTracing();
+/*!
+* \brief Сжатие файлов трейсинга и flight recorder, действует со следующего `R_TRACING_START`.
+* События форматируются и сжимаются в отдельном потоке, к пути добавляется расширение `.gz` / `.rlz`.
+* \return Сжатие, которое будет использовано: `gzip` без zlib заменяется на `lz`.
+*/
+  R_FUNC
+  TraceCompression benchmarkSetTracingCompression(TraceCompression compression);
+/*!
+* \brief Бинарный трейсинг (Linux, macOS): файл `capacityMb` отображается в память, каждый поток
+* пишет события записями по 64 байта прямо в свои чанки файла, без копирования и форматирования.
+* Записанное остается в файле и при падении процесса. Останавливается `benchmarkStopTracing`,
+* JSON для Perfetto получается инструментом `trace_convert`. Аргументы длиннее 19 символов обрезаются.
+* \return false, если файл не удалось создать или платформа не поддерживается.
+*/
+  R_FUNC
+  bool benchmarkStartBinaryTracing(const std::string &path, size_t capacityMb = 256,
+                                   const std::string &file = "", int line = 0);
+/*!
+* \brief То же, что `benchmarkThreadName`.
+*/
+  R_FUNC
+  void benchmarkTracingThreadName(const std::string &name);
+
+/*!
+* \brief Имя текущего потока для логов (`View::threads`) и трейсинга.
+* Имя сохраняется вместе с id потока в ОС, affinity и приоритетом и попадает в каждую следующую
+* сессию трейсинга, даже если задано до `R_TRACING_START`. Без вызова используется имя потока в ОС.
+*/
+  R_FUNC
+  void benchmarkThreadName(const std::string &name);
+
+/*!
+* \brief Flight recorder: каждый поток постоянно пишет замеры в кольцевой буфер фиксированного размера,
+* по запросу последние `keepSeconds` секунд сохраняются в файл трейсинга (https://ui.perfetto.dev/).
+* \param[in] dumpJsonPath Путь для сохранения, к каждому следующему сохранению добавляется номер: `trace_1.json`.
+* \param[in] keepSeconds Сколько последних секунд сохранять.
+* \param[in] eventsPerThread Размер кольцевого буфера каждого потока. Буфер выделяется целиком при первом
+* замере потока, событие занимает `sizeof(Tracing::TraceInfo)` (176 байт на 64-битных платформах) плюс имя
+* длиннее 15 символов: по умолчанию около 1.5 МБ на поток. Если за `keepSeconds` поток делает больше замеров,
+* сохраняются только последние `eventsPerThread`.
+*/
+  R_FUNC
+  void benchmarkStartFlightRecorder(const std::string &dumpJsonPath, double keepSeconds = 10,
+                                    size_t eventsPerThread = 1 << 13);
+  R_FUNC
+  void benchmarkStopFlightRecorder();
+/*!
+* \brief Сохраняет содержимое flight recorder.
+* \param[in] jsonPath Путь для сохранения, если пустой - используется путь из `benchmarkStartFlightRecorder`.
+* \return `false`, если flight recorder не запущен или файл не удалось записать.
+*/
+  R_FUNC
+  bool benchmarkDumpFlightRecorder(const std::string &jsonPath = "");
+/*!
+* \brief Сохранение flight recorder по сигналу (например `SIGUSR1`).
+* Обработчик только выставляет флаг, файл пишет фоновый поток flight recorder в течение `R_TRACE_WRITE_INTERVAL_MS`.
+*/
+  R_FUNC
+  void benchmarkFlightRecorderDumpOnSignal(int signalNumber);
+/*!
+* \brief Сохранение flight recorder, когда любой замер длится дольше `thresholdMs`.
+* Повторно срабатывает не чаще, чем раз в `keepSeconds`. Значение `<= 0` отключает.
+* Файл пишет фоновый поток flight recorder, `benchmarkStop` медленного замера только будит его.
+*/
+  R_FUNC
+  void benchmarkFlightRecorderDumpOnSlowSpan(double thresholdMs);
+
+/*!
+* \brief Статистический сэмплер (Linux, macOS): `frequencyHz` раз в секунду процессорного времени потока
+* `SIGPROF` прерывает поток и записывает открытый замер и адрес прерванной функции в буфер потока.
+* В Linux у каждого потока с замерами свой таймер, в macOS таймер общий на процесс.
+* Имена функций ищутся только в `benchmarkLog`, где для каждого замера выводятся `topFunctions`
+* функций, в которых поток был чаще всего. Для имен функций исполняемого файла нужна линковка с `-rdynamic`.
+* \return `false`, если сэмплер не поддерживается на платформе.
+*/
+  R_FUNC
+  bool benchmarkStartSampler(int frequencyHz = 100, size_t topFunctions = 5);
+  R_FUNC
+  void benchmarkStopSampler();
+} // namespace roadar
+
+
+#include <stdio.h>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <condition_variable>
+#include <vector>
+#include <unordered_map>
+
+#ifndef R_TRACE_MAX_ARGS
+#define R_TRACE_MAX_ARGS 4
+#endif
+
+#ifndef R_TRACE_WRITE_INTERVAL_MS
+#define R_TRACE_WRITE_INTERVAL_MS 100
+#endif
+
+namespace roadar {
+namespace Tracing {
+enum class ArgType : unsigned char {
+  none = 0,
+  integer,
+  real,
+  string // pointer to string literal or interned string, never freed
+};
+
+struct TraceArg {
+  const char *key;
+  ArgType type;
+  union {
+    long long intValue;
+    double realValue;
+    const char *stringValue;
+  };
+};
+
+/// Fixed-size list of span arguments, formatted only when trace is written
+struct TraceArgs {
+  TraceArg items[R_TRACE_MAX_ARGS];
+  int count;
+
+  void set(const TraceArg &arg);
+};
+
+enum class TraceType {
+  span = 0,    // "X" event, duration of benchmark
+  counter = 1  // "C" event, value of counter at startTime
+};
+
+struct TraceInfo {
+  std::string name;
+  std::thread::id tid; // thread id
+  unsigned long long startTime;
+  unsigned long long duration;
+  int stackDepth;
+  TraceType type;
+  double value; // used only for TraceType::counter
+  TraceArgs args;
+};
+
+/// Fixed-size circular buffer of the last events, used by flight recorder.
+/// Not thread safe, owner should synchronize access.
+class RingBuffer {
+public:
+  explicit RingBuffer(size_t capacity);
+
+  void push(const TraceInfo &info);
+  /// Appends events which finished not earlier than `fromTime`, oldest first
+  void collect(unsigned long long fromTime, std::vector<TraceInfo> &out) const;
+  void clear();
+
+private:
+  std::vector<TraceInfo> data_;
+  size_t next_ = 0;
+  size_t size_ = 0;
+};
+
+/// Output compression of a trace file, values match roadar::TraceCompression
+enum class Compression {
+  none = 0,
+  gzip,  // zlib; replaced by lz when the library is built without zlib
+  lz     // built-in LZ77 block format, see trace_compression.hpp
+};
+
+class CompressBuf;
+
+class Serializer {
+public:
+  Serializer(const Serializer&) = delete;
+  Serializer(Serializer&&) = delete;
+  
+  /// `background` - events are formatted and compressed by a writer thread every
+  /// R_TRACE_WRITE_INTERVAL_MS instead of being kept in memory until `end()`
+  Serializer(const std::string& filepath, bool flushOnMeasure, std::string &outErrMsg,
+             Compression compression = Compression::none, bool background = false);
+  ~Serializer();
+  
+  void saveTrace(TraceInfo info);
+  
+  void write(const TraceInfo& info, bool threadSafe = false);
+  
+  void writeThreadName(const std::thread::id &tid, const std::string &name);
+
+  /// Thread descriptor (`thread_name` metadata event) with OS level details in args
+  void writeThreadInfo(const std::thread::id &tid, const std::string &name, long long osTid,
+                       const std::string &affinity, int priority);
+
+  void writeProcessName(const std::string &name);
+
+  /// Formats one event as `,{...}` - the same text `write` puts into the trace file
+  static void formatEvent(std::ostream &json, const TraceInfo &info, int32_t tidIdx);
+
+  /// Returns pointer which is valid until the end of program, so it can be stored in TraceArg
+  static const char *intern(const std::string &str);
+
+  /// Contents of a JSON string: quotes, backslashes and control characters are escaped
+  static std::string escape(const std::string &str);
+  
+  void end();
+  
+private:
+  std::mutex mut_;          // data_, closed_
+  std::mutex outMut_;       // out_, before threadIdMutex_
+  std::mutex threadIdMutex_;
+  std::unique_ptr<CompressBuf> buf_;
+  std::unique_ptr<std::ostream> out_;
+  bool flushOnMeasure_;
+  bool closed_ = false;
+  std::vector<TraceInfo> data_;
+  std::thread writer_;
+  std::condition_variable writerCv_;
+  std::unordered_map<std::thread::id, int32_t> threadIdxMap_;
+  int32_t lastThreadIdx_ = 0;
+  
+  void writerLoop();
+  void writeBatch(std::vector<TraceInfo> &batch);
+  void writeHeader();
+  void writeFooter();
+  void write(const std::string &str, bool flush);
+  
+  int32_t getThreadIdx(const std::thread::id &id, bool lock);
+};
+} // namespace Tracing
+} // namespace roadar
+
+
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#ifndef R_BENCHMARK_COMPRESS_BLOCK
+#define R_BENCHMARK_COMPRESS_BLOCK (256 * 1024) // байт текста, сжимаемых за раз
+#endif
+#ifndef R_BENCHMARK_GZIP_LEVEL
+#define R_BENCHMARK_GZIP_LEVEL 3 // быстрее уровня по умолчанию, JSON все равно сжимается в ~10 раз
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+/// Сжатие, которое реально будет использовано: gzip без zlib заменяется на lz
+R_FUNC
+Compression availableCompression(Compression requested);
+
+/// Путь с расширением сжатия (".gz", ".rlz"), если его еще нет
+R_FUNC
+std::string compressedPath(const std::string &path, Compression compression);
+
+/// Формат lz: "RLZ1", затем блоки [размер текста u32][размер данных u32][данные].
+/// Данные блока - последовательности в стиле LZ4: токен (длины литералов и совпадения),
+/// литералы, смещение совпадения (2 байта). Если сжать не удалось, блок хранится как есть.
+R_FUNC
+void lzCompress(const char *src, size_t size, std::vector<char> &out);
+R_FUNC
+bool lzDecompress(const char *src, size_t size, char *dst, size_t rawSize);
+
+struct ZStream;
+
+/// Запись в файл через компрессор, сжимается целыми блоками по R_BENCHMARK_COMPRESS_BLOCK
+class CompressBuf : public std::streambuf {
+public:
+  CompressBuf(const std::string &path, Compression compression, std::string &outErrMsg);
+  ~CompressBuf();
+
+  /// Сжимает остаток и закрывает файл
+  void finish();
+
+protected:
+  int_type overflow(int_type ch) override;
+  int sync() override;
+
+private:
+  std::ofstream file_;
+  Compression compression_;
+  std::vector<char> buffer_;
+  std::vector<char> compressed_;
+  std::unique_ptr<ZStream> zstream_;
+
+  void flushBlock(bool final);
+};
+
+/// Чтение трейса с автоопределением формата: обычный JSON, gzip (нужен zlib) или lz
+class DecompressBuf : public std::streambuf {
+public:
+  explicit DecompressBuf(std::istream &in);
+  ~DecompressBuf();
+
+  /// Ошибка формата, пусто если файл прочитан без ошибок
+  const std::string &error() const { return error_; }
+
+protected:
+  int_type underflow() override;
+
+private:
+  enum class Mode {
+    unknown = 0,
+    plain,
+    gzip,
+    lz
+  };
+
+  std::istream &in_;
+  Mode mode_ = Mode::unknown;
+  std::vector<char> buffer_;
+  std::vector<char> input_;
+  std::unique_ptr<ZStream> zstream_;
+  std::string error_;
+
+  bool detect();
+  bool fill();
+};
+
+} // namespace Tracing
+} // namespace roadar
+
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef R_BINARY_TRACE_CHUNK
+#define R_BINARY_TRACE_CHUNK (64 * 1024) // байт на чанк потока, 1024 записи
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+/*!
+ * \brief Бинарный трейс: файл заранее нужного размера отображается в память, каждый поток
+ * забирает себе чанки и пишет в них записи фиксированного размера без блокировок и форматирования.
+ *
+ * Файл: заголовок BinaryTraceHeader, за ним индекс владельцев чанков (uint32 на чанк: индекс
+ * потока + 1, 0 - чанк свободен), с R_BINARY_TRACE_CHUNK-выравниванием - сами чанки.
+ * Чанк читается до первой записи с type == 0: файл создается заполненным нулями, а тип записи
+ * пишется последним, поэтому после падения процесса обрывается только последняя запись потока.
+ */
+enum class BinaryRecordType : uint8_t {
+  end = 0,
+  span,     // id - id узла (registerNode), time/duration
+  counter,  // id - id счетчика потока, time/value
+  arg,      // аргумент следующего span/counter: flags - ArgType, text - ключ и строковое значение
+  name      // flags - BinaryNameKind, id, time - родитель узла, offset - позиция куска в имени
+};
+
+enum class BinaryNameKind : uint8_t {
+  node = 0,  // глобальный id узла
+  counter,   // id счетчика внутри потока-владельца чанка
+  thread     // имя потока-владельца чанка
+};
+
+struct BinaryRecord {
+  uint8_t type;
+  uint8_t flags;
+  uint16_t depth;       // span/counter - глубина вложенности, name - длина куска текста
+  uint32_t id;
+  uint64_t time;        // мкс
+  union {
+    uint64_t duration;
+    double value;
+    long long intValue;
+    double realValue;
+    uint64_t offset;
+  };
+  char text[40];
+};
+static_assert(sizeof(BinaryRecord) == 64, "binary trace record must stay 64 bytes");
+
+/// Длина ключа и строкового значения аргумента в BinaryRecord::text, с завершающим нулем
+static const size_t binaryArgTextSize = 20;
+
+struct BinaryTraceHeader {
+  char magic[8];                       // "RBTRACE1"
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t chunkSize;
+  uint32_t chunkCount;
+  uint64_t dataOffset;                 // начало первого чанка
+  uint64_t startTime;                  // мкс, начало сессии
+  std::atomic<uint32_t> nextChunk;     // сколько чанков выдано, не больше chunkCount
+  std::atomic<uint32_t> nextThread;
+  std::atomic<uint64_t> dropped;       // потоки, которым не хватило чанка: их дальнейшие записи потеряны
+};
+
+/// Позиция потока в его текущем чанке, хранится в группе замеров потока
+struct BinaryCursor {
+  uint64_t session = 0;                // BinaryTraceFile::session(), 0 - не привязан
+  uint32_t threadIdx = 0;
+  BinaryRecord *next = nullptr;
+  BinaryRecord *end = nullptr;
+  bool exhausted = false;              // файл заполнен, до следующей сессии записи отбрасываются без атомиков
+  std::vector<bool> namedNodes;        // узлы, имена которых уже записаны в чанки потока
+  uint64_t registryEpoch = 0;          // перестроение реестра узлов, к которому относятся namedNodes
+  std::unordered_map<std::string, uint32_t> counters;
+};
+
+class BinaryTraceFile {
+public:
+  BinaryTraceFile(const BinaryTraceFile&) = delete;
+
+  /// Создает файл `capacity` байт и отображает его в память
+  BinaryTraceFile(const std::string &path, size_t capacity, uint64_t startTime, std::string &outErrMsg);
+  /// Обрезает файл по последнему выданному чанку и снимает отображение
+  ~BinaryTraceFile();
+
+  uint64_t session() const { return session_; }
+
+  /// Привязывает курсор потока к этой сессии, `threadName` пишется первой записью потока
+  void attach(BinaryCursor &cursor, const std::string &threadName);
+
+  /// `count` подряд идущих записей в чанке потока, nullptr - файл заполнен
+  BinaryRecord *reserve(BinaryCursor &cursor, int count);
+
+  /// Записывает имя кусками по sizeof(BinaryRecord::text)
+  void writeName(BinaryCursor &cursor, BinaryNameKind kind, uint32_t id, uint32_t parent, const std::string &name);
+
+  /// Тип записывается последним: запись без типа читатель считает концом чанка
+  static void commit(BinaryRecord &record, BinaryRecordType type);
+
+private:
+  BinaryTraceHeader *header_ = nullptr;
+  uint32_t *owners_ = nullptr;
+  char *data_ = nullptr;
+  size_t size_ = 0;
+  int fd_ = -1;
+  uint64_t session_;
+};
+
+/// Переводит бинарный трейс в JSON для Perfetto, читая файл по чанку
+R_FUNC
+bool convertBinaryTrace(const std::string &path, std::ostream &out, std::string &outErrMsg);
+
+} // namespace Tracing
+} // namespace roadar
+
+
+#include <istream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace roadar {
+namespace Json {
+
+/// Minimal JSON value, enough to read back files written by this library
+struct Value {
+  enum class Type {
+    null = 0,
+    boolean,
+    number,
+    string,
+    array,
+    object
+  };
+
+  Type type = Type::null;
+  bool boolValue = false;
+  double numberValue = 0;
+  std::string stringValue;
+  std::vector<Value> items;                             // Type::array
+  std::vector<std::pair<std::string, Value>> members;   // Type::object
+
+  const Value *find(const std::string &key) const;
+  double number(const std::string &key, double defaultValue = 0) const;
+  std::string string(const std::string &key, const std::string &defaultValue = "") const;
+};
+
+class Reader {
+public:
+  explicit Reader(std::istream &in);
+
+  /// Reads one complete value
+  bool parse(Value &out);
+
+  const std::string &error() const { return error_; }
+
+private:
+  std::istream &in_;
+  std::string error_;
+
+  int peek();
+  int get();
+  void skipSpaces();
+  bool expect(char c);
+  bool fail(const std::string &msg);
+  bool parseString(std::string &out);
+  bool parseNumber(double &out);
+  bool parseLiteral(const char *literal);
+};
+
+} // namespace Json
+} // namespace roadar
+
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef R_TRACE_STATS_MAX_PENDING
+#define R_TRACE_STATS_MAX_PENDING 65536 // замеров потока, ждущих родителя, до уплотнения
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+/*!
+ * \brief Статистика одного пути замеров, восстановленная по трейсу, время в микросекундах.
+ * Замеры на границах окна обрезаются по окну.
+ */
+struct TraceStatsNode {
+  double totalTime = 0;
+  unsigned long timesExecuted = 0;
+  double maxTime = 0;
+  double sumSquares = 0;
+  std::vector<std::pair<double, double>> last;                   // (конец, время) последних замеров, по возрастанию конца
+  std::map<int32_t, std::pair<double, unsigned long>> threads;    // tid трейса -> (время, число), только с perThread
+  std::unordered_map<std::string, std::unique_ptr<TraceStatsNode>> children;
+
+  void add(double time, double end, int32_t tid, size_t lastCount, bool perThread);
+  /// Забирает статистику и детей `other`
+  void merge(TraceStatsNode &other, size_t lastCount);
+};
+
+struct TraceCounterStats {
+  double lastValue = 0;
+  double minValue = 0;
+  double maxValue = 0;
+  double sum = 0;
+  unsigned long count = 0;
+  double lastTime = 0;
+};
+
+struct TraceStatsOptions {
+  double fromSec = 0;      // окно от самого раннего события трейса
+  double toSec = 0;        // <= 0 - до конца трейса
+  size_t lastCount = 10;   // сколько последних замеров узла хранить для `last avg`
+  bool perThread = false;  // заполнять TraceStatsNode::threads
+};
+
+struct TraceStats {
+  TraceStatsNode root;
+  std::map<std::string, TraceCounterStats> counters;
+  std::map<int32_t, std::string> threadNames;
+  double startTime = 0;              // мкс, самое раннее событие (только если задано окно)
+  unsigned long long spans = 0;      // замеров в окне
+  unsigned long long approximated = 0; // замеров, родитель которых определен по соседям, см. R_TRACE_STATS_MAX_PENDING
+  bool truncated = false;            // файл оборван (процесс упал до R_TRACING_STOP)
+};
+
+/*!
+ * \brief Читает трейс `Serializer` (в том числе сжатый) по одному событию и восстанавливает вложенность
+ * замеров каждого потока по ts/dur.
+ *
+ * Фоновый поток Serializer пишет события пачками: внутри пачки по возрастанию начала (родитель раньше детей),
+ * а долгий родитель попадает в одну из следующих пачек, после своих детей. Поэтому у каждого потока есть
+ * цепочка открытых замеров (в них еще могут прийти дети из той же пачки) и список завершенных замеров без
+ * родителя, которых забирает записанный позже родитель. В памяти только эти два списка и дерево путей.
+ */
+R_FUNC
+bool readTraceStats(const std::string &path, const TraceStatsOptions &options, TraceStats &out, std::string &outErrMsg);
+
+} // namespace Tracing
+} // namespace roadar
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#ifdef R_BENCHMARK_ZLIB
+#include <zlib.h>
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+inline const char lzMagic[4] = {'R', 'L', 'Z', '1'};
+inline const size_t lzMinMatch = 4;
+inline const int lzHashBits = 14;
+inline const size_t lzMaxOffset = 65535;
+inline const size_t lzMaxBlock = 64 * 1024 * 1024; // защита от поврежденного заголовка блока
+
+struct ZStream {
+#ifdef R_BENCHMARK_ZLIB
+  z_stream stream;
+#endif
+};
+
+Compression availableCompression(Compression requested) {
+#ifndef R_BENCHMARK_ZLIB
+  if (requested == Compression::gzip) return Compression::lz;
+#endif
+  return requested;
+}
+
+std::string compressedPath(const std::string &path, Compression compression) {
+  std::string extension;
+  switch (compression) {
+    case Compression::gzip: extension = ".gz"; break;
+    case Compression::lz: extension = ".rlz"; break;
+    case Compression::none: return path;
+  }
+  if (path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0) {
+    return path;
+  }
+  return path + extension;
+}
+
+inline void writeU32(std::vector<char> &out, uint32_t value) {
+  for (int i = 0; i < 4; i++) out.push_back((char)((value >> (8 * i)) & 0xFF));
+}
+
+inline uint32_t readU32(const char *src) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) value |= (uint32_t)(unsigned char)src[i] << (8 * i);
+  return value;
+}
+
+inline void lzWriteLength(std::vector<char> &out, size_t length) {
+  while (length >= 255) {
+    out.push_back((char)255);
+    length -= 255;
+  }
+  out.push_back((char)length);
+}
+
+inline void lzWriteLiterals(std::vector<char> &out, const char *src, size_t count, size_t matchLength) {
+  size_t extraMatch = matchLength >= lzMinMatch ? matchLength - lzMinMatch : 0;
+  out.push_back((char)((std::min(count, (size_t)15) << 4) | std::min(extraMatch, (size_t)15)));
+  if (count >= 15) lzWriteLength(out, count - 15);
+  out.insert(out.end(), src, src + count);
+}
+
+void lzCompress(const char *src, size_t size, std::vector<char> &out) {
+  out.clear();
+  const unsigned char *in = reinterpret_cast<const unsigned char *>(src);
+  std::vector<uint32_t> table(1 << lzHashBits, UINT32_MAX); // хэш 4 байт -> последняя позиция
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + lzMinMatch <= size) {
+    uint32_t sequence;
+    memcpy(&sequence, in + pos, sizeof(sequence));
+    uint32_t hash = (sequence * 2654435761u) >> (32 - lzHashBits);
+    uint32_t candidate = table[hash];
+    table[hash] = (uint32_t)pos;
+    if (candidate == UINT32_MAX || pos - candidate > lzMaxOffset || memcmp(in + candidate, in + pos, lzMinMatch) != 0) {
+      pos++;
+      continue;
+    }
+    size_t length = lzMinMatch;
+    while (pos + length < size && in[candidate + length] == in[pos + length]) length++;
+    lzWriteLiterals(out, src + anchor, pos - anchor, length);
+    size_t offset = pos - candidate;
+    out.push_back((char)(offset & 0xFF));
+    out.push_back((char)(offset >> 8));
+    if (length - lzMinMatch >= 15) lzWriteLength(out, length - lzMinMatch - 15);
+    pos += length;
+    anchor = pos;
+  }
+  // последняя последовательность - только литералы; если блок закончился совпадением, ее нет
+  if (anchor < size) {
+    lzWriteLiterals(out, src + anchor, size - anchor, 0);
+  }
+}
+
+bool lzDecompress(const char *src, size_t size, char *dst, size_t rawSize) {
+  const unsigned char *in = reinterpret_cast<const unsigned char *>(src);
+  size_t inPos = 0;
+  size_t outPos = 0;
+  auto readLength = [&](size_t length) -> size_t {
+    if (length != 15) return length;
+    while (inPos < size) {
+      unsigned char byte = in[inPos++];
+      length += byte;
+      if (byte != 255) break;
+    }
+    return length;
+  };
+  while (outPos < rawSize) {
+    if (inPos >= size) return false;
+    unsigned char token = in[inPos++];
+    size_t literals = readLength(token >> 4);
+    if (literals > size - inPos || literals > rawSize - outPos) return false;
+    memcpy(dst + outPos, in + inPos, literals);
+    inPos += literals;
+    outPos += literals;
+    if (outPos == rawSize) break;
+    if (inPos + 2 > size) return false;
+    size_t offset = in[inPos] | ((size_t)in[inPos + 1] << 8);
+    inPos += 2;
+    size_t length = readLength(token & 0x0F) + lzMinMatch;
+    if (offset == 0 || offset > outPos || length > rawSize - outPos) return false;
+    // совпадение может перекрывать само себя, копируем по байту
+    for (size_t i = 0; i < length; i++, outPos++) {
+      dst[outPos] = dst[outPos - offset];
+    }
+  }
+  return inPos == size;
+}
+
+inline CompressBuf::CompressBuf(const std::string &path, Compression compression, std::string &outErrMsg)
+: compression_(availableCompression(compression)), buffer_(R_BENCHMARK_COMPRESS_BLOCK) {
+  file_.open(path, std::ios::binary);
+  if (!file_.is_open()) {
+    outErrMsg = "RBenchmark::Tracing::Serializer could not open results file:\n" + path;
+    return;
+  }
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+  if (compression_ == Compression::lz) {
+    file_.write(lzMagic, sizeof(lzMagic));
+  }
+#ifdef R_BENCHMARK_ZLIB
+  if (compression_ == Compression::gzip) {
+    zstream_.reset(new ZStream());
+    // 15 + 16: окно 32 КБ и заголовок gzip, файл открывается gunzip и Perfetto
+    if (deflateInit2(&zstream_->stream, R_BENCHMARK_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      outErrMsg = "RBenchmark::Tracing::Serializer could not initialize zlib";
+      zstream_.reset();
+      file_.close();
+    }
+  }
+#endif
+}
+
+inline CompressBuf::~CompressBuf() {
+  finish();
+}
+
+inline void CompressBuf::finish() {
+  if (!file_.is_open()) return;
+  flushBlock(true);
+  file_.close();
+#ifdef R_BENCHMARK_ZLIB
+  if (zstream_) deflateEnd(&zstream_->stream);
+#endif
+  zstream_.reset();
+}
+
+inline CompressBuf::int_type CompressBuf::overflow(int_type ch) {
+  if (!file_.is_open()) return traits_type::eof();
+  flushBlock(false);
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+inline int CompressBuf::sync() {
+  if (!file_.is_open()) return 0;
+  flushBlock(false);
+  file_.flush();
+  return 0;
+}
+
+inline void CompressBuf::flushBlock(bool final) {
+  size_t size = pptr() - pbase();
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+  switch (compression_) {
+    case Compression::none:
+      file_.write(buffer_.data(), size);
+      break;
+    case Compression::lz: {
+      if (size == 0) break;
+      lzCompress(buffer_.data(), size, compressed_);
+      bool stored = compressed_.size() >= size; // несжимаемый блок хранится как есть
+      std::vector<char> header;
+      writeU32(header, (uint32_t)size);
+      writeU32(header, (uint32_t)(stored ? size : compressed_.size()));
+      file_.write(header.data(), header.size());
+      if (stored) {
+        file_.write(buffer_.data(), size);
+      } else {
+        file_.write(compressed_.data(), compressed_.size());
+      }
+      break;
+    }
+    case Compression::gzip: {
+#ifdef R_BENCHMARK_ZLIB
+      if (!zstream_) break;
+      z_stream &stream = zstream_->stream;
+      stream.next_in = reinterpret_cast<Bytef *>(buffer_.data());
+      stream.avail_in = (uInt)size;
+      compressed_.resize(R_BENCHMARK_COMPRESS_BLOCK);
+      int result;
+      do {
+        stream.next_out = reinterpret_cast<Bytef *>(compressed_.data());
+        stream.avail_out = (uInt)compressed_.size();
+        result = deflate(&stream, final ? Z_FINISH : Z_NO_FLUSH);
+        file_.write(compressed_.data(), compressed_.size() - stream.avail_out);
+      } while (stream.avail_out == 0 || (final && result == Z_OK));
+#else
+      (void)final;
+#endif
+      break;
+    }
+  }
+}
+
+inline DecompressBuf::DecompressBuf(std::istream &in)
+: in_(in) {
+}
+
+inline DecompressBuf::~DecompressBuf() {
+#ifdef R_BENCHMARK_ZLIB
+  if (zstream_) inflateEnd(&zstream_->stream);
+#endif
+}
+
+inline bool DecompressBuf::detect() {
+  char magic[4] = {};
+  in_.read(magic, sizeof(magic));
+  size_t count = (size_t)in_.gcount();
+  if (count == sizeof(magic) && memcmp(magic, lzMagic, sizeof(magic)) == 0) {
+    mode_ = Mode::lz;
+    return true;
+  }
+  if (count >= 2 && (unsigned char)magic[0] == 0x1F && (unsigned char)magic[1] == 0x8B) {
+#ifdef R_BENCHMARK_ZLIB
+    mode_ = Mode::gzip;
+    zstream_.reset(new ZStream());
+    if (inflateInit2(&zstream_->stream, 15 + 32) != Z_OK) { // 15 + 32: заголовок gzip или zlib
+      zstream_.reset();
+      error_ = "could not initialize zlib";
+      return false;
+    }
+    input_.assign(magic, magic + count);
+    zstream_->stream.next_in = reinterpret_cast<Bytef *>(input_.data());
+    zstream_->stream.avail_in = (uInt)input_.size();
+    return true;
+#else
+    error_ = "gzip trace, but the library is built without zlib";
+    return false;
+#endif
+  }
+  // обычный текст: прочитанные байты отдаются первыми
+  mode_ = Mode::plain;
+  buffer_.assign(magic, magic + count);
+  setg(buffer_.data(), buffer_.data(), buffer_.data() + buffer_.size());
+  return true;
+}
+
+inline bool DecompressBuf::fill() {
+  switch (mode_) {
+    case Mode::unknown:
+      return false;
+    case Mode::plain: {
+      buffer_.resize(R_BENCHMARK_COMPRESS_BLOCK);
+      in_.read(buffer_.data(), buffer_.size());
+      buffer_.resize((size_t)in_.gcount());
+      break;
+    }
+    case Mode::lz: {
+      char header[8];
+      in_.read(header, sizeof(header));
+      if (in_.gcount() == 0) return false;
+      if (in_.gcount() != sizeof(header)) {
+        error_ = "truncated lz block header";
+        return false;
+      }
+      size_t rawSize = readU32(header);
+      size_t size = readU32(header + 4);
+      if (rawSize > lzMaxBlock || size > rawSize) {
+        error_ = "bad lz block header";
+        return false;
+      }
+      input_.resize(size);
+      in_.read(input_.data(), size);
+      if ((size_t)in_.gcount() != size) {
+        error_ = "truncated lz block";
+        return false;
+      }
+      buffer_.resize(rawSize);
+      if (size == rawSize) {
+        buffer_.swap(input_);
+      } else if (!lzDecompress(input_.data(), size, buffer_.data(), rawSize)) {
+        error_ = "corrupted lz block";
+        return false;
+      }
+      break;
+    }
+    case Mode::gzip: {
+#ifdef R_BENCHMARK_ZLIB
+      z_stream &stream = zstream_->stream;
+      buffer_.resize(R_BENCHMARK_COMPRESS_BLOCK);
+      stream.next_out = reinterpret_cast<Bytef *>(buffer_.data());
+      stream.avail_out = (uInt)buffer_.size();
+      while (stream.avail_out == buffer_.size()) {
+        if (stream.avail_in == 0) {
+          input_.resize(R_BENCHMARK_COMPRESS_BLOCK);
+          in_.read(input_.data(), input_.size());
+          input_.resize((size_t)in_.gcount());
+          if (input_.empty()) break;
+          stream.next_in = reinterpret_cast<Bytef *>(input_.data());
+          stream.avail_in = (uInt)input_.size();
+        }
+        int result = inflate(&stream, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) break;
+        if (result != Z_OK) {
+          error_ = "corrupted gzip stream";
+          return false;
+        }
+      }
+      buffer_.resize(buffer_.size() - stream.avail_out);
+#endif
+      break;
+    }
+  }
+  setg(buffer_.data(), buffer_.data(), buffer_.data() + buffer_.size());
+  return !buffer_.empty();
+}
+
+inline DecompressBuf::int_type DecompressBuf::underflow() {
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  if (mode_ == Mode::unknown) {
+    if (!detect()) return traits_type::eof();
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  }
+  if (!fill()) return traits_type::eof();
+  return traits_type::to_int_type(*gptr());
+}
+
+} // namespace Tracing
+} // namespace roadar
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <new>
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define R_BINARY_TRACE_SUPPORTED
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+inline const char binaryMagic[8] = {'R', 'B', 'T', 'R', 'A', 'C', 'E', '1'};
+inline const uint32_t binaryVersion = 1;
+inline std::atomic<uint64_t> binarySessions{0};
+
+inline void BinaryTraceFile::commit(BinaryRecord &record, BinaryRecordType type) {
+  std::atomic_signal_fence(std::memory_order_release);
+  record.type = static_cast<uint8_t>(type);
+}
+
+inline BinaryTraceFile::BinaryTraceFile(const std::string &path, size_t capacity, uint64_t startTime, std::string &outErrMsg)
+: session_(++binarySessions) {
+#ifdef R_BINARY_TRACE_SUPPORTED
+  const size_t chunkSize = R_BINARY_TRACE_CHUNK;
+  uint32_t chunkCount = (uint32_t)std::max<size_t>(capacity / chunkSize, 1);
+  size_t headerSize = sizeof(BinaryTraceHeader) + chunkCount * sizeof(uint32_t);
+  size_t dataOffset = (headerSize + chunkSize - 1) / chunkSize * chunkSize;
+  size_ = dataOffset + (size_t)chunkCount * chunkSize;
+
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0 || ftruncate(fd_, (off_t)size_) != 0) {
+    outErrMsg = "RBenchmark::Tracing::BinaryTraceFile could not create results file:\n" + path;
+    if (fd_ >= 0) close(fd_);
+    fd_ = -1;
+    return;
+  }
+  void *mapped = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (mapped == MAP_FAILED) {
+    outErrMsg = "RBenchmark::Tracing::BinaryTraceFile could not map results file:\n" + path;
+    close(fd_);
+    fd_ = -1;
+    return;
+  }
+  char *base = static_cast<char *>(mapped);
+  // файл после ftruncate заполнен нулями, заполняем только заголовок
+  header_ = new (base) BinaryTraceHeader();
+  memcpy(header_->magic, binaryMagic, sizeof(binaryMagic));
+  header_->version = binaryVersion;
+  header_->recordSize = sizeof(BinaryRecord);
+  header_->chunkSize = (uint32_t)chunkSize;
+  header_->chunkCount = chunkCount;
+  header_->dataOffset = dataOffset;
+  header_->startTime = startTime;
+  owners_ = reinterpret_cast<uint32_t *>(base + sizeof(BinaryTraceHeader));
+  data_ = base + dataOffset;
+#else
+  (void)path;
+  (void)capacity;
+  (void)startTime;
+  outErrMsg = "RBenchmark::Tracing::BinaryTraceFile is supported only on Linux and macOS";
+#endif
+}
+
+inline BinaryTraceFile::~BinaryTraceFile() {
+#ifdef R_BINARY_TRACE_SUPPORTED
+  if (!header_) return;
+  uint32_t used = std::min(header_->nextChunk.load(), header_->chunkCount);
+  size_t usedSize = (size_t)header_->dataOffset + (size_t)used * header_->chunkSize;
+  msync(header_, size_, MS_SYNC);
+  munmap(header_, size_);
+  if (ftruncate(fd_, (off_t)usedSize) != 0) {
+    // файл остается полного размера, пустые чанки читатель пропускает
+  }
+  close(fd_);
+#endif
+}
+
+inline void BinaryTraceFile::attach(BinaryCursor &cursor, const std::string &threadName) {
+  cursor.session = session_;
+  cursor.next = cursor.end = nullptr;
+  cursor.exhausted = false;
+  cursor.namedNodes.clear();
+  cursor.counters.clear();
+  if (!header_) return;
+  cursor.threadIdx = header_->nextThread.fetch_add(1);
+  writeName(cursor, BinaryNameKind::thread, cursor.threadIdx, 0, threadName);
+}
+
+inline BinaryRecord *BinaryTraceFile::reserve(BinaryCursor &cursor, int count) {
+  if (!header_ || cursor.exhausted) return nullptr;
+  if (cursor.next && cursor.end - cursor.next >= count) {
+    BinaryRecord *records = cursor.next;
+    cursor.next += count;
+    return records;
+  }
+  // остаток чанка остается нулевым, читатель перейдет к следующему чанку потока.
+  // Счетчик не растет дальше chunkCount, иначе после 2^32 отказов он переполнится и выдаст занятые чанки
+  uint32_t chunk = header_->nextChunk.load();
+  do {
+    if (chunk >= header_->chunkCount) {
+      cursor.next = cursor.end = nullptr;
+      cursor.exhausted = true;
+      header_->dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+  } while (!header_->nextChunk.compare_exchange_weak(chunk, chunk + 1));
+  owners_[chunk] = cursor.threadIdx + 1;
+  cursor.next = reinterpret_cast<BinaryRecord *>(data_ + (size_t)chunk * header_->chunkSize);
+  cursor.end = cursor.next + header_->chunkSize / sizeof(BinaryRecord);
+  BinaryRecord *records = cursor.next;
+  cursor.next += count;
+  return records;
+}
+
+inline void BinaryTraceFile::writeName(BinaryCursor &cursor, BinaryNameKind kind, uint32_t id, uint32_t parent, const std::string &name) {
+  const size_t piece = sizeof(BinaryRecord::text);
+  size_t offset = 0;
+  size_t length;
+  // последний кусок всегда короче sizeof(text), по нему читатель понимает, что имя закончилось
+  do {
+    BinaryRecord *record = reserve(cursor, 1);
+    if (!record) return;
+    length = std::min(piece, name.size() - offset);
+    record->flags = static_cast<uint8_t>(kind);
+    record->depth = (uint16_t)length;
+    record->id = id;
+    record->time = parent;
+    record->offset = offset;
+    memcpy(record->text, name.data() + offset, length);
+    commit(*record, BinaryRecordType::name);
+    offset += length;
+  } while (length == piece);
+}
+
+/// Читатель бинарного трейса: события чанка переводятся в JSON сразу, в памяти только имена
+struct BinaryTraceReader {
+  std::ostream &out;
+  std::map<std::pair<uint32_t, uint32_t>, std::string> nodes;    // (поток, id) -> имя, поток пишет имена сам
+  std::map<std::pair<uint32_t, uint32_t>, std::string> counters; // (поток, id) -> имя
+  std::map<uint32_t, std::string> threads;
+  std::vector<BinaryRecord> args;
+
+  static void appendPiece(std::string &name, const BinaryRecord &record) {
+    if (record.offset == 0) name.clear(); // id узла мог получить новое имя после benchmarkReset
+    size_t length = std::min<size_t>(record.depth, sizeof(record.text));
+    if (name.size() < record.offset + length) name.resize(record.offset + length);
+    memcpy(&name[record.offset], record.text, length);
+  }
+
+  static std::string argText(const char *text) {
+    return std::string(text, strnlen(text, binaryArgTextSize));
+  }
+
+  void readName(uint32_t thread, const BinaryRecord &record) {
+    switch (static_cast<BinaryNameKind>(record.flags)) {
+      case BinaryNameKind::node:
+        appendPiece(nodes[std::make_pair(thread, record.id)], record);
+        break;
+      case BinaryNameKind::counter:
+        appendPiece(counters[std::make_pair(thread, record.id)], record);
+        break;
+      case BinaryNameKind::thread: {
+        std::string &name = threads[record.id];
+        appendPiece(name, record);
+        if (record.depth < sizeof(record.text)) {
+          out << ",{\"cat\":\"function\",\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << record.id
+              << ",\"args\":{\"name\":\"" << Serializer::escape(name) << "\"}}";
+        }
+        break;
+      }
+    }
+  }
+
+  void readEvent(uint32_t thread, const BinaryRecord &record, BinaryRecordType type) {
+    TraceInfo info;
+    std::deque<std::string> strings; // указатели аргументов действительны до форматирования
+    info.args.count = 0;
+    for (const auto &arg : args) {
+      TraceArg traceArg;
+      strings.push_back(argText(arg.text));
+      traceArg.key = strings.back().c_str();
+      traceArg.type = static_cast<ArgType>(arg.flags);
+      if (traceArg.type == ArgType::integer) {
+        traceArg.intValue = arg.intValue;
+      } else if (traceArg.type == ArgType::real) {
+        traceArg.realValue = arg.realValue;
+      } else if (traceArg.type == ArgType::string) {
+        strings.push_back(argText(arg.text + binaryArgTextSize));
+        traceArg.stringValue = strings.back().c_str();
+      }
+      info.args.set(traceArg);
+    }
+    args.clear();
+    info.startTime = record.time;
+    info.stackDepth = record.depth;
+    if (type == BinaryRecordType::span) {
+      info.type = TraceType::span;
+      info.duration = record.duration;
+      info.value = 0;
+      info.name = nodes[std::make_pair(thread, record.id)];
+    } else {
+      info.type = TraceType::counter;
+      info.duration = 0;
+      info.value = record.value;
+      info.name = counters[std::make_pair(thread, record.id)];
+    }
+    Serializer::formatEvent(out, info, (int32_t)thread);
+  }
+
+  void readChunk(uint32_t thread, const char *chunk, size_t size) {
+    args.clear();
+    for (size_t pos = 0; pos + sizeof(BinaryRecord) <= size; pos += sizeof(BinaryRecord)) {
+      BinaryRecord record;
+      memcpy(&record, chunk + pos, sizeof(record));
+      auto type = static_cast<BinaryRecordType>(record.type);
+      switch (type) {
+        case BinaryRecordType::end:
+          return;
+        case BinaryRecordType::name:
+          readName(thread, record);
+          break;
+        case BinaryRecordType::arg:
+          args.push_back(record);
+          break;
+        case BinaryRecordType::span:
+        case BinaryRecordType::counter:
+          readEvent(thread, record, type);
+          break;
+      }
+    }
+  }
+};
+
+bool convertBinaryTrace(const std::string &path, std::ostream &out, std::string &outErrMsg) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    outErrMsg = "could not open " + path;
+    return false;
+  }
+  uint64_t fileSize = (uint64_t)file.tellg();
+  file.seekg(0);
+  std::vector<char> headerBytes(sizeof(BinaryTraceHeader));
+  file.read(headerBytes.data(), headerBytes.size());
+  const BinaryTraceHeader *header = reinterpret_cast<const BinaryTraceHeader *>(headerBytes.data());
+  if (file.gcount() != (std::streamsize)headerBytes.size() || memcmp(header->magic, binaryMagic, sizeof(binaryMagic)) != 0) {
+    outErrMsg = path + " is not a binary trace";
+    return false;
+  }
+  if (header->version != binaryVersion || header->recordSize != sizeof(BinaryRecord) ||
+      header->chunkSize % sizeof(BinaryRecord) != 0) {
+    outErrMsg = path + ": unsupported binary trace version";
+    return false;
+  }
+  uint32_t chunkCount = header->chunkCount;
+  uint32_t used = std::min(header->nextChunk.load(), chunkCount);
+  uint64_t chunkSize = header->chunkSize;
+  uint64_t dataOffset = header->dataOffset;
+  // размеры из испорченного файла не должны приводить к выделению гигабайт: индекс владельцев лежит
+  // до первого чанка, а выданные чанки - в файле (при закрытии он обрезается по последнему выданному)
+  if (chunkSize == 0 || chunkSize > fileSize || dataOffset > fileSize ||
+      sizeof(BinaryTraceHeader) + (uint64_t)chunkCount * sizeof(uint32_t) > dataOffset ||
+      (uint64_t)used * chunkSize > fileSize - dataOffset) {
+    outErrMsg = path + ": binary trace header does not match the file size";
+    return false;
+  }
+  std::vector<uint32_t> owners(chunkCount);
+  file.read(reinterpret_cast<char *>(owners.data()), owners.size() * sizeof(uint32_t));
+
+  out << R"({"otherData": {},"traceEvents":[{})";
+  out << std::setprecision(3) << std::fixed;
+  BinaryTraceReader reader{out, {}, {}, {}, {}};
+  std::vector<char> chunk((size_t)chunkSize);
+  for (uint32_t i = 0; i < used; i++) {
+    if (owners[i] == 0) continue; // чанк выдан, но поток упал раньше, чем записал владельца
+    file.seekg((std::streamoff)(dataOffset + (uint64_t)i * chunkSize));
+    file.read(chunk.data(), chunk.size());
+    reader.readChunk(owners[i] - 1, chunk.data(), (size_t)file.gcount());
+    file.clear(); // обрезанный последний чанк
+  }
+  out << "]}";
+  if (header->dropped.load() > 0) {
+    outErrMsg = "events of " + std::to_string(header->dropped.load()) + " threads did not fit into " + path;
+  }
+  return true;
+}
+
+} // namespace Tracing
+} // namespace roadar
+
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <iomanip>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_set>
+
+namespace roadar {
+namespace Tracing {
+
+inline void TraceArgs::set(const TraceArg &arg) {
+    for (int i = 0; i < count; i++) {
+        if (items[i].key == arg.key || strcmp(items[i].key, arg.key) == 0) {
+            items[i] = arg;
+            return;
+        }
+    }
+    if (count < R_TRACE_MAX_ARGS) {
+        items[count++] = arg;
+    }
+}
+
+inline RingBuffer::RingBuffer(size_t capacity)
+: data_(std::max(capacity, (size_t)1)) {
+}
+
+inline void RingBuffer::push(const TraceInfo &info) {
+    data_[next_] = info;
+    next_ = (next_ + 1) % data_.size();
+    if (size_ < data_.size()) size_++;
+}
+
+inline void RingBuffer::collect(unsigned long long fromTime, std::vector<TraceInfo> &out) const {
+    size_t first = (next_ + data_.size() - size_) % data_.size();
+    for (size_t i = 0; i < size_; i++) {
+        const TraceInfo &info = data_[(first + i) % data_.size()];
+        if (info.startTime + info.duration >= fromTime) {
+            out.push_back(info);
+        }
+    }
+}
+
+inline void RingBuffer::clear() {
+    next_ = 0;
+    size_ = 0;
+}
+
+inline const char *Serializer::intern(const std::string &str) {
+    static std::mutex internMutex;
+    static std::unordered_set<std::string> interned;
+    std::lock_guard<std::mutex> lock(internMutex);
+    return interned.insert(str).first->c_str();
+}
+
+inline std::string Serializer::escape(const std::string &str) {
+    std::string result;
+    result.reserve(str.size());
+    for (char c : str) {
+        switch (c) {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char code[8];
+                    snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+                    result += code;
+                } else {
+                    result += c;
+                }
+        }
+    }
+    return result;
+}
+
+/// Вещественное значение аргумента или счетчика без фиксированных 3 знаков потока: 1e-4 не превращается в 0.000.
+/// nan и inf в JSON не бывает, вместо них null
+inline void writeReal(std::ostream &json, double value) {
+    if (!std::isfinite(value)) {
+        json << "null";
+        return;
+    }
+    std::ios::fmtflags flags = json.flags();
+    std::streamsize precision = json.precision();
+    json.unsetf(std::ios::floatfield);
+    json << std::setprecision(std::numeric_limits<double>::digits10) << value;
+    json.flags(flags);
+    json.precision(precision);
+}
+
+inline void writeArgs(std::ostream &json, const TraceArgs &args) {
+    json << ",\"args\":{";
+    for (int i = 0; i < args.count; i++) {
+        const TraceArg &arg = args.items[i];
+        if (i > 0) json << ",";
+        json << "\"" << Serializer::escape(arg.key) << "\":";
+        switch (arg.type) {
+            case ArgType::integer:
+                json << arg.intValue;
+                break;
+            case ArgType::real:
+                writeReal(json, arg.realValue);
+                break;
+            case ArgType::string:
+                json << "\"" << Serializer::escape(arg.stringValue) << "\"";
+                break;
+            case ArgType::none:
+                json << "null";
+                break;
+        }
+    }
+    json << "}";
+}
+
+inline Serializer::Serializer(const std::string& filepath, bool flushOnMeasure, std::string &outErrMsg,
+                       Compression compression, bool background)
+: flushOnMeasure_(flushOnMeasure) {
+    std::lock_guard<std::mutex> lock(outMut_);
+    buf_.reset(new CompressBuf(filepath, compression, outErrMsg));
+    if (!outErrMsg.empty()) {
+        buf_.reset();
+        closed_ = true;
+        return;
+    }
+    out_.reset(new std::ostream(buf_.get()));
+    writeHeader();
+    if (background) {
+        writer_ = std::thread(&Serializer::writerLoop, this);
+    }
+}
+inline Serializer::~Serializer() {
+    end();
+}
+
+inline void sortTraces(std::vector<TraceInfo> &data) {
+    sort(data.begin(), data.end(), [](const TraceInfo &a, const TraceInfo &b) -> bool {
+        if (a.startTime == b.startTime) {
+            if (a.duration == b.duration) {
+                return a.stackDepth < b.stackDepth;
+            } else {
+                return a.duration > b.duration;
+            }
+        } else {
+            return a.startTime < b.startTime;
+        }
+    });
+}
+
+inline void Serializer::end() {
+    std::vector<TraceInfo> rest;
+    {
+        std::lock_guard<std::mutex> lock(mut_);
+        if (closed_) return;
+        closed_ = true;
+        rest.swap(data_);
+    }
+    writerCv_.notify_all();
+    if (writer_.joinable()) writer_.join();
+    writeBatch(rest);
+    std::lock_guard<std::mutex> lock(outMut_);
+    writeFooter();
+    out_.reset();
+    buf_->finish();
+}
+
+inline void Serializer::writerLoop() {
+    std::unique_lock<std::mutex> lock(mut_);
+    while (!closed_) {
+        writerCv_.wait_for(lock, std::chrono::milliseconds(R_TRACE_WRITE_INTERVAL_MS));
+        if (data_.empty()) continue;
+        std::vector<TraceInfo> batch;
+        batch.swap(data_);
+        // форматирование и сжатие без mut_: записывающие потоки только добавляют в data_
+        lock.unlock();
+        writeBatch(batch);
+        lock.lock();
+    }
+}
+
+inline void Serializer::writeBatch(std::vector<TraceInfo> &batch) {
+    if (batch.empty()) return;
+    sortTraces(batch);
+    std::lock_guard<std::mutex> lock(outMut_);
+    std::lock_guard<std::mutex> idLock(threadIdMutex_);
+    for (const auto &d: batch) {
+        write(d, true);
+    }
+}
+
+
+inline void Serializer::saveTrace(TraceInfo info) {
+    std::lock_guard<std::mutex> lock(mut_);
+    if (closed_) return; // уже вызван end()
+    data_.push_back(std::move(info));
+}
+
+inline void Serializer::formatEvent(std::ostream &json, const TraceInfo &info, int32_t tidIdx) {
+    json << ",{";
+    if (info.type == TraceType::counter) {
+        json << "\"cat\":\"counter\",";
+        json << "\"name\":\"" << escape(info.name) << "\",";
+        json << "\"ph\":\"C\",";
+        json << "\"pid\":0,";
+        json << "\"tid\":" << tidIdx << ",";
+        json << "\"ts\":" << info.startTime << ",";
+        json << "\"args\":{\"value\":";
+        writeReal(json, info.value);
+        json << "}";
+    } else {
+        json << "\"cat\":\"function\",";
+        json << "\"dur\":" << (info.duration) << ',';
+        json << "\"name\":\"" << escape(info.name) << "\",";
+        json << "\"ph\":\"X\",";
+        json << "\"pid\":0,";
+        json << "\"tid\":" << tidIdx << ",";
+        json << "\"ts\":" << info.startTime;
+        if (info.args.count > 0) {
+            writeArgs(json, info.args);
+        }
+    }
+    json << "}";
+}
+
+inline void Serializer::write(const TraceInfo& info, bool threadSafe) {
+    std::stringstream json;
+    
+    auto tidIdx = getThreadIdx(info.tid, !threadSafe);
+    json << std::setprecision(3) << std::fixed;
+    formatEvent(json, info, tidIdx);
+    
+    if (threadSafe) {
+        write(json.str(), flushOnMeasure_);
+    } else {
+        std::lock_guard<std::mutex> lock(outMut_);
+        write(json.str(), flushOnMeasure_);
+    }
+}
+
+inline void Serializer::writeThreadName(const std::thread::id &tid, const std::string &name) {
+    std::stringstream json;
+    
+    auto tidIdx = getThreadIdx(tid, true);
+    json << std::setprecision(3) << std::fixed;
+    json << ",{";
+    json << "\"cat\":\"function\",";
+    json << "\"name\":\"thread_name\",";
+    json << "\"ph\":\"M\",";
+    json << "\"pid\":0,";
+    json << "\"tid\":" << tidIdx << ",";
+    json << "\"args\":{\"name\":\"" << escape(name) << "\"}";
+    json << "}";
+    
+    std::lock_guard<std::mutex> lock(outMut_);
+    write(json.str(), flushOnMeasure_);
+}
+
+inline void Serializer::writeThreadInfo(const std::thread::id &tid, const std::string &name, long long osTid,
+                                 const std::string &affinity, int priority) {
+    std::stringstream json;
+
+    auto tidIdx = getThreadIdx(tid, true);
+    json << ",{";
+    json << "\"cat\":\"function\",";
+    json << "\"name\":\"thread_name\",";
+    json << "\"ph\":\"M\",";
+    json << "\"pid\":0,";
+    json << "\"tid\":" << tidIdx << ",";
+    json << "\"args\":{\"name\":\"" << escape(name) << "\"";
+    if (osTid != 0) json << ",\"os_tid\":" << osTid;
+    if (!affinity.empty()) json << ",\"affinity\":\"" << escape(affinity) << "\"";
+    json << ",\"priority\":" << priority << "}";
+    json << "}";
+
+    std::lock_guard<std::mutex> lock(outMut_);
+    write(json.str(), flushOnMeasure_);
+}
+
+inline void Serializer::writeProcessName(const std::string &name) {
+    std::stringstream json;
+    json << ",{";
+    json << "\"cat\":\"function\",";
+    json << "\"name\":\"process_name\",";
+    json << "\"ph\":\"M\",";
+    json << "\"pid\":0,";
+    json << "\"args\":{\"name\":\"" << escape(name) << "\"}";
+    json << "}";
+
+    std::lock_guard<std::mutex> lock(outMut_);
+    write(json.str(), flushOnMeasure_);
+}
+
+inline void Serializer::writeHeader() {
+    *out_ << R"({"otherData": {},"traceEvents":[{})";
+}
+
+inline void Serializer::writeFooter() {
+    *out_ << "]}";
+    out_->flush();
+}
+
+inline void Serializer::write(const std::string &str, bool flush) {
+    if (!out_) return;
+    *out_ << str;
+    if(flush) out_->flush();
+}
+
+inline int32_t Serializer::getThreadIdx(const std::thread::id &id, bool lock) {
+    if (lock) threadIdMutex_.lock();
+    if (threadIdxMap_.count(id) == 0) {
+        threadIdxMap_[id] = lastThreadIdx_++;
+    }
+    auto result = threadIdxMap_.at(id);
+    if (lock) threadIdMutex_.unlock();
+    return result;
+}
+} // namespace Tracing
+} // namespace roadar
+
+#include <cstdlib>
+
+namespace roadar {
+namespace Json {
+
+inline const Value *Value::find(const std::string &key) const {
+    for (const auto &member : members) {
+        if (member.first == key) return &member.second;
+    }
+    return nullptr;
+}
+
+inline double Value::number(const std::string &key, double defaultValue) const {
+    const Value *value = find(key);
+    return (value && value->type == Type::number) ? value->numberValue : defaultValue;
+}
+
+inline std::string Value::string(const std::string &key, const std::string &defaultValue) const {
+    const Value *value = find(key);
+    return (value && value->type == Type::string) ? value->stringValue : defaultValue;
+}
+
+inline Reader::Reader(std::istream &in)
+: in_(in) {
+}
+
+inline int Reader::peek() {
+    return in_.peek();
+}
+
+inline int Reader::get() {
+    return in_.get();
+}
+
+inline void Reader::skipSpaces() {
+    int c = peek();
+    while (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+        get();
+        c = peek();
+    }
+}
+
+inline bool Reader::expect(char c) {
+    skipSpaces();
+    if (get() != c) {
+        return fail(std::string("expected '") + c + "'");
+    }
+    return true;
+}
+
+inline bool Reader::fail(const std::string &msg) {
+    if (error_.empty()) {
+        error_ = "JSON parse error at " + std::to_string((long long)in_.tellg()) + ": " + msg;
+    }
+    return false;
+}
+
+inline bool Reader::parse(Value &out) {
+    skipSpaces();
+    int c = peek();
+    out = Value();
+    switch (c) {
+        case '{': {
+            get();
+            out.type = Value::Type::object;
+            skipSpaces();
+            if (peek() == '}') {
+                get();
+                return true;
+            }
+            while (true) {
+                std::string key;
+                skipSpaces();
+                if (!parseString(key) || !expect(':')) return false;
+                out.members.emplace_back(std::move(key), Value());
+                if (!parse(out.members.back().second)) return false;
+                skipSpaces();
+                c = get();
+                if (c == '}') return true;
+                if (c != ',') return fail("expected ',' or '}'");
+            }
+        }
+        case '[': {
+            get();
+            out.type = Value::Type::array;
+            skipSpaces();
+            if (peek() == ']') {
+                get();
+                return true;
+            }
+            while (true) {
+                out.items.emplace_back();
+                if (!parse(out.items.back())) return false;
+                skipSpaces();
+                c = get();
+                if (c == ']') return true;
+                if (c != ',') return fail("expected ',' or ']'");
+            }
+        }
+        case '"':
+            out.type = Value::Type::string;
+            return parseString(out.stringValue);
+        case 't':
+            out.type = Value::Type::boolean;
+            out.boolValue = true;
+            return parseLiteral("true");
+        case 'f':
+            out.type = Value::Type::boolean;
+            return parseLiteral("false");
+        case 'n':
+            return parseLiteral("null");
+        default:
+            out.type = Value::Type::number;
+            return parseNumber(out.numberValue);
+    }
+}
+
+inline bool Reader::parseString(std::string &out) {
+    if (get() != '"') return fail("expected string");
+    out.clear();
+    while (true) {
+        int c = get();
+        if (c == EOF) return fail("unterminated string");
+        if (c == '"') return true;
+        if (c == '\\') {
+            c = get();
+            switch (c) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    // only code points from the basic plane, encoded back to UTF-8
+                    char hex[5] = {};
+                    for (int i = 0; i < 4; i++) hex[i] = (char)get();
+                    unsigned long code = strtoul(hex, nullptr, 16);
+                    if (code < 0x80) {
+                        out += (char)code;
+                    } else if (code < 0x800) {
+                        out += (char)(0xC0 | (code >> 6));
+                        out += (char)(0x80 | (code & 0x3F));
+                    } else {
+                        out += (char)(0xE0 | (code >> 12));
+                        out += (char)(0x80 | ((code >> 6) & 0x3F));
+                        out += (char)(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default: out += (char)c; break;
+            }
+        } else {
+            out += (char)c;
+        }
+    }
+}
+
+inline bool Reader::parseNumber(double &out) {
+    std::string str;
+    int c = peek();
+    while (c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E' || (c >= '0' && c <= '9')) {
+        str += (char)get();
+        c = peek();
+    }
+    if (str.empty()) return fail("unexpected symbol");
+    char *end = nullptr;
+    out = strtod(str.c_str(), &end);
+    if (end != str.c_str() + str.size()) return fail("bad number \"" + str + "\"");
+    return true;
+}
+
+inline bool Reader::parseLiteral(const char *literal) {
+    for (const char *p = literal; *p; p++) {
+        if (get() != *p) return fail(std::string("expected ") + literal);
+    }
+    return true;
+}
+
+} // namespace Json
+} // namespace roadar
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <limits>
+
+namespace roadar {
+namespace Tracing {
+
+/// Вставляет замер в `last`, если он среди `lastCount` последних по концу
+inline void insertLast(std::vector<std::pair<double, double>> &last, double end, double time, size_t lastCount) {
+  if (lastCount == 0 || (last.size() >= lastCount && end < last.front().first)) return;
+  auto position = std::upper_bound(last.begin(), last.end(), std::make_pair(end, time));
+  last.insert(position, std::make_pair(end, time));
+  if (last.size() > lastCount) last.erase(last.begin());
+}
+
+inline void TraceStatsNode::add(double time, double end, int32_t tid, size_t lastCount, bool perThread) {
+  totalTime += time;
+  timesExecuted++;
+  maxTime = std::max(maxTime, time);
+  sumSquares += time * time;
+  insertLast(last, end, time, lastCount);
+  if (perThread) {
+    auto &thread = threads[tid];
+    thread.first += time;
+    thread.second++;
+  }
+}
+
+inline void TraceStatsNode::merge(TraceStatsNode &other, size_t lastCount) {
+  totalTime += other.totalTime;
+  timesExecuted += other.timesExecuted;
+  maxTime = std::max(maxTime, other.maxTime);
+  sumSquares += other.sumSquares;
+  if (last.empty()) {
+    last.swap(other.last);
+  } else {
+    for (const auto &item : other.last) insertLast(last, item.first, item.second, lastCount);
+  }
+  for (const auto &keyVal : other.threads) {
+    auto &thread = threads[keyVal.first];
+    thread.first += keyVal.second.first;
+    thread.second += keyVal.second.second;
+  }
+  for (auto &keyVal : other.children) {
+    auto &child = children[keyVal.first];
+    if (!child) {
+      child = std::move(keyVal.second);
+    } else {
+      child->merge(*keyVal.second, lastCount);
+    }
+  }
+  other.children.clear();
+}
+
+/// Поля события, нужные для статистики; остальные пропускаются
+struct TraceEvent {
+  std::string phase;
+  std::string name;
+  int32_t tid = 0;
+  double ts = 0;
+  double dur = 0;
+  double value = 0;        // args.value счетчика, nan - значение записано как null
+  std::string argName;     // args.name описания потока
+};
+
+/// Разбор текста одного события. Json::Reader читает istream по символу, на файлах в гигабайты
+/// это основное время, поэтому событие сначала целиком копируется из streambuf, а разбирается здесь
+class TraceEventParser {
+public:
+  bool parse(const std::string &text, TraceEvent &out) {
+    p_ = text.data();
+    end_ = p_ + text.size();
+    out = TraceEvent();
+    return parseObject(out, false);
+  }
+
+private:
+  const char *p_ = nullptr;
+  const char *end_ = nullptr;
+  std::string key_;
+
+  void skipSpaces() {
+    while (p_ < end_ && (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t')) p_++;
+  }
+
+  bool expect(char c) {
+    skipSpaces();
+    if (p_ >= end_ || *p_ != c) return false;
+    p_++;
+    return true;
+  }
+
+  bool parseString(std::string *out) {
+    if (!expect('"')) return false;
+    if (out) out->clear();
+    while (p_ < end_ && *p_ != '"') {
+      char c = *p_++;
+      if (c == '\\' && p_ < end_) {
+        c = *p_++;
+        switch (c) {
+          case 'n': c = '\n'; break;
+          case 't': c = '\t'; break;
+          case 'r': c = '\r'; break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          default: break; // \uXXXX остается как есть
+        }
+      }
+      if (out) out->push_back(c);
+    }
+    return expect('"');
+  }
+
+  bool parseNumber(double *out) {
+    skipSpaces();
+    char *numberEnd = nullptr;
+    double value = strtod(p_, &numberEnd);
+    if (numberEnd == p_ || numberEnd > end_) return false;
+    p_ = numberEnd;
+    if (out) *out = value;
+    return true;
+  }
+
+  /// Пропускает значение любого типа
+  bool skipValue() {
+    skipSpaces();
+    if (p_ >= end_) return false;
+    if (*p_ == '"') return parseString(nullptr);
+    if (*p_ == '{' || *p_ == '[') {
+      char close = *p_ == '{' ? '}' : ']';
+      p_++;
+      skipSpaces();
+      if (p_ < end_ && *p_ == close) {
+        p_++;
+        return true;
+      }
+      while (true) {
+        if (close == '}' && (!parseString(nullptr) || !expect(':'))) return false;
+        if (!skipValue()) return false;
+        skipSpaces();
+        if (p_ >= end_) return false;
+        char c = *p_++;
+        if (c == close) return true;
+        if (c != ',') return false;
+      }
+    }
+    if (*p_ == '-' || (*p_ >= '0' && *p_ <= '9')) return parseNumber(nullptr);
+    while (p_ < end_ && *p_ >= 'a' && *p_ <= 'z') p_++; // true, false, null
+    return true;
+  }
+
+  bool parseObject(TraceEvent &out, bool args) {
+    if (!expect('{')) return false;
+    skipSpaces();
+    if (p_ < end_ && *p_ == '}') {
+      p_++;
+      return true;
+    }
+    while (true) {
+      if (!parseString(&key_) || !expect(':')) return false;
+      bool parsed;
+      double number = 0;
+      if (args) {
+        if (key_ == "value") {
+          skipSpaces();
+          if (p_ < end_ && *p_ == 'n') {
+            out.value = std::numeric_limits<double>::quiet_NaN();
+            parsed = skipValue();
+          } else {
+            parsed = parseNumber(&out.value);
+          }
+        } else if (key_ == "name") {
+          parsed = parseString(&out.argName);
+        } else {
+          parsed = skipValue();
+        }
+      } else if (key_ == "ph") {
+        parsed = parseString(&out.phase);
+      } else if (key_ == "name") {
+        parsed = parseString(&out.name);
+      } else if (key_ == "tid") {
+        parsed = parseNumber(&number);
+        out.tid = (int32_t)number;
+      } else if (key_ == "ts") {
+        parsed = parseNumber(&out.ts);
+      } else if (key_ == "dur") {
+        parsed = parseNumber(&out.dur);
+      } else if (key_ == "args") {
+        skipSpaces();
+        parsed = p_ < end_ && *p_ == '{' ? parseObject(out, true) : skipValue();
+      } else {
+        parsed = skipValue();
+      }
+      if (!parsed) return false;
+      skipSpaces();
+      if (p_ >= end_) return false;
+      char c = *p_++;
+      if (c == '}') return true;
+      if (c != ',') return false;
+    }
+  }
+};
+
+/// События массива traceEvents по одному, файл целиком в память не читается
+class TraceEventReader {
+public:
+  explicit TraceEventReader(const std::string &path)
+  : file_(path, std::ios::binary), buf_(file_) {
+  }
+
+  /// Переходит к первому событию
+  bool open(const std::string &path, std::string &outErrMsg) {
+    if (!file_.is_open()) {
+      outErrMsg = "could not open " + path;
+      return false;
+    }
+    int c = nextToken();
+    if (c == '{') {
+      // {"otherData": {},"traceEvents":[...]}
+      const std::string key = "\"traceEvents\"";
+      size_t matched = 0;
+      while (matched < key.size() && (c = buf_.sbumpc()) != EOF) {
+        matched = c == key[matched] ? matched + 1 : (c == key[0] ? 1 : 0);
+      }
+      if (matched == key.size() && nextToken() == ':') c = nextToken();
+    }
+    if (c != '[') {
+      outErrMsg = buf_.error().empty() ? "no traceEvents in " + path : buf_.error();
+      return false;
+    }
+    return true;
+  }
+
+  /// `false` - конец массива, конец файла или ошибка формата
+  bool next(TraceEvent &event) {
+    int c;
+    do {
+      c = buf_.sgetc();
+      if (c == ',' || c == ' ' || c == '\n' || c == '\r' || c == '\t') buf_.sbumpc();
+    } while (c == ',' || c == ' ' || c == '\n' || c == '\r' || c == '\t');
+    if (c == ']') return false;
+    if (c == EOF) {
+      truncated_ = true;
+      return false;
+    }
+    if (!readObject()) return false;
+    events_++;
+    if (!parser_.parse(text_, event)) {
+      error_ = "JSON parse error in trace event " + std::to_string(events_);
+      return false;
+    }
+    return true;
+  }
+
+  bool truncated() const { return truncated_; }
+
+  /// Ошибка формата или распаковки, пусто если файл прочитан без ошибок
+  std::string error() const { return buf_.error().empty() ? error_ : buf_.error(); }
+
+private:
+  std::ifstream file_;
+  DecompressBuf buf_;
+  TraceEventParser parser_;
+  std::string text_;
+  unsigned long long events_ = 0;
+  std::string error_;
+  bool truncated_ = false;
+
+  int nextToken() {
+    int c = buf_.sbumpc();
+    while (c == ' ' || c == '\n' || c == '\r' || c == '\t') c = buf_.sbumpc();
+    return c;
+  }
+
+  /// Копирует текст события до парной закрывающей скобки
+  bool readObject() {
+    text_.clear();
+    int depth = 0;
+    bool inString = false;
+    bool escape = false;
+    while (true) {
+      int c = buf_.sbumpc();
+      if (c == EOF) {
+        truncated_ = true;
+        return false;
+      }
+      text_.push_back((char)c);
+      if (inString) {
+        if (escape) {
+          escape = false;
+        } else if (c == '\\') {
+          escape = true;
+        } else if (c == '"') {
+          inString = false;
+        }
+      } else if (c == '"') {
+        inString = true;
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if ((c == '}' || c == ']') && --depth == 0) {
+        return true;
+      }
+    }
+  }
+};
+
+/// Замер потока, для которого еще не известен родитель или не все дети
+struct ThreadSpan {
+  std::string name;
+  double start;
+  double end;
+  double time;         // время внутри окна
+  unsigned long count; // замеров верхнего уровня в группе
+  std::unique_ptr<TraceStatsNode> children; // только дети, создается при первом ребенке
+  bool group;          // несколько соседних замеров, слитых при уплотнении: children - их общий безымянный родитель
+};
+
+struct ThreadNesting {
+  std::vector<ThreadSpan> open;    // каждый следующий внутри предыдущего, в них еще могут прийти дети
+  std::deque<ThreadSpan> pending;  // завершенные замеры без родителя, по времени
+};
+
+class TraceNesting {
+public:
+  TraceNesting(const TraceStatsOptions &options, TraceStats &stats)
+  : options_(options), stats_(stats) {
+  }
+
+  void addSpan(int32_t tid, const std::string &name, double start, double end, double time) {
+    ThreadNesting &thread = threads_[tid];
+    ThreadSpan span{name, start, end, time, 1, nullptr, false};
+    while (!thread.open.empty() && !contains(thread.open.back(), span)) {
+      retire(thread, tid);
+    }
+    thread.open.push_back(std::move(span));
+  }
+
+  void finish() {
+    for (auto &keyVal : threads_) {
+      ThreadNesting &thread = keyVal.second;
+      while (!thread.open.empty()) retire(thread, keyVal.first);
+      for (auto &span : thread.pending) adopt(stats_.root, span, keyVal.first);
+      thread.pending.clear();
+    }
+  }
+
+private:
+  const TraceStatsOptions &options_;
+  TraceStats &stats_;
+  std::map<int32_t, ThreadNesting> threads_;
+
+  static bool contains(const ThreadSpan &outer, const ThreadSpan &inner) {
+    return outer.start <= inner.start && inner.end <= outer.end;
+  }
+
+  /// Добавляет замер и его детей в статистику `parent`: свой узел на каждый замер не выделяется
+  void adopt(TraceStatsNode &parent, ThreadSpan &span, int32_t tid) {
+    if (!span.group) {
+      auto &child = parent.children[span.name];
+      if (!child) child.reset(new TraceStatsNode());
+      child->add(span.time, span.end, tid, options_.lastCount, options_.perThread);
+      if (span.children) child->merge(*span.children, options_.lastCount);
+    } else {
+      parent.merge(*span.children, options_.lastCount);
+    }
+  }
+
+  void adoptChild(ThreadSpan &parent, ThreadSpan &span, int32_t tid) {
+    if (!parent.children) parent.children.reset(new TraceStatsNode());
+    adopt(*parent.children, span, tid);
+  }
+
+  /// Последний открытый замер больше не получит детей
+  void retire(ThreadNesting &thread, int32_t tid) {
+    ThreadSpan span = std::move(thread.open.back());
+    thread.open.pop_back();
+    adoptPending(thread, span, tid);
+    if (!thread.open.empty()) {
+      adoptChild(thread.open.back(), span, tid);
+      return;
+    }
+    if (thread.pending.size() >= R_TRACE_STATS_MAX_PENDING) compact(thread, tid);
+    thread.pending.push_back(std::move(span));
+  }
+
+  /// Замер забирает из pending своих детей, записанных раньше него. Забирает, только когда сам завершен:
+  /// за ним в той же пачке могут прийти вложенные в него долгие замеры, которым эти дети принадлежат ближе
+  void adoptPending(ThreadNesting &thread, ThreadSpan &parent, int32_t tid) {
+    auto &pending = thread.pending;
+    size_t hi = pending.size();
+    while (hi > 0 && pending[hi - 1].start >= parent.end && !contains(parent, pending[hi - 1])) hi--;
+    size_t lo = hi;
+    while (lo > 0) {
+      const ThreadSpan &span = pending[lo - 1];
+      // начинается раньше родителя - только группа: часть ее замеров, возможно, принадлежит не ему
+      bool straddles = span.group && span.start < parent.start && span.end > parent.start && span.end <= parent.end;
+      if (!contains(parent, span) && !straddles) break;
+      if (straddles) stats_.approximated += span.count;
+      lo--;
+    }
+    for (size_t i = lo; i < hi; i++) {
+      adoptChild(parent, pending[i], tid);
+    }
+    pending.erase(pending.begin() + lo, pending.begin() + hi);
+  }
+
+  /// Ограничивает память, если родитель долго не приходит (например, один замер на весь трейс):
+  /// каждые groupSize соседних записей pending сливаются в группу, старые замеры оказываются в группах крупнее.
+  /// Записанный позже родитель забирает группу целиком, поэтому вложенность приблизительна,
+  /// только если он начался внутри группы, и только для замеров этой группы
+  void compact(ThreadNesting &thread, int32_t tid) {
+    const size_t groupSize = 8; // чем больше, тем реже уплотнение и слияние старых групп между собой
+    auto &pending = thread.pending;
+    size_t count = 0;
+    for (size_t i = 0; i < pending.size(); i += groupSize) {
+      size_t end = std::min(i + groupSize, pending.size());
+      ThreadSpan &first = pending[i];
+      if (!first.group && end - i > 1) {
+        ThreadSpan group{std::string(), first.start, first.end, 0, 0,
+                         std::unique_ptr<TraceStatsNode>(new TraceStatsNode()), true};
+        addToGroup(group, first, tid);
+        pending[i] = std::move(group);
+      }
+      for (size_t j = i + 1; j < end; j++) addToGroup(pending[i], pending[j], tid);
+      pending[count++] = std::move(pending[i]);
+    }
+    pending.resize(count);
+  }
+
+  void addToGroup(ThreadSpan &group, ThreadSpan &span, int32_t tid) {
+    group.start = std::min(group.start, span.start);
+    group.end = std::max(group.end, span.end);
+    group.count += span.count;
+    adopt(*group.children, span, tid);
+  }
+};
+
+inline void addCounter(TraceStats &stats, const std::string &name, double time, double value) {
+  TraceCounterStats &counter = stats.counters[name];
+  if (counter.count == 0 || value < counter.minValue) counter.minValue = value;
+  if (counter.count == 0 || value > counter.maxValue) counter.maxValue = value;
+  if (counter.count == 0 || time >= counter.lastTime) {
+    counter.lastValue = value;
+    counter.lastTime = time;
+  }
+  counter.sum += value;
+  counter.count++;
+}
+
+/// Самое раннее событие трейса: от него отсчитывается окно
+inline bool findStartTime(const std::string &path, double &outStart, std::string &outErrMsg) {
+  TraceEventReader reader(path);
+  if (!reader.open(path, outErrMsg)) return false;
+  TraceEvent event;
+  outStart = std::numeric_limits<double>::max();
+  while (reader.next(event)) {
+    if (event.phase == "X" || event.phase == "C") outStart = std::min(outStart, event.ts);
+  }
+  if (!reader.error().empty()) {
+    outErrMsg = reader.error();
+    return false;
+  }
+  if (outStart == std::numeric_limits<double>::max()) outStart = 0;
+  return true;
+}
+
+bool readTraceStats(const std::string &path, const TraceStatsOptions &options, TraceStats &out, std::string &outErrMsg) {
+  double windowStart = -std::numeric_limits<double>::max();
+  double windowEnd = std::numeric_limits<double>::max();
+  if (options.fromSec > 0 || options.toSec > 0) {
+    if (!findStartTime(path, out.startTime, outErrMsg)) return false;
+    windowStart = out.startTime + options.fromSec * 1e6;
+    if (options.toSec > 0) windowEnd = out.startTime + options.toSec * 1e6;
+  }
+
+  TraceEventReader reader(path);
+  if (!reader.open(path, outErrMsg)) return false;
+  TraceNesting nesting(options, out);
+  TraceEvent event;
+  while (reader.next(event)) {
+    if (event.phase == "X") {
+      double end = event.ts + event.dur;
+      // дети замера вне окна тоже вне окна, такие замеры не нужны и для вложенности
+      if (event.ts >= windowEnd || end < windowStart) continue;
+      double time = std::max(0.0, std::min(end, windowEnd) - std::max(event.ts, windowStart));
+      nesting.addSpan(event.tid, event.name, event.ts, end, time);
+      out.spans++;
+    } else if (event.phase == "C") {
+      if (event.ts < windowStart || event.ts >= windowEnd) continue;
+      if (std::isnan(event.value)) continue; // nan и inf в трейсе записаны как null
+      addCounter(out, event.name, event.ts, event.value);
+    } else if (event.phase == "M" && event.name == "thread_name") {
+      out.threadNames[event.tid] = event.argName;
+    }
+  }
+  if (!reader.error().empty()) {
+    outErrMsg = reader.error();
+    return false;
+  }
+  nesting.finish();
+  out.truncated = reader.truncated();
+  return true;
+}
+
+} // namespace Tracing
+} // namespace roadar
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <iomanip>
+#include <chrono>
+#include <memory> // unique_ptr
+#include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <cstring>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+#include <cerrno>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+// сэмплер берет адрес прерванной инструкции из ucontext, это зависит от архитектуры
+#if defined(__x86_64__) || defined(__aarch64__) || (defined(__linux__) && defined(__i386__))
+#define R_BENCHMARK_SAMPLER_SUPPORTED
+#endif
+#endif
+#if defined(__linux__) && defined(R_BENCHMARK_SAMPLER_SUPPORTED)
+#include <time.h>
+#define R_BENCHMARK_SAMPLER_THREAD_TIMERS // свой таймер процессорного времени у каждого потока
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid // glibc объявляет имя только с 2.35
+#endif
+#endif
+
+#ifndef CAPTURE_LAST_N_TIMES
+#define CAPTURE_LAST_N_TIMES 10
+#endif
+
+// редкие ветки (создание узла, ошибки) не встраиваются в start/stop
+#ifdef _MSC_VER
+#define R_NOINLINE __declspec(noinline)
+#else
+#define R_NOINLINE __attribute__((noinline))
+#endif
+
+
+// -------------------------------------------------
+
+namespace roadar {
+
+typedef unsigned long long timestamp_t;
+struct MeasurementInfo;
+/// К сожалению старая версия  GCC не поддерживает вложенность структур для создания деревьев
+/// Не на всех проектах есть возможность обновить GCC
+typedef std::unordered_map<std::string, std::unique_ptr<MeasurementInfo>> MeasurementMap;
+
+#ifndef BENCHMARK_DISABLED
+  static timestamp_t get_timestamp() {
+  //TODO Тут отличие от github версии
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+#endif
+
+inline std::string joined(const std::vector<std::string> &array, const std::string &separator = " » ") {
+  std::string joinedString;
+  for (size_t i = 0; i < array.size(); i++) {
+    if (i > 0) joinedString += separator;
+    joinedString += array[i];
+  }
+  return joinedString;
+}
+
+/// Строка для значения JSON: кавычки, обратная косая черта и управляющие символы экранируются так же, как в трейсе
+inline std::string jsonEscaped(const std::string &text) {
+  return Tracing::Serializer::escape(text);
+}
+
+/// Текст для строки таблицы: переводы строк заменяются пробелами
+inline std::string singleLine(std::string text) {
+  for (char &c : text) {
+    if (c == '\n' || c == '\r') c = ' ';
+  }
+  return text;
+}
+
+/*!
+ * \brief Статистика замера из сохраненного baseline, время в микросекундах.
+ */
+struct BaselineStat {
+  double avg = 0;
+  double std = 0; // 0 если в baseline нет разброса (например, обычный JSON лог)
+  double times = 0;
+};
+typedef std::unordered_map<std::string, BaselineStat> BaselineMap; // ключ - полный путь через " » "
+
+#ifndef R_BENCHMARK_CHILD_CACHE
+#define R_BENCHMARK_CHILD_CACHE 4 // последних найденных детей одного узла
+#endif
+
+/*!
+ * \brief Последние найденные дочерние узлы: повторный запуск замера, в том числе чередующихся
+ * соседних замеров одного уровня, обходится без поиска в map и копии строки.
+ */
+struct ChildCache {
+  const std::string *keys[R_BENCHMARK_CHILD_CACHE] = {}; // ключи узлов в MeasurementMap родителя
+  MeasurementInfo *nodes[R_BENCHMARK_CHILD_CACHE] = {};
+  unsigned next = 0; // запись, которую заменит следующий промах
+
+  /// Индекс записи `identifier` или -1
+  int find(const char *identifier, const std::string *identifierString) const {
+    for (int i = 0; i < R_BENCHMARK_CHILD_CACHE; i++) {
+      if (!nodes[i]) break;
+      if (identifierString ? *keys[i] == *identifierString : strcmp(keys[i]->c_str(), identifier) == 0) return i;
+    }
+    return -1;
+  }
+
+  void put(const std::string *key, MeasurementInfo *node) {
+    keys[next] = key;
+    nodes[next] = node;
+    next = (next + 1) % R_BENCHMARK_CHILD_CACHE;
+  }
+};
+
+struct CardinalityOverflow;
+
+/*!
+ * \brief Информация о замерах.
+ */
+struct MeasurementInfo {
+  double totalTime = 0;
+  double childrenTime = 0;
+  unsigned long timesExecuted = 0;
+  timestamp_t lastStartTime = 0;
+  double lastNTimes[CAPTURE_LAST_N_TIMES] = {};
+  unsigned long startNTimesIdx = 0;
+  double maxTime = 0;
+  double sumSquares = 0;
+  std::atomic<timestamp_t> budget{0}; // 0 - без бюджета, может меняться из другого потока
+  unsigned long budgetViolations = 0;
+  std::atomic<const BaselineStat *> baseline{nullptr};
+  bool regressed = false;
+  // общий для всех потоков id пути замера, см. registerNode; benchmarkReset перенумеровывает под `mut` группы
+  std::atomic<uint32_t> nodeId{0};
+  double elapsedTime = 0; // для прерываемых замеров: время от начала до конца вместе с приостановками
+  ChildCache lastChild;
+  std::shared_ptr<CardinalityOverflow> childrenOverflow; // уровень детей переполнен, новые идентификаторы - в overflowKey
+  MeasurementMap children;
+};
+
+/*!
+ * \brief Информация о счетчике.
+ */
+struct CounterInfo {
+  double lastValue = 0;
+  double minValue = 0;
+  double maxValue = 0;
+  double sum = 0;
+  unsigned long count = 0;
+  timestamp_t lastTime = 0;
+
+  void update(double value, timestamp_t time) {
+    if (count == 0 || value < minValue) minValue = value;
+    if (count == 0 || value > maxValue) maxValue = value;
+    lastValue = value;
+    lastTime = time;
+    sum += value;
+    count++;
+  }
+
+  void merge(const CounterInfo &other) {
+    if (other.count == 0) return;
+    if (count == 0 || other.minValue < minValue) minValue = other.minValue;
+    if (count == 0 || other.maxValue > maxValue) maxValue = other.maxValue;
+    if (other.lastTime >= lastTime) {
+      lastValue = other.lastValue;
+      lastTime = other.lastTime;
+    }
+    sum += other.sum;
+    count += other.count;
+  }
+};
+typedef std::unordered_map<std::string, CounterInfo> CounterMap;
+
+inline std::mutex budgetMut;
+inline std::unordered_map<std::string, timestamp_t> budgets;
+inline std::function<void(const BudgetViolation &)> budgetCallback;
+inline std::atomic<bool> hasBudgetCallback{false};
+
+inline timestamp_t findBudget(const std::string &identifier) {
+  std::lock_guard<std::mutex> lock(budgetMut);
+  auto it = budgets.find(identifier);
+  return it == budgets.end() ? 0 : it->second;
+}
+
+inline std::mutex baselineMut;
+// загруженные baseline не удаляем, на них ссылаются узлы замеров
+inline std::vector<std::unique_ptr<BaselineMap>> loadedBaselines;
+inline std::atomic<const BaselineMap *> activeBaseline{nullptr};
+inline std::atomic<double> regressionMinScore{3.0};
+inline std::atomic<double> regressionMinDrift{0.1};
+inline std::function<void(const RegressionInfo &)> regressionCallback;
+
+inline const BaselineStat *findBaseline(const std::string &path) {
+  const BaselineMap *baseline = activeBaseline.load();
+  if (!baseline) return nullptr;
+  auto it = baseline->find(path);
+  return it == baseline->end() ? nullptr : &it->second;
+}
+
+/// Welch t-test: насколько текущее окно медленнее baseline (в сигмах)
+inline double regressionScore(const BaselineStat &baseline, double mean, double variance, double count) {
+  double err = 0;
+  if (baseline.times > 0) err += baseline.std * baseline.std / baseline.times;
+  if (count > 0) err += variance / count;
+  double diff = mean - baseline.avg;
+  if (err <= 0) {
+    return diff > 0 ? INFINITY : 0;
+  }
+  return diff / std::sqrt(err);
+}
+
+inline bool isRegression(const BaselineStat &baseline, double mean, double variance, double count, double &outDrift, double &outScore) {
+  outDrift = baseline.avg <= 0 ? 0 : (mean - baseline.avg) / baseline.avg;
+  outScore = regressionScore(baseline, mean, variance, count);
+  return count > 0 && outDrift >= regressionMinDrift.load() && outScore >= regressionMinScore.load();
+}
+
+/*!
+ * \brief Реестр путей замеров: один id на путь для всех потоков.
+ * По id замеры потоков складываются в плоский массив без поиска по именам при слиянии.
+ * Родитель всегда получает id раньше детей, 0 - корень. Между сбросами id не удаляются,
+ * benchmarkReset строит реестр заново по оставшимся открытым замерам, см. rebuildNodeRegistryLocked.
+ */
+struct NodeDesc {
+  uint32_t parent;
+  std::string name;
+};
+inline std::mutex nodeRegistryMut;
+inline std::deque<NodeDesc> nodeRegistry = {{0, ""}};
+inline std::vector<std::unordered_map<std::string, uint32_t>> nodeRegistryChildren(1);
+inline std::atomic<uint64_t> nodeRegistryEpoch{0}; // номер перестроения реестра
+// unionMeasurements читает реестр без nodeRegistryMut, перестроение ждет окончания лога
+inline std::mutex mergeMut;
+
+#ifndef R_BENCHMARK_MAX_CHILDREN
+#define R_BENCHMARK_MAX_CHILDREN 1000   // разных идентификаторов внутри одного замера (и на верхнем уровне)
+#endif
+#ifndef R_BENCHMARK_MAX_NODES
+#define R_BENCHMARK_MAX_NODES 100000    // разных путей замеров всего
+#endif
+#ifndef R_BENCHMARK_CARDINALITY_EXAMPLES
+#define R_BENCHMARK_CARDINALITY_EXAMPLES 5
+#endif
+#ifndef R_BENCHMARK_FLAT_TOP
+#define R_BENCHMARK_FLAT_TOP 30         // строк View::flat по умолчанию, см. benchmarkSetFlatViewTop
+#endif
+
+/// Замеры сверх лимитов попадают в этот узел того же уровня
+inline const char *const overflowKey = "(other)";
+inline std::atomic<size_t> maxChildrenPerNode{R_BENCHMARK_MAX_CHILDREN};
+inline std::atomic<size_t> maxNodes{R_BENCHMARK_MAX_NODES};
+
+/*!
+ * \brief Уровень, на котором сработал лимит. До benchmarkReset (или смены лимитов) новых идентификаторов
+ * на нем не появится, поэтому поток, получивший описание уровня, решает сам, без реестра и его блокировки.
+ */
+struct CardinalityOverflow {
+  std::unordered_set<std::string> kept; // идентификаторы уровня в реестре на момент переполнения, не меняется
+  size_t maxChildren;                   // лимиты на момент переполнения
+  size_t maxNodes;
+  std::atomic<unsigned long> redirected{0}; // сколько запусков замеров попало в overflowKey
+  std::vector<std::string> examples;        // под nodeRegistryMut
+
+  bool current() const {
+    return maxChildren == maxChildrenPerNode.load(std::memory_order_relaxed) &&
+           maxNodes == ::roadar::maxNodes.load(std::memory_order_relaxed);
+  }
+};
+inline std::unordered_map<uint32_t, std::shared_ptr<CardinalityOverflow>> cardinalityOverflows; // ключ - id родителя, под nodeRegistryMut
+
+/// Вызывать под nodeRegistryMut
+inline uint32_t addNodeLocked(uint32_t parent, const std::string &name) {
+  auto id = static_cast<uint32_t>(nodeRegistry.size());
+  nodeRegistry.push_back({parent, name});
+  nodeRegistryChildren.emplace_back();
+  // emplace_back мог переместить вектор, поэтому снова берем по индексу
+  nodeRegistryChildren[parent][name] = id;
+  return id;
+}
+
+/*!
+ * \brief Возвращает id узла; если лимит превышен, `name` заменяется на overflowKey,
+ * а `outOverflow` - описание переполненного уровня.
+ */
+inline uint32_t registerNode(uint32_t parent, std::string &name, std::shared_ptr<CardinalityOverflow> &outOverflow) {
+  std::lock_guard<std::mutex> lock(nodeRegistryMut);
+  auto &children = nodeRegistryChildren[parent];
+  auto it = children.find(name);
+  if (it != children.end()) return it->second;
+  if (name != overflowKey &&
+      (children.size() >= maxChildrenPerNode.load() || nodeRegistry.size() >= maxNodes.load())) {
+    auto &overflow = cardinalityOverflows[parent];
+    if (!overflow || !overflow->current()) {
+      std::shared_ptr<CardinalityOverflow> level(new CardinalityOverflow());
+      for (const auto &keyVal : children) level->kept.insert(keyVal.first);
+      level->maxChildren = maxChildrenPerNode.load();
+      level->maxNodes = maxNodes.load();
+      if (overflow) {
+        // лимиты поменялись: счет продолжаем
+        level->redirected = overflow->redirected.load();
+        level->examples = overflow->examples;
+      }
+      overflow = level;
+    }
+    overflow->redirected++;
+    if (overflow->examples.size() < R_BENCHMARK_CARDINALITY_EXAMPLES) {
+      overflow->examples.push_back(name);
+    }
+    outOverflow = overflow;
+    name = overflowKey;
+    it = children.find(name);
+    if (it != children.end()) return it->second;
+  }
+  return addNodeLocked(parent, name);
+}
+
+/*!
+ * \brief Описание потока для логов и трейсинга, заполняется один раз при первом замере потока.
+ */
+struct ThreadInfo {
+  std::string name;      // R_THREAD_NAME или имя потока в ОС
+  long long osTid = 0;   // id потока в ОС (как в top / perf), 0 - неизвестен
+  std::string affinity;  // ядра, на которых может работать поток: "0-3,6"; пусто - неизвестно
+  int priority = 0;      // nice в Linux, приоритет планировщика в остальных ОС
+};
+
+inline std::string cpuListString(const std::vector<int> &cpus) {
+  std::string result;
+  for (size_t i = 0; i < cpus.size(); ) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+    if (!result.empty()) result += ",";
+    result += std::to_string(cpus[i]);
+    if (j > i) result += "-" + std::to_string(cpus[j]);
+    i = j + 1;
+  }
+  return result;
+}
+
+/// Вызывается в самом потоке
+inline void fillCurrentThreadInfo(ThreadInfo &info) {
+#if defined(__linux__)
+  info.osTid = static_cast<long long>(syscall(SYS_gettid));
+  char name[64] = {};
+  if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0) info.name = name;
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0) {
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &cpuSet)) cpus.push_back(cpu);
+    }
+    info.affinity = cpuListString(cpus);
+  }
+  info.priority = getpriority(PRIO_PROCESS, static_cast<id_t>(info.osTid));
+#elif defined(__APPLE__)
+  uint64_t osTid = 0;
+  pthread_threadid_np(nullptr, &osTid);
+  info.osTid = static_cast<long long>(osTid);
+  char name[64] = {};
+  if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0) info.name = name;
+  int policy = 0;
+  sched_param param = {};
+  if (pthread_getschedparam(pthread_self(), &policy, &param) == 0) info.priority = param.sched_priority;
+#elif defined(_WIN32)
+  info.osTid = static_cast<long long>(GetCurrentThreadId());
+  info.priority = GetThreadPriority(GetCurrentThread());
+#endif
+}
+
+/// Открытый замер потока
+struct OpenMeasurement {
+  MeasurementInfo *node = nullptr;
+  const std::string *key = nullptr;   // ключ узла, открытый узел не удаляется из дерева
+  std::string overflowIdentifier;     // исходный идентификатор, если замер попал в overflowKey
+  Tracing::TraceArgs args;            // аргументы для трейсинга
+
+  OpenMeasurement() {
+    args.count = 0;
+  }
+  const std::string &identifier() const {
+    return overflowIdentifier.empty() ? *key : overflowIdentifier;
+  }
+};
+
+#ifndef R_BENCHMARK_SAMPLER_CAPACITY
+#define R_BENCHMARK_SAMPLER_CAPACITY 1024 // сэмплов потока между двумя benchmarkLog
+#endif
+
+/// Сэмпл: открытый замер потока и адрес прерванной инструкции, символы ищутся только при выводе
+struct Sample {
+  uint32_t nodeId;
+  void *address;
+};
+
+/// Пишет только обработчик сигнала в своем потоке, читает benchmarkLog: очередь без блокировок
+struct SampleBuffer {
+  std::atomic<size_t> writeIdx{0};
+  std::atomic<size_t> readIdx{0};
+  std::atomic<unsigned long> dropped{0}; // буфер был полон
+  Sample samples[R_BENCHMARK_SAMPLER_CAPACITY];
+};
+
+struct MeasurementGroup {
+  MeasurementGroup() = default;
+  ~MeasurementGroup() {
+    delete sampleBuffer.load();
+  }
+//  MeasurementGroup(MeasurementGroup const &val) {
+//    map = val.map;
+//  };
+  // map и counters меняет поток-владелец, читают другие потоки: доступ только под `mut`
+  std::mutex mut;
+  MeasurementMap map = {};
+  CounterMap counters = {};
+  std::thread::id tid;
+  ThreadInfo thread; // под `mut`
+  std::atomic<bool> registered{false}; // группа есть в measurementThreadMap
+  std::atomic<uint32_t> currentNodeId{0}; // id последнего открытого замера для обработчика сэмплера
+  std::atomic<SampleBuffer *> sampleBuffer{nullptr}; // создается под `::mut` при включенном сэмплере
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  pthread_t pthread = {};      // поток-владелец: его часы процессорного времени считает таймер сэмплера
+  timer_t samplerTimer = {};   // под samplerState.mut
+  bool hasSamplerTimer = false;
+#endif
+  // используются только потоком-владельцем
+  std::vector<OpenMeasurement> openMeasurements;
+  ChildCache rootLastChild; // под `mut`
+  std::shared_ptr<CardinalityOverflow> rootOverflow; // под `mut`, см. MeasurementInfo::childrenOverflow
+  bool paused = false; // замеры потока временно не записываются
+  bool calibration = false; // группа benchmarkCalibrate: вне реестра и лимитов, без трейсинга, бюджетов и baseline
+  std::mutex flightRecorderMut; // защищает flightRecorder от сохранения из другого потока
+  std::unique_ptr<Tracing::RingBuffer> flightRecorder;
+  Tracing::BinaryCursor binaryCursor; // только поток-владелец
+
+  /// Идентификаторы открытых замеров, от корня
+  std::vector<std::string> path() const {
+    std::vector<std::string> result;
+    for (const auto &measurement : openMeasurements) {
+      result.push_back(measurement.identifier());
+    }
+    return result;
+  }
+
+  MeasurementInfo *getLast() {
+    return openMeasurements.empty() ? nullptr : openMeasurements.back().node;
+  }
+
+  void pop() {
+    openMeasurements.pop_back();
+    currentNodeId.store(openMeasurements.empty() ? 0 : openMeasurements.back().node->nodeId.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+  }
+
+  /*!
+   * \brief Находит или создает узел `identifier` внутри последнего открытого замера и добавляет его в стек.
+   * Вызывать под `mut`. `identifierString` - тот же идентификатор, если у вызывающего уже есть std::string.
+   */
+  MeasurementInfo *push(const char *identifier, const std::string *identifierString) {
+    MeasurementInfo *parent = getLast();
+    ChildCache &cache = parent ? parent->lastChild : rootLastChild;
+    int cached = cache.find(identifier, identifierString);
+    if (cached < 0) {
+      return pushNew(parent, cache, identifier, identifierString);
+    }
+    MeasurementInfo *node = cache.nodes[cached];
+    openMeasurements.emplace_back();
+    openMeasurements.back().node = node;
+    openMeasurements.back().key = cache.keys[cached];
+    currentNodeId.store(node->nodeId.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return node;
+  }
+
+  /// Поиск в дереве и создание узла, если узла нет среди последних найденных на уровне
+  R_NOINLINE MeasurementInfo *pushNew(MeasurementInfo *parent, ChildCache &cache,
+                                      const char *identifier, const std::string *identifierString) {
+    std::string localIdentifier;
+    if (!identifierString) {
+      localIdentifier = identifier;
+      identifierString = &localIdentifier;
+    }
+    MeasurementMap &children = parent ? parent->children : map;
+    auto it = children.find(*identifierString);
+    bool overflowed = false;
+    if (it == children.end()) {
+      // уровень уже переполнен: новый идентификатор уходит в overflowKey без реестра
+      auto &overflow = parent ? parent->childrenOverflow : rootOverflow;
+      if (overflow && overflow->current() && !overflow->kept.count(*identifierString)) {
+        it = children.find(overflowKey);
+        overflowed = it != children.end();
+        if (overflowed) overflow->redirected.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    if (it == children.end()) {
+      std::string key = *identifierString;
+      uint32_t nodeId = calibration ? 0 : registerNode(parent ? parent->nodeId.load(std::memory_order_relaxed) : 0, key,
+                                                       parent ? parent->childrenOverflow : rootOverflow);
+      overflowed = key != *identifierString;
+      // при превышении лимита key - общий узел уровня, он может уже существовать
+      it = children.find(key);
+      if (it == children.end()) {
+        std::unique_ptr<MeasurementInfo> node(new MeasurementInfo());
+        node->nodeId = nodeId;
+        node->budget = calibration ? 0 : findBudget(key);
+        if (!calibration && activeBaseline.load()) {
+          std::vector<std::string> nodePath = path();
+          nodePath.push_back(key);
+          node->baseline = findBaseline(joined(nodePath));
+        }
+        it = children.emplace(key, std::move(node)).first;
+      }
+    }
+    if (!overflowed) {
+      cache.put(&it->first, it->second.get());
+    }
+    openMeasurements.emplace_back();
+    openMeasurements.back().node = it->second.get();
+    openMeasurements.back().key = &it->first;
+    if (overflowed) openMeasurements.back().overflowIdentifier = *identifierString;
+    currentNodeId.store(it->second->nodeId.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return it->second.get();
+  }
+};
+
+#ifndef R_BENCHMARK_ERROR_SITES
+#define R_BENCHMARK_ERROR_SITES 64      // разных мест ошибок; ошибки остальных мест только считаются
+#endif
+#define R_BENCHMARK_ERROR_TEXT 128      // тексты места ошибки обрезаются до этой длины
+
+enum class ErrorKind : uint8_t {
+  alreadyRun,    // start уже открытого замера
+  stopMismatch,  // stop не последнего открытого замера: стек раскручен до него
+  stopNotOpen,   // stop замера, которого нет среди открытых
+  notStarted,    // stop узла, у которого нет времени старта
+  io,            // файл трейсинга или flight recorder
+  otherSites,    // ошибки мест, не поместившихся в R_BENCHMARK_ERROR_SITES
+};
+
+inline const char *errorKindName(ErrorKind kind) {
+  switch (kind) {
+    case ErrorKind::alreadyRun: return "already run";
+    case ErrorKind::stopMismatch: return "stop mismatch";
+    case ErrorKind::stopNotOpen: return "stop not open";
+    case ErrorKind::notStarted: return "not started";
+    case ErrorKind::io: return "io";
+    case ErrorKind::otherSites: return "other sites";
+  }
+  return "";
+}
+
+/// Место ошибки: тексты копируются один раз при первой ошибке, дальше меняются только счетчики
+struct ErrorSite {
+  std::atomic<int> state{0};  // 0 - свободно, 1 - заполняется, 2 - готово
+  uint32_t hash = 0;
+  ErrorKind kind = ErrorKind::io;
+  int line = 0;
+  char file[R_BENCHMARK_ERROR_TEXT];   // конец пути, если он длиннее
+  char detail[R_BENCHMARK_ERROR_TEXT]; // идентификатор замера или сообщение
+  std::atomic<unsigned long> count{0};
+  std::atomic<unsigned long> unwound{0}; // брошенных незакрытых замеров, для stopMismatch
+};
+
+struct ErrorReport {
+  ErrorKind kind;
+  std::string file;
+  int line;
+  std::string detail;
+  unsigned long count;
+  unsigned long unwound;
+};
+
+/*!
+ * \brief Счетчики ошибок по местам вызова.
+ * Ошибка не сбрасывает накопленную статистику и не берет блокировок: место ищется в открытой адресации
+ * по хешу (вид, файл, строка, идентификатор), занимается через CAS, тексты копируются без выделения памяти.
+ */
+class ErrorSites {
+public:
+  void update(ErrorKind kind, const char *detail, const char *file, int line, unsigned long unwound = 0) {
+    if (!file) file = "";
+    if (!detail) detail = "";
+    uint32_t hash = hashSite(kind, detail, file, line);
+    for (size_t probe = 0; probe < R_BENCHMARK_ERROR_SITES; probe++) {
+      ErrorSite &site = sites_[(hash + probe) % R_BENCHMARK_ERROR_SITES];
+      int state = site.state.load(std::memory_order_acquire);
+      if (state == 0) {
+        if (site.state.compare_exchange_strong(state, 1, std::memory_order_acquire)) {
+          site.hash = hash;
+          site.kind = kind;
+          site.line = line;
+          copyText(site.file, file, true);
+          copyText(site.detail, detail, false);
+          site.state.store(2, std::memory_order_release);
+          count(site, unwound);
+          return;
+        }
+      }
+      // место заполняет другой поток: это может быть то же самое место
+      while (state == 1) {
+        std::this_thread::yield();
+        state = site.state.load(std::memory_order_acquire);
+      }
+      if (site.hash == hash && site.kind == kind && site.line == line &&
+          sameText(site.file, file, true) && sameText(site.detail, detail, false)) {
+        count(site, unwound);
+        return;
+      }
+    }
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Места с ошибками после последнего `reset`, по убыванию числа ошибок
+  std::vector<ErrorReport> collect() const {
+    std::vector<ErrorReport> reports;
+    for (const auto &site : sites_) {
+      if (site.state.load(std::memory_order_acquire) != 2) continue;
+      unsigned long count = site.count.load(std::memory_order_relaxed);
+      if (count == 0) continue;
+      reports.push_back({site.kind, site.file, site.line, site.detail, count, site.unwound.load(std::memory_order_relaxed)});
+    }
+    unsigned long dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped > 0) {
+      reports.push_back({ErrorKind::otherSites, "", 0, "", dropped, 0});
+    }
+    std::stable_sort(reports.begin(), reports.end(), [](const ErrorReport &a, const ErrorReport &b) -> bool {
+      return a.count > b.count;
+    });
+    return reports;
+  }
+
+  /// Места остаются занятыми, обнуляются только счетчики
+  void reset() {
+    for (auto &site : sites_) {
+      site.count.store(0, std::memory_order_relaxed);
+      site.unwound.store(0, std::memory_order_relaxed);
+    }
+    dropped_.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  ErrorSite sites_[R_BENCHMARK_ERROR_SITES];
+  std::atomic<unsigned long> dropped_{0};
+
+  static void count(ErrorSite &site, unsigned long unwound) {
+    site.count.fetch_add(1, std::memory_order_relaxed);
+    if (unwound > 0) site.unwound.fetch_add(unwound, std::memory_order_relaxed);
+  }
+
+  /// Начало текста, который помещается в ErrorSite: для пути файла - его конец
+  static const char *fittedText(const char *text, bool keepTail, size_t &outLength) {
+    size_t length = strlen(text);
+    outLength = std::min<size_t>(length, R_BENCHMARK_ERROR_TEXT - 1);
+    return keepTail ? text + (length - outLength) : text;
+  }
+
+  /// Текст хранится как есть, экранируется при выводе
+  static void copyText(char *dst, const char *src, bool keepTail) {
+    size_t length;
+    const char *text = fittedText(src, keepTail, length);
+    memcpy(dst, text, length);
+    dst[length] = '\0';
+  }
+
+  static bool sameText(const char *stored, const char *src, bool keepTail) {
+    size_t length;
+    const char *text = fittedText(src, keepTail, length);
+    return strncmp(stored, text, length) == 0 && stored[length] == '\0';
+  }
+
+  static uint32_t hashSite(ErrorKind kind, const char *detail, const char *file, int line) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    auto mix = [&hash](unsigned char c) {
+      hash ^= c;
+      hash *= 16777619u;
+    };
+    for (const char *c = file; *c; c++) mix((unsigned char)*c);
+    for (const char *c = detail; *c; c++) mix((unsigned char)*c);
+    for (size_t i = 0; i < sizeof(line); i++) mix((unsigned char)(line >> (i * 8)));
+    mix(static_cast<unsigned char>(kind));
+    return hash;
+  }
+};
+
+// without pointer this map fails on Win machine
+// shared_ptr: поток держит свою группу, даже если ее уже убрали из map
+// ключ std::thread::id() - общая группа завершившихся потоков, см. retireGroup
+inline std::unordered_map<std::thread::id, std::shared_ptr<MeasurementGroup>> measurementThreadMap;
+inline std::mutex mut;
+inline ErrorSites errorSites;
+inline std::shared_ptr<Tracing::Serializer> tracing; // только через std::atomic_load / std::atomic_store
+inline std::atomic<bool> tracingEnabled{false};
+inline Tracing::Compression tracingCompression = Tracing::Compression::none; // под mut
+inline std::shared_ptr<Tracing::BinaryTraceFile> binaryTracing; // только через std::atomic_load / std::atomic_store
+inline std::atomic<bool> binaryTracingEnabled{false};
+
+inline std::shared_ptr<Tracing::BinaryTraceFile> activeBinaryTracing() {
+  if (!binaryTracingEnabled.load(std::memory_order_relaxed)) return nullptr;
+  return std::atomic_load(&binaryTracing);
+}
+
+inline std::shared_ptr<Tracing::Serializer> activeTracing() {
+  if (!tracingEnabled.load(std::memory_order_relaxed)) return nullptr;
+  return std::atomic_load(&tracing);
+}
+
+struct FlightRecorderState {
+  std::atomic<bool> enabled{false};
+  std::atomic<bool> dumpRequested{false};
+  std::atomic<timestamp_t> slowSpanThreshold{0}; // 0 - отключено
+  std::atomic<timestamp_t> lastDumpTime{0};
+  std::atomic<unsigned> dumpIndex{0};
+  // меняются только под `mut`, пока enabled == false
+  std::atomic<size_t> eventsPerThread{0};
+  std::atomic<timestamp_t> keepTime{0};
+  std::string dumpPath;
+  // фоновый поток сохранения: benchmarkStop только будит его, файл пишется вне потока замера
+  std::mutex writerControlMut; // запуск и остановка writer, без `::mut`: writer сам берет `::mut`
+  std::thread writer;
+  std::mutex writerMut;
+  std::condition_variable writerCv;
+  bool writerPending = false; // под writerMut
+  bool writerStop = false;    // под writerMut
+
+  ~FlightRecorderState() {
+    stopWriter();
+  }
+
+  void stopWriter() {
+    std::lock_guard<std::mutex> controlLock(writerControlMut);
+    if (!writer.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(writerMut);
+      writerStop = true;
+    }
+    writerCv.notify_all();
+    writer.join();
+    std::lock_guard<std::mutex> lock(writerMut);
+    writerStop = false;
+    writerPending = false;
+  }
+};
+inline FlightRecorderState flightRecorderState;
+
+struct SamplerState {
+  std::atomic<bool> enabled{false};
+  std::mutex mut; // после `::mut`, если нужны обе
+  size_t topFunctions = 5;
+  // сэмплы, перенесенные из буферов потоков: id узла -> адрес -> число сэмплов
+  std::unordered_map<uint32_t, std::unordered_map<void *, unsigned long>> counts;
+  std::unordered_map<void *, std::string> symbols; // кэш символов
+  unsigned long dropped = 0;
+  long intervalNs = 0; // период таймеров потоков, 0 - сэмплер остановлен
+};
+inline SamplerState samplerState;
+// группа потока для обработчика сигнала: тривиальный thread_local читается без инициализации
+inline thread_local MeasurementGroup *samplerGroup = nullptr;
+
+inline std::atomic<double> overheadPerCall{-1}; // мкс на пару start/stop, < 0 - не измерено
+inline std::atomic<double> overheadInside{0};   // мкс, часть пары, попадающая в время самого замера
+inline std::atomic<bool> overheadCompensation{false};
+inline std::atomic<size_t> flatViewTop{R_BENCHMARK_FLAT_TOP}; // строк View::flat, 0 - все
+inline void processFlightRecorder(MeasurementGroup &group, const Tracing::TraceInfo &info);
+
+inline void writeThreadDescriptor(Tracing::Serializer &serializer, MeasurementGroup &group) {
+  ThreadInfo thread;
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    thread = group.thread;
+  }
+  if (thread.name.empty()) thread.name = "thread " + std::to_string(thread.osTid);
+  serializer.writeThreadInfo(group.tid, thread.name, thread.osTid, thread.affinity, thread.priority);
+}
+
+/// Привязывает курсор потока к сессии бинарного трейса, первой записью идет имя потока
+inline void attachBinaryTracing(Tracing::BinaryTraceFile &binary, MeasurementGroup &group) {
+  if (group.binaryCursor.session == binary.session()) return;
+  ThreadInfo thread;
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    thread = group.thread;
+  }
+  if (thread.name.empty()) thread.name = "thread " + std::to_string(thread.osTid);
+  binary.attach(group.binaryCursor, thread.name);
+}
+
+/*!
+ * \brief Имена узла и его предков пишутся в чанки потока перед первым замером узла в сессии.
+ * \param epoch nodeRegistryEpoch, прочитанный вместе с `nodeId`
+ * \return `false`, если реестр с тех пор перестроен и `nodeId` уже означает другой путь
+ */
+inline bool nameBinaryNode(Tracing::BinaryTraceFile &binary, MeasurementGroup &group, uint32_t nodeId, uint64_t epoch) {
+  std::vector<bool> &named = group.binaryCursor.namedNodes;
+  if (group.binaryCursor.registryEpoch == epoch && nodeId < named.size() && named[nodeId]) return true;
+  std::vector<std::pair<uint32_t, NodeDesc>> missing;
+  {
+    std::lock_guard<std::mutex> lock(nodeRegistryMut);
+    if (epoch != nodeRegistryEpoch.load()) return false;
+    if (group.binaryCursor.registryEpoch != epoch) {
+      // id перенумерованы: имена пишутся заново, читатель заменяет имя id потока
+      named.clear();
+      group.binaryCursor.registryEpoch = epoch;
+    }
+    for (uint32_t id = nodeId; id != 0 && !(id < named.size() && named[id]); id = nodeRegistry[id].parent) {
+      missing.emplace_back(id, nodeRegistry[id]);
+    }
+  }
+  for (auto it = missing.rbegin(); it != missing.rend(); ++it) {
+    if (named.size() <= it->first) named.resize(it->first + 1, false);
+    named[it->first] = true;
+    binary.writeName(group.binaryCursor, Tracing::BinaryNameKind::node, it->first, it->second.parent, it->second.name);
+  }
+  return true;
+}
+
+inline void writeBinarySpan(Tracing::BinaryTraceFile &binary, MeasurementGroup &group, uint32_t nodeId, uint64_t epoch,
+                            timestamp_t ts, timestamp_t dt, int depth, const Tracing::TraceArgs &args) {
+  attachBinaryTracing(binary, group);
+  if (!nameBinaryNode(binary, group, nodeId, epoch)) return; // замер закончился во время benchmarkReset
+  Tracing::BinaryRecord *records = binary.reserve(group.binaryCursor, 1 + args.count);
+  if (!records) return;
+  for (int i = 0; i < args.count; i++) {
+    const Tracing::TraceArg &arg = args.items[i];
+    Tracing::BinaryRecord &record = records[i];
+    record.flags = static_cast<uint8_t>(arg.type);
+    // запись в новом чанке заполнена нулями: строки до binaryArgTextSize - 1 символов остаются с нулем в конце
+    strncpy(record.text, arg.key, Tracing::binaryArgTextSize - 1);
+    if (arg.type == Tracing::ArgType::integer) {
+      record.intValue = arg.intValue;
+    } else if (arg.type == Tracing::ArgType::real) {
+      record.realValue = arg.realValue;
+    } else if (arg.type == Tracing::ArgType::string) {
+      strncpy(record.text + Tracing::binaryArgTextSize, arg.stringValue, Tracing::binaryArgTextSize - 1);
+    }
+    Tracing::BinaryTraceFile::commit(record, Tracing::BinaryRecordType::arg);
+  }
+  Tracing::BinaryRecord &span = records[args.count];
+  span.depth = (uint16_t)depth;
+  span.id = nodeId;
+  span.time = ts;
+  span.duration = dt;
+  Tracing::BinaryTraceFile::commit(span, Tracing::BinaryRecordType::span);
+}
+
+inline void writeBinaryCounter(Tracing::BinaryTraceFile &binary, MeasurementGroup &group, const std::string &identifier,
+                               timestamp_t ts, double value, int depth) {
+  attachBinaryTracing(binary, group);
+  auto &counters = group.binaryCursor.counters;
+  auto it = counters.find(identifier);
+  if (it == counters.end()) {
+    it = counters.emplace(identifier, (uint32_t)counters.size()).first;
+    binary.writeName(group.binaryCursor, Tracing::BinaryNameKind::counter, it->second, 0, identifier);
+  }
+  Tracing::BinaryRecord *record = binary.reserve(group.binaryCursor, 1);
+  if (!record) return;
+  record->depth = (uint16_t)depth;
+  record->id = it->second;
+  record->time = ts;
+  record->value = value;
+  Tracing::BinaryTraceFile::commit(*record, Tracing::BinaryRecordType::counter);
+}
+
+/// Добавляет замеры `from` в `into`, незавершенные замеры `from` не переносятся
+inline void mergeMeasurementTree(MeasurementMap &into, const MeasurementMap &from) {
+  for (const auto &keyVal : from) {
+    const MeasurementInfo &src = *keyVal.second;
+    auto &dst = into[keyVal.first];
+    if (!dst) {
+      dst = std::unique_ptr<MeasurementInfo>(new MeasurementInfo());
+      dst->nodeId = src.nodeId.load();
+      dst->budget = src.budget.load();
+      dst->baseline = src.baseline.load();
+    }
+    dst->totalTime += src.totalTime;
+    dst->childrenTime += src.childrenTime;
+    dst->elapsedTime += src.elapsedTime;
+    dst->timesExecuted += src.timesExecuted;
+    dst->maxTime = std::max(dst->maxTime, src.maxTime);
+    dst->sumSquares += src.sumSquares;
+    dst->budgetViolations += src.budgetViolations;
+    dst->regressed = dst->regressed || src.regressed;
+    // последние замеры в порядке записи
+    unsigned long count = std::min(src.startNTimesIdx, (unsigned long)CAPTURE_LAST_N_TIMES);
+    for (unsigned long i = src.startNTimesIdx - count; i < src.startNTimesIdx; i++) {
+      dst->lastNTimes[dst->startNTimesIdx % CAPTURE_LAST_N_TIMES] = src.lastNTimes[i % CAPTURE_LAST_N_TIMES];
+      dst->startNTimesIdx++;
+    }
+    mergeMeasurementTree(dst->children, src.children);
+  }
+}
+
+/// Переносит сэмплы из буфера потока в samplerState.counts, вызывать под samplerState.mut
+inline void drainSamplesLocked(MeasurementGroup &group) {
+  SampleBuffer *buffer = group.sampleBuffer.load(std::memory_order_acquire);
+  if (!buffer) return;
+  size_t read = buffer->readIdx.load(std::memory_order_relaxed);
+  size_t write = buffer->writeIdx.load(std::memory_order_acquire);
+  for (; read != write; read++) {
+    const Sample &sample = buffer->samples[read % R_BENCHMARK_SAMPLER_CAPACITY];
+    samplerState.counts[sample.nodeId][sample.address]++;
+  }
+  buffer->readIdx.store(write, std::memory_order_release);
+  samplerState.dropped += buffer->dropped.exchange(0);
+}
+
+/*!
+ * \brief Запускает таймер процессорного времени потока группы: SIGPROF приходит именно этому потоку,
+ * а частота не зависит от числа работающих потоков. Вызывать под samplerState.mut.
+ */
+inline void startSamplerTimerLocked(MeasurementGroup &group) {
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  if (group.hasSamplerTimer || samplerState.intervalNs <= 0 || group.thread.osTid == 0) return;
+  clockid_t clock;
+  if (pthread_getcpuclockid(group.pthread, &clock) != 0) return;
+  sigevent event;
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = static_cast<pid_t>(group.thread.osTid);
+  timer_t timer;
+  if (timer_create(clock, &event, &timer) != 0) return;
+  itimerspec spec;
+  spec.it_interval.tv_sec = samplerState.intervalNs / 1000000000L;
+  spec.it_interval.tv_nsec = samplerState.intervalNs % 1000000000L;
+  spec.it_value = spec.it_interval;
+  if (timer_settime(timer, 0, &spec, nullptr) != 0) {
+    timer_delete(timer);
+    return;
+  }
+  group.samplerTimer = timer;
+  group.hasSamplerTimer = true;
+#else
+  (void)group;
+#endif
+}
+
+/// Вызывать под samplerState.mut
+inline void stopSamplerTimerLocked(MeasurementGroup &group) {
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  if (!group.hasSamplerTimer) return;
+  timer_delete(group.samplerTimer);
+  group.hasSamplerTimer = false;
+#else
+  (void)group;
+#endif
+}
+
+/*!
+ * \brief Переносит замеры группы в общую группу завершившихся потоков и убирает группу из map.
+ * Так размер map и стоимость лога зависят от числа живых потоков. Вызывать под `mut`.
+ */
+inline void retireGroupLocked(const std::shared_ptr<MeasurementGroup> &group) {
+  auto it = measurementThreadMap.find(group->tid);
+  if (it != measurementThreadMap.end() && it->second == group) {
+    measurementThreadMap.erase(it);
+  }
+  group->registered = false;
+  {
+    std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+    stopSamplerTimerLocked(*group);
+    drainSamplesLocked(*group);
+  }
+  // замеры забираем до блокировки общей группы: две группы одновременно блокирует только benchmarkReset
+  MeasurementMap map;
+  CounterMap counters;
+  {
+    std::lock_guard<std::mutex> groupLock(group->mut);
+    if (group->map.empty() && group->counters.empty()) return;
+    map.swap(group->map);
+    counters.swap(group->counters);
+    group->rootLastChild = ChildCache();
+  }
+
+  auto &retired = measurementThreadMap[std::thread::id()];
+  if (!retired) {
+    retired = std::make_shared<MeasurementGroup>();
+    retired->thread.name = "exited threads";
+    retired->registered = true;
+  }
+  std::lock_guard<std::mutex> retiredLock(retired->mut);
+  mergeMeasurementTree(retired->map, map);
+  for (const auto &keyVal : counters) {
+    retired->counters[keyVal.first].merge(keyVal.second);
+  }
+}
+
+/// Группа текущего потока; при завершении потока ее замеры переносятся в группу завершившихся потоков
+struct ThreadGroupHolder {
+  std::shared_ptr<MeasurementGroup> group;
+
+  ~ThreadGroupHolder() {
+    if (!group) return;
+    samplerGroup = nullptr;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> lock(mut);
+    retireGroupLocked(group);
+  }
+};
+inline thread_local ThreadGroupHolder threadGroupHolder;
+
+inline MeasurementGroup &getMeasurementGroup() {
+  std::shared_ptr<MeasurementGroup> &threadGroup = threadGroupHolder.group;
+  if (threadGroup && threadGroup->registered.load(std::memory_order_relaxed)) {
+    return *threadGroup;
+  }
+  auto tid = std::this_thread::get_id();
+  bool created = false;
+  if (!threadGroup) {
+    threadGroup = std::make_shared<MeasurementGroup>();
+    threadGroup->tid = tid;
+    fillCurrentThreadInfo(threadGroup->thread);
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+    threadGroup->pthread = pthread_self();
+#endif
+    samplerGroup = threadGroup.get();
+    created = true;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    auto it = measurementThreadMap.find(tid);
+    if (it != measurementThreadMap.end() && it->second != threadGroup) {
+      // группа другого потока с тем же id, который не успел ее убрать
+      auto stale = it->second;
+      retireGroupLocked(stale);
+    }
+    // после benchmarkReset возвращаем в map ту же группу
+    measurementThreadMap[tid] = threadGroup;
+    threadGroup->registered = true;
+    if (samplerState.enabled) {
+      if (!threadGroup->sampleBuffer.load()) threadGroup->sampleBuffer = new SampleBuffer();
+      std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+      startSamplerTimerLocked(*threadGroup);
+    }
+  }
+  auto serializer = created ? activeTracing() : nullptr;
+  if (serializer) {
+    writeThreadDescriptor(*serializer, *threadGroup);
+  }
+  return *threadGroup;
+}
+
+#ifndef BENCHMARK_DISABLED
+inline void notifyBudgetViolation(const MeasurementGroup &group, const std::string &identifier,
+                                  timestamp_t time, timestamp_t budget) {
+  std::function<void(const BudgetViolation &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(budgetMut);
+    callback = budgetCallback;
+  }
+  if (!callback) return;
+  std::vector<std::string> path = group.path();
+  path.push_back(identifier);
+  callback({identifier, joined(path), time / 1000., budget / 1000.});
+}
+
+/// Проверяет окно последних замеров, возвращает `true` при новом обнаружении замедления
+inline bool checkRegression(MeasurementInfo &info, const BaselineStat &baseline, double &outMean, double &outDrift, double &outScore) {
+  double mean = 0;
+  for (double time : info.lastNTimes) mean += time;
+  mean /= CAPTURE_LAST_N_TIMES;
+  double variance = 0;
+  for (double time : info.lastNTimes) variance += (time - mean) * (time - mean);
+  variance /= (CAPTURE_LAST_N_TIMES > 1 ? CAPTURE_LAST_N_TIMES - 1 : 1);
+
+  bool regressed = isRegression(baseline, mean, variance, CAPTURE_LAST_N_TIMES, outDrift, outScore);
+  bool detected = regressed && !info.regressed;
+  info.regressed = regressed;
+  outMean = mean;
+  return detected;
+}
+
+inline void notifyRegression(const MeasurementGroup &group, const std::string &identifier,
+                             const BaselineStat &baseline, double mean, double drift, double score) {
+  std::function<void(const RegressionInfo &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(baselineMut);
+    callback = regressionCallback;
+  }
+  if (!callback) return;
+  std::vector<std::string> path = group.path();
+  path.push_back(identifier);
+  callback({identifier, joined(path), baseline.avg / 1000., mean / 1000., drift, score});
+}
+#endif
+
+#ifndef BENCHMARK_DISABLED
+inline R_NOINLINE void reportAlreadyRun(MeasurementGroup &group, const char *identifier, const char *file, int line) {
+  errorSites.update(ErrorKind::alreadyRun, identifier, file, line);
+  // повторный запуск не открывает новый замер
+  group.pop();
+}
+
+/*!
+ * \brief Восстанавливает стек после stop не последнего замера: замеры, открытые внутри `index`
+ * и не закрытые, бросаются - их время неизвестно, в статистику они не попадают.
+ */
+inline R_NOINLINE void unwindOpenMeasurements(MeasurementGroup &group, size_t index, const char *identifier,
+                                              const char *file, int line) {
+  unsigned long unwound = (unsigned long)(group.openMeasurements.size() - index - 1);
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    for (size_t i = index + 1; i < group.openMeasurements.size(); i++) {
+      group.openMeasurements[i].node->lastStartTime = 0;
+    }
+  }
+  while (group.openMeasurements.size() > index + 1) group.pop();
+  errorSites.update(ErrorKind::stopMismatch, identifier, file, line, unwound);
+}
+
+inline R_NOINLINE void reportStopNotOpen(const char *identifier, const char *file, int line) {
+  errorSites.update(ErrorKind::stopNotOpen, identifier, file, line);
+}
+
+/// То же для замеров по `handle`; возвращает `false`, если замера нет среди открытых
+inline R_NOINLINE bool unwindToHandle(MeasurementGroup &group, void *handle, const char *kind) {
+  auto &open = group.openMeasurements;
+  size_t index = open.size();
+  while (index > 0 && open[index - 1].node != handle) index--;
+  if (index == 0) {
+    // узел мог быть удален в benchmarkReset, по `handle` его не читаем
+    reportStopNotOpen(kind, "", 0);
+    return false;
+  }
+  unwindOpenMeasurements(group, index - 1, open[index - 1].identifier().c_str(), "", 0);
+  return true;
+}
+
+/// Открывает замер; `identifierString` - тот же идентификатор, если он уже есть в виде std::string
+inline MeasurementInfo *startMeasurement(const char *identifier, const std::string *identifierString,
+                                         const char *file, int line) {
+  auto &group = getMeasurementGroup();
+  if (group.paused) return nullptr;
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    MeasurementInfo *info = group.push(identifier, identifierString);
+    if (info->lastStartTime == 0) {
+      info->lastStartTime = get_timestamp();
+      return info;
+    }
+  }
+  reportAlreadyRun(group, identifier, file, line);
+  return nullptr;
+}
+
+/*!
+ * \brief Закрывает последний открытый замер группы.
+ * `times` - сколько исполнений кода прошло между start и stop.
+ * Для прерываемого замера `span` закрывается отрезок до приостановки: исполнение засчитывается
+ * только при `finish`, со временем всех отрезков.
+ */
+inline void stopLastMeasurement(MeasurementGroup &group, timestamp_t now, const char *file, int line, unsigned long times,
+                                SuspendableSpan *span = nullptr, bool finish = true) {
+  timestamp_t ts, dt, budget = 0;
+  double time;
+  const BaselineStat *baseline = nullptr;
+  double regressionMean = 0, drift = 0, score = 0;
+  bool budgetViolated = false, regressionDetected = false;
+  // калибровка измеряет только таймер и дерево, без выводов
+  auto serializer = group.calibration ? nullptr : activeTracing();
+  auto binary = group.calibration ? nullptr : activeBinaryTracing();
+  bool flightRecorder = !group.calibration && flightRecorderState.enabled.load(std::memory_order_relaxed);
+  OpenMeasurement &last = group.openMeasurements.back();
+  std::string identifier;
+  uint32_t nodeId;
+  uint64_t registryEpoch;
+  {
+    std::unique_lock<std::mutex> lock(group.mut);
+    MeasurementInfo &info = *last.node;
+    if (info.lastStartTime == 0) {
+      lock.unlock();
+      errorSites.update(ErrorKind::notStarted, last.identifier().c_str(), file, line);
+      // незавершенный узел может быть удален в benchmarkReset, указатель на него не храним
+      group.pop();
+      return;
+    }
+
+    ts = info.lastStartTime;
+    nodeId = info.nodeId.load(std::memory_order_relaxed);
+    registryEpoch = nodeRegistryEpoch.load(std::memory_order_relaxed); // меняется только под `mut` группы
+    dt = now > ts ? now - ts : 0;
+    info.totalTime += static_cast<double>(dt);
+    info.lastStartTime = 0;
+    time = static_cast<double>(dt) / times;
+    if (span) {
+      span->activeTime += dt;
+      time = static_cast<double>(span->activeTime);
+    }
+    if (finish) {
+      if (span) {
+        info.elapsedTime += static_cast<double>(now > span->startTime ? now - span->startTime : 0);
+      }
+      info.timesExecuted += times;
+      info.lastNTimes[info.startNTimesIdx % CAPTURE_LAST_N_TIMES] = time;
+      info.startNTimesIdx++;
+      if (time > info.maxTime) info.maxTime = time;
+      info.sumSquares += time * time * times;
+      budget = info.budget.load(std::memory_order_relaxed);
+      if (budget > 0 && time > budget) {
+        info.budgetViolations++;
+        budgetViolated = true;
+      }
+      baseline = info.baseline.load(std::memory_order_relaxed);
+      if (baseline && info.startNTimesIdx % CAPTURE_LAST_N_TIMES == 0) {
+        // окно последних замеров заполнилось заново
+        regressionDetected = checkRegression(info, *baseline, regressionMean, drift, score);
+      }
+    }
+    // после снятия блокировки завершенный узел (и его ключ) может удалить benchmarkReset,
+    // поэтому строку копируем здесь и только если она нужна
+    if (serializer || flightRecorder || budgetViolated || regressionDetected) {
+      identifier = last.identifier();
+    }
+  }
+
+  Tracing::TraceArgs args = last.args;
+  group.pop();
+
+  // callback вызываем без блокировок: внутри можно вызывать функции библиотеки
+  if (budgetViolated && hasBudgetCallback.load(std::memory_order_relaxed)) {
+    notifyBudgetViolation(group, identifier, static_cast<timestamp_t>(time), budget);
+  }
+  if (regressionDetected) {
+    notifyRegression(group, identifier, *baseline, regressionMean, drift, score);
+  }
+
+  int depth = (int)group.openMeasurements.size();
+  if (serializer) {
+    serializer->saveTrace({identifier, group.tid, ts, dt, depth, Tracing::TraceType::span, 0, args});
+  }
+  if (binary) {
+    writeBinarySpan(*binary, group, nodeId, registryEpoch, ts, dt, depth, args);
+  }
+  if (flightRecorder) {
+    processFlightRecorder(group, {identifier, group.tid, ts, dt, depth, Tracing::TraceType::span, 0, args});
+  }
+}
+
+inline void stopMeasurement(const char *identifier, const std::string *identifierString,
+                            const char *file, int line, unsigned long times) {
+  auto now = get_timestamp();
+  auto &group = getMeasurementGroup();
+  if (group.paused) return;
+
+  auto &open = group.openMeasurements;
+  size_t index = open.size();
+  auto matches = [&](const OpenMeasurement &measurement) -> bool {
+    return identifierString ? measurement.identifier() == *identifierString : measurement.identifier() == identifier;
+  };
+  // ищем замер и глубже в стеке: пропущенный stop внутреннего замера не должен ломать внешние
+  while (index > 0 && !matches(open[index - 1])) index--;
+  if (index == 0) {
+    reportStopNotOpen(identifier, file, line);
+    return;
+  }
+  if (index < open.size()) unwindOpenMeasurements(group, index - 1, identifier, file, line);
+  stopLastMeasurement(group, now, file, line, times);
+}
+#endif
+
+bool benchmarkStart(const std::string &identifier, const char *file, int line) {
+#ifndef BENCHMARK_DISABLED
+  startMeasurement(identifier.c_str(), &identifier, file, line);
+#endif
+  return true;
+}
+
+bool benchmarkStart(const char *identifier, const char *file, int line) {
+#ifndef BENCHMARK_DISABLED
+  startMeasurement(identifier, nullptr, file, line);
+#endif
+  return true;
+}
+
+void benchmarkStop(const std::string &identifier, const char *file, int line) {
+#ifndef BENCHMARK_DISABLED
+  stopMeasurement(identifier.c_str(), &identifier, file, line, 1);
+#endif
+}
+
+void benchmarkStop(const char *identifier, const char *file, int line) {
+#ifndef BENCHMARK_DISABLED
+  stopMeasurement(identifier, nullptr, file, line, 1);
+#endif
+}
+
+void *benchmarkStartScoped(const std::string &identifier) {
+#ifndef BENCHMARK_DISABLED
+  return startMeasurement(identifier.c_str(), &identifier, "", 0);
+#else
+  return nullptr;
+#endif
+}
+
+void *benchmarkStartScoped(const char *identifier) {
+#ifndef BENCHMARK_DISABLED
+  return startMeasurement(identifier, nullptr, "", 0);
+#else
+  return nullptr;
+#endif
+}
+
+void benchmarkStopScoped(void *handle) {
+#ifndef BENCHMARK_DISABLED
+  if (!handle) return; // замер не был открыт: пауза или ошибка при старте
+  auto now = get_timestamp();
+  auto &group = getMeasurementGroup();
+  if (group.paused) return;
+  if ((group.openMeasurements.empty() || group.openMeasurements.back().node != handle) &&
+      !unwindToHandle(group, handle, "ScopedBenchmark")) {
+    return;
+  }
+  stopLastMeasurement(group, now, "", 0, 1);
+#endif
+}
+
+void benchmarkSpanResume(SuspendableSpan &span, const std::string &identifier) {
+#ifndef BENCHMARK_DISABLED
+  if (span.startTime == 0) span.startTime = get_timestamp();
+  span.handle = startMeasurement(identifier.c_str(), &identifier, "", 0);
+#endif
+}
+
+void benchmarkSpanSuspend(SuspendableSpan &span, bool finish) {
+#ifndef BENCHMARK_DISABLED
+  void *handle = span.handle;
+  span.handle = nullptr;
+  if (!handle) return; // отрезок не был открыт: пауза или ошибка при старте
+  auto now = get_timestamp();
+  auto &group = getMeasurementGroup();
+  if (group.paused) return;
+  // внутри отрезка мог остаться открытый замер, например ScopedBenchmark через co_await
+  if ((group.openMeasurements.empty() || group.openMeasurements.back().node != handle) &&
+      !unwindToHandle(group, handle, "CoroutineSpan")) {
+    return;
+  }
+  stopLastMeasurement(group, now, "", 0, 1, &span, finish);
+#endif
+}
+
+void benchmarkStopBatch(const std::string &identifier, unsigned long times) {
+#ifndef BENCHMARK_DISABLED
+  stopMeasurement(identifier.c_str(), &identifier, "", 0, std::max(times, 1UL));
+#endif
+}
+
+void benchmarkPauseThread(bool paused) {
+#ifndef BENCHMARK_DISABLED
+  getMeasurementGroup().paused = paused;
+#endif
+}
+
+#ifndef BENCHMARK_DISABLED
+inline void setSpanArg(const Tracing::TraceArg &arg) {
+  auto &group = getMeasurementGroup();
+  if (group.openMeasurements.empty()) return;
+  group.openMeasurements.back().args.set(arg);
+}
+#endif
+
+void benchmarkSpanArg(const char *key, long long value) {
+#ifndef BENCHMARK_DISABLED
+  Tracing::TraceArg arg;
+  arg.key = key;
+  arg.type = Tracing::ArgType::integer;
+  arg.intValue = value;
+  setSpanArg(arg);
+#endif
+}
+
+void benchmarkSpanArg(const char *key, double value) {
+#ifndef BENCHMARK_DISABLED
+  Tracing::TraceArg arg;
+  arg.key = key;
+  arg.type = Tracing::ArgType::real;
+  arg.realValue = value;
+  setSpanArg(arg);
+#endif
+}
+
+void benchmarkSpanArg(const char *key, const char *value) {
+#ifndef BENCHMARK_DISABLED
+  Tracing::TraceArg arg;
+  arg.key = key;
+  arg.type = Tracing::ArgType::string;
+  arg.stringValue = value;
+  setSpanArg(arg);
+#endif
+}
+
+const char *benchmarkIntern(const std::string &value) {
+  return Tracing::Serializer::intern(value);
+}
+
+void benchmarkSetBudget(const std::string &identifier, double maxMs) {
+#ifndef BENCHMARK_DISABLED
+  timestamp_t budget = maxMs <= 0 ? 0 : static_cast<timestamp_t>(maxMs * 1000.);
+  {
+    std::lock_guard<std::mutex> lock(budgetMut);
+    if (budget == 0) {
+      budgets.erase(identifier);
+    } else {
+      budgets[identifier] = budget;
+    }
+  }
+  // обновляем уже созданные узлы
+  std::lock_guard<std::mutex> lock(mut);
+  for (auto &kv : measurementThreadMap) {
+    std::lock_guard<std::mutex> groupLock(kv.second->mut);
+    std::vector<MeasurementMap *> maps = {&(kv.second->map)};
+    for (size_t idx = 0; idx < maps.size(); idx++) {
+      for (auto &child : *maps[idx]) {
+        if (child.first == identifier) {
+          child.second->budget = budget;
+        }
+        maps.push_back(&(child.second->children));
+      }
+    }
+  }
+#endif
+}
+
+void benchmarkSetBudgetCallback(std::function<void(const BudgetViolation &)> callback) {
+#ifndef BENCHMARK_DISABLED
+  std::lock_guard<std::mutex> lock(budgetMut);
+  hasBudgetCallback = static_cast<bool>(callback);
+  budgetCallback = std::move(callback);
+#endif
+}
+
+double benchmarkCalibrate(int iterations) {
+#ifndef BENCHMARK_DISABLED
+  // замеряем в отдельном потоке, чтобы не трогать дерево текущего
+  double result = 0;
+  double inside = 0;
+  std::thread calibration([&result, &inside, iterations]() {
+    const std::string parent = "calibration";
+    const std::string child = "empty";
+    // группа не попадает в measurementThreadMap и сэмплер: калибровка не видна в логе,
+    // трейсинге и flight recorder, а stopLastMeasurement пропускает для нее все выводы
+    auto group = std::make_shared<MeasurementGroup>();
+    group->tid = std::this_thread::get_id();
+    group->calibration = true;
+    group->registered = true;
+    threadGroupHolder.group = group;
+    benchmarkStart(parent);
+    // прогрев: создаем узел и заполняем кэши
+    for (int i = 0; i < 100; i++) {
+      benchmarkStart(child);
+      benchmarkStop(child);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      benchmarkStart(child);
+      benchmarkStop(child);
+    }
+    auto end = std::chrono::steady_clock::now();
+    benchmarkStop(parent);
+    result = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000. / std::max(iterations, 1);
+
+    threadGroupHolder.group.reset();
+    std::lock_guard<std::mutex> groupLock(group->mut);
+    // пустой замер записывает только свою внутреннюю часть накладных расходов;
+    // если узла нет (поток был на паузе), считаем, что внутрь замера расходы не попадают
+    auto parentIt = group->map.find(parent);
+    if (parentIt == group->map.end()) return;
+    auto childIt = parentIt->second->children.find(child);
+    if (childIt == parentIt->second->children.end()) return;
+    const MeasurementInfo &empty = *childIt->second;
+    inside = std::min(result, empty.totalTime / std::max(empty.timesExecuted, 1UL));
+  });
+  calibration.join();
+  overheadInside = inside;
+  overheadPerCall = result;
+  return result;
+#else
+  return 0;
+#endif
+}
+
+void benchmarkSetCardinalityLimits(size_t maxChildren, size_t maxTotalNodes) {
+#ifndef BENCHMARK_DISABLED
+  maxChildrenPerNode = maxChildren == 0 ? R_BENCHMARK_MAX_CHILDREN : maxChildren;
+  maxNodes = maxTotalNodes == 0 ? R_BENCHMARK_MAX_NODES : maxTotalNodes;
+#endif
+}
+
+void benchmarkSetOverheadCompensation(bool enabled) {
+#ifndef BENCHMARK_DISABLED
+  overheadCompensation = enabled;
+#endif
+}
+
+void benchmarkSetFlatViewTop(size_t top) {
+#ifndef BENCHMARK_DISABLED
+  flatViewTop = top;
+#else
+  (void)top;
+#endif
+}
+
+void benchmarkCounter(const std::string &identifier, double value) {
+#ifndef BENCHMARK_DISABLED
+  auto &group = getMeasurementGroup();
+  auto ts = get_timestamp();
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    group.counters[identifier].update(value, ts);
+  }
+  auto serializer = activeTracing();
+  if (serializer) {
+    serializer->saveTrace({identifier, group.tid, ts, 0, (int)group.openMeasurements.size(), Tracing::TraceType::counter, value, {}});
+  }
+  auto binary = activeBinaryTracing();
+  if (binary) {
+    writeBinaryCounter(*binary, group, identifier, ts, value, (int)group.openMeasurements.size());
+  }
+#endif
+}
+
+/*!
+ * \brief Строит реестр путей заново по узлам, оставшимся в группах после сброса.
+ * Вызывать под `mut`, `mergeMut`, `mut` всех групп и nodeRegistryMut.
+ */
+inline void rebuildNodeRegistryLocked(const std::vector<std::shared_ptr<MeasurementGroup>> &groups) {
+  nodeRegistry = {{0, ""}};
+  nodeRegistryChildren.assign(1, {});
+  cardinalityOverflows.clear();
+  std::unordered_map<uint32_t, uint32_t> remap = {{0, 0}}; // старый id -> новый
+  for (auto &group : groups) {
+    group->rootOverflow.reset();
+    std::vector<std::pair<uint32_t, MeasurementMap *>> levels = {{0, &group->map}};
+    for (size_t idx = 0; idx < levels.size(); idx++) {
+      uint32_t parent = levels[idx].first;
+      for (auto &keyVal : *levels[idx].second) {
+        MeasurementInfo &node = *keyVal.second;
+        node.childrenOverflow.reset();
+        if (group->calibration) continue;
+        auto &children = nodeRegistryChildren[parent];
+        auto it = children.find(keyVal.first);
+        uint32_t id = it != children.end() ? it->second : addNodeLocked(parent, keyVal.first);
+        remap[node.nodeId.load(std::memory_order_relaxed)] = id;
+        node.nodeId.store(id, std::memory_order_relaxed);
+        levels.push_back({id, &node.children});
+      }
+    }
+    // сэмплер читает currentNodeId без блокировок, владелец мог уже сменить его
+    uint32_t current = group->currentNodeId.load(std::memory_order_relaxed);
+    auto it = remap.find(current);
+    group->currentNodeId.compare_exchange_strong(current, it != remap.end() ? it->second : 0, std::memory_order_relaxed);
+  }
+  nodeRegistryEpoch++;
+}
+
+void benchmarkReset() {
+#ifndef BENCHMARK_DISABLED
+  // группы блокируются на весь сброс: иначе поток может зарегистрировать узел в старом реестре
+  std::lock_guard<std::mutex> mergeLock(mergeMut);
+  std::lock_guard<std::mutex> lock(mut);
+  std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+  errorSites.reset();
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  for (auto &kv : measurementThreadMap) {
+    groups.push_back(kv.second);
+  }
+  // одинаковый порядок блокировок при каждом сбросе
+  sort(groups.begin(), groups.end());
+  std::vector<std::unique_lock<std::mutex>> groupLocks;
+  for (auto &group : groups) {
+    groupLocks.emplace_back(group->mut);
+    group->counters.clear();
+    group->rootLastChild = ChildCache();
+    std::vector<MeasurementMap *> cleanupMap = {&(group->map)};
+    
+    for (size_t idx = 0; idx < cleanupMap.size(); idx++) {
+      auto map = cleanupMap[idx];
+      for (auto it = map->begin(); it != map->end(); ) {
+        if (it->second->lastStartTime == 0) {
+          // reset info for non finished benchmarks
+          it = map->erase(it);
+        } else {
+          it->second->lastChild = ChildCache(); // дети могут быть удалены
+          cleanupMap.push_back(&(it->second->children));
+          ++it;
+        }
+      }
+    }
+    drainSamplesLocked(*group);
+  }
+  samplerState.counts.clear();
+  samplerState.dropped = 0;
+
+  for (auto it = measurementThreadMap.begin(); it != measurementThreadMap.end(); ) {
+    if (it->second->map.empty() && it->second->counters.empty()) {
+      // no measurments for thread, cleanup
+      it->second->registered = false;
+      stopSamplerTimerLocked(*it->second); // снова запустится при регистрации группы
+      it = measurementThreadMap.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  std::lock_guard<std::mutex> registryLock(nodeRegistryMut);
+  rebuildNodeRegistryLocked(groups);
+#endif
+}
+
+// Out measurements
+/// В этом классе собираем конечные замеры перед переводом в табличное представление
+/// Замеры узла одного потока для View::threads
+struct ThreadInfoOut {
+  std::string name;
+  double totalTime;
+  unsigned long timesExecuted;
+  double currentRunningTime;
+};
+
+struct MeasurementInfoOut {
+  double totalTime = 0;
+  double elapsedTime = 0; // только у прерываемых замеров
+  double childrenTime = 0;
+  double lastTime = 0;
+  double currentRunningTime = 0;
+  unsigned long timesExecuted = 0;
+  double maxTime = 0;
+  double sumSquares = 0;
+  double budget = 0;
+  unsigned long budgetViolations = 0;
+  // последние CAPTURE_LAST_N_TIMES замеров всех потоков
+  double lastTimesTotal = 0;
+  double lastTimesSquares = 0;
+  unsigned long lastCount = 0;
+  const BaselineStat *baseline = nullptr;
+  std::vector<ThreadInfoOut> threads; // только для View::threads
+  std::unordered_map<std::string, std::unique_ptr<MeasurementInfoOut>> children;
+  std::vector<std::string> childrenOrder; // нам нужна сортировка по занятому времени
+};
+
+/// Разброс общего времени узла между потоками, `false` если узел не разбит по потокам
+inline bool threadImbalance(const MeasurementInfoOut &info, double &outMin, double &outAvg, double &outMax) {
+  if (info.threads.empty()) return false;
+  outMin = info.threads.front().totalTime;
+  outMax = outMin;
+  double sum = 0;
+  for (const auto &thread : info.threads) {
+    outMin = std::min(outMin, thread.totalTime);
+    outMax = std::max(outMax, thread.totalTime);
+    sum += thread.totalTime;
+  }
+  outAvg = sum / info.threads.size();
+  return true;
+}
+
+/// Отклонение последних замеров от baseline; `outScore > 0` только для статистически значимого замедления
+inline bool nodeDrift(const MeasurementInfoOut &info, double &outDrift, double &outScore) {
+  if (!info.baseline || info.lastCount == 0) return false;
+  double count = static_cast<double>(info.lastCount);
+  double mean = info.lastTimesTotal / count;
+  double variance = count > 1 ? std::max(0.0, (info.lastTimesSquares - mean * info.lastTimesTotal) / (count - 1)) : 0.0;
+  if (!isRegression(*info.baseline, mean, variance, count, outDrift, outScore)) {
+    outScore = 0;
+  }
+  return true;
+}
+
+#ifndef MERGE_PARALLEL_MIN_NODES
+#define MERGE_PARALLEL_MIN_NODES 50000 // меньше узлов быстрее слить в одном потоке, чем запускать потоки
+#endif
+
+/// Сумма замеров одного пути по всем потокам, элемент плоского массива слияния
+struct MergedNode {
+  bool used;
+  double totalTime;
+  double elapsedTime;
+  unsigned long timesExecuted;
+  double currentRunningTime;
+  double maxTime;
+  double sumSquares;
+  double budget;
+  unsigned long budgetViolations;
+  double lastTimesTotal;
+  double lastTimesSquares;
+  unsigned long lastCount;
+  const BaselineStat *baseline;
+
+  void add(const MeasurementInfo &info, timestamp_t now) {
+    used = true;
+    totalTime += info.totalTime;
+    elapsedTime += info.elapsedTime;
+    timesExecuted += info.timesExecuted;
+    if (info.lastStartTime > 0 && now > info.lastStartTime) {
+      currentRunningTime += now - info.lastStartTime;
+    }
+    maxTime = std::max(maxTime, info.maxTime);
+    sumSquares += info.sumSquares;
+    budget = std::max(budget, static_cast<double>(info.budget.load()));
+    budgetViolations += info.budgetViolations;
+    unsigned long count = std::min(info.startNTimesIdx, (unsigned long)CAPTURE_LAST_N_TIMES);
+    for (unsigned long i = 0; i < count; i++) {
+      lastTimesTotal += info.lastNTimes[i];
+      lastTimesSquares += info.lastNTimes[i] * info.lastNTimes[i];
+    }
+    lastCount += count;
+    if (!baseline) baseline = info.baseline.load();
+  }
+
+  void merge(const MergedNode &other) {
+    if (!other.used) return;
+    used = true;
+    totalTime += other.totalTime;
+    elapsedTime += other.elapsedTime;
+    timesExecuted += other.timesExecuted;
+    currentRunningTime += other.currentRunningTime;
+    maxTime = std::max(maxTime, other.maxTime);
+    sumSquares += other.sumSquares;
+    budget = std::max(budget, other.budget);
+    budgetViolations += other.budgetViolations;
+    lastTimesTotal += other.lastTimesTotal;
+    lastTimesSquares += other.lastTimesSquares;
+    lastCount += other.lastCount;
+    if (!baseline) baseline = other.baseline;
+  }
+};
+
+/// Буферы слияния переиспользуются между вызовами, чтобы `benchmarkLog` не выделял память на каждый узел
+/// Под mergeMut
+struct MergeBuffers {
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  std::vector<const NodeDesc *> nodes;
+  std::vector<std::vector<MergedNode>> partial; // [0] - итог, остальные - для параллельных потоков
+  std::vector<MeasurementInfoOut *> out;
+};
+inline MergeBuffers mergeBuffers;
+
+/// Копирует список групп, чтобы дальше работать без глобальной блокировки
+inline void snapshotGroups(std::vector<std::shared_ptr<MeasurementGroup>> &outGroups) {
+  outGroups.clear();
+  std::lock_guard<std::mutex> lock(mut);
+  for (auto &kv : measurementThreadMap) {
+    outGroups.push_back(kv.second);
+  }
+}
+
+inline void accumulateGroup(MeasurementGroup &group, std::vector<MergedNode> &merged, timestamp_t now,
+                            std::vector<const MeasurementMap *> &stack) {
+  std::lock_guard<std::mutex> groupLock(group.mut);
+  stack.clear();
+  stack.push_back(&group.map);
+  while (!stack.empty()) {
+    const MeasurementMap *map = stack.back();
+    stack.pop_back();
+    for (const auto &keyVal : *map) {
+      const MeasurementInfo &info = *keyVal.second;
+      // узел создан после снимка реестра, попадет в следующий лог
+      if (info.nodeId >= merged.size()) continue;
+      merged[info.nodeId].add(info, now);
+      stack.push_back(&info.children);
+    }
+  }
+}
+
+inline void accumulateGroups(const std::vector<std::shared_ptr<MeasurementGroup>> &groups, size_t from, size_t step,
+                             std::vector<MergedNode> &merged, timestamp_t now) {
+  std::vector<const MeasurementMap *> stack;
+  for (size_t idx = from; idx < groups.size(); idx += step) {
+    accumulateGroup(*groups[idx], merged, now, stack);
+  }
+}
+
+inline std::string threadDisplayName(MeasurementGroup &group) {
+  std::lock_guard<std::mutex> groupLock(group.mut);
+  if (!group.thread.name.empty()) return group.thread.name;
+  if (group.thread.osTid != 0) return "thread " + std::to_string(group.thread.osTid);
+  std::stringstream ss;
+  ss << "thread " << group.tid;
+  return ss.str();
+}
+
+/// \param perThread Кроме общего дерева сохранить в узлах замеры каждого потока (`MeasurementInfoOut::threads`)
+inline
+MeasurementInfoOut unionMeasurements(bool perThread = false) {
+//  объеденяем все замеры в один результат: каждый поток складывается в плоский массив по id узлов
+  MeasurementInfoOut res;
+  std::lock_guard<std::mutex> lock(mergeMut);
+  auto &groups = mergeBuffers.groups;
+  auto &nodes = mergeBuffers.nodes;
+  snapshotGroups(groups);
+  {
+    std::lock_guard<std::mutex> registryLock(nodeRegistryMut);
+    nodes.clear();
+    for (const auto &node : nodeRegistry) nodes.push_back(&node);
+  }
+  auto now = get_timestamp();
+
+  size_t workers = 1;
+  std::vector<std::vector<MergedNode>> threadNodes;
+  std::vector<std::string> threadNames;
+  if (perThread) {
+    // отдельный массив на каждый поток, дальше складываем как при параллельном слиянии
+    std::vector<const MeasurementMap *> stack;
+    for (auto &group : groups) {
+      threadNames.push_back(threadDisplayName(*group));
+      threadNodes.emplace_back(nodes.size(), MergedNode());
+      accumulateGroup(*group, threadNodes.back(), now, stack);
+    }
+    workers = 0;
+  } else if (nodes.size() * groups.size() >= MERGE_PARALLEL_MIN_NODES) {
+    workers = std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned)groups.size() / 2));
+  }
+  auto &partial = mergeBuffers.partial;
+  if (partial.size() < std::max<size_t>(workers, 1)) partial.resize(std::max<size_t>(workers, 1));
+  for (size_t w = 0; w < std::max<size_t>(workers, 1); w++) {
+    partial[w].assign(nodes.size(), MergedNode());
+  }
+  if (workers == 0) {
+    for (const auto &thread : threadNodes) {
+      for (size_t id = 0; id < nodes.size(); id++) {
+        partial[0][id].merge(thread[id]);
+      }
+    }
+  } else if (workers == 1) {
+    accumulateGroups(groups, 0, 1, partial[0], now);
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; w++) {
+      threads.emplace_back(accumulateGroups, std::cref(groups), w, workers, std::ref(partial[w]), now);
+    }
+    accumulateGroups(groups, 0, workers, partial[0], now);
+    for (size_t w = 1; w < workers; w++) {
+      threads[w - 1].join();
+      for (size_t id = 0; id < nodes.size(); id++) {
+        partial[0][id].merge(partial[w][id]);
+      }
+    }
+  }
+  // группы держим только на время слияния
+  groups.clear();
+
+  // родитель зарегистрирован раньше детей, поэтому дерево строится за один проход
+  auto &merged = partial[0];
+  auto &out = mergeBuffers.out;
+  out.assign(nodes.size(), nullptr);
+  out[0] = &res;
+  for (size_t id = 1; id < nodes.size(); id++) {
+    const MergedNode &node = merged[id];
+    MeasurementInfoOut *parent = out[nodes[id]->parent];
+    if (!node.used || !parent) continue;
+    auto &child = parent->children[nodes[id]->name];
+    child = std::unique_ptr<MeasurementInfoOut>(new MeasurementInfoOut());
+    child->totalTime = node.totalTime;
+    child->elapsedTime = node.elapsedTime;
+    child->timesExecuted = node.timesExecuted;
+    child->currentRunningTime = node.currentRunningTime;
+    child->maxTime = node.maxTime;
+    child->sumSquares = node.sumSquares;
+    child->budget = node.budget;
+    child->budgetViolations = node.budgetViolations;
+    child->lastTimesTotal = node.lastTimesTotal;
+    child->lastTimesSquares = node.lastTimesSquares;
+    child->lastCount = node.lastCount;
+    child->lastTime = node.lastCount == 0 ? 0.0 : (node.lastTimesTotal / (double)node.lastCount);
+    child->baseline = node.baseline;
+    for (size_t t = 0; t < threadNodes.size(); t++) {
+      const MergedNode &thread = threadNodes[t][id];
+      if (thread.used) {
+        child->threads.push_back({threadNames[t], thread.totalTime, thread.timesExecuted, thread.currentRunningTime});
+      }
+    }
+    parent->childrenTime += node.totalTime;
+    out[id] = child.get();
+  }
+  return res;
+}
+
+inline
+std::vector<std::pair<std::string, CounterInfo>> unionCounters() {
+  std::unordered_map<std::string, CounterInfo> merged;
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  snapshotGroups(groups);
+  for (auto &group : groups) {
+    std::lock_guard<std::mutex> groupLock(group->mut);
+    for (const auto &keyVal : group->counters) {
+      merged[keyVal.first].merge(keyVal.second);
+    }
+  }
+  std::vector<std::pair<std::string, CounterInfo>> res(merged.begin(), merged.end());
+  sort(res.begin(), res.end(),
+       [](const std::pair<std::string, CounterInfo> &a, const std::pair<std::string, CounterInfo> &b) -> bool {
+         return a.first < b.first;
+       });
+  return res;
+}
+
+/// Вычитает стоимость вложенных start/stop и собственную внутреннюю часть из времени узлов,
+/// возвращает число вложенных вызовов
+inline
+double subtractOverhead(MeasurementInfoOut &info, double overhead, double inside) {
+  double descendantCalls = 0;
+  double childrenTime = 0;
+  for (auto &keyVal : info.children) {
+    descendantCalls += keyVal.second->timesExecuted + subtractOverhead(*keyVal.second, overhead, inside);
+    childrenTime += keyVal.second->totalTime;
+  }
+  if (info.timesExecuted > 0) {
+    double subtracted = std::min(info.totalTime, descendantCalls * overhead + info.timesExecuted * inside);
+    info.lastTime = std::max(0.0, info.lastTime - subtracted / info.timesExecuted);
+    info.totalTime -= subtracted;
+  }
+  info.childrenTime = childrenTime;
+  return descendantCalls;
+}
+
+inline
+void sortChildren(MeasurementInfoOut &info) {
+  info.childrenOrder.clear();
+  for (auto &keyVal: info.children) {
+    info.childrenOrder.push_back(keyVal.first);
+  }
+  sort(info.childrenOrder.begin(), info.childrenOrder.end(),
+       [&info](const std::string &a, const std::string &b) -> bool {
+         return info.children.at(a)->totalTime > info.children.at(b)->totalTime;
+       });
+  
+  // recursive
+  for (auto &keyVal: info.children) {
+    if (!keyVal.second->children.empty()) {
+      sortChildren(*keyVal.second);
+    }
+  }
+}
+
+/// Общая с harness.cpp: колонки выравниваются по самой длинной ячейке, первая - влево
+R_FUNC
+void formGrid(const std::vector<std::vector<std::string>> &rows, std::ostream &out) {
+  std::vector<int> maxLengths;
+  for (const std::vector<std::string> &row : rows) {
+    for (size_t i = 0; i < row.size(); i++) {
+      int s = (int)row[i].size();
+      if (i >= maxLengths.size()) {
+        maxLengths.push_back(s);
+      } else if (maxLengths[i] < s){
+        maxLengths[i] = s;
+      }
+    }
+  }
+
+  int border = 1;
+  for (const std::vector<std::string> &row : rows) {
+    for (size_t i = 0; i < row.size(); i++) {
+      auto alignment = i == 0 ? std::left : std::right;
+      out << std::setw(maxLengths[i] + border) << alignment << row[i];
+    }
+    out << "\n";
+  }
+}
+
+template<typename T>
+inline std::string formatString(std::stringstream &ss, T val) {
+  ss.str("");
+  ss << val;
+  return ss.str();
+}
+
+typedef std::vector<std::pair<std::string, CounterInfo>> CountersOut;
+
+/// Строка View::flat: все узлы с одним идентификатором по всем путям и потокам
+struct FlatEntryOut {
+  std::string name;
+  double selfTime = 0;   // без времени вложенных замеров
+  double totalTime = 0;  // рекурсивные вызовы внутри того же идентификатора не учитываются повторно
+  unsigned long timesExecuted = 0;
+};
+
+struct FlatProfileOut {
+  std::vector<FlatEntryOut> entries; // по убыванию selfTime, первые flatViewTop
+  double selfTime = 0;               // всех идентификаторов, для процентов
+  size_t identifiers = 0;            // всего разных идентификаторов
+};
+
+inline void generateTableOutput(const MeasurementInfoOut &root, const FlatProfileOut *flat, const CountersOut &counters,
+                                const Field &withoutFields, const std::string *traceSource, std::ostream &out);
+inline void generateJsonOutput(const MeasurementInfoOut &root, const FlatProfileOut *flat, const CountersOut &counters,
+                               const Field &withoutFields, const std::string *traceSource, std::ostream &out);
+
+/*!
+ * \brief Плоский профиль за один проход по объединенному дереву: собственное время и число вызовов
+ * каждого идентификатора, сложенные по всем путям.
+ */
+inline FlatProfileOut collectFlatProfile(const MeasurementInfoOut &root, size_t top) {
+  FlatProfileOut profile;
+  std::unordered_map<std::string, size_t> indices;
+  std::vector<int> onPath; // сколько раз идентификатор уже открыт выше по пути
+  struct Visit {
+    const MeasurementInfoOut *node;
+    size_t entry;
+    bool leave;
+  };
+  std::vector<Visit> stack;
+  auto pushChildren = [&](const MeasurementInfoOut &node) {
+    for (const auto &keyVal : node.children) {
+      auto inserted = indices.emplace(keyVal.first, profile.entries.size());
+      if (inserted.second) {
+        profile.entries.emplace_back();
+        profile.entries.back().name = keyVal.first;
+        onPath.push_back(0);
+      }
+      stack.push_back({keyVal.second.get(), inserted.first->second, false});
+    }
+  };
+  pushChildren(root);
+  while (!stack.empty()) {
+    Visit visit = stack.back();
+    stack.pop_back();
+    if (visit.leave) {
+      onPath[visit.entry]--;
+      continue;
+    }
+    const MeasurementInfoOut &node = *visit.node;
+    FlatEntryOut &entry = profile.entries[visit.entry];
+    double selfTime = std::max(0.0, node.totalTime - node.childrenTime);
+    entry.selfTime += selfTime;
+    profile.selfTime += selfTime;
+    if (onPath[visit.entry] == 0) entry.totalTime += node.totalTime;
+    entry.timesExecuted += node.timesExecuted;
+    onPath[visit.entry]++;
+    stack.push_back({visit.node, visit.entry, true});
+    pushChildren(node);
+  }
+
+  profile.identifiers = profile.entries.size();
+  auto order = [](const FlatEntryOut &a, const FlatEntryOut &b) -> bool {
+    return a.selfTime != b.selfTime ? a.selfTime > b.selfTime : a.name < b.name;
+  };
+  if (top > 0 && top < profile.entries.size()) {
+    std::partial_sort(profile.entries.begin(), profile.entries.begin() + top, profile.entries.end(), order);
+    profile.entries.resize(top);
+  } else {
+    std::sort(profile.entries.begin(), profile.entries.end(), order);
+  }
+  return profile;
+}
+inline std::string generateError(const std::string &msg, Format format) {
+  std::string result;
+  switch (format) {
+    case Format::table:
+      result += "\n=============== Benchmark Error ===============\n";
+      result += msg;
+      result += "\n===============================================\n";
+      break;
+    case Format::json:
+      result = "{\"error\":\"" + jsonEscaped(msg) + "\"}";
+      break;
+  }
+  return result;
+}
+
+/// Общая часть `benchmarkLog` и `benchmarkLogFromTrace`: сортировка дерева и вывод
+/// \param traceSource Описание файла трейсинга, `nullptr` - замеры текущего процесса
+inline std::string generateOutput(MeasurementInfoOut &root, const CountersOut &counters, Field withoutFields, Format format,
+                                  View view, const std::string *traceSource, std::ostream *out) {
+  sortChildren(root);
+  root.totalTime = 0;
+  for (const auto &keyVal : root.children) {
+    root.totalTime += keyVal.second->totalTime;
+  }
+  FlatProfileOut flat;
+  if (view == View::flat) {
+    flat = collectFlatProfile(root, flatViewTop.load());
+  }
+  const FlatProfileOut *flatOut = view == View::flat ? &flat : nullptr;
+  
+  std::stringstream result;
+  bool returnEmptyString = false;
+  if (out == nullptr) {
+    out = &result;
+  } else {
+    returnEmptyString = true;
+  }
+  switch (format) {
+    case Format::table:
+      generateTableOutput(root, flatOut, counters, withoutFields, traceSource, *out);
+      break;
+    case Format::json:
+      generateJsonOutput(root, flatOut, counters, withoutFields, traceSource, *out);
+      break;
+  }
+  if (returnEmptyString) {
+    return "";
+  } else {
+    return result.str();
+  }
+}
+
+struct MeasurementInfoOut;
+std::string benchmarkLog(Field withoutFields, Format format, std::ostream *out, View view) {
+#ifndef BENCHMARK_DISABLED
+  MeasurementInfoOut root = unionMeasurements(view == View::threads);
+  CountersOut counters = unionCounters();
+  if (overheadCompensation) {
+    if (overheadPerCall.load() < 0) {
+      benchmarkCalibrate();
+    }
+    subtractOverhead(root, overheadPerCall.load(), overheadInside.load());
+  }
+  return generateOutput(root, counters, withoutFields, format, view, nullptr, out);
+#else
+  return std::string();
+#endif
+}
+
+#ifndef BENCHMARK_DISABLED
+/// Переносит статистику, восстановленную по трейсу, в дерево вывода
+inline void traceStatsToOut(Tracing::TraceStatsNode &stats, const std::map<int32_t, std::string> &threadNames,
+                            MeasurementInfoOut &out) {
+  for (auto &keyVal : stats.children) {
+    Tracing::TraceStatsNode &node = *keyVal.second;
+    auto &child = out.children[keyVal.first];
+    child = std::unique_ptr<MeasurementInfoOut>(new MeasurementInfoOut());
+    child->totalTime = node.totalTime;
+    child->timesExecuted = node.timesExecuted;
+    child->maxTime = node.maxTime;
+    child->sumSquares = node.sumSquares;
+    for (const auto &last : node.last) {
+      child->lastTimesTotal += last.second;
+      child->lastTimesSquares += last.second * last.second;
+    }
+    child->lastCount = node.last.size();
+    child->lastTime = node.last.empty() ? 0.0 : child->lastTimesTotal / (double)child->lastCount;
+    for (const auto &thread : node.threads) {
+      auto name = threadNames.find(thread.first);
+      child->threads.push_back({name != threadNames.end() ? name->second : "thread " + std::to_string(thread.first),
+                                thread.second.first, thread.second.second, 0});
+    }
+    out.childrenTime += node.totalTime;
+    traceStatsToOut(node, threadNames, *child);
+  }
+  stats.children.clear();
+}
+#endif
+
+std::string benchmarkLogFromTrace(const std::string &tracePath, double fromSec, double toSec, Field withoutFields,
+                                  Format format, std::ostream *out, View view, std::string *outError) {
+#ifndef BENCHMARK_DISABLED
+  Tracing::TraceStatsOptions options;
+  options.fromSec = fromSec;
+  options.toSec = toSec;
+  options.lastCount = CAPTURE_LAST_N_TIMES;
+  options.perThread = view == View::threads;
+  Tracing::TraceStats stats;
+  std::string err;
+  if (!Tracing::readTraceStats(tracePath, options, stats, err)) {
+    if (outError) *outError = err;
+    std::string msg = generateError(err, format);
+    if (out) {
+      *out << msg;
+      return "";
+    }
+    return msg;
+  }
+  MeasurementInfoOut root;
+  traceStatsToOut(stats.root, stats.threadNames, root);
+  CountersOut counters;
+  for (const auto &keyVal : stats.counters) {
+    CounterInfo info;
+    info.lastValue = keyVal.second.lastValue;
+    info.minValue = keyVal.second.minValue;
+    info.maxValue = keyVal.second.maxValue;
+    info.sum = keyVal.second.sum;
+    info.count = keyVal.second.count;
+    counters.emplace_back(keyVal.first, info);
+  }
+  std::stringstream source;
+  source << "trace: " << tracePath;
+  if (fromSec > 0 || toSec > 0) {
+    source << std::setprecision(3) << std::fixed << ", " << fromSec << " - ";
+    if (toSec > 0) {
+      source << toSec << " s";
+    } else {
+      source << "end";
+    }
+  }
+  source << ", " << stats.spans << " spans";
+  if (stats.truncated) {
+    source << "\nfile is truncated, spans that were still open are missing";
+  }
+  if (stats.approximated > 0) {
+    source << "\n" << stats.approximated << " spans waited too long for their parent, their nesting is approximate";
+  }
+  std::string sourceString = source.str();
+  return generateOutput(root, counters, withoutFields, format, view, &sourceString, out);
+#else
+  (void)tracePath;
+  (void)fromSec;
+  (void)toSec;
+  (void)withoutFields;
+  (void)format;
+  (void)out;
+  (void)view;
+  (void)outError;
+  return std::string();
+#endif
+}
+
+/// Строки узла по потокам, самый загруженный поток первым
+inline void generateThreadRows(const MeasurementInfoOut &info, int level, const Field &withoutFields, std::vector<std::vector<std::string>> &outRows) {
+  std::vector<const ThreadInfoOut *> threads;
+  for (const auto &thread : info.threads) threads.push_back(&thread);
+  sort(threads.begin(), threads.end(), [](const ThreadInfoOut *a, const ThreadInfoOut *b) -> bool {
+    return a->totalTime > b->totalTime;
+  });
+  std::stringstream ss;
+  for (const auto *thread : threads) {
+    std::vector<std::string> row;
+    row.push_back(std::string(level*2, ' ') + "[" + thread->name + "]:");
+    ss << std::setprecision(2) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::total)) {
+      row.emplace_back("   total:");
+      row.emplace_back(formatString(ss, thread->totalTime / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::times)) {
+      row.emplace_back("   times:");
+      row.emplace_back(formatString(ss, thread->timesExecuted));
+    }
+    if (!static_cast<bool>(withoutFields & Field::average)) {
+      row.emplace_back("   avg:");
+      double avg = thread->timesExecuted == 0 ? 0.0 : (thread->totalTime / (double)thread->timesExecuted);
+      row.emplace_back(formatString(ss, avg / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::running)) {
+      row.emplace_back("   running:");
+      row.emplace_back(formatString(ss, thread->currentRunningTime / 1000.));
+    }
+    ss << std::setprecision(1) << std::fixed;
+    row.emplace_back("   share:");
+    double share = info.totalTime == 0 ? 0 : thread->totalTime / info.totalTime;
+    row.emplace_back(formatString(ss, int(share * 1000) / 10.) + " %");
+    outRows.push_back(std::move(row));
+  }
+}
+
+inline void generateTableRowsRecursive(const MeasurementInfoOut &root, double totalExecutionTime, int level, const Field &withoutFields, std::vector<std::vector<std::string>> &outRows) {
+  
+  std::stringstream ss;
+  
+  for (const auto &key: root.childrenOrder) {
+    std::vector<std::string> row;
+    row.push_back(std::string(level*2, ' ') + key + ":");
+    const auto &info = *root.children.at(key);
+    
+    ss << std::setprecision(2) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::total)) {
+      row.emplace_back("   total:");
+      row.emplace_back(formatString(ss, info.totalTime / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::times)) {
+      row.emplace_back("   times:");
+      row.emplace_back(formatString(ss, info.timesExecuted));
+    }
+    if (!static_cast<bool>(withoutFields & Field::average)) {
+      row.emplace_back("   avg:");
+      double avg = info.timesExecuted == 0 ? 0.0 : (info.totalTime / (double)info.timesExecuted);
+      row.emplace_back(formatString(ss, avg / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::lastAverage)) {
+      row.emplace_back("   last avg:");
+      row.emplace_back(formatString(ss, info.lastTime / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::running)) {
+      row.emplace_back("   running:");
+      row.emplace_back(formatString(ss, info.currentRunningTime / 1000.));
+    }
+    
+    ss << std::setprecision(1) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::percent)) {
+      row.emplace_back("   percent:");
+      double percent = totalExecutionTime == 0 ? 0 : info.totalTime / totalExecutionTime;
+      row.emplace_back(formatString(ss, int(percent * 1000) / 10.) + " %");
+    }
+    if (!static_cast<bool>(withoutFields & Field::percentMissed)) {
+      row.emplace_back("   missed:");
+      double missed = (totalExecutionTime == 0 || info.childrenTime == 0) ? 0 : std::max(0.0, info.totalTime - info.childrenTime) / totalExecutionTime;
+      row.emplace_back(formatString(ss, int(missed * 1000) / 10.) + " %");
+    }
+    if (!static_cast<bool>(withoutFields & Field::budget) && info.budget > 0) {
+      ss << std::setprecision(2) << std::fixed;
+      row.emplace_back("   budget:");
+      row.emplace_back(formatString(ss, info.budget / 1000.));
+      row.emplace_back("   over:");
+      row.emplace_back(formatString(ss, info.budgetViolations));
+      row.emplace_back("   max:");
+      row.emplace_back(formatString(ss, info.maxTime / 1000.));
+    }
+    if (info.elapsedTime > 0 && info.timesExecuted > 0) {
+      ss << std::setprecision(2) << std::fixed;
+      row.emplace_back("   elapsed:");
+      row.emplace_back(formatString(ss, info.elapsedTime / info.timesExecuted / 1000.));
+    }
+    double drift, score;
+    if (!static_cast<bool>(withoutFields & Field::drift) && nodeDrift(info, drift, score)) {
+      ss << std::setprecision(1) << std::fixed << std::showpos;
+      row.emplace_back("   drift:");
+      row.emplace_back(formatString(ss, int(drift * 1000) / 10.) + (score > 0 ? " % !" : " %  "));
+      ss << std::noshowpos;
+    }
+    double threadMin, threadAvg, threadMax;
+    if (threadImbalance(info, threadMin, threadAvg, threadMax)) {
+      ss << std::setprecision(2) << std::fixed;
+      row.emplace_back("   threads:");
+      row.emplace_back(formatString(ss, info.threads.size()));
+      row.emplace_back("   min:");
+      row.emplace_back(formatString(ss, threadMin / 1000.));
+      row.emplace_back("   avg:");
+      row.emplace_back(formatString(ss, threadAvg / 1000.));
+      row.emplace_back("   max:");
+      row.emplace_back(formatString(ss, threadMax / 1000.));
+      row.emplace_back("   imbalance:");
+      row.emplace_back(formatString(ss, threadAvg == 0 ? 1.0 : threadMax / threadAvg));
+    }
+    
+    outRows.push_back(std::move(row));
+    generateThreadRows(info, level + 1, withoutFields, outRows);
+    // мне не нравится рекурсия, но пока так; без рекурсии пока не придумал как меньше кода написать
+    if (!info.children.empty()) {
+      generateTableRowsRecursive(info, totalExecutionTime, level+1, withoutFields, outRows);
+    }
+  }
+}
+
+inline void generateCounterRows(const CountersOut &counters, std::vector<std::vector<std::string>> &outRows) {
+  std::stringstream ss;
+  ss << std::setprecision(2) << std::fixed;
+  for (const auto &keyVal : counters) {
+    const CounterInfo &info = keyVal.second;
+    std::vector<std::string> row;
+    row.push_back(keyVal.first + ":");
+    row.emplace_back("   last:");
+    row.emplace_back(formatString(ss, info.lastValue));
+    row.emplace_back("   min:");
+    row.emplace_back(formatString(ss, info.minValue));
+    row.emplace_back("   max:");
+    row.emplace_back(formatString(ss, info.maxValue));
+    row.emplace_back("   avg:");
+    row.emplace_back(formatString(ss, info.count == 0 ? 0.0 : info.sum / (double)info.count));
+    outRows.push_back(std::move(row));
+  }
+}
 
-  info.lastStartTime = get_timestamp();
+#ifndef BUDGET_WORST_OFFENDERS
+#define BUDGET_WORST_OFFENDERS 10
 #endif
-  return true;
+
+struct BudgetOffender {
+  std::string path;
+  const MeasurementInfoOut *info;
+};
+
+inline void collectBudgetOffenders(const MeasurementInfoOut &root, std::vector<std::string> &path, std::vector<BudgetOffender> &out) {
+  for (const auto &key : root.childrenOrder) {
+    const auto &info = *root.children.at(key);
+    path.push_back(key);
+    if (info.budgetViolations > 0) {
+      out.push_back({joined(path), &info});
+    }
+    collectBudgetOffenders(info, path, out);
+    path.pop_back();
+  }
+}
+
+inline void generateBudgetRows(const MeasurementInfoOut &root, std::vector<std::vector<std::string>> &outRows) {
+  std::vector<BudgetOffender> offenders;
+  std::vector<std::string> path;
+  collectBudgetOffenders(root, path, offenders);
+  auto rate = [](const MeasurementInfoOut &info) -> double {
+    return info.timesExecuted == 0 ? 0.0 : info.budgetViolations / (double)info.timesExecuted;
+  };
+  sort(offenders.begin(), offenders.end(), [&rate](const BudgetOffender &a, const BudgetOffender &b) -> bool {
+    return rate(*a.info) > rate(*b.info);
+  });
+  if (offenders.size() > BUDGET_WORST_OFFENDERS) {
+    offenders.resize(BUDGET_WORST_OFFENDERS);
+  }
+
+  std::stringstream ss;
+  for (const auto &offender : offenders) {
+    const auto &info = *offender.info;
+    std::vector<std::string> row;
+    row.push_back(offender.path + ":");
+    ss << std::setprecision(2) << std::fixed;
+    row.emplace_back("   budget:");
+    row.emplace_back(formatString(ss, info.budget / 1000.));
+    row.emplace_back("   over:");
+    row.emplace_back(formatString(ss, info.budgetViolations) + " / " + formatString(ss, info.timesExecuted));
+    row.emplace_back("   max:");
+    row.emplace_back(formatString(ss, info.maxTime / 1000.));
+    ss << std::setprecision(1) << std::fixed;
+    row.emplace_back("   rate:");
+    row.emplace_back(formatString(ss, int(rate(info) * 1000) / 10.) + " %");
+    outRows.push_back(std::move(row));
+  }
+}
+
+struct CardinalityOffender {
+  std::string path;         // путь узла overflowKey
+  size_t kept;              // идентификаторов уровня, попавших в реестр до переполнения
+  unsigned long redirected;
+  std::vector<std::string> examples;
+};
+
+/// Уровни, на которых сработал лимит числа узлов, по убыванию числа перенаправленных замеров
+inline std::vector<CardinalityOffender> collectCardinalityOffenders() {
+  std::vector<CardinalityOffender> offenders;
+  std::lock_guard<std::mutex> lock(nodeRegistryMut);
+  for (const auto &keyVal : cardinalityOverflows) {
+    std::vector<std::string> path = {overflowKey};
+    for (uint32_t id = keyVal.first; id != 0 && id < nodeRegistry.size(); id = nodeRegistry[id].parent) {
+      path.insert(path.begin(), nodeRegistry[id].name);
+    }
+    offenders.push_back({joined(path), keyVal.second->kept.size(),
+                         keyVal.second->redirected.load(), keyVal.second->examples});
+  }
+  sort(offenders.begin(), offenders.end(), [](const CardinalityOffender &a, const CardinalityOffender &b) -> bool {
+    return a.redirected > b.redirected;
+  });
+  return offenders;
+}
+
+inline void generateCardinalityRows(const std::vector<CardinalityOffender> &offenders, std::vector<std::vector<std::string>> &outRows) {
+  for (const auto &offender : offenders) {
+    std::vector<std::string> row;
+    row.push_back(offender.path + ":");
+    row.emplace_back("   kept:");
+    row.emplace_back(std::to_string(offender.kept));
+    row.emplace_back("   redirected:");
+    row.emplace_back(std::to_string(offender.redirected));
+    std::string examples;
+    for (const auto &example : offender.examples) {
+      examples += (examples.empty() ? "" : ", ") + example;
+    }
+    row.emplace_back("   e.g.: " + examples);
+    outRows.push_back(std::move(row));
+  }
+}
+
+inline void generateErrorRows(const std::vector<ErrorReport> &errors, std::vector<std::vector<std::string>> &outRows) {
+  for (const auto &error : errors) {
+    std::vector<std::string> row;
+    row.push_back(std::string(errorKindName(error.kind)) + ":");
+    // сообщения об ошибках файлов многострочные, в таблице нужна одна строка
+    row.push_back(error.detail.empty() ? "" : "   " + singleLine(error.detail));
+    row.push_back(error.file.empty() ? "" : "   " + singleLine(error.file) + ":" + std::to_string(error.line));
+    row.emplace_back("   times:");
+    row.emplace_back(std::to_string(error.count));
+    row.push_back(error.kind == ErrorKind::stopMismatch ? "   unwound: " + std::to_string(error.unwound) : "");
+    outRows.push_back(std::move(row));
+  }
+}
+
+struct SampledFunction {
+  std::string name;
+  unsigned long samples;
+};
+
+struct SampleReport {
+  std::string path;         // путь замера, в котором был поток
+  unsigned long samples;
+  std::vector<SampledFunction> functions; // первые samplerState.topFunctions по числу сэмплов
+};
+
+#ifdef R_BENCHMARK_SAMPLER_SUPPORTED
+/// Имя функции по адресу; без `-rdynamic` функции исполняемого файла выводятся как `файл+смещение`
+inline std::string symbolName(void *address) {
+  Dl_info info;
+  if (dladdr(address, &info) == 0) {
+    std::stringstream ss;
+    ss << address;
+    return ss.str();
+  }
+  if (info.dli_sname) {
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    std::string name = (status == 0 && demangled) ? demangled : info.dli_sname;
+    free(demangled);
+    return name;
+  }
+  std::string module = info.dli_fname ? info.dli_fname : "";
+  module = module.substr(module.find_last_of('/') + 1);
+  std::stringstream ss;
+  ss << module << "+0x" << std::hex << (reinterpret_cast<uintptr_t>(address) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+  return ss.str();
+}
+#endif
+
+/// Сэмплы по замерам, по убыванию числа сэмплов; символы ищутся здесь, а не в обработчике сигнала
+inline std::vector<SampleReport> collectSampleReports() {
+  std::vector<SampleReport> reports;
+#ifdef R_BENCHMARK_SAMPLER_SUPPORTED
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  snapshotGroups(groups);
+  std::lock_guard<std::mutex> lock(samplerState.mut);
+  for (auto &group : groups) {
+    drainSamplesLocked(*group);
+  }
+  for (const auto &node : samplerState.counts) {
+    SampleReport report;
+    report.samples = 0;
+    {
+      std::lock_guard<std::mutex> registryLock(nodeRegistryMut);
+      std::vector<std::string> path;
+      for (uint32_t id = node.first; id != 0 && id < nodeRegistry.size(); id = nodeRegistry[id].parent) {
+        path.insert(path.begin(), nodeRegistry[id].name);
+      }
+      report.path = joined(path);
+    }
+    std::unordered_map<std::string, unsigned long> byName; // несколько адресов одной функции
+    for (const auto &address : node.second) {
+      auto it = samplerState.symbols.find(address.first);
+      if (it == samplerState.symbols.end()) {
+        it = samplerState.symbols.emplace(address.first, symbolName(address.first)).first;
+      }
+      byName[it->second] += address.second;
+      report.samples += address.second;
+    }
+    for (const auto &function : byName) {
+      report.functions.push_back({function.first, function.second});
+    }
+    sort(report.functions.begin(), report.functions.end(), [](const SampledFunction &a, const SampledFunction &b) -> bool {
+      return a.samples > b.samples || (a.samples == b.samples && a.name < b.name);
+    });
+    if (report.functions.size() > samplerState.topFunctions) {
+      report.functions.resize(samplerState.topFunctions);
+    }
+    reports.push_back(std::move(report));
+  }
+  sort(reports.begin(), reports.end(), [](const SampleReport &a, const SampleReport &b) -> bool {
+    return a.samples > b.samples;
+  });
+#endif
+  return reports;
+}
+
+inline void generateSampleRows(const std::vector<SampleReport> &reports, std::vector<std::vector<std::string>> &outRows) {
+  std::stringstream ss;
+  ss << std::setprecision(1) << std::fixed;
+  for (const auto &report : reports) {
+    std::vector<std::string> row;
+    row.push_back(report.path + ":");
+    row.emplace_back("   samples:");
+    row.emplace_back(std::to_string(report.samples));
+    outRows.push_back(std::move(row));
+    for (const auto &function : report.functions) {
+      std::vector<std::string> functionRow;
+      functionRow.push_back("  " + function.name + ":");
+      functionRow.emplace_back("   samples:");
+      functionRow.emplace_back(std::to_string(function.samples));
+      functionRow.emplace_back("   share:");
+      functionRow.emplace_back(formatString(ss, int(function.samples * 1000. / report.samples) / 10.) + " %");
+      outRows.push_back(std::move(functionRow));
+    }
+  }
+}
+
+inline void generateFlatRows(const FlatProfileOut &flat, const Field &withoutFields, std::vector<std::vector<std::string>> &outRows) {
+  std::stringstream ss;
+  for (const auto &entry : flat.entries) {
+    std::vector<std::string> row;
+    row.push_back(entry.name + ":");
+    ss << std::setprecision(2) << std::fixed;
+    row.emplace_back("   self:");
+    row.emplace_back(formatString(ss, entry.selfTime / 1000.));
+    if (!static_cast<bool>(withoutFields & Field::total)) {
+      row.emplace_back("   total:");
+      row.emplace_back(formatString(ss, entry.totalTime / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::times)) {
+      row.emplace_back("   times:");
+      row.emplace_back(formatString(ss, entry.timesExecuted));
+    }
+    if (!static_cast<bool>(withoutFields & Field::average)) {
+      row.emplace_back("   avg self:");
+      double avg = entry.timesExecuted == 0 ? 0.0 : (entry.selfTime / (double)entry.timesExecuted);
+      row.emplace_back(formatString(ss, avg / 1000.));
+    }
+    ss << std::setprecision(1) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::percent)) {
+      row.emplace_back("   percent:");
+      double percent = flat.selfTime == 0 ? 0 : entry.selfTime / flat.selfTime;
+      row.emplace_back(formatString(ss, int(percent * 1000) / 10.) + " %");
+    }
+    outRows.push_back(std::move(row));
+  }
+}
+
+inline void generateTableOutput(const MeasurementInfoOut &root, const FlatProfileOut *flat, const CountersOut &counters,
+                                const Field &withoutFields, const std::string *traceSource, std::ostream &out) {
+  std::vector<std::vector<std::string>> rows;
+  if (flat) {
+    generateFlatRows(*flat, withoutFields, rows);
+  } else {
+    generateTableRowsRecursive(root, root.totalTime, 0, withoutFields, rows);
+  }
+
+  out << "\n================== Benchmark ==================\n";
+  double overhead = overheadPerCall.load();
+  if (traceSource) {
+    out << *traceSource << "\n";
+  } else if (overhead >= 0) {
+    std::stringstream ss;
+    ss << std::setprecision(3) << std::fixed << overhead;
+    out << "overhead: " << ss.str() << " us per start/stop" << (overheadCompensation ? " (subtracted)" : "") << "\n";
+  }
+  if (flat) {
+    out << "flat: " << flat->entries.size() << " of " << flat->identifiers << " identifiers by self time\n";
+  }
+  formGrid(rows, out);
+  if (!counters.empty()) {
+    std::vector<std::vector<std::string>> counterRows;
+    generateCounterRows(counters, counterRows);
+    out << "------------------- Counters ------------------\n";
+    formGrid(counterRows, out);
+  }
+  std::vector<std::vector<std::string>> budgetRows;
+  if (!static_cast<bool>(withoutFields & Field::budget)) {
+    generateBudgetRows(root, budgetRows);
+  }
+  if (!budgetRows.empty()) {
+    out << "--------------- Budget violations -------------\n";
+    formGrid(budgetRows, out);
+  }
+  // переполнения, сэмплы и ошибки относятся к текущему процессу, а не к трейсу
+  auto offenders = traceSource ? std::vector<CardinalityOffender>() : collectCardinalityOffenders();
+  if (!offenders.empty()) {
+    std::vector<std::vector<std::string>> cardinalityRows;
+    generateCardinalityRows(offenders, cardinalityRows);
+    out << "------------- Cardinality overflow ------------\n";
+    formGrid(cardinalityRows, out);
+  }
+  auto samples = traceSource ? std::vector<SampleReport>() : collectSampleReports();
+  if (!samples.empty()) {
+    std::vector<std::vector<std::string>> sampleRows;
+    generateSampleRows(samples, sampleRows);
+    out << "------------------- Samples -------------------\n";
+    formGrid(sampleRows, out);
+  }
+  auto errors = traceSource ? std::vector<ErrorReport>() : errorSites.collect();
+  if (!errors.empty()) {
+    std::vector<std::vector<std::string>> errorRows;
+    generateErrorRows(errors, errorRows);
+    out << "------------------- Errors --------------------\n";
+    formGrid(errorRows, out);
+  }
+  out << "===============================================\n";
+}
+
+inline void generateJsonItems(const MeasurementInfoOut &root, double totalExecutionTime, const Field &withoutFields, std::ostream &out) {
+  std::stringstream ss;
+
+  for (size_t i = 0; i < root.childrenOrder.size(); i++) {
+    const auto &name = root.childrenOrder[i];
+    const auto &info = *root.children.at(name);
+    if (i == 0) {
+      out << "{";
+    } else {
+      out << ",{";
+    }
+
+    double totalTime = info.totalTime;
+    double childrenTime = info.childrenTime;
+    unsigned long timesExecuted = info.timesExecuted;
+
+    double avg = timesExecuted == 0 ? 0.0 : (totalTime / (double) timesExecuted);
+    double percent = totalExecutionTime == 0 ? 0 : totalTime / totalExecutionTime;
+    double missed = (totalExecutionTime == 0 || childrenTime == 0) ? 0 : std::max(0.0, totalTime - childrenTime) /
+                                                                         totalExecutionTime;
+
+    ss << std::setprecision(2) << std::fixed;
+    out << "\"name\":\"" << jsonEscaped(name) << "\"";
+    if (!static_cast<bool>(withoutFields & Field::total)) {
+      out << ",\"total\":" << formatString(ss, totalTime / 1000.);
+    }
+    if (!static_cast<bool>(withoutFields & Field::times)) {
+      out << ",\"times\":" << formatString(ss, timesExecuted);
+    }
+    if (!static_cast<bool>(withoutFields & Field::average)) {
+      out << ",\"avg\":" << formatString(ss, avg / 1000.);
+    }
+    if (!static_cast<bool>(withoutFields & Field::lastAverage)) {
+      out << ",\"last avg\":" << formatString(ss, info.lastTime / 1000.);
+    }
+    if (!static_cast<bool>(withoutFields & Field::running)) {
+      out << ",\"running\":" << formatString(ss, info.currentRunningTime / 1000.);
+    }
+
+    ss << std::setprecision(1) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::percent)) {
+      out << ",\"percent\":" << formatString(ss, int(percent * 1000) / 10.);
+    }
+    if (!static_cast<bool>(withoutFields & Field::percentMissed)) {
+      out << ",\"missed\":" << formatString(ss, int(missed * 1000) / 10.);
+    }
+    if (!static_cast<bool>(withoutFields & Field::budget) && info.budget > 0) {
+      ss << std::setprecision(2) << std::fixed;
+      out << ",\"budget\":" << formatString(ss, info.budget / 1000.);
+      out << ",\"over budget\":" << formatString(ss, info.budgetViolations);
+      out << ",\"max\":" << formatString(ss, info.maxTime / 1000.);
+    }
+    if (info.elapsedTime > 0 && info.timesExecuted > 0) {
+      ss << std::setprecision(2) << std::fixed;
+      out << ",\"elapsed\":" << formatString(ss, info.elapsedTime / info.timesExecuted / 1000.);
+    }
+    double drift, score;
+    if (!static_cast<bool>(withoutFields & Field::drift) && nodeDrift(info, drift, score)) {
+      ss << std::setprecision(1) << std::fixed;
+      out << ",\"drift\":" << formatString(ss, int(drift * 1000) / 10.);
+      out << ",\"regression\":" << (score > 0 ? "true" : "false");
+    }
+    double threadMin, threadAvg, threadMax;
+    if (threadImbalance(info, threadMin, threadAvg, threadMax)) {
+      ss << std::setprecision(2) << std::fixed;
+      out << ",\"thread min\":" << formatString(ss, threadMin / 1000.);
+      out << ",\"thread avg\":" << formatString(ss, threadAvg / 1000.);
+      out << ",\"thread max\":" << formatString(ss, threadMax / 1000.);
+      out << ",\"imbalance\":" << formatString(ss, threadAvg == 0 ? 1.0 : threadMax / threadAvg);
+      out << ",\"threads\":[";
+      for (size_t t = 0; t < info.threads.size(); t++) {
+        const auto &thread = info.threads[t];
+        out << (t == 0 ? "{" : ",{") << "\"name\":\"" << jsonEscaped(thread.name) << "\"";
+        out << ",\"total\":" << formatString(ss, thread.totalTime / 1000.);
+        out << ",\"times\":" << formatString(ss, thread.timesExecuted);
+        out << "}";
+      }
+      out << "]";
+    }
+
+    if (!info.children.empty()) {
+      out << ",\"children\":[";
+      generateJsonItems(info, totalExecutionTime, withoutFields, out);
+      out << "]";
+    }
+    out << "}";
+  }
+}
+
+inline void generateJsonCounterItems(const CountersOut &counters, bool first, std::ostream &out) {
+  std::stringstream ss;
+  ss << std::setprecision(2) << std::fixed;
+  for (const auto &keyVal : counters) {
+    const CounterInfo &info = keyVal.second;
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(keyVal.first) << "\",\"counter\":true";
+    out << ",\"last\":" << formatString(ss, info.lastValue);
+    out << ",\"min\":" << formatString(ss, info.minValue);
+    out << ",\"max\":" << formatString(ss, info.maxValue);
+    out << ",\"avg\":" << formatString(ss, info.count == 0 ? 0.0 : info.sum / (double)info.count);
+    out << "}";
+  }
+}
+
+inline void generateJsonCardinalityItems(const std::vector<CardinalityOffender> &offenders, bool first, std::ostream &out) {
+  for (const auto &offender : offenders) {
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(offender.path) << "\",\"cardinality\":true";
+    out << ",\"kept\":" << offender.kept;
+    out << ",\"redirected\":" << offender.redirected;
+    out << ",\"examples\":[";
+    for (size_t i = 0; i < offender.examples.size(); i++) {
+      out << (i == 0 ? "\"" : ",\"") << jsonEscaped(offender.examples[i]) << "\"";
+    }
+    out << "]}";
+  }
+}
+
+inline void generateJsonSampleItems(const std::vector<SampleReport> &reports, bool first, std::ostream &out) {
+  for (const auto &report : reports) {
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(report.path) << "\",\"sampled\":true";
+    out << ",\"samples\":" << report.samples;
+    out << ",\"functions\":[";
+    for (size_t i = 0; i < report.functions.size(); i++) {
+      out << (i == 0 ? "{" : ",{") << "\"name\":\"" << jsonEscaped(report.functions[i].name) << "\",\"samples\":" << report.functions[i].samples << "}";
+    }
+    out << "]}";
+  }
+}
+
+inline void generateJsonErrorItems(const std::vector<ErrorReport> &errors, bool first, std::ostream &out) {
+  for (const auto &error : errors) {
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(error.detail) << "\",\"error\":\"" << errorKindName(error.kind) << "\"";
+    out << ",\"file\":\"" << jsonEscaped(error.file) << "\",\"line\":" << error.line;
+    out << ",\"times\":" << error.count;
+    if (error.kind == ErrorKind::stopMismatch) out << ",\"unwound\":" << error.unwound;
+    out << "}";
+  }
+}
+
+/// Строки View::flat помечены "flat": их не читает benchmarkLoadBaseline
+inline void generateJsonFlatItems(const FlatProfileOut &flat, const Field &withoutFields, std::ostream &out) {
+  std::stringstream ss;
+  bool first = true;
+  for (const auto &entry : flat.entries) {
+    out << (first ? "{" : ",{");
+    first = false;
+    ss << std::setprecision(2) << std::fixed;
+    out << "\"name\":\"" << jsonEscaped(entry.name) << "\",\"flat\":true";
+    out << ",\"self\":" << formatString(ss, entry.selfTime / 1000.);
+    if (!static_cast<bool>(withoutFields & Field::total)) {
+      out << ",\"total\":" << formatString(ss, entry.totalTime / 1000.);
+    }
+    if (!static_cast<bool>(withoutFields & Field::times)) {
+      out << ",\"times\":" << formatString(ss, entry.timesExecuted);
+    }
+    if (!static_cast<bool>(withoutFields & Field::average)) {
+      double avg = entry.timesExecuted == 0 ? 0.0 : (entry.selfTime / (double)entry.timesExecuted);
+      out << ",\"avg self\":" << formatString(ss, avg / 1000.);
+    }
+    ss << std::setprecision(1) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::percent)) {
+      double percent = flat.selfTime == 0 ? 0 : entry.selfTime / flat.selfTime;
+      out << ",\"percent\":" << formatString(ss, int(percent * 1000) / 10.);
+    }
+    out << "}";
+  }
 }
 
-static
-void failWrongNestingKey(const std::string &fullPath, const std::string &idetifier, const std::string &file, int line) {
-  auto keyFromIdx = fullPath.find_last_of(kNestingString);
-  std::string lastKeyPath;
-  if (keyFromIdx == std::string::npos) {
-    lastKeyPath = fullPath;
+inline void generateJsonOutput(const MeasurementInfoOut &root, const FlatProfileOut *flat, const CountersOut &counters,
+                               const Field &withoutFields, const std::string *traceSource, std::ostream &out) {
+  out << "[";
+  if (flat) {
+    generateJsonFlatItems(*flat, withoutFields, out);
   } else {
-    lastKeyPath = fullPath.substr(keyFromIdx+1);
+    generateJsonItems(root, root.totalTime, withoutFields, out);
   }
-  std::string msg = "benchmarkStop(\"" + idetifier + "\") not matched with last key \"" + lastKeyPath + "\"";
-  errorMsg.update(msg, file, line);
+  bool empty = flat ? flat->entries.empty() : root.childrenOrder.empty();
+  // счетчики, переполнения, сэмплы и ошибки добавляем в тот же массив верхнего уровня
+  // с пометкой "counter" / "cardinality" / "sampled" / "error"
+  generateJsonCounterItems(counters, empty, out);
+  auto offenders = traceSource ? std::vector<CardinalityOffender>() : collectCardinalityOffenders();
+  generateJsonCardinalityItems(offenders, empty && counters.empty(), out);
+  auto samples = traceSource ? std::vector<SampleReport>() : collectSampleReports();
+  generateJsonSampleItems(samples, empty && counters.empty() && offenders.empty(), out);
+  auto errors = traceSource ? std::vector<ErrorReport>() : errorSites.collect();
+  generateJsonErrorItems(errors, empty && counters.empty() && offenders.empty() && samples.empty(), out);
+  out << "]";
 }
 
-void benchmarkStop(const std::string &identifier, const std::string &file, int line) {
+// Baseline
 #ifndef BENCHMARK_DISABLED
-  auto &measurmentGroup = getMeasurmentGroup();
-  auto &measurmentMap = measurmentGroup.map;
+inline void generateBaselineItems(const MeasurementInfoOut &root, std::ostream &out) {
+  std::stringstream ss;
+  ss << std::setprecision(3) << std::fixed;
+  bool first = true;
+  for (const auto &keyVal : root.children) {
+    const auto &info = *keyVal.second;
+    double times = static_cast<double>(info.timesExecuted);
+    double avg = times == 0 ? 0.0 : info.totalTime / times;
+    double variance = times > 1 ? std::max(0.0, (info.sumSquares - avg * info.totalTime) / (times - 1)) : 0.0;
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(keyVal.first) << "\"";
+    out << ",\"times\":" << info.timesExecuted;
+    out << ",\"avg\":" << formatString(ss, avg / 1000.);
+    out << ",\"std\":" << formatString(ss, std::sqrt(variance) / 1000.);
+    if (!info.children.empty()) {
+      out << ",\"children\":[";
+      generateBaselineItems(info, out);
+      out << "]";
+    }
+    out << "}";
+  }
+}
 
-  if (!stringHasSuffix(measurmentGroup.parentKey, identifier)) {
-    failWrongNestingKey(measurmentGroup.parentKey, identifier, file, line);
-    return;
+inline void readBaselineItems(const Json::Value &items, std::vector<std::string> &path, BaselineMap &out) {
+  if (items.type != Json::Value::Type::array) return;
+  for (const auto &item : items.items) {
+    if (item.type != Json::Value::Type::object || item.find("counter") || item.find("cardinality") || item.find("sampled") ||
+        item.find("error") || item.find("flat")) continue;
+    path.push_back(item.string("name"));
+    BaselineStat stat;
+    stat.avg = item.number("avg") * 1000.;
+    stat.std = item.number("std") * 1000.;
+    stat.times = item.number("times");
+    out[joined(path)] = stat;
+    const Json::Value *children = item.find("children");
+    if (children) {
+      readBaselineItems(*children, path, out);
+    }
+    path.pop_back();
   }
+}
 
-  if (measurmentMap.count(measurmentGroup.parentKey) == 0) {
-    errorMsg.update("Internal error. Missing \"" + measurmentGroup.parentKey + "\" key", file, line);
-    return;
+inline void updateBaselineRecursive(MeasurementMap &map, std::vector<std::string> &path) {
+  for (auto &keyVal : map) {
+    path.push_back(keyVal.first);
+    keyVal.second->baseline = findBaseline(joined(path));
+    updateBaselineRecursive(keyVal.second->children, path);
+    path.pop_back();
   }
-  MeasurmentInfo &info = measurmentMap[measurmentGroup.parentKey];
-  if (info.lastStartTime == 0) {
-    errorMsg.update("Benchmark for \"" + measurmentGroup.parentKey + "\" key not started", file, line);
-    return;
+}
+#endif
+
+bool benchmarkSaveBaseline(const std::string &path, std::string *outError) {
+#ifndef BENCHMARK_DISABLED
+  MeasurementInfoOut root = unionMeasurements();
+  std::ofstream file(path);
+  if (!file.is_open()) {
+    if (outError) *outError = "RBenchmark could not open baseline file:\n" + path;
+    return false;
+  }
+  file << "{\"baseline\":[";
+  generateBaselineItems(root, file);
+  file << "]}";
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool benchmarkLoadBaseline(const std::string &path, std::string *outError) {
+#ifndef BENCHMARK_DISABLED
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    if (outError) *outError = "RBenchmark could not open baseline file:\n" + path;
+    return false;
+  }
+  Json::Value json;
+  Json::Reader reader(file);
+  if (!reader.parse(json)) {
+    if (outError) *outError = reader.error();
+    return false;
+  }
+  const Json::Value *items = json.type == Json::Value::Type::object ? json.find("baseline") : &json;
+  if (!items || items->type != Json::Value::Type::array) {
+    if (outError) *outError = "RBenchmark baseline file has unknown format:\n" + path;
+    return false;
+  }
+
+  std::unique_ptr<BaselineMap> baseline(new BaselineMap());
+  std::vector<std::string> keyPath;
+  readBaselineItems(*items, keyPath, *baseline);
+  {
+    std::lock_guard<std::mutex> lock(baselineMut);
+    activeBaseline = baseline.get();
+    loadedBaselines.push_back(std::move(baseline));
+  }
+
+  std::lock_guard<std::mutex> lock(mut);
+  for (auto &kv : measurementThreadMap) {
+    std::lock_guard<std::mutex> groupLock(kv.second->mut);
+    updateBaselineRecursive(kv.second->map, keyPath);
   }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void benchmarkSetRegressionThreshold(double minScore, double minDrift) {
+#ifndef BENCHMARK_DISABLED
+  regressionMinScore = minScore;
+  regressionMinDrift = minDrift;
+#endif
+}
 
-  long toIdx = (long)measurmentGroup.parentKey.length() - (long)identifier.length() - (long)kNestingString.length();
-  measurmentGroup.parentKey = measurmentGroup.parentKey.substr(0, std::max((long)0, toIdx));
+void benchmarkSetRegressionCallback(std::function<void(const RegressionInfo &)> callback) {
+#ifndef BENCHMARK_DISABLED
+  std::lock_guard<std::mutex> lock(baselineMut);
+  regressionCallback = std::move(callback);
+#endif
+}
+
+inline std::string currentProcessName() {
+#if defined(__linux__)
+  std::ifstream comm("/proc/self/comm");
+  std::string name;
+  if (std::getline(comm, name) && !name.empty()) return name;
+#elif defined(__APPLE__)
+  const char *name = getprogname();
+  if (name) return name;
+#endif
+  return "process";
+}
+
+/// Описания процесса и потоков, пишутся в начале каждой сессии трейсинга и каждого сохранения flight recorder
+inline void writeSessionDescriptors(Tracing::Serializer &serializer, const std::vector<std::shared_ptr<MeasurementGroup>> &groups) {
+  serializer.writeProcessName(currentProcessName());
+  for (auto &group : groups) {
+    writeThreadDescriptor(serializer, *group);
+  }
+}
 
-  auto dt = get_timestamp() - info.lastStartTime;
-  auto ts = info.lastStartTime;
-  auto time = static_cast<double>(dt);
-  info.totalTime += time;
-  info.timesExecuted++;
-  info.lastStartTime = 0;
-  info.lastNTimes[info.startNTimesIdx % CAPTURE_LAST_N_TIMES] = time;
-  info.startNTimesIdx++;
-  if (tracing) {
-    tracing->saveTrace({identifier, measurmentGroup.tid, ts, dt, (int)measurmentGroup.parentKey.length()});
+void benchmarkStartTracing(const std::string &writeJsonPath, const std::string &file, int line) {
+  std::lock_guard<std::mutex> lock(mut);
+  std::string err;
+  auto serializer = std::make_shared<Tracing::Serializer>(Tracing::compressedPath(writeJsonPath, tracingCompression),
+                                                          false, err, tracingCompression, true);
+  if (!err.empty()) {
+    errorSites.update(ErrorKind::io, err.c_str(), file.c_str(), line);
+    return;
   }
+#ifndef BENCHMARK_DISABLED
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  for (auto &kv : measurementThreadMap) groups.push_back(kv.second);
+  writeSessionDescriptors(*serializer, groups);
 #endif
+  // потоки, которые еще пишут в старый serializer, держат его через shared_ptr
+  auto previous = std::atomic_exchange(&tracing, serializer);
+  tracingEnabled = true;
+  if (previous) previous->end();
+}
+void benchmarkStopTracing() {
+  std::lock_guard<std::mutex> lock(mut);
+  tracingEnabled = false;
+  auto previous = std::atomic_exchange(&tracing, std::shared_ptr<Tracing::Serializer>());
+  if (previous) previous->end();
+  binaryTracingEnabled = false;
+  // файл закрывается, когда его отпустит последний пишущий поток
+  std::atomic_exchange(&binaryTracing, std::shared_ptr<Tracing::BinaryTraceFile>());
 }
 
-void benchmarkReset() {
+bool benchmarkStartBinaryTracing(const std::string &path, size_t capacityMb, const std::string &file, int line) {
 #ifndef BENCHMARK_DISABLED
   std::lock_guard<std::mutex> lock(mut);
-  for (auto &kv : measurmentThreadMap) {
-    auto &map = kv.second->map;
-    for (auto it = map.begin(); it != map.end(); ) {
-      if (it->second.lastStartTime == 0) {
-        // reset info for non finished benchmarks
-        auto lastStartTime = it->second.lastStartTime;
-        it->second = MeasurmentInfo();
-        it->second.lastStartTime = lastStartTime;
-        it = map.erase(it);
-      } else {
-        // remove all finished benchmarks
-        ++it;
-      }
-    }
-  }
-
-  for (auto it = measurmentThreadMap.begin(); it != measurmentThreadMap.end(); ) {
-    if (it->second->map.empty()) {
-      // no measurments for thread, cleanup
-      it = measurmentThreadMap.erase(it);
-    } else {
-      ++it;
-    }
+  std::string err;
+  auto binary = std::make_shared<Tracing::BinaryTraceFile>(path, capacityMb * 1024 * 1024, get_timestamp(), err);
+  if (!err.empty()) {
+    errorSites.update(ErrorKind::io, err.c_str(), file.c_str(), line);
+    return false;
   }
+  std::atomic_exchange(&binaryTracing, binary);
+  binaryTracingEnabled = true;
+  return true;
+#else
+  return false;
 #endif
 }
 
-// Out measurments
+TraceCompression benchmarkSetTracingCompression(TraceCompression compression) {
+  std::lock_guard<std::mutex> lock(mut);
+  tracingCompression = Tracing::availableCompression(static_cast<Tracing::Compression>(compression));
+  return static_cast<TraceCompression>(tracingCompression);
+}
 
-static
-double getTotalExecutionTime(const std::vector<std::pair<std::string, MeasurmentInfo>> &measureVector) {
+void benchmarkThreadName(const std::string &name) {
 #ifndef BENCHMARK_DISABLED
-  int count = static_cast<int>(measureVector.size());
-  std::vector<int> parents(measureVector.size(), -2);
+  auto &group = getMeasurementGroup();
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    group.thread.name = name;
+  }
+  auto serializer = activeTracing();
+  if (serializer) writeThreadDescriptor(*serializer, group);
+#endif
+}
 
-  for (int j = 0; j < count; j++) {
-    std::string prefix = measureVector[j].first + kNestingString;
+void benchmarkTracingThreadName(const std::string &name) {
+  benchmarkThreadName(name);
+}
 
-    for (int i = 0; i < count; i++) {
-      if (i == j || !stringHasPrefix(measureVector[i].first, prefix))
-        continue;
+// Flight recorder
+#ifndef BENCHMARK_DISABLED
+inline std::string flightRecorderDumpPath(unsigned index) {
+  const std::string &path = flightRecorderState.dumpPath;
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = path.size();
+  }
+  return path.substr(0, dot) + "_" + std::to_string(index) + path.substr(dot);
+}
 
-      parents[i] = j;
+inline bool dumpFlightRecorder(const std::string &jsonPath) {
+  std::vector<Tracing::TraceInfo> events;
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  std::string path = jsonPath;
+  Tracing::Compression compression;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (!flightRecorderState.enabled) return false;
+    if (path.empty()) {
+      path = flightRecorderDumpPath(++flightRecorderState.dumpIndex);
+    }
+    compression = tracingCompression;
+    auto now = get_timestamp();
+    auto fromTime = now > flightRecorderState.keepTime ? now - flightRecorderState.keepTime : 0;
+    for (auto &kv : measurementThreadMap) {
+      MeasurementGroup &group = *kv.second;
+      groups.push_back(kv.second);
+      std::lock_guard<std::mutex> groupLock(group.flightRecorderMut);
+      if (group.flightRecorder) {
+        group.flightRecorder->collect(fromTime, events);
+      }
     }
   }
-
-  double totalTime = 0;
-  for (int i = 0; i < count; i++) {
-    if (parents[i] < 0)
-      totalTime += measureVector[i].second.totalTime;
+  // пишем файл без глобальной блокировки, остальные потоки продолжают работать
+  std::string err;
+  Tracing::Serializer serializer(Tracing::compressedPath(path, compression), false, err, compression);
+  if (!err.empty()) {
+    errorSites.update(ErrorKind::io, err.c_str(), "", 0);
+    return false;
   }
-  return totalTime;
-#else
-  return 0;
-#endif
+  writeSessionDescriptors(serializer, groups);
+  for (auto &info : events) {
+    serializer.saveTrace(std::move(info));
+  }
+  serializer.end();
+  return true;
 }
 
-static
-void sortAsThree(std::vector<std::pair<std::string, MeasurmentInfo>> &measureVector, bool skipPrefix = true) {
-#ifndef BENCHMARK_DISABLED
-  // make Tree structure
-  int count = (int)measureVector.size();
-
-  std::vector<int> levels(measureVector.size(), 0);
-  std::vector<int> parents(measureVector.size(), -2);
-  std::vector<std::string> origNames(measureVector.size());
-
-  int maxLevel = 0;
-  for (int j = 0; j < count; j++) {
-    std::string prefix = measureVector[j].first;
-    origNames[j] = prefix;
-    prefix += kNestingString;
-
-    for (int i = 0; i < count; i++) {
-      if (i == j || !stringHasPrefix(measureVector[i].first, prefix))
-        continue;
-
-      levels[i]++;
-      parents[i] = j;
-      if (levels[i] > maxLevel)
-        maxLevel = levels[i];
+inline void processFlightRecorder(MeasurementGroup &group, const Tracing::TraceInfo &info) {
+  {
+    std::lock_guard<std::mutex> lock(group.flightRecorderMut);
+    if (!flightRecorderState.enabled) {
+      group.flightRecorder.reset(nullptr);
+      return;
     }
+    if (!group.flightRecorder) {
+      group.flightRecorder = std::unique_ptr<Tracing::RingBuffer>(new Tracing::RingBuffer(flightRecorderState.eventsPerThread));
+    }
+    group.flightRecorder->push(info);
   }
 
-  // save level indentation, remove parent names
-  for (int i = 0; i < count; i++) {
-    std::string name = measureVector[i].first;
-    if (skipPrefix && parents[i] >= 0) {
-      size_t from = origNames[parents[i]].size();
-      from += kNestingString.size();
-      name = name.substr(from);
-      measureVector[parents[i]].second.childrenTime += measureVector[i].second.totalTime;
+  bool dump = flightRecorderState.dumpRequested.exchange(false);
+  auto threshold = flightRecorderState.slowSpanThreshold.load(std::memory_order_relaxed);
+  if (!dump && threshold > 0 && info.duration > threshold) {
+    auto now = get_timestamp();
+    auto lastDump = flightRecorderState.lastDumpTime.load();
+    // не сохраняем повторно тот же участок времени
+    dump = (lastDump == 0 || now - lastDump >= flightRecorderState.keepTime) &&
+           flightRecorderState.lastDumpTime.compare_exchange_strong(lastDump, now);
+  }
+  if (dump) {
+    {
+      std::lock_guard<std::mutex> lock(flightRecorderState.writerMut);
+      flightRecorderState.writerPending = true;
     }
-
-    measureVector[i].second.level = levels[i];
-    measureVector[i].first = name;
+    flightRecorderState.writerCv.notify_one();
   }
+}
 
-  // save exchange order, and then do exchange
-  std::vector<int> order(count);
-  for (int i = 0; i < count; i++)
-    order[i] = i;
-
-  for (int level = 1; level <= maxLevel; level++) {
-    for (int i = count - 1; i >= 0; i--) {
-      int origIdx = order[i];
-      if (levels[origIdx] != level)
-        continue;
+/// Сохраняет flight recorder по запросу из benchmarkStop, а также по сигналу, если замеров нет
+inline void flightRecorderWriterLoop() {
+  std::unique_lock<std::mutex> lock(flightRecorderState.writerMut);
+  while (!flightRecorderState.writerStop) {
+    flightRecorderState.writerCv.wait_for(lock, std::chrono::milliseconds(R_TRACE_WRITE_INTERVAL_MS), []() {
+      return flightRecorderState.writerPending || flightRecorderState.writerStop;
+    });
+    if (flightRecorderState.writerStop) break;
+    bool dump = flightRecorderState.writerPending || flightRecorderState.dumpRequested.exchange(false);
+    flightRecorderState.writerPending = false;
+    if (!dump) continue;
+    lock.unlock();
+    dumpFlightRecorder("");
+    lock.lock();
+  }
+}
 
-      int parentIdx = -1;
-      for (int k = 0; k < count; k++) {
-        if (parents[origIdx] == order[k])
-          parentIdx = k;
-      }
-      int toIdx = parentIdx + 1;
-      if (toIdx > i) toIdx--;
-      std::pair<std::string, MeasurmentInfo> measure = measureVector[i];
-      measureVector.erase(measureVector.begin() + i);
-      measureVector.insert(measureVector.begin() + toIdx, measure);
+inline void startFlightRecorderWriter() {
+  std::lock_guard<std::mutex> controlLock(flightRecorderState.writerControlMut);
+  if (!flightRecorderState.writer.joinable()) {
+    flightRecorderState.writer = std::thread(flightRecorderWriterLoop);
+  }
+}
 
-      int orderVal = order[i];
-      order.erase(order.begin() + i);
-      order.insert(order.begin() + toIdx, orderVal);
+inline void flightRecorderSignalHandler(int) {
+  flightRecorderState.dumpRequested.store(true);
+}
+#endif
 
-      levels[origIdx] = 0;
-      i++;
-    }
+void benchmarkStartFlightRecorder(const std::string &dumpJsonPath, double keepSeconds, size_t eventsPerThread) {
+#ifndef BENCHMARK_DISABLED
+  std::unique_lock<std::mutex> lock(mut);
+  flightRecorderState.enabled = false;
+  for (auto &kv : measurementThreadMap) {
+    std::lock_guard<std::mutex> groupLock(kv.second->flightRecorderMut);
+    kv.second->flightRecorder.reset(nullptr);
   }
+  flightRecorderState.dumpPath = dumpJsonPath;
+  flightRecorderState.keepTime = static_cast<timestamp_t>(keepSeconds * 1000000.);
+  flightRecorderState.eventsPerThread = eventsPerThread;
+  flightRecorderState.dumpIndex = 0;
+  flightRecorderState.lastDumpTime = 0;
+  flightRecorderState.enabled = true;
+  lock.unlock();
+  startFlightRecorderWriter();
 #endif
 }
 
-static
-std::unordered_map<std::string, MeasurmentInfo> unionMeasurments() {
-//  объеденяем все замеры в один результат
-  if (measurmentThreadMap.empty()) {
-    return {};
-  }
-  std::unordered_map<std::string, MeasurmentInfo> res;
-  for (auto &threadMeasurments : measurmentThreadMap) {
-    const auto &measurmentsMap = threadMeasurments.second->map;
-    if (res.empty()) {
-      res = measurmentsMap;
-    } else {
-      for (const auto &measure: measurmentsMap) {
-        if (res.count(measure.first) == 0) {
-          res[measure.first] = measure.second;
-        } else {
-          auto &destMeasure = res[measure.first];
-          destMeasure.totalTime += measure.second.totalTime;
-          destMeasure.timesExecuted += measure.second.timesExecuted;
-        }
-      }
+void benchmarkStopFlightRecorder() {
+#ifndef BENCHMARK_DISABLED
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    flightRecorderState.enabled = false;
+    for (auto &kv : measurementThreadMap) {
+      std::lock_guard<std::mutex> groupLock(kv.second->flightRecorderMut);
+      kv.second->flightRecorder.reset(nullptr);
     }
   }
-  return res;
+  flightRecorderState.stopWriter();
+#endif
 }
 
-static
-void formGrid(const std::vector<std::vector<std::string>> &rows, std::ostream &out) {
-  std::vector<int> maxLengths;
-  for (const std::vector<std::string> &row : rows) {
-    for (size_t i = 0; i < row.size(); i++) {
-      int s = (int)row[i].size();
-      if (i >= maxLengths.size()) {
-        maxLengths.push_back(s);
-      } else if (maxLengths[i] < s){
-        maxLengths[i] = s;
-      }
-    }
-  }
+bool benchmarkDumpFlightRecorder(const std::string &jsonPath) {
+#ifndef BENCHMARK_DISABLED
+  return dumpFlightRecorder(jsonPath);
+#else
+  return false;
+#endif
+}
 
-  int border = 1;
-  for (const std::vector<std::string> &row : rows) {
-    for (size_t i = 0; i < row.size(); i++) {
-      auto alignment = i == 0 ? std::left : std::right;
-      out << std::setw(maxLengths[i] + border) << alignment << row[i];
-    }
-    out << "\n";
-  }
+void benchmarkFlightRecorderDumpOnSignal(int signalNumber) {
+#ifndef BENCHMARK_DISABLED
+  std::signal(signalNumber, flightRecorderSignalHandler);
+#endif
 }
 
-template<typename T>
-inline std::string formatString(std::stringstream &ss, T val) {
-  ss.str("");
-  ss << val;
-  return ss.str();
+void benchmarkFlightRecorderDumpOnSlowSpan(double thresholdMs) {
+#ifndef BENCHMARK_DISABLED
+  flightRecorderState.slowSpanThreshold = thresholdMs <= 0 ? 0 : static_cast<timestamp_t>(thresholdMs * 1000.);
+#endif
 }
 
-void generateTableOutput(const std::vector <std::pair<std::string, MeasurmentInfo>> &measureVector, const Field &withoutFields,
-                           double totalExecutionTime, std::ostream &out);
-void generateJsonOutput(const std::vector <std::pair<std::string, MeasurmentInfo>> &measureVector, const Field &withoutFields,
-                           double totalExecutionTime, std::ostream &out);
+// Sampler
+#if !defined(BENCHMARK_DISABLED) && defined(R_BENCHMARK_SAMPLER_SUPPORTED)
+/// Адрес прерванной инструкции, `nullptr` на неизвестной архитектуре
+inline void *interruptedAddress(void *context) {
+  auto *ucontext = static_cast<ucontext_t *>(context);
+#if defined(__linux__) && defined(__x86_64__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__linux__) && defined(__i386__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext.gregs[REG_EIP]);
+#elif defined(__linux__) && defined(__aarch64__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext.pc);
+#elif defined(__APPLE__) && defined(__x86_64__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext->__ss.__rip);
+#elif defined(__APPLE__) && defined(__aarch64__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext->__ss.__pc);
+#else
+  (void)ucontext;
+  return nullptr;
+#endif
+}
 
-std::string benchmarkLog(Field withoutFields, Format format, std::ostream *out) {
-#ifndef BENCHMARK_DISABLED
-  std::string errorMsgString;
-  if (errorMsg.popError(errorMsgString)) {
-    std::string msg = "\n=============== Benchmark Error ===============\n";
-    msg += errorMsgString;
-    msg += "\n===============================================\n";
-    benchmarkReset();
-    if (out) {
-      *out << msg;
-      return "";
+/// Только async-signal-safe действия: чтение ucontext и запись в буфер своего потока без блокировок и выделения памяти
+inline void samplerSignalHandler(int, siginfo_t *, void *context) {
+  int savedErrno = errno;
+  MeasurementGroup *group = samplerGroup;
+  SampleBuffer *buffer = group ? group->sampleBuffer.load(std::memory_order_acquire) : nullptr;
+  uint32_t nodeId = group ? group->currentNodeId.load(std::memory_order_relaxed) : 0;
+  void *address = interruptedAddress(context);
+  // вне замеров сэмплы не нужны
+  if (buffer && nodeId != 0 && address && samplerState.enabled.load(std::memory_order_relaxed)) {
+    size_t write = buffer->writeIdx.load(std::memory_order_relaxed);
+    if (write - buffer->readIdx.load(std::memory_order_acquire) >= R_BENCHMARK_SAMPLER_CAPACITY) {
+      buffer->dropped.fetch_add(1, std::memory_order_relaxed);
     } else {
-      return msg;
+      Sample &sample = buffer->samples[write % R_BENCHMARK_SAMPLER_CAPACITY];
+      sample.nodeId = nodeId;
+      sample.address = address;
+      buffer->writeIdx.store(write + 1, std::memory_order_release);
     }
   }
+  errno = savedErrno;
+}
+#endif
 
-  std::vector<std::pair<std::string, MeasurmentInfo>> measureVector;
-  {
-    std::lock_guard<std::mutex> lock(mut);
-    const auto measurements = unionMeasurments();
-    for (const auto &k: measurements)
-      measureVector.emplace_back(k);
-  }
-
-  sort(measureVector.begin(), measureVector.end(),
-       [](const std::pair<std::string, MeasurmentInfo> &a, const std::pair<std::string, MeasurmentInfo> &b) -> bool {
-         return a.second.totalTime > b.second.totalTime;
-       });
-
-
-  double totalExecutionTime = 0;
-  totalExecutionTime = getTotalExecutionTime(measureVector);
-  sortAsThree(measureVector);
+bool benchmarkStartSampler(int frequencyHz, size_t topFunctions) {
+#if !defined(BENCHMARK_DISABLED) && defined(R_BENCHMARK_SAMPLER_SUPPORTED)
+  if (frequencyHz <= 0) return false;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = samplerSignalHandler;
+  action.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, nullptr);
 
-  std::stringstream result;
-  if (out == nullptr) {
-    out = &result;
+  std::lock_guard<std::mutex> lock(mut);
+  std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+  samplerState.topFunctions = std::max(topFunctions, (size_t)1);
+  samplerState.intervalNs = std::max(1L, 1000000000L / frequencyHz);
+  for (auto &kv : measurementThreadMap) {
+    if (!kv.second->sampleBuffer.load()) kv.second->sampleBuffer = new SampleBuffer();
   }
-  switch (format) {
-    case Format::table:
-      generateTableOutput(measureVector, withoutFields, totalExecutionTime, *out);
-      break;
-    case Format::json:
-      generateJsonOutput(measureVector, withoutFields, totalExecutionTime, *out);
-      break;
+  samplerState.enabled = true;
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  // таймер на каждый зарегистрированный поток, новые потоки получают таймер в getMeasurementGroup
+  for (auto &kv : measurementThreadMap) {
+    if (kv.first == std::thread::id()) continue; // группа завершившихся потоков
+    stopSamplerTimerLocked(*kv.second);
+    startSamplerTimerLocked(*kv.second);
+  }
+#else
+  // ITIMER_PROF считает процессорное время процесса, сигнал получает поток, который сейчас работает
+  long intervalUs = std::max(1L, samplerState.intervalNs / 1000);
+  itimerval timer;
+  timer.it_interval.tv_sec = intervalUs / 1000000;
+  timer.it_interval.tv_usec = intervalUs % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+    samplerState.enabled = false;
+    samplerState.intervalNs = 0;
+    return false;
   }
-  return result.str();
+#endif
+  return true;
 #else
-  return string();
+  (void)frequencyHz;
+  (void)topFunctions;
+  return false;
 #endif
 }
 
-void generateTableOutput(const std::vector <std::pair<std::string, MeasurmentInfo>> &measureVector, const Field &withoutFields,
-                           double totalExecutionTime, std::ostream &out) {
-  std::vector<std::vector<std::string>> rows;
-  rows.reserve(measureVector.size());
-  std::stringstream ss;
+void benchmarkStopSampler() {
+#if !defined(BENCHMARK_DISABLED) && defined(R_BENCHMARK_SAMPLER_SUPPORTED)
+  std::lock_guard<std::mutex> lock(mut);
+  std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  for (auto &kv : measurementThreadMap) {
+    stopSamplerTimerLocked(*kv.second);
+  }
+#else
+  itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+  samplerState.intervalNs = 0;
+  // обработчик остается: уже отправленный SIGPROF с действием по умолчанию завершил бы процесс
+  samplerState.enabled = false;
+#endif
+}
 
-  for (auto const &k : measureVector) {
-    std::vector<std::string> row;
-    row.push_back(std::string(k.second.level*2, ' ') + k.first + ":");
+} // namespace roadar
 
-    double totalTime = k.second.totalTime;
-    double childrenTime = k.second.childrenTime;
-    unsigned long timesExecuted = k.second.timesExecuted;
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
 
-    double lastTimesTotal = 0;
-    unsigned long avaiableLastMeasurmentCount = k.second.startNTimesIdx < CAPTURE_LAST_N_TIMES
-                                                    ? k.second.startNTimesIdx
-                                                    : CAPTURE_LAST_N_TIMES;
-    for (unsigned long i = 0; i < avaiableLastMeasurmentCount; i++)
-      lastTimesTotal += k.second.lastNTimes[i];
+namespace roadar {
 
-    double lastTimes = avaiableLastMeasurmentCount == 0 ? 0.0 : (lastTimesTotal / (double)avaiableLastMeasurmentCount);
-    double avg = timesExecuted == 0 ? 0.0 : (totalTime / (double)timesExecuted);
-    double percent = totalExecutionTime == 0 ? 0 : totalTime / totalExecutionTime;
-    double missed = (totalExecutionTime == 0 || childrenTime == 0) ? 0 : std::max(0.0, totalTime - childrenTime) / totalExecutionTime;
+typedef std::pair<std::string, std::function<void()>> HarnessEntry;
 
-    ss << std::setprecision(2) << std::fixed;
-    if (!static_cast<bool>(withoutFields & Field::total)) {
-      row.emplace_back("   total:");
-      row.emplace_back(formatString(ss, totalTime / 1000.));
-    }
-    if (!static_cast<bool>(withoutFields & Field::times)) {
-      row.emplace_back("   times:");
-      row.emplace_back(formatString(ss, timesExecuted));
-    }
-    if (!static_cast<bool>(withoutFields & Field::average)) {
-      row.emplace_back("   avg:");
-      row.emplace_back(formatString(ss, avg / 1000.));
-    }
-    if (!static_cast<bool>(withoutFields & Field::lastAverage)) {
-      row.emplace_back("   last avg:");
-      row.emplace_back(formatString(ss, lastTimes / 1000.));
-    }
+inline std::mutex harnessMut;
+inline std::vector<HarnessEntry> harnessEntries;
 
-    ss << std::setprecision(1) << std::fixed;
-    if (!static_cast<bool>(withoutFields & Field::percent)) {
-      row.emplace_back("   percent:");
-      row.emplace_back(formatString(ss, int(percent * 1000) / 10.) + " %");
-    }
-    if (!static_cast<bool>(withoutFields & Field::percentMissed)) {
-      row.emplace_back("   missed:");
-      row.emplace_back(formatString(ss, int(missed * 1000) / 10.) + " %");
+void benchmarkRegister(const std::string &identifier, std::function<void()> callable) {
+  std::lock_guard<std::mutex> lock(harnessMut);
+  for (auto &entry : harnessEntries) {
+    if (entry.first == identifier) {
+      entry.second = std::move(callable);
+      return;
     }
+  }
+  harnessEntries.emplace_back(identifier, std::move(callable));
+}
+
+#ifndef BENCHMARK_DISABLED
+/// Таблица с выровненными колонками, как в benchmarkLog
+R_FUNC
+void formGrid(const std::vector<std::vector<std::string>> &rows, std::ostream &out);
 
-    rows.push_back(move(row));
+/// Пауза замеров потока на время подбора итераций и прогрева, снимается и при исключении из участка
+struct HarnessPause {
+  HarnessPause() {
+    benchmarkPauseThread(true);
+  }
+  ~HarnessPause() {
+    benchmarkPauseThread(false);
   }
+  HarnessPause(const HarnessPause &) = delete;
+  HarnessPause &operator=(const HarnessPause &) = delete;
+};
 
-  out << "\n================== Benchmark ==================\n";
-  formGrid(rows, out);
-  out << "===============================================\n";
+/// Время в наносекундах, точнее чем таймер замеров
+inline double runIterations(const std::function<void()> &callable, unsigned long iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++) {
+    callable();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
 }
 
-void generateJsonOutput(const std::vector <std::pair<std::string, MeasurmentInfo>> &measureVector, const Field &withoutFields,
-                        double totalExecutionTime, std::ostream &out) {
-  std::stringstream ss;
-
-  for (size_t i = 0; i < measureVector.size(); i++) {
-    const auto &name = measureVector[i].first;
-    const auto &info = measureVector[i].second;
-    if (i == 0) {
-      out << "[{";
+inline unsigned long chooseIterations(const std::function<void()> &callable, double minTimeNs) {
+  unsigned long iterations = 1;
+  while (true) {
+    double time = runIterations(callable, iterations);
+    if (time >= minTimeNs || iterations >= (1UL << 30)) {
+      return iterations;
     }
+    // как в google/benchmark: растем с запасом, но не больше чем в 10 раз за шаг
+    double multiplier = time <= 0 ? 10.0 : std::min(10.0, std::max(2.0, minTimeNs * 1.4 / time));
+    iterations = static_cast<unsigned long>(std::ceil(iterations * multiplier));
+  }
+}
 
-    double totalTime = info.totalTime;
-    double childrenTime = info.childrenTime;
-    unsigned long timesExecuted = info.timesExecuted;
+inline double quantile(const std::vector<double> &sorted, double q) {
+  if (sorted.empty()) return 0;
+  double pos = q * (sorted.size() - 1);
+  size_t idx = static_cast<size_t>(pos);
+  if (idx + 1 >= sorted.size()) return sorted.back();
+  return sorted[idx] + (sorted[idx + 1] - sorted[idx]) * (pos - idx);
+}
 
-    double lastTimesTotal = 0;
-    unsigned long availableLastMeasurementCount = info.startNTimesIdx < CAPTURE_LAST_N_TIMES
-                                                ? info.startNTimesIdx
-                                                : CAPTURE_LAST_N_TIMES;
-    for (unsigned long ii = 0; ii < availableLastMeasurementCount; ii++)
-      lastTimesTotal += info.lastNTimes[ii];
+/// Критическое значение t-распределения Стьюдента (двусторонний интервал)
+inline double studentT(int degreesOfFreedom, double confidence) {
+  static const double t90[] = {6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812,
+                               1.796, 1.782, 1.771, 1.761, 1.753, 1.746, 1.740, 1.734, 1.729, 1.725};
+  static const double t95[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                               2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086};
+  static const double t99[] = {63.657, 9.925, 5.841, 4.604, 4.032, 3.707, 3.499, 3.355, 3.250, 3.169,
+                               3.106, 3.055, 3.012, 2.977, 2.947, 2.921, 2.898, 2.878, 2.861, 2.845};
+  const double *table = t95;
+  double z = 1.960;
+  if (confidence >= 0.985) {
+    table = t99;
+    z = 2.576;
+  } else if (confidence < 0.925) {
+    table = t90;
+    z = 1.645;
+  }
+  if (degreesOfFreedom <= 0) return 0;
+  if (degreesOfFreedom <= 20) return table[degreesOfFreedom - 1];
+  return z;
+}
 
-    double lastTimes =
-            availableLastMeasurementCount == 0 ? 0.0 : (lastTimesTotal / (double) availableLastMeasurementCount);
-    double avg = timesExecuted == 0 ? 0.0 : (totalTime / (double) timesExecuted);
-    double percent = totalExecutionTime == 0 ? 0 : totalTime / totalExecutionTime;
-    double missed = (totalExecutionTime == 0 || childrenTime == 0) ? 0 : std::max(0.0, totalTime - childrenTime) /
-                                                                         totalExecutionTime;
+inline HarnessResult runHarnessEntry(const HarnessEntry &entry, const HarnessOptions &options) {
+  const std::string &identifier = entry.first;
+  const std::function<void()> &callable = entry.second;
 
-    ss << std::setprecision(2) << std::fixed;
-    out << "\"name\":\"" << name << "\",";
-    if (!static_cast<bool>(withoutFields & Field::total)) {
-      out << "\"total\":" << formatString(ss, totalTime / 1000.);
-    }
-    if (!static_cast<bool>(withoutFields & Field::times)) {
-      out << ",\"times\":" << formatString(ss, timesExecuted);
-    }
-    if (!static_cast<bool>(withoutFields & Field::average)) {
-      out << ",\"avg\":" << formatString(ss, avg / 1000.);
-    }
-    if (!static_cast<bool>(withoutFields & Field::lastAverage)) {
-      out << ",\"last avg\":" << formatString(ss, avg / 1000.);
+  unsigned long iterations;
+  {
+    HarnessPause pause;
+    iterations = chooseIterations(callable, options.minTimeMs * 1e6);
+    for (int i = 0; i < options.warmupRepetitions; i++) {
+      runIterations(callable, iterations);
     }
+  }
 
-    ss << std::setprecision(1) << std::fixed;
-    if (!static_cast<bool>(withoutFields & Field::percent)) {
-      out << ",\"percent\":" << formatString(ss, int(percent * 1000) / 10.);
-    }
-    if (!static_cast<bool>(withoutFields & Field::percentMissed)) {
-      out << ",\"missed\":" << formatString(ss, int(missed * 1000) / 10.);
-    }
+  std::vector<double> times; // время одной итерации, нс
+  for (int i = 0; i < std::max(options.repetitions, 1); i++) {
+    benchmarkStart(identifier);
+    double time = runIterations(callable, iterations);
+    benchmarkStopBatch(identifier, iterations);
+    times.push_back(time / iterations);
+  }
 
-    // make children nesting
-    if (i+1 == measureVector.size()) {
-      out << "}";
-      for (int l = 0; l < info.level; l++) {
-        out << "]}";
-      }
-    } else {
-      auto nextLevel = measureVector[i+1].second.level;
-      if (nextLevel > info.level) {
-        out << ",\"children\":[{";
-      } else if (nextLevel == info.level) {
-        out << "},{";
-      } else { // nextLevel < info.level; // close previous children
-        out << "}";
-        for (int l = 0; l < info.level - nextLevel; l++) {
-          out << "]}";
-        }
-        out << ",{";
+  std::vector<double> sorted = times;
+  std::sort(sorted.begin(), sorted.end());
+  int outliers = 0;
+  if (options.outlierIqr > 0 && sorted.size() >= 4) {
+    double q1 = quantile(sorted, 0.25);
+    double q3 = quantile(sorted, 0.75);
+    double low = q1 - options.outlierIqr * (q3 - q1);
+    double high = q3 + options.outlierIqr * (q3 - q1);
+    std::vector<double> kept;
+    for (double time : sorted) {
+      if (time >= low && time <= high) {
+        kept.push_back(time);
+      } else {
+        outliers++;
       }
     }
+    sorted.swap(kept);
   }
-  out << "]";
+
+  double n = static_cast<double>(sorted.size());
+  double mean = 0;
+  for (double time : sorted) mean += time;
+  mean /= n;
+  double variance = 0;
+  for (double time : sorted) variance += (time - mean) * (time - mean);
+  variance = n > 1 ? variance / (n - 1) : 0;
+  double stdDev = std::sqrt(variance);
+  double halfWidth = studentT((int)sorted.size() - 1, options.confidence) * stdDev / std::sqrt(n);
+
+  HarnessResult result;
+  result.identifier = identifier;
+  result.iterations = iterations;
+  result.repetitions = (int)sorted.size();
+  result.outliers = outliers;
+  result.meanMs = mean / 1e6;
+  result.medianMs = quantile(sorted, 0.5) / 1e6;
+  result.stdMs = stdDev / 1e6;
+  result.ciLowMs = (mean - halfWidth) / 1e6;
+  result.ciHighMs = (mean + halfWidth) / 1e6;
+  return result;
 }
 
-void benchmarkStartTracing(const std::string &writeJsonPath, const std::string &file, int line) {
-  std::lock_guard<std::mutex> lock(mut);
-  std::string err;
-  tracing = std::unique_ptr<Tracing::Serializer>(new Tracing::Serializer(writeJsonPath, false, err));
-  if (!err.empty()) {
-    tracing.reset(nullptr);
-    errorMsg.update(err, file, line);
+inline void printHarnessResults(const std::vector<HarnessResult> &results, const HarnessOptions &options, std::ostream &out) {
+  std::vector<std::vector<std::string>> rows;
+  std::stringstream ss;
+  ss << std::setprecision(6) << std::fixed;
+  auto format = [&ss](double val) -> std::string {
+    ss.str("");
+    ss << val;
+    return ss.str();
+  };
+  for (const auto &result : results) {
+    std::vector<std::string> row;
+    row.push_back(result.identifier + ":");
+    row.push_back("   iterations:");
+    row.push_back(std::to_string(result.iterations));
+    row.push_back("   reps:");
+    row.push_back(std::to_string(result.repetitions) + " (-" + std::to_string(result.outliers) + ")");
+    row.push_back("   mean:");
+    row.push_back(format(result.meanMs));
+    row.push_back("   median:");
+    row.push_back(format(result.medianMs));
+    row.push_back("   std:");
+    row.push_back(format(result.stdMs));
+    row.push_back("   ci " + std::to_string(int(options.confidence * 100 + 0.5)) + "%:");
+    row.push_back(format(result.ciLowMs) + " .. " + format(result.ciHighMs));
+    rows.push_back(std::move(row));
   }
+
+  out << "\n=================== Harness ===================\n";
+  formGrid(rows, out);
+  out << "===============================================\n";
 }
-void benchmarkStopTracing() {
-  std::lock_guard<std::mutex> lock(mut);
-  tracing.reset(nullptr);
-}
+#endif
 
-void benchmarkTracingThreadName(const std::string &name) {
-  if (tracing) tracing->writeThreadName(std::this_thread::get_id(), name);
+std::vector<HarnessResult> benchmarkRunRegistered(const HarnessOptions &options, const std::string &filter, std::ostream *out) {
+  std::vector<HarnessResult> results;
+#ifndef BENCHMARK_DISABLED
+  std::vector<HarnessEntry> entries;
+  {
+    std::lock_guard<std::mutex> lock(harnessMut);
+    entries = harnessEntries;
+  }
+  for (const auto &entry : entries) {
+    if (!filter.empty() && entry.first.find(filter) == std::string::npos) continue;
+    results.push_back(runHarnessEntry(entry, options));
+  }
+  if (out) {
+    printHarnessResults(results, options, *out);
+  }
+#endif
+  return results;
 }
 
 } // namespace roadar
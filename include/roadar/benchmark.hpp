@@ -6,6 +6,18 @@
 #pragma once
 
 #include <string>
+#include <type_traits>
+#include <functional>
+#include <vector>
+#include <ostream>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define R_BENCHMARK_COROUTINES
+#endif
+#endif
 
 #define R_FUNC
 
@@ -24,13 +36,45 @@
 #define R_BENCHMARK_SCOPED_RESET(_identifier_) r_bench.reset(_identifier_)
 #define R_BENCHMARK_SCOPED_L(_identifier_) R_HIDDEN_SCOPED_L_(_identifier_, __LINE__)
 
+// замеры по категориям: политика категории выбирается при компиляции, см. CategoryPolicy
+#define R_BENCHMARK_CATEGORY(_category_, _mode_, _sample_every_)                                  \
+ namespace roadar { namespace category { struct _category_; }                                     \
+ template <> struct CategoryPolicy<category::_category_> {                                        \
+   static constexpr CategoryMode mode = CategoryMode::_mode_;                                     \
+   static constexpr unsigned sampleEvery = (_sample_every_) > 0 ? (_sample_every_) : 1;           \
+ }; }
+// идентификатор вычисляется только если категория записывается
+#define R_HIDDEN_CAT_L__(_category_, _identifier_, line)                                          \
+ roadar::CategoryScopedBenchmark<roadar::category::_category_> r_bench_cat##line(                 \
+   [&]() -> decltype((_identifier_)) { return (_identifier_); })
+#define R_HIDDEN_CAT_L_(_category_, _identifier_, line) R_HIDDEN_CAT_L__(_category_, _identifier_, line)
+#define R_BENCHMARK_CAT(_category_, _identifier_) R_HIDDEN_CAT_L_(_category_, _identifier_, __LINE__)
+
+// замер внутри C++20 корутины, см. CoroutineSpan
+#define R_BENCHMARK_COROUTINE(_identifier_) roadar::CoroutineSpan r_bench_co(_identifier_)
+#define R_CO_AWAIT(...) (co_await r_bench_co.await(__VA_ARGS__))
+
 #define R_BENCHMARK_LOG(_without_fields_, ...) roadar::benchmarkLog(_without_fields_, ##__VA_ARGS__)
 #define R_BENCHMARK_RESET() roadar::benchmarkReset()
 
+#define R_COUNTER(_identifier_, _value_) roadar::benchmarkCounter(_identifier_, _value_)
+#define R_BENCHMARK_REGISTER(_identifier_, _callable_) roadar::benchmarkRegister(_identifier_, _callable_)
+#define R_BENCHMARK_ARG(_key_, _value_) roadar::benchmarkSpanArg(_key_, _value_)
+#define R_BENCHMARK_BUDGET(_identifier_, _max_ms_) roadar::benchmarkSetBudget(_identifier_, _max_ms_)
+
 // To view result of tracing use https://ui.perfetto.dev/
 #define R_TRACING_START(_file_name_) roadar::benchmarkStartTracing(_file_name_, __FILE__, __LINE__)
 #define R_TRACING_STOP() roadar::benchmarkStopTracing()
+#define R_TRACING_START_BINARY(_file_name_, _capacity_mb_) roadar::benchmarkStartBinaryTracing(_file_name_, _capacity_mb_, __FILE__, __LINE__)
 #define R_TRACING_THREAD_NAME(_thread_name_) roadar::benchmarkTracingThreadName(_thread_name_)
+#define R_THREAD_NAME(_thread_name_) roadar::benchmarkThreadName(_thread_name_)
+
+#define R_FLIGHT_RECORDER_START(_dump_file_name_, _keep_seconds_) roadar::benchmarkStartFlightRecorder(_dump_file_name_, _keep_seconds_)
+#define R_FLIGHT_RECORDER_STOP() roadar::benchmarkStopFlightRecorder()
+#define R_FLIGHT_RECORDER_DUMP() roadar::benchmarkDumpFlightRecorder()
+
+#define R_SAMPLER_START(_frequency_hz_) roadar::benchmarkStartSampler(_frequency_hz_)
+#define R_SAMPLER_STOP() roadar::benchmarkStopSampler()
 
 #else
 #define R_BENCHMARK_START(_identifier_)
@@ -39,11 +83,26 @@
 #define R_BENCHMARK_SCOPED(_identifier_)
 #define R_BENCHMARK_SCOPED_RESET(_identifier_)
 #define R_BENCHMARK_SCOPED_L(_identifier_)
+#define R_BENCHMARK_CATEGORY(_category_, _mode_, _sample_every_)
+#define R_BENCHMARK_CAT(_category_, _identifier_)
+#define R_BENCHMARK_COROUTINE(_identifier_)
+#define R_CO_AWAIT(...) (co_await (__VA_ARGS__))
 #define R_BENCHMARK_LOG(_without_fields_) "Benchmark disabled"
 #define R_BENCHMARK_RESET()
+#define R_COUNTER(_identifier_, _value_)
+#define R_BENCHMARK_REGISTER(_identifier_, _callable_)
+#define R_BENCHMARK_ARG(_key_, _value_)
+#define R_BENCHMARK_BUDGET(_identifier_, _max_ms_)
 #define R_TRACING_START(_file_name_)
 #define R_TRACING_STOP()
+#define R_TRACING_START_BINARY(_file_name_, _capacity_mb_)
 #define R_TRACING_THREAD_NAME(_name_)
+#define R_THREAD_NAME(_name_)
+#define R_FLIGHT_RECORDER_START(_dump_file_name_, _keep_seconds_)
+#define R_FLIGHT_RECORDER_STOP()
+#define R_FLIGHT_RECORDER_DUMP()
+#define R_SAMPLER_START(_frequency_hz_)
+#define R_SAMPLER_STOP()
 #endif
 
 //!
@@ -65,14 +124,145 @@ namespace roadar {
 * \return Всегда возвращает `true`
 */
   R_FUNC
-  bool benchmarkStart(const std::string &identifier, const std::string &file = "", int line = 0);
+  bool benchmarkStart(const std::string &identifier, const char *file = "", int line = 0);
+  R_FUNC
+  bool benchmarkStart(const char *identifier, const char *file = "", int line = 0);
 
 /*!
 * \brief Конец бенчмарка.
 * \param[in] identifier Идентификатор.
 */
   R_FUNC
-  void benchmarkStop(const std::string &identifier, const std::string &file = "", int line = 0);
+  void benchmarkStop(const std::string &identifier, const char *file = "", int line = 0);
+  R_FUNC
+  void benchmarkStop(const char *identifier, const char *file = "", int line = 0);
+
+/*!
+* \brief Начало замера для `ScopedBenchmark`.
+* \return Описатель открытого замера для `benchmarkStopScoped`, `nullptr` если замер не открыт
+* (поток на паузе или ошибка). Повторный запуск того же замера не выделяет память.
+*/
+  R_FUNC
+  void *benchmarkStartScoped(const std::string &identifier);
+  R_FUNC
+  void *benchmarkStartScoped(const char *identifier);
+
+/*!
+* \brief Конец замера, открытого `benchmarkStartScoped`: без поиска и сравнения строк.
+*/
+  R_FUNC
+  void benchmarkStopScoped(void *handle);
+
+  /// Состояние замера, который прерывается и продолжается, возможно в другом потоке (корутины)
+  struct SuspendableSpan {
+    void *handle = nullptr;             ///< открытый отрезок, `nullptr` пока замер приостановлен
+    unsigned long long startTime = 0;   ///< начало первого отрезка
+    unsigned long long activeTime = 0;  ///< сумма закрытых отрезков
+  };
+
+/*!
+* \brief Открывает очередной отрезок прерываемого замера внутри последнего открытого замера текущего потока.
+*/
+  R_FUNC
+  void benchmarkSpanResume(SuspendableSpan &span, const std::string &identifier);
+
+/*!
+* \brief Закрывает отрезок прерываемого замера, каждый отрезок попадает в трейс отдельно.
+* \param[in] finish Последний отрезок: исполнение засчитывается со временем всех отрезков,
+* а время от начала до конца вместе с приостановками выводится в колонке `elapsed`.
+*/
+  R_FUNC
+  void benchmarkSpanSuspend(SuspendableSpan &span, bool finish = false);
+
+/*!
+* \brief Записывает значение счетчика (глубина очереди, размер кадра и т.п.).
+* В логе выводятся last/min/max/avg, при записи трейсинга сохраняется как counter трек.
+* \param[in] identifier Идентификатор счетчика.
+* \param[in] value Текущее значение.
+*/
+  R_FUNC
+  void benchmarkCounter(const std::string &identifier, double value);
+
+/*!
+* \brief Добавляет аргумент к последнему запущенному замеру текущего потока.
+* Аргументы хранятся в бинарном виде и форматируются только при записи трейсинга (`args` в Perfetto).
+* \param[in] key Имя аргумента, строковый литерал или результат `benchmarkIntern`.
+* \param[in] value Значение.
+*/
+  R_FUNC
+  void benchmarkSpanArg(const char *key, long long value);
+  R_FUNC
+  void benchmarkSpanArg(const char *key, double value);
+/*!
+* \param[in] value Строковый литерал или результат `benchmarkIntern`, строка не копируется.
+*/
+  R_FUNC
+  void benchmarkSpanArg(const char *key, const char *value);
+
+  template<typename T>
+  inline typename std::enable_if<std::is_integral<T>::value>::type
+  benchmarkSpanArg(const char *key, T value) {
+    benchmarkSpanArg(key, static_cast<long long>(value));
+  }
+  template<typename T>
+  inline typename std::enable_if<std::is_floating_point<T>::value>::type
+  benchmarkSpanArg(const char *key, T value) {
+    benchmarkSpanArg(key, static_cast<double>(value));
+  }
+
+/*!
+* \brief Сохраняет строку на все время работы программы.
+* \return Указатель, который можно передавать в `benchmarkSpanArg` без копирования.
+*/
+  R_FUNC
+  const char *benchmarkIntern(const std::string &value);
+
+/*!
+* \brief Конец бенчмарка, за время которого код был исполнен `times` раз (например, цикл из `times` итераций).
+* В статистику попадает `times` исполнений со средним временем.
+*/
+  R_FUNC
+  void benchmarkStopBatch(const std::string &identifier, unsigned long times);
+
+/*!
+* \brief Временно отключает запись замеров в текущем потоке (вызовы start/stop игнорируются).
+* Переключать только вне открытых замеров.
+*/
+  R_FUNC
+  void benchmarkPauseThread(bool paused);
+
+/*!
+* \brief Измеряет стоимость пустой пары start/stop на этой машине (в отдельном потоке).
+* Измеряются только таймер и дерево замеров: калибровка не пишется в трейсинг, flight recorder и лог.
+* После калибровки стоимость выводится в заголовке лога.
+* \return Время пары в микросекундах.
+*/
+  R_FUNC
+  double benchmarkCalibrate(int iterations = 100000);
+
+/*!
+* \brief Вычитать стоимость вложенных замеров из total, avg и missed родителей.
+* Если калибровка не проводилась, она выполнится при первом `benchmarkLog`.
+*/
+  R_FUNC
+  void benchmarkSetOverheadCompensation(bool enabled);
+
+/*!
+* \brief Сколько идентификаторов с наибольшим собственным временем выводит `View::flat`.
+* \param[in] top Число строк, 0 - все. По умолчанию 30.
+*/
+  R_FUNC
+  void benchmarkSetFlatViewTop(size_t top);
+
+/*!
+* \brief Лимиты числа узлов дерева замеров, защищают от идентификаторов вида `"request_" + std::to_string(id)`.
+* Новые идентификаторы сверх лимита записываются в общий узел `(other)` того же уровня,
+* уровни с переполнением выводятся в логе в разделе "Cardinality overflow".
+* \param[in] maxChildren Разных идентификаторов внутри одного замера (и на верхнем уровне), 0 - по умолчанию (1000).
+* \param[in] maxTotalNodes Разных путей замеров всего, 0 - по умолчанию (100000).
+*/
+  R_FUNC
+  void benchmarkSetCardinalityLimits(size_t maxChildren, size_t maxTotalNodes = 0);
 
   enum class Field {
     none          = 0,
@@ -82,7 +272,9 @@ namespace roadar {
     lastAverage   = 1<<3,   // 0x08
     running       = 1<<4,   // 0x10
     percent       = 1<<5,   // 0x20
-    percentMissed = 1<<6    // 0x30
+    percentMissed = 1<<6,   // 0x40
+    budget        = 1<<7,   // 0x80
+    drift         = 1<<8    // 0x100
   };
   R_BENCHMARK_ENUM_FLAG_OPERATORS(Field)
 
@@ -91,13 +283,95 @@ namespace roadar {
     json = 1
   };
 
+  enum class TraceCompression {
+    none = 0,
+    gzip = 1,     ///< zlib, если библиотека собрана с ним, иначе lz
+    lz = 2        ///< встроенный LZ-формат, распаковка - `trace_unpack`
+  };
+
+  enum class View {
+    tree = 0,     ///< все потоки объединены в одно дерево
+    threads = 1,  ///< дерево + замеры каждого потока и разброс между потоками (min/avg/max, imbalance = max/avg)
+    flat = 2      ///< идентификаторы по собственному времени (без вложенных замеров), сложенные по всем путям и потокам
+  };
+
+  struct BudgetViolation {
+    std::string identifier;
+    std::string path;   ///< полный путь замера, через " » "
+    double timeMs;
+    double budgetMs;
+  };
+
+/*!
+* \brief Задает бюджет времени для всех замеров с идентификатором `identifier`.
+* Превышения считаются в `benchmarkStop` (одно сравнение с порогом, сохраненным в узле),
+* выводятся в логе колонками budget/over/max и отдельным списком нарушителей.
+* \param[in] maxMs Допустимое время в миллисекундах, `<= 0` снимает бюджет.
+*/
+  R_FUNC
+  void benchmarkSetBudget(const std::string &identifier, double maxMs);
+/*!
+* \brief Callback при превышении бюджета, вызывается в потоке замера. Пустая функция отключает.
+*/
+  R_FUNC
+  void benchmarkSetBudgetCallback(std::function<void(const BudgetViolation &)> callback);
+
+  struct RegressionInfo {
+    std::string identifier;
+    std::string path;   ///< полный путь замера, через " » "
+    double baselineMs;  ///< среднее время в baseline
+    double currentMs;   ///< среднее время последних замеров
+    double drift;       ///< относительное замедление, 0.25 = на 25% медленнее
+    double score;       ///< значимость замедления (Welch t-test)
+  };
+
+/*!
+* \brief Сохраняет текущую статистику как baseline (JSON) для сравнения в следующих запусках.
+*/
+  R_FUNC
+  bool benchmarkSaveBaseline(const std::string &path, std::string *outError = nullptr);
+/*!
+* \brief Загружает baseline: файл из `benchmarkSaveBaseline` или JSON из `benchmarkLog(..., Format::json)`.
+* Последние замеры каждого узла постоянно сравниваются с baseline, в логе выводится колонка drift
+* (значимое замедление помечается `!`), при появлении замедления вызывается callback.
+*/
+  R_FUNC
+  bool benchmarkLoadBaseline(const std::string &path, std::string *outError = nullptr);
+/*!
+* \brief Пороги регрессии: замедление считается значимым, если оно не меньше `minDrift` (0.1 = 10%)
+* и отличается от baseline не меньше чем на `minScore` стандартных ошибок.
+*/
+  R_FUNC
+  void benchmarkSetRegressionThreshold(double minScore = 3.0, double minDrift = 0.1);
+/*!
+* \brief Callback при обнаружении замедления, вызывается в потоке замера. Пустая функция отключает.
+*/
+  R_FUNC
+  void benchmarkSetRegressionCallback(std::function<void(const RegressionInfo &)> callback);
+
 /*!
 * \brief Бенчмарк-лог.
+* \param[in] view `View::threads` - для каждого узла вывести замеры по потокам,
+* имена потоков задаются через `R_TRACING_THREAD_NAME` (работает и без трейсинга).
 * \return Текст лога.
 */
   R_FUNC
   std::string benchmarkLog(Field withoutFields = Field::none, Format format = Format::table,
-                           std::ostream *out = nullptr);
+                           std::ostream *out = nullptr, View view = View::tree);
+
+/*!
+* \brief Бенчмарк-лог по файлу трейсинга (`R_TRACING_START`, в том числе сжатому), например записанному не на этой машине.
+* Вложенность замеров восстанавливается в каждом потоке по началу и длительности, файл читается по одному событию.
+* \param[in] fromSec, toSec Окно в секундах от самого раннего события трейса, `toSec <= 0` - до конца.
+* Замеры на границе окна учитываются только своей частью внутри окна.
+* \param[out] outError Ошибка чтения, пусто если лог построен. Предупреждения (файл оборван,
+* вложенность части замеров приблизительна) выводятся в заголовке таблицы.
+* \return Текст лога, при ошибке чтения - текст ошибки в формате `format`.
+*/
+  R_FUNC
+  std::string benchmarkLogFromTrace(const std::string &tracePath, double fromSec = 0, double toSec = 0,
+                                    Field withoutFields = Field::none, Format format = Format::table,
+                                    std::ostream *out = nullptr, View view = View::tree, std::string *outError = nullptr);
 
 /*!
 * \brief Очищает все завершенные замеры
@@ -106,29 +380,230 @@ namespace roadar {
   void benchmarkReset();
 
 
+  /// Хранит только описатель открытого замера, идентификатор не копируется
   class ScopedBenchmark {
   public:
-    explicit ScopedBenchmark(const std::string& identifier): m_identifier(identifier) {
+    explicit ScopedBenchmark(const char *identifier) {
 #ifndef BENCHMARK_DISABLED
-      benchmarkStart(identifier);
+      m_handle = benchmarkStartScoped(identifier);
+#endif
+    }
+    explicit ScopedBenchmark(const std::string& identifier) {
+#ifndef BENCHMARK_DISABLED
+      m_handle = benchmarkStartScoped(identifier);
+#endif
+    }
+    ScopedBenchmark(const ScopedBenchmark &) = delete;
+    ScopedBenchmark &operator=(const ScopedBenchmark &) = delete;
+
+    void reset(const char *newIdentifier) {
+#ifndef BENCHMARK_DISABLED
+      benchmarkStopScoped(m_handle);
+      m_handle = benchmarkStartScoped(newIdentifier);
 #endif
     }
     void reset(const std::string& newIdentifier) {
 #ifndef BENCHMARK_DISABLED
-      benchmarkStop(m_identifier);
-      m_identifier = newIdentifier;
-      benchmarkStart(m_identifier);
+      benchmarkStopScoped(m_handle);
+      m_handle = benchmarkStartScoped(newIdentifier);
 #endif
     }
     ~ScopedBenchmark() {
 #ifndef BENCHMARK_DISABLED
-      benchmarkStop(m_identifier);
+      benchmarkStopScoped(m_handle);
 #endif
     }
+  private:
+    void *m_handle = nullptr;
+  };
+
+  enum class CategoryMode {
+    full = 0,     ///< записывается каждый вызов
+    sampled = 1,  ///< записывается каждый `sampleEvery`-й вызов в потоке
+    off = 2       ///< замер не попадает в бинарник
+  };
+
+/*!
+* \brief Политика категории замеров, задается через `R_BENCHMARK_CATEGORY(name, mode, sampleEvery)`.
+* Например, подробные замеры внутренних циклов можно выключить в release сборке,
+* оставив верхнеуровневые этапы:
+* \code
+* #ifdef NDEBUG
+* R_BENCHMARK_CATEGORY(inner, off, 1)
+* #else
+* R_BENCHMARK_CATEGORY(inner, sampled, 100)
+* #endif
+* ...
+* R_BENCHMARK_CAT(inner, "decode");
+* \endcode
+*/
+  template <typename Category>
+  struct CategoryPolicy {
+    static constexpr CategoryMode mode = CategoryMode::full;
+    static constexpr unsigned sampleEvery = 1;
+  };
+
+  /// Замер в текущем скопе, `identifier` - функция, возвращающая идентификатор
+  template <typename Category, CategoryMode Mode = CategoryPolicy<Category>::mode>
+  class CategoryScopedBenchmark {
+  public:
+    template <typename Identifier>
+    explicit CategoryScopedBenchmark(Identifier &&identifier): m_handle(benchmarkStartScoped(identifier())) {}
+    CategoryScopedBenchmark(const CategoryScopedBenchmark &) = delete;
+    CategoryScopedBenchmark &operator=(const CategoryScopedBenchmark &) = delete;
+    ~CategoryScopedBenchmark() {
+      benchmarkStopScoped(m_handle);
+    }
+  private:
+    void *m_handle;
+  };
+
+  /// Записывается только каждый `sampleEvery`-й вызов; avg и max по выборке, times и total - примерно 1/sampleEvery от полных
+  template <typename Category>
+  class CategoryScopedBenchmark<Category, CategoryMode::sampled> {
+  public:
+    template <typename Identifier>
+    explicit CategoryScopedBenchmark(Identifier &&identifier) {
+      if (counter()++ % CategoryPolicy<Category>::sampleEvery == 0) {
+        m_handle = benchmarkStartScoped(identifier());
+      }
+    }
+    CategoryScopedBenchmark(const CategoryScopedBenchmark &) = delete;
+    CategoryScopedBenchmark &operator=(const CategoryScopedBenchmark &) = delete;
+    ~CategoryScopedBenchmark() {
+      if (m_handle) benchmarkStopScoped(m_handle);
+    }
+  private:
+    void *m_handle = nullptr;
+
+    static unsigned &counter() {
+      static thread_local unsigned value = 0;
+      return value;
+    }
+  };
+
+  /// Выключенная категория: ни вызовов, ни вычисления идентификатора
+  template <typename Category>
+  class CategoryScopedBenchmark<Category, CategoryMode::off> {
+  public:
+    template <typename Identifier>
+    explicit CategoryScopedBenchmark(Identifier &&) {}
+  };
+
+#if defined(R_BENCHMARK_COROUTINES) && !defined(BENCHMARK_DISABLED)
+/*!
+* \brief Замер внутри корутины (C++20): приостановки в `co_await` не входят во время замера.
+* \code
+* R_BENCHMARK_COROUTINE("read");
+* auto data = co_await r_bench_co.await(socket.read());   // или R_CO_AWAIT(socket.read())
+* \endcode
+* Замер не держит открытых замеров потока во время приостановки, поэтому корутина может
+* продолжиться в другом потоке. ScopedBenchmark через `co_await` внутри такой корутины использовать нельзя.
+*/
+  class CoroutineSpan {
+  public:
+    explicit CoroutineSpan(std::string identifier): m_identifier(std::move(identifier)) {
+      benchmarkSpanResume(m_span, m_identifier);
+    }
+    CoroutineSpan(const CoroutineSpan &) = delete;
+    CoroutineSpan &operator=(const CoroutineSpan &) = delete;
+    ~CoroutineSpan() {
+      benchmarkSpanSuspend(m_span, true);
+    }
+
+    void suspend() {
+      if (m_span.handle) benchmarkSpanSuspend(m_span, false);
+    }
+    void resume() {
+      if (!m_span.handle) benchmarkSpanResume(m_span, m_identifier);
+    }
+
+    /// Обертка ожидания: замер приостанавливается, только если корутина действительно уходит в ожидание
+    template <typename Awaitable>
+    auto await(Awaitable &&awaitable) {
+      // временный awaiter переносится в обертку, на lvalue храним ссылку
+      using Inner = decltype(getAwaiter(std::forward<Awaitable>(awaitable)));
+      using Stored = typename std::conditional<std::is_lvalue_reference<Inner>::value, Inner,
+                                               typename std::remove_reference<Inner>::type>::type;
+      return Awaiter<Stored>{*this, getAwaiter(std::forward<Awaitable>(awaitable))};
+    }
+
   private:
     std::string m_identifier;
+    SuspendableSpan m_span;
+
+    template <typename Awaitable>
+    static decltype(auto) getAwaiter(Awaitable &&awaitable) {
+      if constexpr (requires { std::forward<Awaitable>(awaitable).operator co_await(); }) {
+        return std::forward<Awaitable>(awaitable).operator co_await();
+      } else if constexpr (requires { operator co_await(std::forward<Awaitable>(awaitable)); }) {
+        return operator co_await(std::forward<Awaitable>(awaitable));
+      } else {
+        return std::forward<Awaitable>(awaitable);
+      }
+    }
+
+    template <typename Inner>
+    struct Awaiter {
+      CoroutineSpan &span;
+      Inner inner;
+
+      bool await_ready() {
+        return inner.await_ready();
+      }
+      template <typename Promise>
+      auto await_suspend(std::coroutine_handle<Promise> handle) {
+        // после inner.await_suspend корутина может уже продолжиться в другом потоке
+        span.suspend();
+        return inner.await_suspend(handle);
+      }
+      decltype(auto) await_resume() {
+        span.resume();
+        return inner.await_resume();
+      }
+    };
+  };
+#endif
+
+  // Harness: изолированный запуск участков кода с теми же идентификаторами, что и в работе системы
+
+  struct HarnessOptions {
+    double minTimeMs = 100;      ///< минимальное время одного повтора, по нему подбирается число итераций
+    int repetitions = 10;        ///< число повторов для статистики
+    int warmupRepetitions = 1;   ///< прогревочные повторы, не попадают в статистику
+    double outlierIqr = 1.5;     ///< выбросы за границами Тьюки (Q1 - k*IQR, Q3 + k*IQR), 0 - не отбрасывать
+    double confidence = 0.95;    ///< доверительный интервал: 0.9, 0.95 или 0.99
+  };
+
+  struct HarnessResult {
+    std::string identifier;
+    unsigned long iterations;    ///< итераций в одном повторе
+    int repetitions;             ///< повторов в статистике (без выбросов)
+    int outliers;
+    double meanMs;               ///< время одной итерации
+    double medianMs;
+    double stdMs;
+    double ciLowMs;
+    double ciHighMs;
   };
 
+/*!
+* \brief Регистрирует участок кода для запуска через `benchmarkRunRegistered`.
+*/
+  R_FUNC
+  void benchmarkRegister(const std::string &identifier, std::function<void()> callable);
+
+/*!
+* \brief Запускает зарегистрированные участки кода в текущем потоке.
+* Каждый повтор записывается в общее дерево замеров под своим идентификатором (вложенные замеры - его дети),
+* поэтому результат виден и в `benchmarkLog`. Прогрев и подбор числа итераций не записываются.
+* \param[in] filter Запускаются только идентификаторы, содержащие эту подстроку.
+* \param[in] out Куда вывести таблицу результатов, `nullptr` - не выводить.
+*/
+  R_FUNC
+  std::vector<HarnessResult> benchmarkRunRegistered(const HarnessOptions &options = HarnessOptions(),
+                                                    const std::string &filter = "", std::ostream *out = nullptr);
+
 //
 /*!
 * \brief Use this function when you want to start capture tracing.
@@ -140,6 +615,83 @@ namespace roadar {
   void benchmarkStartTracing(const std::string &writeJsonPath, const std::string &file = "", int line = 0);
   R_FUNC
   void benchmarkStopTracing();
+/*!
+* \brief Сжатие файлов трейсинга и flight recorder, действует со следующего `R_TRACING_START`.
+* События форматируются и сжимаются в отдельном потоке, к пути добавляется расширение `.gz` / `.rlz`.
+* \return Сжатие, которое будет использовано: `gzip` без zlib заменяется на `lz`.
+*/
+  R_FUNC
+  TraceCompression benchmarkSetTracingCompression(TraceCompression compression);
+/*!
+* \brief Бинарный трейсинг (Linux, macOS): файл `capacityMb` отображается в память, каждый поток
+* пишет события записями по 64 байта прямо в свои чанки файла, без копирования и форматирования.
+* Записанное остается в файле и при падении процесса. Останавливается `benchmarkStopTracing`,
+* JSON для Perfetto получается инструментом `trace_convert`. Аргументы длиннее 19 символов обрезаются.
+* \return false, если файл не удалось создать или платформа не поддерживается.
+*/
+  R_FUNC
+  bool benchmarkStartBinaryTracing(const std::string &path, size_t capacityMb = 256,
+                                   const std::string &file = "", int line = 0);
+/*!
+* \brief То же, что `benchmarkThreadName`.
+*/
   R_FUNC
   void benchmarkTracingThreadName(const std::string &name);
+
+/*!
+* \brief Имя текущего потока для логов (`View::threads`) и трейсинга.
+* Имя сохраняется вместе с id потока в ОС, affinity и приоритетом и попадает в каждую следующую
+* сессию трейсинга, даже если задано до `R_TRACING_START`. Без вызова используется имя потока в ОС.
+*/
+  R_FUNC
+  void benchmarkThreadName(const std::string &name);
+
+/*!
+* \brief Flight recorder: каждый поток постоянно пишет замеры в кольцевой буфер фиксированного размера,
+* по запросу последние `keepSeconds` секунд сохраняются в файл трейсинга (https://ui.perfetto.dev/).
+* \param[in] dumpJsonPath Путь для сохранения, к каждому следующему сохранению добавляется номер: `trace_1.json`.
+* \param[in] keepSeconds Сколько последних секунд сохранять.
+* \param[in] eventsPerThread Размер кольцевого буфера каждого потока. Буфер выделяется целиком при первом
+* замере потока, событие занимает `sizeof(Tracing::TraceInfo)` (176 байт на 64-битных платформах) плюс имя
+* длиннее 15 символов: по умолчанию около 1.5 МБ на поток. Если за `keepSeconds` поток делает больше замеров,
+* сохраняются только последние `eventsPerThread`.
+*/
+  R_FUNC
+  void benchmarkStartFlightRecorder(const std::string &dumpJsonPath, double keepSeconds = 10,
+                                    size_t eventsPerThread = 1 << 13);
+  R_FUNC
+  void benchmarkStopFlightRecorder();
+/*!
+* \brief Сохраняет содержимое flight recorder.
+* \param[in] jsonPath Путь для сохранения, если пустой - используется путь из `benchmarkStartFlightRecorder`.
+* \return `false`, если flight recorder не запущен или файл не удалось записать.
+*/
+  R_FUNC
+  bool benchmarkDumpFlightRecorder(const std::string &jsonPath = "");
+/*!
+* \brief Сохранение flight recorder по сигналу (например `SIGUSR1`).
+* Обработчик только выставляет флаг, файл пишет фоновый поток flight recorder в течение `R_TRACE_WRITE_INTERVAL_MS`.
+*/
+  R_FUNC
+  void benchmarkFlightRecorderDumpOnSignal(int signalNumber);
+/*!
+* \brief Сохранение flight recorder, когда любой замер длится дольше `thresholdMs`.
+* Повторно срабатывает не чаще, чем раз в `keepSeconds`. Значение `<= 0` отключает.
+* Файл пишет фоновый поток flight recorder, `benchmarkStop` медленного замера только будит его.
+*/
+  R_FUNC
+  void benchmarkFlightRecorderDumpOnSlowSpan(double thresholdMs);
+
+/*!
+* \brief Статистический сэмплер (Linux, macOS): `frequencyHz` раз в секунду процессорного времени потока
+* `SIGPROF` прерывает поток и записывает открытый замер и адрес прерванной функции в буфер потока.
+* В Linux у каждого потока с замерами свой таймер, в macOS таймер общий на процесс.
+* Имена функций ищутся только в `benchmarkLog`, где для каждого замера выводятся `topFunctions`
+* функций, в которых поток был чаще всего. Для имен функций исполняемого файла нужна линковка с `-rdynamic`.
+* \return `false`, если сэмплер не поддерживается на платформе.
+*/
+  R_FUNC
+  bool benchmarkStartSampler(int frequencyHz = 100, size_t topFunctions = 5);
+  R_FUNC
+  void benchmarkStopSampler();
 } // namespace roadar
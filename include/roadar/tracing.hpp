@@ -5,25 +5,97 @@
 #include <fstream>
 #include <thread>
 #include <mutex>
+#include <memory>
+#include <condition_variable>
 #include <vector>
 #include <unordered_map>
 
+#ifndef R_TRACE_MAX_ARGS
+#define R_TRACE_MAX_ARGS 4
+#endif
+
+#ifndef R_TRACE_WRITE_INTERVAL_MS
+#define R_TRACE_WRITE_INTERVAL_MS 100
+#endif
+
 namespace roadar {
 namespace Tracing {
+enum class ArgType : unsigned char {
+  none = 0,
+  integer,
+  real,
+  string // pointer to string literal or interned string, never freed
+};
+
+struct TraceArg {
+  const char *key;
+  ArgType type;
+  union {
+    long long intValue;
+    double realValue;
+    const char *stringValue;
+  };
+};
+
+/// Fixed-size list of span arguments, formatted only when trace is written
+struct TraceArgs {
+  TraceArg items[R_TRACE_MAX_ARGS];
+  int count;
+
+  void set(const TraceArg &arg);
+};
+
+enum class TraceType {
+  span = 0,    // "X" event, duration of benchmark
+  counter = 1  // "C" event, value of counter at startTime
+};
+
 struct TraceInfo {
   std::string name;
   std::thread::id tid; // thread id
   unsigned long long startTime;
   unsigned long long duration;
   int stackDepth;
+  TraceType type;
+  double value; // used only for TraceType::counter
+  TraceArgs args;
+};
+
+/// Fixed-size circular buffer of the last events, used by flight recorder.
+/// Not thread safe, owner should synchronize access.
+class RingBuffer {
+public:
+  explicit RingBuffer(size_t capacity);
+
+  void push(const TraceInfo &info);
+  /// Appends events which finished not earlier than `fromTime`, oldest first
+  void collect(unsigned long long fromTime, std::vector<TraceInfo> &out) const;
+  void clear();
+
+private:
+  std::vector<TraceInfo> data_;
+  size_t next_ = 0;
+  size_t size_ = 0;
+};
+
+/// Output compression of a trace file, values match roadar::TraceCompression
+enum class Compression {
+  none = 0,
+  gzip,  // zlib; replaced by lz when the library is built without zlib
+  lz     // built-in LZ77 block format, see trace_compression.hpp
 };
 
+class CompressBuf;
+
 class Serializer {
 public:
   Serializer(const Serializer&) = delete;
   Serializer(Serializer&&) = delete;
   
-  Serializer(const std::string& filepath, bool flushOnMeasure, std::string &outErrMsg);
+  /// `background` - events are formatted and compressed by a writer thread every
+  /// R_TRACE_WRITE_INTERVAL_MS instead of being kept in memory until `end()`
+  Serializer(const std::string& filepath, bool flushOnMeasure, std::string &outErrMsg,
+             Compression compression = Compression::none, bool background = false);
   ~Serializer();
   
   void saveTrace(TraceInfo info);
@@ -31,18 +103,40 @@ public:
   void write(const TraceInfo& info, bool threadSafe = false);
   
   void writeThreadName(const std::thread::id &tid, const std::string &name);
+
+  /// Thread descriptor (`thread_name` metadata event) with OS level details in args
+  void writeThreadInfo(const std::thread::id &tid, const std::string &name, long long osTid,
+                       const std::string &affinity, int priority);
+
+  void writeProcessName(const std::string &name);
+
+  /// Formats one event as `,{...}` - the same text `write` puts into the trace file
+  static void formatEvent(std::ostream &json, const TraceInfo &info, int32_t tidIdx);
+
+  /// Returns pointer which is valid until the end of program, so it can be stored in TraceArg
+  static const char *intern(const std::string &str);
+
+  /// Contents of a JSON string: quotes, backslashes and control characters are escaped
+  static std::string escape(const std::string &str);
   
   void end();
   
 private:
-  std::mutex mut_;
+  std::mutex mut_;          // data_, closed_
+  std::mutex outMut_;       // out_, before threadIdMutex_
   std::mutex threadIdMutex_;
-  std::ofstream outStream_;
+  std::unique_ptr<CompressBuf> buf_;
+  std::unique_ptr<std::ostream> out_;
   bool flushOnMeasure_;
+  bool closed_ = false;
   std::vector<TraceInfo> data_;
+  std::thread writer_;
+  std::condition_variable writerCv_;
   std::unordered_map<std::thread::id, int32_t> threadIdxMap_;
   int32_t lastThreadIdx_ = 0;
   
+  void writerLoop();
+  void writeBatch(std::vector<TraceInfo> &batch);
   void writeHeader();
   void writeFooter();
   void write(const std::string &str, bool flush);
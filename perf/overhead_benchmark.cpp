@@ -0,0 +1,193 @@
+//
+// Measures the cost of the library itself.
+// Every result is printed as one JSON object per line, so results can be tracked across releases:
+//   {"name":"start_stop","threads":1,"depth":1,"nodes":0,"ns_per_op":57.3}
+//
+// Usage: overhead_benchmark [--quick] [--out results.jsonl]
+//
+
+
+#include <roadar/benchmark.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedNs(Clock::time_point start) {
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+struct Result {
+  std::string name;
+  int threads;
+  int depth;
+  int nodes;
+  double nsPerOp;
+};
+
+static std::vector<Result> results;
+static long long iterationsDivider = 1; // --quick: only checks that every scenario runs
+
+static void report(const std::string &name, int threads, int depth, int nodes, double nsPerOp) {
+  results.push_back({name, threads, depth, nodes, nsPerOp});
+  std::cerr << name << " threads=" << threads << " depth=" << depth << " nodes=" << nodes
+            << ": " << nsPerOp << " ns/op" << std::endl;
+}
+
+static void benchStartStop(int threadsCount) {
+  const long long iterations = 200000 / iterationsDivider;
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<double> perThread(threadsCount);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadsCount; t++) {
+    threads.emplace_back([&, t]() {
+      R_BENCHMARK_START("frame"); // warmup, node creation
+      R_BENCHMARK_STOP("frame");
+      ready++;
+      while (!go) std::this_thread::yield();
+      auto start = Clock::now();
+      for (long long i = 0; i < iterations; i++) {
+        R_BENCHMARK_START("frame");
+        R_BENCHMARK_STOP("frame");
+      }
+      perThread[t] = elapsedNs(start) / iterations;
+    });
+  }
+  while (ready < threadsCount) std::this_thread::yield();
+  go = true;
+  for (auto &thread : threads) thread.join();
+  double avg = 0;
+  for (double v : perThread) avg += v;
+  report("start_stop", threadsCount, 1, 0, avg / threadsCount);
+  R_BENCHMARK_RESET();
+}
+
+static void benchScoped() {
+  const long long iterations = 200000 / iterationsDivider;
+  { R_BENCHMARK_SCOPED("frame"); }
+  auto start = Clock::now();
+  for (long long i = 0; i < iterations; i++) {
+    R_BENCHMARK_SCOPED("frame");
+  }
+  report("scoped", 1, 1, 0, elapsedNs(start) / iterations);
+  R_BENCHMARK_RESET();
+}
+
+static void benchNesting(int depth) {
+  const long long iterations = 100000 / iterationsDivider;
+  std::vector<std::string> names;
+  for (int i = 0; i < depth - 1; i++) names.push_back("level_" + std::to_string(i));
+  for (const auto &name : names) R_BENCHMARK_START(name);
+  R_BENCHMARK_START("leaf");
+  R_BENCHMARK_STOP("leaf");
+  auto start = Clock::now();
+  for (long long i = 0; i < iterations; i++) {
+    R_BENCHMARK_START("leaf");
+    R_BENCHMARK_STOP("leaf");
+  }
+  report("start_stop_nested", 1, depth, 0, elapsedNs(start) / iterations);
+  for (auto it = names.rbegin(); it != names.rend(); ++it) R_BENCHMARK_STOP(*it);
+  R_BENCHMARK_RESET();
+}
+
+static void benchLog(int nodes) {
+  // дерево: 10 корней, остальные узлы - дети
+  int roots = std::min(nodes, 10);
+  int perRoot = nodes / roots - 1;
+  for (int r = 0; r < roots; r++) {
+    std::string root = "root_" + std::to_string(r);
+    R_BENCHMARK_START(root);
+    for (int c = 0; c < perRoot; c++) {
+      std::string child = "child_" + std::to_string(c);
+      R_BENCHMARK_START(child);
+      R_BENCHMARK_STOP(child);
+    }
+    R_BENCHMARK_STOP(root);
+  }
+  const int iterations = std::max(3, (int)(20 / iterationsDivider));
+  auto start = Clock::now();
+  size_t size = 0;
+  for (int i = 0; i < iterations; i++) {
+    size += R_BENCHMARK_LOG(roadar::Field::none).size();
+  }
+  report("log", 1, 2, nodes, elapsedNs(start) / iterations);
+  if (size == 0) std::cerr << "empty log" << std::endl;
+  R_BENCHMARK_RESET();
+}
+
+static void benchTracing(const std::string &path) {
+  const long long iterations = 100000 / iterationsDivider;
+  R_TRACING_START(path);
+  auto start = Clock::now();
+  for (long long i = 0; i < iterations; i++) {
+    R_BENCHMARK_START("traced");
+    R_BENCHMARK_STOP("traced");
+  }
+  report("tracing_record", 1, 1, 0, elapsedNs(start) / iterations);
+  start = Clock::now();
+  R_TRACING_STOP();
+  report("tracing_write", 1, 1, 0, elapsedNs(start) / iterations);
+  std::remove(path.c_str());
+  R_BENCHMARK_RESET();
+}
+
+static void benchBinaryTracing(const std::string &path) {
+  const long long iterations = 100000 / iterationsDivider;
+  if (!R_TRACING_START_BINARY(path, 64)) return;
+  auto start = Clock::now();
+  for (long long i = 0; i < iterations; i++) {
+    R_BENCHMARK_START("traced");
+    R_BENCHMARK_STOP("traced");
+  }
+  report("binary_tracing_record", 1, 1, 0, elapsedNs(start) / iterations);
+  R_TRACING_STOP();
+  std::remove(path.c_str());
+  R_BENCHMARK_RESET();
+}
+
+int main(int argc, const char * argv[]) {
+  std::string outPath;
+  bool quick = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0) {
+      quick = true;
+      iterationsDivider = 100;
+    } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+      outPath = argv[++i];
+    }
+  }
+
+  benchScoped();
+  for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+    if (quick && threads > 4) break;
+    benchStartStop(threads);
+  }
+  for (int depth : {1, 4, 16, 64}) {
+    benchNesting(depth);
+  }
+  for (int nodes : {10, 100, 1000, 10000}) {
+    if (quick && nodes > 1000) break;
+    benchLog(nodes);
+  }
+  benchTracing(outPath.empty() ? "overhead_tracing.json" : outPath + ".tracing.json");
+  benchBinaryTracing(outPath.empty() ? "overhead_tracing.rbt" : outPath + ".tracing.rbt");
+
+  std::ofstream file;
+  if (!outPath.empty()) file.open(outPath);
+  std::ostream &out = file.is_open() ? file : std::cout;
+  for (const auto &result : results) {
+    out << "{\"name\":\"" << result.name << "\",\"threads\":" << result.threads
+        << ",\"depth\":" << result.depth << ",\"nodes\":" << result.nodes
+        << ",\"ns_per_op\":" << result.nsPerOp << "}\n";
+  }
+  return 0;
+}
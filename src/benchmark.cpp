@@ -1,9 +1,14 @@
 #include <roadar/benchmark.hpp>
 #include <roadar/tracing.hpp>
+#include "json_reader.hpp"
+#include "trace_compression.hpp"
+#include "binary_trace.hpp"
+#include "trace_stats.hpp"
 #include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include <vector>
 #include <sstream>
@@ -11,15 +16,59 @@
 #include <iomanip>
 #include <chrono>
 #include <memory> // unique_ptr
+#include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <cstring>
+#include <cstdio>
 
 #ifndef _WIN32
 #include <sys/time.h>
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+#include <cerrno>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+// сэмплер берет адрес прерванной инструкции из ucontext, это зависит от архитектуры
+#if defined(__x86_64__) || defined(__aarch64__) || (defined(__linux__) && defined(__i386__))
+#define R_BENCHMARK_SAMPLER_SUPPORTED
+#endif
+#endif
+#if defined(__linux__) && defined(R_BENCHMARK_SAMPLER_SUPPORTED)
+#include <time.h>
+#define R_BENCHMARK_SAMPLER_THREAD_TIMERS // свой таймер процессорного времени у каждого потока
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid // glibc объявляет имя только с 2.35
+#endif
 #endif
 
 #ifndef CAPTURE_LAST_N_TIMES
 #define CAPTURE_LAST_N_TIMES 10
 #endif
 
+// редкие ветки (создание узла, ошибки) не встраиваются в start/stop
+#ifdef _MSC_VER
+#define R_NOINLINE __declspec(noinline)
+#else
+#define R_NOINLINE __attribute__((noinline))
+#endif
+
 
 // -------------------------------------------------
 
@@ -39,6 +88,69 @@ typedef std::unordered_map<std::string, std::unique_ptr<MeasurementInfo>> Measur
 }
 #endif
 
+inline std::string joined(const std::vector<std::string> &array, const std::string &separator = " » ") {
+  std::string joinedString;
+  for (size_t i = 0; i < array.size(); i++) {
+    if (i > 0) joinedString += separator;
+    joinedString += array[i];
+  }
+  return joinedString;
+}
+
+/// Строка для значения JSON: кавычки, обратная косая черта и управляющие символы экранируются так же, как в трейсе
+static std::string jsonEscaped(const std::string &text) {
+  return Tracing::Serializer::escape(text);
+}
+
+/// Текст для строки таблицы: переводы строк заменяются пробелами
+static std::string singleLine(std::string text) {
+  for (char &c : text) {
+    if (c == '\n' || c == '\r') c = ' ';
+  }
+  return text;
+}
+
+/*!
+ * \brief Статистика замера из сохраненного baseline, время в микросекундах.
+ */
+struct BaselineStat {
+  double avg = 0;
+  double std = 0; // 0 если в baseline нет разброса (например, обычный JSON лог)
+  double times = 0;
+};
+typedef std::unordered_map<std::string, BaselineStat> BaselineMap; // ключ - полный путь через " » "
+
+#ifndef R_BENCHMARK_CHILD_CACHE
+#define R_BENCHMARK_CHILD_CACHE 4 // последних найденных детей одного узла
+#endif
+
+/*!
+ * \brief Последние найденные дочерние узлы: повторный запуск замера, в том числе чередующихся
+ * соседних замеров одного уровня, обходится без поиска в map и копии строки.
+ */
+struct ChildCache {
+  const std::string *keys[R_BENCHMARK_CHILD_CACHE] = {}; // ключи узлов в MeasurementMap родителя
+  MeasurementInfo *nodes[R_BENCHMARK_CHILD_CACHE] = {};
+  unsigned next = 0; // запись, которую заменит следующий промах
+
+  /// Индекс записи `identifier` или -1
+  int find(const char *identifier, const std::string *identifierString) const {
+    for (int i = 0; i < R_BENCHMARK_CHILD_CACHE; i++) {
+      if (!nodes[i]) break;
+      if (identifierString ? *keys[i] == *identifierString : strcmp(keys[i]->c_str(), identifier) == 0) return i;
+    }
+    return -1;
+  }
+
+  void put(const std::string *key, MeasurementInfo *node) {
+    keys[next] = key;
+    nodes[next] = node;
+    next = (next + 1) % R_BENCHMARK_CHILD_CACHE;
+  }
+};
+
+struct CardinalityOverflow;
+
 /*!
  * \brief Информация о замерах.
  */
@@ -49,338 +161,1950 @@ struct MeasurementInfo {
   timestamp_t lastStartTime = 0;
   double lastNTimes[CAPTURE_LAST_N_TIMES] = {};
   unsigned long startNTimesIdx = 0;
+  double maxTime = 0;
+  double sumSquares = 0;
+  std::atomic<timestamp_t> budget{0}; // 0 - без бюджета, может меняться из другого потока
+  unsigned long budgetViolations = 0;
+  std::atomic<const BaselineStat *> baseline{nullptr};
+  bool regressed = false;
+  // общий для всех потоков id пути замера, см. registerNode; benchmarkReset перенумеровывает под `mut` группы
+  std::atomic<uint32_t> nodeId{0};
+  double elapsedTime = 0; // для прерываемых замеров: время от начала до конца вместе с приостановками
+  ChildCache lastChild;
+  std::shared_ptr<CardinalityOverflow> childrenOverflow; // уровень детей переполнен, новые идентификаторы - в overflowKey
   MeasurementMap children;
 };
 
-struct MeasurementGroup {
-  MeasurementGroup() = default;
-//  MeasurementGroup(MeasurementGroup const &val) {
-//    map = val.map;
-//  };
-  MeasurementMap map = {};
-  std::thread::id tid;
-  std::vector<std::string> measureKey;
-  
-  MeasurementInfo *getLast(const std::string &addNewKey = "") {
-    MeasurementMap *mapRef = &map;
-    MeasurementInfo *info = nullptr;
-    for (const auto &key : measureKey) {
-      info = mapRef->at(key).get();
-      mapRef = &(info->children);
-    }
+/*!
+ * \brief Информация о счетчике.
+ */
+struct CounterInfo {
+  double lastValue = 0;
+  double minValue = 0;
+  double maxValue = 0;
+  double sum = 0;
+  unsigned long count = 0;
+  timestamp_t lastTime = 0;
 
-    if (!addNewKey.empty()) {
-      if ((*mapRef).count(addNewKey) == 0) {
-        (*mapRef)[addNewKey] = std::unique_ptr<MeasurementInfo>(new MeasurementInfo());
-      }
-      info = (*mapRef)[addNewKey].get();
-      measureKey.push_back(addNewKey);
+  void update(double value, timestamp_t time) {
+    if (count == 0 || value < minValue) minValue = value;
+    if (count == 0 || value > maxValue) maxValue = value;
+    lastValue = value;
+    lastTime = time;
+    sum += value;
+    count++;
+  }
+
+  void merge(const CounterInfo &other) {
+    if (other.count == 0) return;
+    if (count == 0 || other.minValue < minValue) minValue = other.minValue;
+    if (count == 0 || other.maxValue > maxValue) maxValue = other.maxValue;
+    if (other.lastTime >= lastTime) {
+      lastValue = other.lastValue;
+      lastTime = other.lastTime;
     }
-    return info;
+    sum += other.sum;
+    count += other.count;
   }
 };
+typedef std::unordered_map<std::string, CounterInfo> CounterMap;
 
-class ErrorMsg {
-public:
-  ErrorMsg() = default;
-  void update(const std::string &msg, const std::string &file, int line) {
-    std::lock_guard<std::mutex> lock(mut_);
-    if (msg_.empty()) {
-      msg_ = msg;
-      if (!file.empty()) {
-        msg_ += "\nLocation: " + std::string(file) + " > line: " + std::to_string(line);
-      }
-    }
+static std::mutex budgetMut;
+static std::unordered_map<std::string, timestamp_t> budgets;
+static std::function<void(const BudgetViolation &)> budgetCallback;
+static std::atomic<bool> hasBudgetCallback{false};
+
+static timestamp_t findBudget(const std::string &identifier) {
+  std::lock_guard<std::mutex> lock(budgetMut);
+  auto it = budgets.find(identifier);
+  return it == budgets.end() ? 0 : it->second;
+}
+
+static std::mutex baselineMut;
+// загруженные baseline не удаляем, на них ссылаются узлы замеров
+static std::vector<std::unique_ptr<BaselineMap>> loadedBaselines;
+static std::atomic<const BaselineMap *> activeBaseline{nullptr};
+static std::atomic<double> regressionMinScore{3.0};
+static std::atomic<double> regressionMinDrift{0.1};
+static std::function<void(const RegressionInfo &)> regressionCallback;
+
+static const BaselineStat *findBaseline(const std::string &path) {
+  const BaselineMap *baseline = activeBaseline.load();
+  if (!baseline) return nullptr;
+  auto it = baseline->find(path);
+  return it == baseline->end() ? nullptr : &it->second;
+}
+
+/// Welch t-test: насколько текущее окно медленнее baseline (в сигмах)
+static double regressionScore(const BaselineStat &baseline, double mean, double variance, double count) {
+  double err = 0;
+  if (baseline.times > 0) err += baseline.std * baseline.std / baseline.times;
+  if (count > 0) err += variance / count;
+  double diff = mean - baseline.avg;
+  if (err <= 0) {
+    return diff > 0 ? INFINITY : 0;
   }
+  return diff / std::sqrt(err);
+}
 
-  bool popError(std::string &outMsg) {
-    std::lock_guard<std::mutex> lock(mut_);
-    if (msg_.empty()) {
-      return false;
-    }
-    outMsg = msg_;
-    msg_ = "";
-    return true;
+static bool isRegression(const BaselineStat &baseline, double mean, double variance, double count, double &outDrift, double &outScore) {
+  outDrift = baseline.avg <= 0 ? 0 : (mean - baseline.avg) / baseline.avg;
+  outScore = regressionScore(baseline, mean, variance, count);
+  return count > 0 && outDrift >= regressionMinDrift.load() && outScore >= regressionMinScore.load();
+}
+
+/*!
+ * \brief Реестр путей замеров: один id на путь для всех потоков.
+ * По id замеры потоков складываются в плоский массив без поиска по именам при слиянии.
+ * Родитель всегда получает id раньше детей, 0 - корень. Между сбросами id не удаляются,
+ * benchmarkReset строит реестр заново по оставшимся открытым замерам, см. rebuildNodeRegistryLocked.
+ */
+struct NodeDesc {
+  uint32_t parent;
+  std::string name;
+};
+static std::mutex nodeRegistryMut;
+static std::deque<NodeDesc> nodeRegistry = {{0, ""}};
+static std::vector<std::unordered_map<std::string, uint32_t>> nodeRegistryChildren(1);
+static std::atomic<uint64_t> nodeRegistryEpoch{0}; // номер перестроения реестра
+// unionMeasurements читает реестр без nodeRegistryMut, перестроение ждет окончания лога
+static std::mutex mergeMut;
+
+#ifndef R_BENCHMARK_MAX_CHILDREN
+#define R_BENCHMARK_MAX_CHILDREN 1000   // разных идентификаторов внутри одного замера (и на верхнем уровне)
+#endif
+#ifndef R_BENCHMARK_MAX_NODES
+#define R_BENCHMARK_MAX_NODES 100000    // разных путей замеров всего
+#endif
+#ifndef R_BENCHMARK_CARDINALITY_EXAMPLES
+#define R_BENCHMARK_CARDINALITY_EXAMPLES 5
+#endif
+#ifndef R_BENCHMARK_FLAT_TOP
+#define R_BENCHMARK_FLAT_TOP 30         // строк View::flat по умолчанию, см. benchmarkSetFlatViewTop
+#endif
+
+/// Замеры сверх лимитов попадают в этот узел того же уровня
+static const char *const overflowKey = "(other)";
+static std::atomic<size_t> maxChildrenPerNode{R_BENCHMARK_MAX_CHILDREN};
+static std::atomic<size_t> maxNodes{R_BENCHMARK_MAX_NODES};
+
+/*!
+ * \brief Уровень, на котором сработал лимит. До benchmarkReset (или смены лимитов) новых идентификаторов
+ * на нем не появится, поэтому поток, получивший описание уровня, решает сам, без реестра и его блокировки.
+ */
+struct CardinalityOverflow {
+  std::unordered_set<std::string> kept; // идентификаторы уровня в реестре на момент переполнения, не меняется
+  size_t maxChildren;                   // лимиты на момент переполнения
+  size_t maxNodes;
+  std::atomic<unsigned long> redirected{0}; // сколько запусков замеров попало в overflowKey
+  std::vector<std::string> examples;        // под nodeRegistryMut
+
+  bool current() const {
+    return maxChildren == maxChildrenPerNode.load(std::memory_order_relaxed) &&
+           maxNodes == ::roadar::maxNodes.load(std::memory_order_relaxed);
   }
-private:
-  std::mutex mut_;
-  std::string msg_;
 };
+static std::unordered_map<uint32_t, std::shared_ptr<CardinalityOverflow>> cardinalityOverflows; // ключ - id родителя, под nodeRegistryMut
 
-// without unique_ptr this map fails on Win machine
-static std::unordered_map<std::thread::id, std::unique_ptr<MeasurementGroup>> measurementThreadMap;
-static std::mutex mut;
-static ErrorMsg errorMsg;
-static std::unique_ptr<Tracing::Serializer> tracing;
+/// Вызывать под nodeRegistryMut
+static uint32_t addNodeLocked(uint32_t parent, const std::string &name) {
+  auto id = static_cast<uint32_t>(nodeRegistry.size());
+  nodeRegistry.push_back({parent, name});
+  nodeRegistryChildren.emplace_back();
+  // emplace_back мог переместить вектор, поэтому снова берем по индексу
+  nodeRegistryChildren[parent][name] = id;
+  return id;
+}
 
-inline MeasurementGroup &getMeasurementGroup() {
-  auto tid = std::this_thread::get_id();
-  std::lock_guard<std::mutex> lock(mut);
-  if (measurementThreadMap.count(tid) == 0) {
-    measurementThreadMap.emplace(tid, std::unique_ptr<MeasurementGroup>(new MeasurementGroup()));
-    measurementThreadMap[tid]->tid = tid;
+/*!
+ * \brief Возвращает id узла; если лимит превышен, `name` заменяется на overflowKey,
+ * а `outOverflow` - описание переполненного уровня.
+ */
+static uint32_t registerNode(uint32_t parent, std::string &name, std::shared_ptr<CardinalityOverflow> &outOverflow) {
+  std::lock_guard<std::mutex> lock(nodeRegistryMut);
+  auto &children = nodeRegistryChildren[parent];
+  auto it = children.find(name);
+  if (it != children.end()) return it->second;
+  if (name != overflowKey &&
+      (children.size() >= maxChildrenPerNode.load() || nodeRegistry.size() >= maxNodes.load())) {
+    auto &overflow = cardinalityOverflows[parent];
+    if (!overflow || !overflow->current()) {
+      std::shared_ptr<CardinalityOverflow> level(new CardinalityOverflow());
+      for (const auto &keyVal : children) level->kept.insert(keyVal.first);
+      level->maxChildren = maxChildrenPerNode.load();
+      level->maxNodes = maxNodes.load();
+      if (overflow) {
+        // лимиты поменялись: счет продолжаем
+        level->redirected = overflow->redirected.load();
+        level->examples = overflow->examples;
+      }
+      overflow = level;
+    }
+    overflow->redirected++;
+    if (overflow->examples.size() < R_BENCHMARK_CARDINALITY_EXAMPLES) {
+      overflow->examples.push_back(name);
+    }
+    outOverflow = overflow;
+    name = overflowKey;
+    it = children.find(name);
+    if (it != children.end()) return it->second;
   }
-  return *measurementThreadMap[tid].get();
+  return addNodeLocked(parent, name);
 }
 
-inline std::string joined(const std::vector<std::string> &array, const std::string &separator = " » ") {
-  std::string joinedString;
-  for (size_t i = 0; i < array.size(); i++) {
-    if (i > 0) joinedString += separator;
-    joinedString += array[i];
+/*!
+ * \brief Описание потока для логов и трейсинга, заполняется один раз при первом замере потока.
+ */
+struct ThreadInfo {
+  std::string name;      // R_THREAD_NAME или имя потока в ОС
+  long long osTid = 0;   // id потока в ОС (как в top / perf), 0 - неизвестен
+  std::string affinity;  // ядра, на которых может работать поток: "0-3,6"; пусто - неизвестно
+  int priority = 0;      // nice в Linux, приоритет планировщика в остальных ОС
+};
+
+static std::string cpuListString(const std::vector<int> &cpus) {
+  std::string result;
+  for (size_t i = 0; i < cpus.size(); ) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+    if (!result.empty()) result += ",";
+    result += std::to_string(cpus[i]);
+    if (j > i) result += "-" + std::to_string(cpus[j]);
+    i = j + 1;
   }
-  return joinedString;
+  return result;
 }
 
-bool benchmarkStart(const std::string &identifier, const std::string &file, int line) {
-#ifndef BENCHMARK_DISABLED
-  auto &group = getMeasurementGroup();
-  MeasurementInfo &info = *group.getLast(identifier);
-  if (info.lastStartTime > 0) {
-    std::string fullPath = joined(group.measureKey);
-    errorMsg.update("Benchmark already run for \"" + fullPath + "\" key", file, line);
-    return true;
+/// Вызывается в самом потоке
+static void fillCurrentThreadInfo(ThreadInfo &info) {
+#if defined(__linux__)
+  info.osTid = static_cast<long long>(syscall(SYS_gettid));
+  char name[64] = {};
+  if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0) info.name = name;
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0) {
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &cpuSet)) cpus.push_back(cpu);
+    }
+    info.affinity = cpuListString(cpus);
   }
-  info.lastStartTime = get_timestamp();
+  info.priority = getpriority(PRIO_PROCESS, static_cast<id_t>(info.osTid));
+#elif defined(__APPLE__)
+  uint64_t osTid = 0;
+  pthread_threadid_np(nullptr, &osTid);
+  info.osTid = static_cast<long long>(osTid);
+  char name[64] = {};
+  if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0) info.name = name;
+  int policy = 0;
+  sched_param param = {};
+  if (pthread_getschedparam(pthread_self(), &policy, &param) == 0) info.priority = param.sched_priority;
+#elif defined(_WIN32)
+  info.osTid = static_cast<long long>(GetCurrentThreadId());
+  info.priority = GetThreadPriority(GetCurrentThread());
 #endif
-  return true;
 }
 
-void benchmarkStop(const std::string &identifier, const std::string &file, int line) {
-#ifndef BENCHMARK_DISABLED
-  auto &group = getMeasurementGroup();
+/// Открытый замер потока
+struct OpenMeasurement {
+  MeasurementInfo *node = nullptr;
+  const std::string *key = nullptr;   // ключ узла, открытый узел не удаляется из дерева
+  std::string overflowIdentifier;     // исходный идентификатор, если замер попал в overflowKey
+  Tracing::TraceArgs args;            // аргументы для трейсинга
 
-  if (group.measureKey.size() == 0 || group.measureKey.back() != identifier) {
-    std::string lastKey = group.measureKey.empty() ? "" : group.measureKey.back();
-    std::string msg = "benchmarkStop(\"" + identifier + "\") not matched with last key \"" + lastKey + "\"";
-    errorMsg.update(msg, file, line);
-    return;
+  OpenMeasurement() {
+    args.count = 0;
   }
-
-  MeasurementInfo &info = *(group.getLast());
-  if (info.lastStartTime == 0) {
-    std::string fullPath = joined(group.measureKey);
-    errorMsg.update("Benchmark for \"" + fullPath + "\" key not started", file, line);
-    return;
+  const std::string &identifier() const {
+    return overflowIdentifier.empty() ? *key : overflowIdentifier;
   }
+};
+
+#ifndef R_BENCHMARK_SAMPLER_CAPACITY
+#define R_BENCHMARK_SAMPLER_CAPACITY 1024 // сэмплов потока между двумя benchmarkLog
+#endif
+
+/// Сэмпл: открытый замер потока и адрес прерванной инструкции, символы ищутся только при выводе
+struct Sample {
+  uint32_t nodeId;
+  void *address;
+};
 
-  group.measureKey.pop_back();
+/// Пишет только обработчик сигнала в своем потоке, читает benchmarkLog: очередь без блокировок
+struct SampleBuffer {
+  std::atomic<size_t> writeIdx{0};
+  std::atomic<size_t> readIdx{0};
+  std::atomic<unsigned long> dropped{0}; // буфер был полон
+  Sample samples[R_BENCHMARK_SAMPLER_CAPACITY];
+};
 
-  auto dt = get_timestamp() - info.lastStartTime;
-  auto ts = info.lastStartTime;
-  auto time = static_cast<double>(dt);
-  info.totalTime += time;
-  info.timesExecuted++;
-  info.lastStartTime = 0;
-  info.lastNTimes[info.startNTimesIdx % CAPTURE_LAST_N_TIMES] = time;
-  info.startNTimesIdx++;
-  if (tracing) {
-    tracing->saveTrace({identifier, group.tid, ts, dt, (int)group.measureKey.size()});
+struct MeasurementGroup {
+  MeasurementGroup() = default;
+  ~MeasurementGroup() {
+    delete sampleBuffer.load();
   }
+//  MeasurementGroup(MeasurementGroup const &val) {
+//    map = val.map;
+//  };
+  // map и counters меняет поток-владелец, читают другие потоки: доступ только под `mut`
+  std::mutex mut;
+  MeasurementMap map = {};
+  CounterMap counters = {};
+  std::thread::id tid;
+  ThreadInfo thread; // под `mut`
+  std::atomic<bool> registered{false}; // группа есть в measurementThreadMap
+  std::atomic<uint32_t> currentNodeId{0}; // id последнего открытого замера для обработчика сэмплера
+  std::atomic<SampleBuffer *> sampleBuffer{nullptr}; // создается под `::mut` при включенном сэмплере
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  pthread_t pthread = {};      // поток-владелец: его часы процессорного времени считает таймер сэмплера
+  timer_t samplerTimer = {};   // под samplerState.mut
+  bool hasSamplerTimer = false;
 #endif
-}
+  // используются только потоком-владельцем
+  std::vector<OpenMeasurement> openMeasurements;
+  ChildCache rootLastChild; // под `mut`
+  std::shared_ptr<CardinalityOverflow> rootOverflow; // под `mut`, см. MeasurementInfo::childrenOverflow
+  bool paused = false; // замеры потока временно не записываются
+  bool calibration = false; // группа benchmarkCalibrate: вне реестра и лимитов, без трейсинга, бюджетов и baseline
+  std::mutex flightRecorderMut; // защищает flightRecorder от сохранения из другого потока
+  std::unique_ptr<Tracing::RingBuffer> flightRecorder;
+  Tracing::BinaryCursor binaryCursor; // только поток-владелец
 
-void benchmarkReset() {
-#ifndef BENCHMARK_DISABLED
-  std::lock_guard<std::mutex> lock(mut);
-  for (auto &kv : measurementThreadMap) {
-    std::vector<MeasurementMap *> cleanupMap = {&(kv.second->map)};
-    
-    for (size_t idx = 0; idx < cleanupMap.size(); idx++) {
-      auto map = cleanupMap[idx];
-      for (auto it = map->begin(); it != map->end(); ) {
-        if (it->second->lastStartTime == 0) {
-          // reset info for non finished benchmarks
-          it = map->erase(it);
-        } else {
-          cleanupMap.push_back(&(it->second->children));
-          ++it;
-        }
-      }
+  /// Идентификаторы открытых замеров, от корня
+  std::vector<std::string> path() const {
+    std::vector<std::string> result;
+    for (const auto &measurement : openMeasurements) {
+      result.push_back(measurement.identifier());
     }
+    return result;
   }
 
-  for (auto it = measurementThreadMap.begin(); it != measurementThreadMap.end(); ) {
-    if (it->second->map.empty()) {
-      // no measurments for thread, cleanup
-      it = measurementThreadMap.erase(it);
-    } else {
-      ++it;
-    }
+  MeasurementInfo *getLast() {
+    return openMeasurements.empty() ? nullptr : openMeasurements.back().node;
   }
-#endif
-}
 
-// Out measurements
-/// В этом классе собираем конечные замеры перед переводом в табличное представление
-struct MeasurementInfoOut {
-  double totalTime = 0;
-  double childrenTime = 0;
-  double lastTime = 0;
-  double currentRunningTime = 0;
-  unsigned long timesExecuted = 0;
-  std::unordered_map<std::string, std::unique_ptr<MeasurementInfoOut>> children;
-  std::vector<std::string> childrenOrder; // нам нужна сортировка по занятому времени
-  
-  void fill(const MeasurementInfo &info, bool captureLast, bool captureCurrentRunning) {
-    totalTime = info.totalTime;
-    timesExecuted = info.timesExecuted;
-    childrenTime = 0;
-    for (const auto &keyVal: info.children) {
-      childrenTime += keyVal.second->totalTime;
-    }
-    
-    if (captureLast) {
-      double lastTimesTotal = 0;
-      unsigned long lastCount = std::min(info.startNTimesIdx, (unsigned long)CAPTURE_LAST_N_TIMES);
-      for (unsigned long i = 0; i < lastCount; i++)
-        lastTimesTotal += info.lastNTimes[i];
+  void pop() {
+    openMeasurements.pop_back();
+    currentNodeId.store(openMeasurements.empty() ? 0 : openMeasurements.back().node->nodeId.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+  }
 
-      lastTime = lastCount == 0 ? 0.0 : (lastTimesTotal / (double)lastCount);
-    } else {
-      lastTime = 0;
+  /*!
+   * \brief Находит или создает узел `identifier` внутри последнего открытого замера и добавляет его в стек.
+   * Вызывать под `mut`. `identifierString` - тот же идентификатор, если у вызывающего уже есть std::string.
+   */
+  MeasurementInfo *push(const char *identifier, const std::string *identifierString) {
+    MeasurementInfo *parent = getLast();
+    ChildCache &cache = parent ? parent->lastChild : rootLastChild;
+    int cached = cache.find(identifier, identifierString);
+    if (cached < 0) {
+      return pushNew(parent, cache, identifier, identifierString);
     }
-    if (captureCurrentRunning && info.lastStartTime > 0) {
-      currentRunningTime = get_timestamp() - info.lastStartTime;
-    } else {
-      currentRunningTime = 0;
+    MeasurementInfo *node = cache.nodes[cached];
+    openMeasurements.emplace_back();
+    openMeasurements.back().node = node;
+    openMeasurements.back().key = cache.keys[cached];
+    currentNodeId.store(node->nodeId.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return node;
+  }
+
+  /// Поиск в дереве и создание узла, если узла нет среди последних найденных на уровне
+  R_NOINLINE MeasurementInfo *pushNew(MeasurementInfo *parent, ChildCache &cache,
+                                      const char *identifier, const std::string *identifierString) {
+    std::string localIdentifier;
+    if (!identifierString) {
+      localIdentifier = identifier;
+      identifierString = &localIdentifier;
     }
-    children.clear();
-    for (const auto &keyVal: info.children) {
-      if (children.count(keyVal.first) == 0) {
-        children[keyVal.first] = std::unique_ptr<MeasurementInfoOut>(new MeasurementInfoOut());
+    MeasurementMap &children = parent ? parent->children : map;
+    auto it = children.find(*identifierString);
+    bool overflowed = false;
+    if (it == children.end()) {
+      // уровень уже переполнен: новый идентификатор уходит в overflowKey без реестра
+      auto &overflow = parent ? parent->childrenOverflow : rootOverflow;
+      if (overflow && overflow->current() && !overflow->kept.count(*identifierString)) {
+        it = children.find(overflowKey);
+        overflowed = it != children.end();
+        if (overflowed) overflow->redirected.fetch_add(1, std::memory_order_relaxed);
       }
-      children.at(keyVal.first)->fill(*keyVal.second, captureLast, captureCurrentRunning);
     }
-  }
-  
-  void merge(const MeasurementInfoOut &other) {
-    totalTime += other.totalTime;
-    timesExecuted += other.timesExecuted;
-    childrenTime += other.childrenTime;
-    lastTime += other.lastTime;
-    currentRunningTime += other.currentRunningTime;
-    for (const auto &key : other.children) {
-      if (children.count(key.first) == 0) {
-        children[key.first] = std::unique_ptr<MeasurementInfoOut>(new MeasurementInfoOut());
+    if (it == children.end()) {
+      std::string key = *identifierString;
+      uint32_t nodeId = calibration ? 0 : registerNode(parent ? parent->nodeId.load(std::memory_order_relaxed) : 0, key,
+                                                       parent ? parent->childrenOverflow : rootOverflow);
+      overflowed = key != *identifierString;
+      // при превышении лимита key - общий узел уровня, он может уже существовать
+      it = children.find(key);
+      if (it == children.end()) {
+        std::unique_ptr<MeasurementInfo> node(new MeasurementInfo());
+        node->nodeId = nodeId;
+        node->budget = calibration ? 0 : findBudget(key);
+        if (!calibration && activeBaseline.load()) {
+          std::vector<std::string> nodePath = path();
+          nodePath.push_back(key);
+          node->baseline = findBaseline(joined(nodePath));
+        }
+        it = children.emplace(key, std::move(node)).first;
       }
-      children.at(key.first)->merge(*key.second);
     }
+    if (!overflowed) {
+      cache.put(&it->first, it->second.get());
+    }
+    openMeasurements.emplace_back();
+    openMeasurements.back().node = it->second.get();
+    openMeasurements.back().key = &it->first;
+    if (overflowed) openMeasurements.back().overflowIdentifier = *identifierString;
+    currentNodeId.store(it->second->nodeId.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return it->second.get();
   }
 };
 
-static
-MeasurementInfoOut unionMeasurements() {
-//  объеденяем все замеры в один результат
-  MeasurementInfoOut res;
-  MeasurementInfoOut tempChild;
-  for (auto &threadMeasurements : measurementThreadMap) {
-    const auto &measurementsMap = threadMeasurements.second->map;
-    for (const auto& keyVal : measurementsMap) {
-      if (res.children.count(keyVal.first) > 0) {
-        tempChild.fill(*keyVal.second, true, true);
-        res.children.at(keyVal.first)->merge(tempChild);
-      } else {
-        res.children[keyVal.first] = std::unique_ptr<MeasurementInfoOut>(new MeasurementInfoOut());
-        res.children.at(keyVal.first)->fill(*keyVal.second, true, true);
-      }
-    }
+#ifndef R_BENCHMARK_ERROR_SITES
+#define R_BENCHMARK_ERROR_SITES 64      // разных мест ошибок; ошибки остальных мест только считаются
+#endif
+#define R_BENCHMARK_ERROR_TEXT 128      // тексты места ошибки обрезаются до этой длины
+
+enum class ErrorKind : uint8_t {
+  alreadyRun,    // start уже открытого замера
+  stopMismatch,  // stop не последнего открытого замера: стек раскручен до него
+  stopNotOpen,   // stop замера, которого нет среди открытых
+  notStarted,    // stop узла, у которого нет времени старта
+  io,            // файл трейсинга или flight recorder
+  otherSites,    // ошибки мест, не поместившихся в R_BENCHMARK_ERROR_SITES
+};
+
+static const char *errorKindName(ErrorKind kind) {
+  switch (kind) {
+    case ErrorKind::alreadyRun: return "already run";
+    case ErrorKind::stopMismatch: return "stop mismatch";
+    case ErrorKind::stopNotOpen: return "stop not open";
+    case ErrorKind::notStarted: return "not started";
+    case ErrorKind::io: return "io";
+    case ErrorKind::otherSites: return "other sites";
   }
-  return res;
+  return "";
 }
 
-static
-void sortChildren(MeasurementInfoOut &info) {
-  info.childrenOrder.clear();
-  for (auto &keyVal: info.children) {
-    info.childrenOrder.push_back(keyVal.first);
-  }
-  sort(info.childrenOrder.begin(), info.childrenOrder.end(),
-       [&info](const std::string &a, const std::string &b) -> bool {
-         return info.children.at(a)->totalTime > info.children.at(b)->totalTime;
-       });
-  
-  // recursive
-  for (auto &keyVal: info.children) {
-    if (!keyVal.second->children.empty()) {
-      sortChildren(*keyVal.second);
+/// Место ошибки: тексты копируются один раз при первой ошибке, дальше меняются только счетчики
+struct ErrorSite {
+  std::atomic<int> state{0};  // 0 - свободно, 1 - заполняется, 2 - готово
+  uint32_t hash = 0;
+  ErrorKind kind = ErrorKind::io;
+  int line = 0;
+  char file[R_BENCHMARK_ERROR_TEXT];   // конец пути, если он длиннее
+  char detail[R_BENCHMARK_ERROR_TEXT]; // идентификатор замера или сообщение
+  std::atomic<unsigned long> count{0};
+  std::atomic<unsigned long> unwound{0}; // брошенных незакрытых замеров, для stopMismatch
+};
+
+struct ErrorReport {
+  ErrorKind kind;
+  std::string file;
+  int line;
+  std::string detail;
+  unsigned long count;
+  unsigned long unwound;
+};
+
+/*!
+ * \brief Счетчики ошибок по местам вызова.
+ * Ошибка не сбрасывает накопленную статистику и не берет блокировок: место ищется в открытой адресации
+ * по хешу (вид, файл, строка, идентификатор), занимается через CAS, тексты копируются без выделения памяти.
+ */
+class ErrorSites {
+public:
+  void update(ErrorKind kind, const char *detail, const char *file, int line, unsigned long unwound = 0) {
+    if (!file) file = "";
+    if (!detail) detail = "";
+    uint32_t hash = hashSite(kind, detail, file, line);
+    for (size_t probe = 0; probe < R_BENCHMARK_ERROR_SITES; probe++) {
+      ErrorSite &site = sites_[(hash + probe) % R_BENCHMARK_ERROR_SITES];
+      int state = site.state.load(std::memory_order_acquire);
+      if (state == 0) {
+        if (site.state.compare_exchange_strong(state, 1, std::memory_order_acquire)) {
+          site.hash = hash;
+          site.kind = kind;
+          site.line = line;
+          copyText(site.file, file, true);
+          copyText(site.detail, detail, false);
+          site.state.store(2, std::memory_order_release);
+          count(site, unwound);
+          return;
+        }
+      }
+      // место заполняет другой поток: это может быть то же самое место
+      while (state == 1) {
+        std::this_thread::yield();
+        state = site.state.load(std::memory_order_acquire);
+      }
+      if (site.hash == hash && site.kind == kind && site.line == line &&
+          sameText(site.file, file, true) && sameText(site.detail, detail, false)) {
+        count(site, unwound);
+        return;
+      }
     }
+    dropped_.fetch_add(1, std::memory_order_relaxed);
   }
-}
 
-static
-void formGrid(const std::vector<std::vector<std::string>> &rows, std::ostream &out) {
-  std::vector<int> maxLengths;
-  for (const std::vector<std::string> &row : rows) {
-    for (size_t i = 0; i < row.size(); i++) {
-      int s = (int)row[i].size();
-      if (i >= maxLengths.size()) {
-        maxLengths.push_back(s);
-      } else if (maxLengths[i] < s){
-        maxLengths[i] = s;
-      }
+  /// Места с ошибками после последнего `reset`, по убыванию числа ошибок
+  std::vector<ErrorReport> collect() const {
+    std::vector<ErrorReport> reports;
+    for (const auto &site : sites_) {
+      if (site.state.load(std::memory_order_acquire) != 2) continue;
+      unsigned long count = site.count.load(std::memory_order_relaxed);
+      if (count == 0) continue;
+      reports.push_back({site.kind, site.file, site.line, site.detail, count, site.unwound.load(std::memory_order_relaxed)});
     }
+    unsigned long dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped > 0) {
+      reports.push_back({ErrorKind::otherSites, "", 0, "", dropped, 0});
+    }
+    std::stable_sort(reports.begin(), reports.end(), [](const ErrorReport &a, const ErrorReport &b) -> bool {
+      return a.count > b.count;
+    });
+    return reports;
   }
 
-  int border = 1;
-  for (const std::vector<std::string> &row : rows) {
-    for (size_t i = 0; i < row.size(); i++) {
-      auto alignment = i == 0 ? std::left : std::right;
-      out << std::setw(maxLengths[i] + border) << alignment << row[i];
+  /// Места остаются занятыми, обнуляются только счетчики
+  void reset() {
+    for (auto &site : sites_) {
+      site.count.store(0, std::memory_order_relaxed);
+      site.unwound.store(0, std::memory_order_relaxed);
     }
-    out << "\n";
+    dropped_.store(0, std::memory_order_relaxed);
   }
-}
 
-template<typename T>
-inline std::string formatString(std::stringstream &ss, T val) {
-  ss.str("");
-  ss << val;
-  return ss.str();
-}
+private:
+  ErrorSite sites_[R_BENCHMARK_ERROR_SITES];
+  std::atomic<unsigned long> dropped_{0};
 
-static void generateTableOutput(const MeasurementInfoOut &root, const Field &withoutFields, std::ostream &out);
-static void generateJsonOutput(const MeasurementInfoOut &root, const Field &withoutFields, std::ostream &out);
-inline std::string generateError(const std::string &msg, Format format) {
-  std::string result;
-  switch (format) {
-    case Format::table:
-      result += "\n=============== Benchmark Error ===============\n";
-      result += msg;
-      result += "\n===============================================\n";
-      break;
-    case Format::json:
-      result = "{\"error\":\"" + msg + "\"}";
-      break;
+  static void count(ErrorSite &site, unsigned long unwound) {
+    site.count.fetch_add(1, std::memory_order_relaxed);
+    if (unwound > 0) site.unwound.fetch_add(unwound, std::memory_order_relaxed);
   }
-  return result;
-}
 
-struct MeasurementInfoOut;
-std::string benchmarkLog(Field withoutFields, Format format, std::ostream *out) {
-#ifndef BENCHMARK_DISABLED
-  std::string errorMsgString;
-  if (errorMsg.popError(errorMsgString)) {
-    std::string msg = generateError(errorMsgString, format);
-    benchmarkReset();
-    if (out) {
-      *out << msg;
-      return "";
-    } else {
-      return msg;
-    }
+  /// Начало текста, который помещается в ErrorSite: для пути файла - его конец
+  static const char *fittedText(const char *text, bool keepTail, size_t &outLength) {
+    size_t length = strlen(text);
+    outLength = std::min<size_t>(length, R_BENCHMARK_ERROR_TEXT - 1);
+    return keepTail ? text + (length - outLength) : text;
   }
 
-  MeasurementInfoOut root;
+  /// Текст хранится как есть, экранируется при выводе
+  static void copyText(char *dst, const char *src, bool keepTail) {
+    size_t length;
+    const char *text = fittedText(src, keepTail, length);
+    memcpy(dst, text, length);
+    dst[length] = '\0';
+  }
+
+  static bool sameText(const char *stored, const char *src, bool keepTail) {
+    size_t length;
+    const char *text = fittedText(src, keepTail, length);
+    return strncmp(stored, text, length) == 0 && stored[length] == '\0';
+  }
+
+  static uint32_t hashSite(ErrorKind kind, const char *detail, const char *file, int line) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    auto mix = [&hash](unsigned char c) {
+      hash ^= c;
+      hash *= 16777619u;
+    };
+    for (const char *c = file; *c; c++) mix((unsigned char)*c);
+    for (const char *c = detail; *c; c++) mix((unsigned char)*c);
+    for (size_t i = 0; i < sizeof(line); i++) mix((unsigned char)(line >> (i * 8)));
+    mix(static_cast<unsigned char>(kind));
+    return hash;
+  }
+};
+
+// without pointer this map fails on Win machine
+// shared_ptr: поток держит свою группу, даже если ее уже убрали из map
+// ключ std::thread::id() - общая группа завершившихся потоков, см. retireGroup
+static std::unordered_map<std::thread::id, std::shared_ptr<MeasurementGroup>> measurementThreadMap;
+static std::mutex mut;
+static ErrorSites errorSites;
+static std::shared_ptr<Tracing::Serializer> tracing; // только через std::atomic_load / std::atomic_store
+static std::atomic<bool> tracingEnabled{false};
+static Tracing::Compression tracingCompression = Tracing::Compression::none; // под mut
+static std::shared_ptr<Tracing::BinaryTraceFile> binaryTracing; // только через std::atomic_load / std::atomic_store
+static std::atomic<bool> binaryTracingEnabled{false};
+
+inline std::shared_ptr<Tracing::BinaryTraceFile> activeBinaryTracing() {
+  if (!binaryTracingEnabled.load(std::memory_order_relaxed)) return nullptr;
+  return std::atomic_load(&binaryTracing);
+}
+
+inline std::shared_ptr<Tracing::Serializer> activeTracing() {
+  if (!tracingEnabled.load(std::memory_order_relaxed)) return nullptr;
+  return std::atomic_load(&tracing);
+}
+
+struct FlightRecorderState {
+  std::atomic<bool> enabled{false};
+  std::atomic<bool> dumpRequested{false};
+  std::atomic<timestamp_t> slowSpanThreshold{0}; // 0 - отключено
+  std::atomic<timestamp_t> lastDumpTime{0};
+  std::atomic<unsigned> dumpIndex{0};
+  // меняются только под `mut`, пока enabled == false
+  std::atomic<size_t> eventsPerThread{0};
+  std::atomic<timestamp_t> keepTime{0};
+  std::string dumpPath;
+  // фоновый поток сохранения: benchmarkStop только будит его, файл пишется вне потока замера
+  std::mutex writerControlMut; // запуск и остановка writer, без `::mut`: writer сам берет `::mut`
+  std::thread writer;
+  std::mutex writerMut;
+  std::condition_variable writerCv;
+  bool writerPending = false; // под writerMut
+  bool writerStop = false;    // под writerMut
+
+  ~FlightRecorderState() {
+    stopWriter();
+  }
+
+  void stopWriter() {
+    std::lock_guard<std::mutex> controlLock(writerControlMut);
+    if (!writer.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(writerMut);
+      writerStop = true;
+    }
+    writerCv.notify_all();
+    writer.join();
+    std::lock_guard<std::mutex> lock(writerMut);
+    writerStop = false;
+    writerPending = false;
+  }
+};
+static FlightRecorderState flightRecorderState;
+
+struct SamplerState {
+  std::atomic<bool> enabled{false};
+  std::mutex mut; // после `::mut`, если нужны обе
+  size_t topFunctions = 5;
+  // сэмплы, перенесенные из буферов потоков: id узла -> адрес -> число сэмплов
+  std::unordered_map<uint32_t, std::unordered_map<void *, unsigned long>> counts;
+  std::unordered_map<void *, std::string> symbols; // кэш символов
+  unsigned long dropped = 0;
+  long intervalNs = 0; // период таймеров потоков, 0 - сэмплер остановлен
+};
+static SamplerState samplerState;
+// группа потока для обработчика сигнала: тривиальный thread_local читается без инициализации
+static thread_local MeasurementGroup *samplerGroup = nullptr;
+
+static std::atomic<double> overheadPerCall{-1}; // мкс на пару start/stop, < 0 - не измерено
+static std::atomic<double> overheadInside{0};   // мкс, часть пары, попадающая в время самого замера
+static std::atomic<bool> overheadCompensation{false};
+static std::atomic<size_t> flatViewTop{R_BENCHMARK_FLAT_TOP}; // строк View::flat, 0 - все
+static void processFlightRecorder(MeasurementGroup &group, const Tracing::TraceInfo &info);
+
+static void writeThreadDescriptor(Tracing::Serializer &serializer, MeasurementGroup &group) {
+  ThreadInfo thread;
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    thread = group.thread;
+  }
+  if (thread.name.empty()) thread.name = "thread " + std::to_string(thread.osTid);
+  serializer.writeThreadInfo(group.tid, thread.name, thread.osTid, thread.affinity, thread.priority);
+}
+
+/// Привязывает курсор потока к сессии бинарного трейса, первой записью идет имя потока
+static void attachBinaryTracing(Tracing::BinaryTraceFile &binary, MeasurementGroup &group) {
+  if (group.binaryCursor.session == binary.session()) return;
+  ThreadInfo thread;
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    thread = group.thread;
+  }
+  if (thread.name.empty()) thread.name = "thread " + std::to_string(thread.osTid);
+  binary.attach(group.binaryCursor, thread.name);
+}
+
+/*!
+ * \brief Имена узла и его предков пишутся в чанки потока перед первым замером узла в сессии.
+ * \param epoch nodeRegistryEpoch, прочитанный вместе с `nodeId`
+ * \return `false`, если реестр с тех пор перестроен и `nodeId` уже означает другой путь
+ */
+static bool nameBinaryNode(Tracing::BinaryTraceFile &binary, MeasurementGroup &group, uint32_t nodeId, uint64_t epoch) {
+  std::vector<bool> &named = group.binaryCursor.namedNodes;
+  if (group.binaryCursor.registryEpoch == epoch && nodeId < named.size() && named[nodeId]) return true;
+  std::vector<std::pair<uint32_t, NodeDesc>> missing;
+  {
+    std::lock_guard<std::mutex> lock(nodeRegistryMut);
+    if (epoch != nodeRegistryEpoch.load()) return false;
+    if (group.binaryCursor.registryEpoch != epoch) {
+      // id перенумерованы: имена пишутся заново, читатель заменяет имя id потока
+      named.clear();
+      group.binaryCursor.registryEpoch = epoch;
+    }
+    for (uint32_t id = nodeId; id != 0 && !(id < named.size() && named[id]); id = nodeRegistry[id].parent) {
+      missing.emplace_back(id, nodeRegistry[id]);
+    }
+  }
+  for (auto it = missing.rbegin(); it != missing.rend(); ++it) {
+    if (named.size() <= it->first) named.resize(it->first + 1, false);
+    named[it->first] = true;
+    binary.writeName(group.binaryCursor, Tracing::BinaryNameKind::node, it->first, it->second.parent, it->second.name);
+  }
+  return true;
+}
+
+static void writeBinarySpan(Tracing::BinaryTraceFile &binary, MeasurementGroup &group, uint32_t nodeId, uint64_t epoch,
+                            timestamp_t ts, timestamp_t dt, int depth, const Tracing::TraceArgs &args) {
+  attachBinaryTracing(binary, group);
+  if (!nameBinaryNode(binary, group, nodeId, epoch)) return; // замер закончился во время benchmarkReset
+  Tracing::BinaryRecord *records = binary.reserve(group.binaryCursor, 1 + args.count);
+  if (!records) return;
+  for (int i = 0; i < args.count; i++) {
+    const Tracing::TraceArg &arg = args.items[i];
+    Tracing::BinaryRecord &record = records[i];
+    record.flags = static_cast<uint8_t>(arg.type);
+    // запись в новом чанке заполнена нулями: строки до binaryArgTextSize - 1 символов остаются с нулем в конце
+    strncpy(record.text, arg.key, Tracing::binaryArgTextSize - 1);
+    if (arg.type == Tracing::ArgType::integer) {
+      record.intValue = arg.intValue;
+    } else if (arg.type == Tracing::ArgType::real) {
+      record.realValue = arg.realValue;
+    } else if (arg.type == Tracing::ArgType::string) {
+      strncpy(record.text + Tracing::binaryArgTextSize, arg.stringValue, Tracing::binaryArgTextSize - 1);
+    }
+    Tracing::BinaryTraceFile::commit(record, Tracing::BinaryRecordType::arg);
+  }
+  Tracing::BinaryRecord &span = records[args.count];
+  span.depth = (uint16_t)depth;
+  span.id = nodeId;
+  span.time = ts;
+  span.duration = dt;
+  Tracing::BinaryTraceFile::commit(span, Tracing::BinaryRecordType::span);
+}
+
+static void writeBinaryCounter(Tracing::BinaryTraceFile &binary, MeasurementGroup &group, const std::string &identifier,
+                               timestamp_t ts, double value, int depth) {
+  attachBinaryTracing(binary, group);
+  auto &counters = group.binaryCursor.counters;
+  auto it = counters.find(identifier);
+  if (it == counters.end()) {
+    it = counters.emplace(identifier, (uint32_t)counters.size()).first;
+    binary.writeName(group.binaryCursor, Tracing::BinaryNameKind::counter, it->second, 0, identifier);
+  }
+  Tracing::BinaryRecord *record = binary.reserve(group.binaryCursor, 1);
+  if (!record) return;
+  record->depth = (uint16_t)depth;
+  record->id = it->second;
+  record->time = ts;
+  record->value = value;
+  Tracing::BinaryTraceFile::commit(*record, Tracing::BinaryRecordType::counter);
+}
+
+/// Добавляет замеры `from` в `into`, незавершенные замеры `from` не переносятся
+static void mergeMeasurementTree(MeasurementMap &into, const MeasurementMap &from) {
+  for (const auto &keyVal : from) {
+    const MeasurementInfo &src = *keyVal.second;
+    auto &dst = into[keyVal.first];
+    if (!dst) {
+      dst = std::unique_ptr<MeasurementInfo>(new MeasurementInfo());
+      dst->nodeId = src.nodeId.load();
+      dst->budget = src.budget.load();
+      dst->baseline = src.baseline.load();
+    }
+    dst->totalTime += src.totalTime;
+    dst->childrenTime += src.childrenTime;
+    dst->elapsedTime += src.elapsedTime;
+    dst->timesExecuted += src.timesExecuted;
+    dst->maxTime = std::max(dst->maxTime, src.maxTime);
+    dst->sumSquares += src.sumSquares;
+    dst->budgetViolations += src.budgetViolations;
+    dst->regressed = dst->regressed || src.regressed;
+    // последние замеры в порядке записи
+    unsigned long count = std::min(src.startNTimesIdx, (unsigned long)CAPTURE_LAST_N_TIMES);
+    for (unsigned long i = src.startNTimesIdx - count; i < src.startNTimesIdx; i++) {
+      dst->lastNTimes[dst->startNTimesIdx % CAPTURE_LAST_N_TIMES] = src.lastNTimes[i % CAPTURE_LAST_N_TIMES];
+      dst->startNTimesIdx++;
+    }
+    mergeMeasurementTree(dst->children, src.children);
+  }
+}
+
+/// Переносит сэмплы из буфера потока в samplerState.counts, вызывать под samplerState.mut
+static void drainSamplesLocked(MeasurementGroup &group) {
+  SampleBuffer *buffer = group.sampleBuffer.load(std::memory_order_acquire);
+  if (!buffer) return;
+  size_t read = buffer->readIdx.load(std::memory_order_relaxed);
+  size_t write = buffer->writeIdx.load(std::memory_order_acquire);
+  for (; read != write; read++) {
+    const Sample &sample = buffer->samples[read % R_BENCHMARK_SAMPLER_CAPACITY];
+    samplerState.counts[sample.nodeId][sample.address]++;
+  }
+  buffer->readIdx.store(write, std::memory_order_release);
+  samplerState.dropped += buffer->dropped.exchange(0);
+}
+
+/*!
+ * \brief Запускает таймер процессорного времени потока группы: SIGPROF приходит именно этому потоку,
+ * а частота не зависит от числа работающих потоков. Вызывать под samplerState.mut.
+ */
+static void startSamplerTimerLocked(MeasurementGroup &group) {
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  if (group.hasSamplerTimer || samplerState.intervalNs <= 0 || group.thread.osTid == 0) return;
+  clockid_t clock;
+  if (pthread_getcpuclockid(group.pthread, &clock) != 0) return;
+  sigevent event;
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = static_cast<pid_t>(group.thread.osTid);
+  timer_t timer;
+  if (timer_create(clock, &event, &timer) != 0) return;
+  itimerspec spec;
+  spec.it_interval.tv_sec = samplerState.intervalNs / 1000000000L;
+  spec.it_interval.tv_nsec = samplerState.intervalNs % 1000000000L;
+  spec.it_value = spec.it_interval;
+  if (timer_settime(timer, 0, &spec, nullptr) != 0) {
+    timer_delete(timer);
+    return;
+  }
+  group.samplerTimer = timer;
+  group.hasSamplerTimer = true;
+#else
+  (void)group;
+#endif
+}
+
+/// Вызывать под samplerState.mut
+static void stopSamplerTimerLocked(MeasurementGroup &group) {
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  if (!group.hasSamplerTimer) return;
+  timer_delete(group.samplerTimer);
+  group.hasSamplerTimer = false;
+#else
+  (void)group;
+#endif
+}
+
+/*!
+ * \brief Переносит замеры группы в общую группу завершившихся потоков и убирает группу из map.
+ * Так размер map и стоимость лога зависят от числа живых потоков. Вызывать под `mut`.
+ */
+static void retireGroupLocked(const std::shared_ptr<MeasurementGroup> &group) {
+  auto it = measurementThreadMap.find(group->tid);
+  if (it != measurementThreadMap.end() && it->second == group) {
+    measurementThreadMap.erase(it);
+  }
+  group->registered = false;
+  {
+    std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+    stopSamplerTimerLocked(*group);
+    drainSamplesLocked(*group);
+  }
+  // замеры забираем до блокировки общей группы: две группы одновременно блокирует только benchmarkReset
+  MeasurementMap map;
+  CounterMap counters;
+  {
+    std::lock_guard<std::mutex> groupLock(group->mut);
+    if (group->map.empty() && group->counters.empty()) return;
+    map.swap(group->map);
+    counters.swap(group->counters);
+    group->rootLastChild = ChildCache();
+  }
+
+  auto &retired = measurementThreadMap[std::thread::id()];
+  if (!retired) {
+    retired = std::make_shared<MeasurementGroup>();
+    retired->thread.name = "exited threads";
+    retired->registered = true;
+  }
+  std::lock_guard<std::mutex> retiredLock(retired->mut);
+  mergeMeasurementTree(retired->map, map);
+  for (const auto &keyVal : counters) {
+    retired->counters[keyVal.first].merge(keyVal.second);
+  }
+}
+
+/// Группа текущего потока; при завершении потока ее замеры переносятся в группу завершившихся потоков
+struct ThreadGroupHolder {
+  std::shared_ptr<MeasurementGroup> group;
+
+  ~ThreadGroupHolder() {
+    if (!group) return;
+    samplerGroup = nullptr;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> lock(mut);
+    retireGroupLocked(group);
+  }
+};
+static thread_local ThreadGroupHolder threadGroupHolder;
+
+inline MeasurementGroup &getMeasurementGroup() {
+  std::shared_ptr<MeasurementGroup> &threadGroup = threadGroupHolder.group;
+  if (threadGroup && threadGroup->registered.load(std::memory_order_relaxed)) {
+    return *threadGroup;
+  }
+  auto tid = std::this_thread::get_id();
+  bool created = false;
+  if (!threadGroup) {
+    threadGroup = std::make_shared<MeasurementGroup>();
+    threadGroup->tid = tid;
+    fillCurrentThreadInfo(threadGroup->thread);
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+    threadGroup->pthread = pthread_self();
+#endif
+    samplerGroup = threadGroup.get();
+    created = true;
+  }
   {
     std::lock_guard<std::mutex> lock(mut);
-    root = unionMeasurements();
-    sortChildren(root);
+    auto it = measurementThreadMap.find(tid);
+    if (it != measurementThreadMap.end() && it->second != threadGroup) {
+      // группа другого потока с тем же id, который не успел ее убрать
+      auto stale = it->second;
+      retireGroupLocked(stale);
+    }
+    // после benchmarkReset возвращаем в map ту же группу
+    measurementThreadMap[tid] = threadGroup;
+    threadGroup->registered = true;
+    if (samplerState.enabled) {
+      if (!threadGroup->sampleBuffer.load()) threadGroup->sampleBuffer = new SampleBuffer();
+      std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+      startSamplerTimerLocked(*threadGroup);
+    }
+  }
+  auto serializer = created ? activeTracing() : nullptr;
+  if (serializer) {
+    writeThreadDescriptor(*serializer, *threadGroup);
+  }
+  return *threadGroup;
+}
+
+#ifndef BENCHMARK_DISABLED
+static void notifyBudgetViolation(const MeasurementGroup &group, const std::string &identifier,
+                                  timestamp_t time, timestamp_t budget) {
+  std::function<void(const BudgetViolation &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(budgetMut);
+    callback = budgetCallback;
+  }
+  if (!callback) return;
+  std::vector<std::string> path = group.path();
+  path.push_back(identifier);
+  callback({identifier, joined(path), time / 1000., budget / 1000.});
+}
+
+/// Проверяет окно последних замеров, возвращает `true` при новом обнаружении замедления
+static bool checkRegression(MeasurementInfo &info, const BaselineStat &baseline, double &outMean, double &outDrift, double &outScore) {
+  double mean = 0;
+  for (double time : info.lastNTimes) mean += time;
+  mean /= CAPTURE_LAST_N_TIMES;
+  double variance = 0;
+  for (double time : info.lastNTimes) variance += (time - mean) * (time - mean);
+  variance /= (CAPTURE_LAST_N_TIMES > 1 ? CAPTURE_LAST_N_TIMES - 1 : 1);
+
+  bool regressed = isRegression(baseline, mean, variance, CAPTURE_LAST_N_TIMES, outDrift, outScore);
+  bool detected = regressed && !info.regressed;
+  info.regressed = regressed;
+  outMean = mean;
+  return detected;
+}
+
+static void notifyRegression(const MeasurementGroup &group, const std::string &identifier,
+                             const BaselineStat &baseline, double mean, double drift, double score) {
+  std::function<void(const RegressionInfo &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(baselineMut);
+    callback = regressionCallback;
+  }
+  if (!callback) return;
+  std::vector<std::string> path = group.path();
+  path.push_back(identifier);
+  callback({identifier, joined(path), baseline.avg / 1000., mean / 1000., drift, score});
+}
+#endif
+
+#ifndef BENCHMARK_DISABLED
+static R_NOINLINE void reportAlreadyRun(MeasurementGroup &group, const char *identifier, const char *file, int line) {
+  errorSites.update(ErrorKind::alreadyRun, identifier, file, line);
+  // повторный запуск не открывает новый замер
+  group.pop();
+}
+
+/*!
+ * \brief Восстанавливает стек после stop не последнего замера: замеры, открытые внутри `index`
+ * и не закрытые, бросаются - их время неизвестно, в статистику они не попадают.
+ */
+static R_NOINLINE void unwindOpenMeasurements(MeasurementGroup &group, size_t index, const char *identifier,
+                                              const char *file, int line) {
+  unsigned long unwound = (unsigned long)(group.openMeasurements.size() - index - 1);
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    for (size_t i = index + 1; i < group.openMeasurements.size(); i++) {
+      group.openMeasurements[i].node->lastStartTime = 0;
+    }
+  }
+  while (group.openMeasurements.size() > index + 1) group.pop();
+  errorSites.update(ErrorKind::stopMismatch, identifier, file, line, unwound);
+}
+
+static R_NOINLINE void reportStopNotOpen(const char *identifier, const char *file, int line) {
+  errorSites.update(ErrorKind::stopNotOpen, identifier, file, line);
+}
+
+/// То же для замеров по `handle`; возвращает `false`, если замера нет среди открытых
+static R_NOINLINE bool unwindToHandle(MeasurementGroup &group, void *handle, const char *kind) {
+  auto &open = group.openMeasurements;
+  size_t index = open.size();
+  while (index > 0 && open[index - 1].node != handle) index--;
+  if (index == 0) {
+    // узел мог быть удален в benchmarkReset, по `handle` его не читаем
+    reportStopNotOpen(kind, "", 0);
+    return false;
+  }
+  unwindOpenMeasurements(group, index - 1, open[index - 1].identifier().c_str(), "", 0);
+  return true;
+}
+
+/// Открывает замер; `identifierString` - тот же идентификатор, если он уже есть в виде std::string
+static MeasurementInfo *startMeasurement(const char *identifier, const std::string *identifierString,
+                                         const char *file, int line) {
+  auto &group = getMeasurementGroup();
+  if (group.paused) return nullptr;
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    MeasurementInfo *info = group.push(identifier, identifierString);
+    if (info->lastStartTime == 0) {
+      info->lastStartTime = get_timestamp();
+      return info;
+    }
+  }
+  reportAlreadyRun(group, identifier, file, line);
+  return nullptr;
+}
+
+/*!
+ * \brief Закрывает последний открытый замер группы.
+ * `times` - сколько исполнений кода прошло между start и stop.
+ * Для прерываемого замера `span` закрывается отрезок до приостановки: исполнение засчитывается
+ * только при `finish`, со временем всех отрезков.
+ */
+static void stopLastMeasurement(MeasurementGroup &group, timestamp_t now, const char *file, int line, unsigned long times,
+                                SuspendableSpan *span = nullptr, bool finish = true) {
+  timestamp_t ts, dt, budget = 0;
+  double time;
+  const BaselineStat *baseline = nullptr;
+  double regressionMean = 0, drift = 0, score = 0;
+  bool budgetViolated = false, regressionDetected = false;
+  // калибровка измеряет только таймер и дерево, без выводов
+  auto serializer = group.calibration ? nullptr : activeTracing();
+  auto binary = group.calibration ? nullptr : activeBinaryTracing();
+  bool flightRecorder = !group.calibration && flightRecorderState.enabled.load(std::memory_order_relaxed);
+  OpenMeasurement &last = group.openMeasurements.back();
+  std::string identifier;
+  uint32_t nodeId;
+  uint64_t registryEpoch;
+  {
+    std::unique_lock<std::mutex> lock(group.mut);
+    MeasurementInfo &info = *last.node;
+    if (info.lastStartTime == 0) {
+      lock.unlock();
+      errorSites.update(ErrorKind::notStarted, last.identifier().c_str(), file, line);
+      // незавершенный узел может быть удален в benchmarkReset, указатель на него не храним
+      group.pop();
+      return;
+    }
+
+    ts = info.lastStartTime;
+    nodeId = info.nodeId.load(std::memory_order_relaxed);
+    registryEpoch = nodeRegistryEpoch.load(std::memory_order_relaxed); // меняется только под `mut` группы
+    dt = now > ts ? now - ts : 0;
+    info.totalTime += static_cast<double>(dt);
+    info.lastStartTime = 0;
+    time = static_cast<double>(dt) / times;
+    if (span) {
+      span->activeTime += dt;
+      time = static_cast<double>(span->activeTime);
+    }
+    if (finish) {
+      if (span) {
+        info.elapsedTime += static_cast<double>(now > span->startTime ? now - span->startTime : 0);
+      }
+      info.timesExecuted += times;
+      info.lastNTimes[info.startNTimesIdx % CAPTURE_LAST_N_TIMES] = time;
+      info.startNTimesIdx++;
+      if (time > info.maxTime) info.maxTime = time;
+      info.sumSquares += time * time * times;
+      budget = info.budget.load(std::memory_order_relaxed);
+      if (budget > 0 && time > budget) {
+        info.budgetViolations++;
+        budgetViolated = true;
+      }
+      baseline = info.baseline.load(std::memory_order_relaxed);
+      if (baseline && info.startNTimesIdx % CAPTURE_LAST_N_TIMES == 0) {
+        // окно последних замеров заполнилось заново
+        regressionDetected = checkRegression(info, *baseline, regressionMean, drift, score);
+      }
+    }
+    // после снятия блокировки завершенный узел (и его ключ) может удалить benchmarkReset,
+    // поэтому строку копируем здесь и только если она нужна
+    if (serializer || flightRecorder || budgetViolated || regressionDetected) {
+      identifier = last.identifier();
+    }
+  }
+
+  Tracing::TraceArgs args = last.args;
+  group.pop();
+
+  // callback вызываем без блокировок: внутри можно вызывать функции библиотеки
+  if (budgetViolated && hasBudgetCallback.load(std::memory_order_relaxed)) {
+    notifyBudgetViolation(group, identifier, static_cast<timestamp_t>(time), budget);
+  }
+  if (regressionDetected) {
+    notifyRegression(group, identifier, *baseline, regressionMean, drift, score);
+  }
+
+  int depth = (int)group.openMeasurements.size();
+  if (serializer) {
+    serializer->saveTrace({identifier, group.tid, ts, dt, depth, Tracing::TraceType::span, 0, args});
+  }
+  if (binary) {
+    writeBinarySpan(*binary, group, nodeId, registryEpoch, ts, dt, depth, args);
+  }
+  if (flightRecorder) {
+    processFlightRecorder(group, {identifier, group.tid, ts, dt, depth, Tracing::TraceType::span, 0, args});
+  }
+}
+
+static void stopMeasurement(const char *identifier, const std::string *identifierString,
+                            const char *file, int line, unsigned long times) {
+  auto now = get_timestamp();
+  auto &group = getMeasurementGroup();
+  if (group.paused) return;
+
+  auto &open = group.openMeasurements;
+  size_t index = open.size();
+  auto matches = [&](const OpenMeasurement &measurement) -> bool {
+    return identifierString ? measurement.identifier() == *identifierString : measurement.identifier() == identifier;
+  };
+  // ищем замер и глубже в стеке: пропущенный stop внутреннего замера не должен ломать внешние
+  while (index > 0 && !matches(open[index - 1])) index--;
+  if (index == 0) {
+    reportStopNotOpen(identifier, file, line);
+    return;
+  }
+  if (index < open.size()) unwindOpenMeasurements(group, index - 1, identifier, file, line);
+  stopLastMeasurement(group, now, file, line, times);
+}
+#endif
+
+bool benchmarkStart(const std::string &identifier, const char *file, int line) {
+#ifndef BENCHMARK_DISABLED
+  startMeasurement(identifier.c_str(), &identifier, file, line);
+#endif
+  return true;
+}
+
+bool benchmarkStart(const char *identifier, const char *file, int line) {
+#ifndef BENCHMARK_DISABLED
+  startMeasurement(identifier, nullptr, file, line);
+#endif
+  return true;
+}
+
+void benchmarkStop(const std::string &identifier, const char *file, int line) {
+#ifndef BENCHMARK_DISABLED
+  stopMeasurement(identifier.c_str(), &identifier, file, line, 1);
+#endif
+}
+
+void benchmarkStop(const char *identifier, const char *file, int line) {
+#ifndef BENCHMARK_DISABLED
+  stopMeasurement(identifier, nullptr, file, line, 1);
+#endif
+}
+
+void *benchmarkStartScoped(const std::string &identifier) {
+#ifndef BENCHMARK_DISABLED
+  return startMeasurement(identifier.c_str(), &identifier, "", 0);
+#else
+  return nullptr;
+#endif
+}
+
+void *benchmarkStartScoped(const char *identifier) {
+#ifndef BENCHMARK_DISABLED
+  return startMeasurement(identifier, nullptr, "", 0);
+#else
+  return nullptr;
+#endif
+}
+
+void benchmarkStopScoped(void *handle) {
+#ifndef BENCHMARK_DISABLED
+  if (!handle) return; // замер не был открыт: пауза или ошибка при старте
+  auto now = get_timestamp();
+  auto &group = getMeasurementGroup();
+  if (group.paused) return;
+  if ((group.openMeasurements.empty() || group.openMeasurements.back().node != handle) &&
+      !unwindToHandle(group, handle, "ScopedBenchmark")) {
+    return;
+  }
+  stopLastMeasurement(group, now, "", 0, 1);
+#endif
+}
+
+void benchmarkSpanResume(SuspendableSpan &span, const std::string &identifier) {
+#ifndef BENCHMARK_DISABLED
+  if (span.startTime == 0) span.startTime = get_timestamp();
+  span.handle = startMeasurement(identifier.c_str(), &identifier, "", 0);
+#endif
+}
+
+void benchmarkSpanSuspend(SuspendableSpan &span, bool finish) {
+#ifndef BENCHMARK_DISABLED
+  void *handle = span.handle;
+  span.handle = nullptr;
+  if (!handle) return; // отрезок не был открыт: пауза или ошибка при старте
+  auto now = get_timestamp();
+  auto &group = getMeasurementGroup();
+  if (group.paused) return;
+  // внутри отрезка мог остаться открытый замер, например ScopedBenchmark через co_await
+  if ((group.openMeasurements.empty() || group.openMeasurements.back().node != handle) &&
+      !unwindToHandle(group, handle, "CoroutineSpan")) {
+    return;
+  }
+  stopLastMeasurement(group, now, "", 0, 1, &span, finish);
+#endif
+}
+
+void benchmarkStopBatch(const std::string &identifier, unsigned long times) {
+#ifndef BENCHMARK_DISABLED
+  stopMeasurement(identifier.c_str(), &identifier, "", 0, std::max(times, 1UL));
+#endif
+}
+
+void benchmarkPauseThread(bool paused) {
+#ifndef BENCHMARK_DISABLED
+  getMeasurementGroup().paused = paused;
+#endif
+}
+
+#ifndef BENCHMARK_DISABLED
+static void setSpanArg(const Tracing::TraceArg &arg) {
+  auto &group = getMeasurementGroup();
+  if (group.openMeasurements.empty()) return;
+  group.openMeasurements.back().args.set(arg);
+}
+#endif
+
+void benchmarkSpanArg(const char *key, long long value) {
+#ifndef BENCHMARK_DISABLED
+  Tracing::TraceArg arg;
+  arg.key = key;
+  arg.type = Tracing::ArgType::integer;
+  arg.intValue = value;
+  setSpanArg(arg);
+#endif
+}
+
+void benchmarkSpanArg(const char *key, double value) {
+#ifndef BENCHMARK_DISABLED
+  Tracing::TraceArg arg;
+  arg.key = key;
+  arg.type = Tracing::ArgType::real;
+  arg.realValue = value;
+  setSpanArg(arg);
+#endif
+}
+
+void benchmarkSpanArg(const char *key, const char *value) {
+#ifndef BENCHMARK_DISABLED
+  Tracing::TraceArg arg;
+  arg.key = key;
+  arg.type = Tracing::ArgType::string;
+  arg.stringValue = value;
+  setSpanArg(arg);
+#endif
+}
+
+const char *benchmarkIntern(const std::string &value) {
+  return Tracing::Serializer::intern(value);
+}
+
+void benchmarkSetBudget(const std::string &identifier, double maxMs) {
+#ifndef BENCHMARK_DISABLED
+  timestamp_t budget = maxMs <= 0 ? 0 : static_cast<timestamp_t>(maxMs * 1000.);
+  {
+    std::lock_guard<std::mutex> lock(budgetMut);
+    if (budget == 0) {
+      budgets.erase(identifier);
+    } else {
+      budgets[identifier] = budget;
+    }
+  }
+  // обновляем уже созданные узлы
+  std::lock_guard<std::mutex> lock(mut);
+  for (auto &kv : measurementThreadMap) {
+    std::lock_guard<std::mutex> groupLock(kv.second->mut);
+    std::vector<MeasurementMap *> maps = {&(kv.second->map)};
+    for (size_t idx = 0; idx < maps.size(); idx++) {
+      for (auto &child : *maps[idx]) {
+        if (child.first == identifier) {
+          child.second->budget = budget;
+        }
+        maps.push_back(&(child.second->children));
+      }
+    }
+  }
+#endif
+}
+
+void benchmarkSetBudgetCallback(std::function<void(const BudgetViolation &)> callback) {
+#ifndef BENCHMARK_DISABLED
+  std::lock_guard<std::mutex> lock(budgetMut);
+  hasBudgetCallback = static_cast<bool>(callback);
+  budgetCallback = std::move(callback);
+#endif
+}
+
+double benchmarkCalibrate(int iterations) {
+#ifndef BENCHMARK_DISABLED
+  // замеряем в отдельном потоке, чтобы не трогать дерево текущего
+  double result = 0;
+  double inside = 0;
+  std::thread calibration([&result, &inside, iterations]() {
+    const std::string parent = "calibration";
+    const std::string child = "empty";
+    // группа не попадает в measurementThreadMap и сэмплер: калибровка не видна в логе,
+    // трейсинге и flight recorder, а stopLastMeasurement пропускает для нее все выводы
+    auto group = std::make_shared<MeasurementGroup>();
+    group->tid = std::this_thread::get_id();
+    group->calibration = true;
+    group->registered = true;
+    threadGroupHolder.group = group;
+    benchmarkStart(parent);
+    // прогрев: создаем узел и заполняем кэши
+    for (int i = 0; i < 100; i++) {
+      benchmarkStart(child);
+      benchmarkStop(child);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      benchmarkStart(child);
+      benchmarkStop(child);
+    }
+    auto end = std::chrono::steady_clock::now();
+    benchmarkStop(parent);
+    result = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000. / std::max(iterations, 1);
+
+    threadGroupHolder.group.reset();
+    std::lock_guard<std::mutex> groupLock(group->mut);
+    // пустой замер записывает только свою внутреннюю часть накладных расходов;
+    // если узла нет (поток был на паузе), считаем, что внутрь замера расходы не попадают
+    auto parentIt = group->map.find(parent);
+    if (parentIt == group->map.end()) return;
+    auto childIt = parentIt->second->children.find(child);
+    if (childIt == parentIt->second->children.end()) return;
+    const MeasurementInfo &empty = *childIt->second;
+    inside = std::min(result, empty.totalTime / std::max(empty.timesExecuted, 1UL));
+  });
+  calibration.join();
+  overheadInside = inside;
+  overheadPerCall = result;
+  return result;
+#else
+  return 0;
+#endif
+}
+
+void benchmarkSetCardinalityLimits(size_t maxChildren, size_t maxTotalNodes) {
+#ifndef BENCHMARK_DISABLED
+  maxChildrenPerNode = maxChildren == 0 ? R_BENCHMARK_MAX_CHILDREN : maxChildren;
+  maxNodes = maxTotalNodes == 0 ? R_BENCHMARK_MAX_NODES : maxTotalNodes;
+#endif
+}
+
+void benchmarkSetOverheadCompensation(bool enabled) {
+#ifndef BENCHMARK_DISABLED
+  overheadCompensation = enabled;
+#endif
+}
+
+void benchmarkSetFlatViewTop(size_t top) {
+#ifndef BENCHMARK_DISABLED
+  flatViewTop = top;
+#else
+  (void)top;
+#endif
+}
+
+void benchmarkCounter(const std::string &identifier, double value) {
+#ifndef BENCHMARK_DISABLED
+  auto &group = getMeasurementGroup();
+  auto ts = get_timestamp();
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    group.counters[identifier].update(value, ts);
+  }
+  auto serializer = activeTracing();
+  if (serializer) {
+    serializer->saveTrace({identifier, group.tid, ts, 0, (int)group.openMeasurements.size(), Tracing::TraceType::counter, value, {}});
+  }
+  auto binary = activeBinaryTracing();
+  if (binary) {
+    writeBinaryCounter(*binary, group, identifier, ts, value, (int)group.openMeasurements.size());
+  }
+#endif
+}
+
+/*!
+ * \brief Строит реестр путей заново по узлам, оставшимся в группах после сброса.
+ * Вызывать под `mut`, `mergeMut`, `mut` всех групп и nodeRegistryMut.
+ */
+static void rebuildNodeRegistryLocked(const std::vector<std::shared_ptr<MeasurementGroup>> &groups) {
+  nodeRegistry = {{0, ""}};
+  nodeRegistryChildren.assign(1, {});
+  cardinalityOverflows.clear();
+  std::unordered_map<uint32_t, uint32_t> remap = {{0, 0}}; // старый id -> новый
+  for (auto &group : groups) {
+    group->rootOverflow.reset();
+    std::vector<std::pair<uint32_t, MeasurementMap *>> levels = {{0, &group->map}};
+    for (size_t idx = 0; idx < levels.size(); idx++) {
+      uint32_t parent = levels[idx].first;
+      for (auto &keyVal : *levels[idx].second) {
+        MeasurementInfo &node = *keyVal.second;
+        node.childrenOverflow.reset();
+        if (group->calibration) continue;
+        auto &children = nodeRegistryChildren[parent];
+        auto it = children.find(keyVal.first);
+        uint32_t id = it != children.end() ? it->second : addNodeLocked(parent, keyVal.first);
+        remap[node.nodeId.load(std::memory_order_relaxed)] = id;
+        node.nodeId.store(id, std::memory_order_relaxed);
+        levels.push_back({id, &node.children});
+      }
+    }
+    // сэмплер читает currentNodeId без блокировок, владелец мог уже сменить его
+    uint32_t current = group->currentNodeId.load(std::memory_order_relaxed);
+    auto it = remap.find(current);
+    group->currentNodeId.compare_exchange_strong(current, it != remap.end() ? it->second : 0, std::memory_order_relaxed);
+  }
+  nodeRegistryEpoch++;
+}
+
+void benchmarkReset() {
+#ifndef BENCHMARK_DISABLED
+  // группы блокируются на весь сброс: иначе поток может зарегистрировать узел в старом реестре
+  std::lock_guard<std::mutex> mergeLock(mergeMut);
+  std::lock_guard<std::mutex> lock(mut);
+  std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+  errorSites.reset();
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  for (auto &kv : measurementThreadMap) {
+    groups.push_back(kv.second);
+  }
+  // одинаковый порядок блокировок при каждом сбросе
+  sort(groups.begin(), groups.end());
+  std::vector<std::unique_lock<std::mutex>> groupLocks;
+  for (auto &group : groups) {
+    groupLocks.emplace_back(group->mut);
+    group->counters.clear();
+    group->rootLastChild = ChildCache();
+    std::vector<MeasurementMap *> cleanupMap = {&(group->map)};
+    
+    for (size_t idx = 0; idx < cleanupMap.size(); idx++) {
+      auto map = cleanupMap[idx];
+      for (auto it = map->begin(); it != map->end(); ) {
+        if (it->second->lastStartTime == 0) {
+          // reset info for non finished benchmarks
+          it = map->erase(it);
+        } else {
+          it->second->lastChild = ChildCache(); // дети могут быть удалены
+          cleanupMap.push_back(&(it->second->children));
+          ++it;
+        }
+      }
+    }
+    drainSamplesLocked(*group);
+  }
+  samplerState.counts.clear();
+  samplerState.dropped = 0;
+
+  for (auto it = measurementThreadMap.begin(); it != measurementThreadMap.end(); ) {
+    if (it->second->map.empty() && it->second->counters.empty()) {
+      // no measurments for thread, cleanup
+      it->second->registered = false;
+      stopSamplerTimerLocked(*it->second); // снова запустится при регистрации группы
+      it = measurementThreadMap.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  std::lock_guard<std::mutex> registryLock(nodeRegistryMut);
+  rebuildNodeRegistryLocked(groups);
+#endif
+}
+
+// Out measurements
+/// В этом классе собираем конечные замеры перед переводом в табличное представление
+/// Замеры узла одного потока для View::threads
+struct ThreadInfoOut {
+  std::string name;
+  double totalTime;
+  unsigned long timesExecuted;
+  double currentRunningTime;
+};
+
+struct MeasurementInfoOut {
+  double totalTime = 0;
+  double elapsedTime = 0; // только у прерываемых замеров
+  double childrenTime = 0;
+  double lastTime = 0;
+  double currentRunningTime = 0;
+  unsigned long timesExecuted = 0;
+  double maxTime = 0;
+  double sumSquares = 0;
+  double budget = 0;
+  unsigned long budgetViolations = 0;
+  // последние CAPTURE_LAST_N_TIMES замеров всех потоков
+  double lastTimesTotal = 0;
+  double lastTimesSquares = 0;
+  unsigned long lastCount = 0;
+  const BaselineStat *baseline = nullptr;
+  std::vector<ThreadInfoOut> threads; // только для View::threads
+  std::unordered_map<std::string, std::unique_ptr<MeasurementInfoOut>> children;
+  std::vector<std::string> childrenOrder; // нам нужна сортировка по занятому времени
+};
+
+/// Разброс общего времени узла между потоками, `false` если узел не разбит по потокам
+static bool threadImbalance(const MeasurementInfoOut &info, double &outMin, double &outAvg, double &outMax) {
+  if (info.threads.empty()) return false;
+  outMin = info.threads.front().totalTime;
+  outMax = outMin;
+  double sum = 0;
+  for (const auto &thread : info.threads) {
+    outMin = std::min(outMin, thread.totalTime);
+    outMax = std::max(outMax, thread.totalTime);
+    sum += thread.totalTime;
+  }
+  outAvg = sum / info.threads.size();
+  return true;
+}
+
+/// Отклонение последних замеров от baseline; `outScore > 0` только для статистически значимого замедления
+static bool nodeDrift(const MeasurementInfoOut &info, double &outDrift, double &outScore) {
+  if (!info.baseline || info.lastCount == 0) return false;
+  double count = static_cast<double>(info.lastCount);
+  double mean = info.lastTimesTotal / count;
+  double variance = count > 1 ? std::max(0.0, (info.lastTimesSquares - mean * info.lastTimesTotal) / (count - 1)) : 0.0;
+  if (!isRegression(*info.baseline, mean, variance, count, outDrift, outScore)) {
+    outScore = 0;
+  }
+  return true;
+}
+
+#ifndef MERGE_PARALLEL_MIN_NODES
+#define MERGE_PARALLEL_MIN_NODES 50000 // меньше узлов быстрее слить в одном потоке, чем запускать потоки
+#endif
+
+/// Сумма замеров одного пути по всем потокам, элемент плоского массива слияния
+struct MergedNode {
+  bool used;
+  double totalTime;
+  double elapsedTime;
+  unsigned long timesExecuted;
+  double currentRunningTime;
+  double maxTime;
+  double sumSquares;
+  double budget;
+  unsigned long budgetViolations;
+  double lastTimesTotal;
+  double lastTimesSquares;
+  unsigned long lastCount;
+  const BaselineStat *baseline;
+
+  void add(const MeasurementInfo &info, timestamp_t now) {
+    used = true;
+    totalTime += info.totalTime;
+    elapsedTime += info.elapsedTime;
+    timesExecuted += info.timesExecuted;
+    if (info.lastStartTime > 0 && now > info.lastStartTime) {
+      currentRunningTime += now - info.lastStartTime;
+    }
+    maxTime = std::max(maxTime, info.maxTime);
+    sumSquares += info.sumSquares;
+    budget = std::max(budget, static_cast<double>(info.budget.load()));
+    budgetViolations += info.budgetViolations;
+    unsigned long count = std::min(info.startNTimesIdx, (unsigned long)CAPTURE_LAST_N_TIMES);
+    for (unsigned long i = 0; i < count; i++) {
+      lastTimesTotal += info.lastNTimes[i];
+      lastTimesSquares += info.lastNTimes[i] * info.lastNTimes[i];
+    }
+    lastCount += count;
+    if (!baseline) baseline = info.baseline.load();
+  }
+
+  void merge(const MergedNode &other) {
+    if (!other.used) return;
+    used = true;
+    totalTime += other.totalTime;
+    elapsedTime += other.elapsedTime;
+    timesExecuted += other.timesExecuted;
+    currentRunningTime += other.currentRunningTime;
+    maxTime = std::max(maxTime, other.maxTime);
+    sumSquares += other.sumSquares;
+    budget = std::max(budget, other.budget);
+    budgetViolations += other.budgetViolations;
+    lastTimesTotal += other.lastTimesTotal;
+    lastTimesSquares += other.lastTimesSquares;
+    lastCount += other.lastCount;
+    if (!baseline) baseline = other.baseline;
+  }
+};
+
+/// Буферы слияния переиспользуются между вызовами, чтобы `benchmarkLog` не выделял память на каждый узел
+/// Под mergeMut
+struct MergeBuffers {
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  std::vector<const NodeDesc *> nodes;
+  std::vector<std::vector<MergedNode>> partial; // [0] - итог, остальные - для параллельных потоков
+  std::vector<MeasurementInfoOut *> out;
+};
+static MergeBuffers mergeBuffers;
+
+/// Копирует список групп, чтобы дальше работать без глобальной блокировки
+static void snapshotGroups(std::vector<std::shared_ptr<MeasurementGroup>> &outGroups) {
+  outGroups.clear();
+  std::lock_guard<std::mutex> lock(mut);
+  for (auto &kv : measurementThreadMap) {
+    outGroups.push_back(kv.second);
+  }
+}
+
+static void accumulateGroup(MeasurementGroup &group, std::vector<MergedNode> &merged, timestamp_t now,
+                            std::vector<const MeasurementMap *> &stack) {
+  std::lock_guard<std::mutex> groupLock(group.mut);
+  stack.clear();
+  stack.push_back(&group.map);
+  while (!stack.empty()) {
+    const MeasurementMap *map = stack.back();
+    stack.pop_back();
+    for (const auto &keyVal : *map) {
+      const MeasurementInfo &info = *keyVal.second;
+      // узел создан после снимка реестра, попадет в следующий лог
+      if (info.nodeId >= merged.size()) continue;
+      merged[info.nodeId].add(info, now);
+      stack.push_back(&info.children);
+    }
+  }
+}
+
+static void accumulateGroups(const std::vector<std::shared_ptr<MeasurementGroup>> &groups, size_t from, size_t step,
+                             std::vector<MergedNode> &merged, timestamp_t now) {
+  std::vector<const MeasurementMap *> stack;
+  for (size_t idx = from; idx < groups.size(); idx += step) {
+    accumulateGroup(*groups[idx], merged, now, stack);
+  }
+}
+
+static std::string threadDisplayName(MeasurementGroup &group) {
+  std::lock_guard<std::mutex> groupLock(group.mut);
+  if (!group.thread.name.empty()) return group.thread.name;
+  if (group.thread.osTid != 0) return "thread " + std::to_string(group.thread.osTid);
+  std::stringstream ss;
+  ss << "thread " << group.tid;
+  return ss.str();
+}
+
+/// \param perThread Кроме общего дерева сохранить в узлах замеры каждого потока (`MeasurementInfoOut::threads`)
+static
+MeasurementInfoOut unionMeasurements(bool perThread = false) {
+//  объеденяем все замеры в один результат: каждый поток складывается в плоский массив по id узлов
+  MeasurementInfoOut res;
+  std::lock_guard<std::mutex> lock(mergeMut);
+  auto &groups = mergeBuffers.groups;
+  auto &nodes = mergeBuffers.nodes;
+  snapshotGroups(groups);
+  {
+    std::lock_guard<std::mutex> registryLock(nodeRegistryMut);
+    nodes.clear();
+    for (const auto &node : nodeRegistry) nodes.push_back(&node);
+  }
+  auto now = get_timestamp();
+
+  size_t workers = 1;
+  std::vector<std::vector<MergedNode>> threadNodes;
+  std::vector<std::string> threadNames;
+  if (perThread) {
+    // отдельный массив на каждый поток, дальше складываем как при параллельном слиянии
+    std::vector<const MeasurementMap *> stack;
+    for (auto &group : groups) {
+      threadNames.push_back(threadDisplayName(*group));
+      threadNodes.emplace_back(nodes.size(), MergedNode());
+      accumulateGroup(*group, threadNodes.back(), now, stack);
+    }
+    workers = 0;
+  } else if (nodes.size() * groups.size() >= MERGE_PARALLEL_MIN_NODES) {
+    workers = std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned)groups.size() / 2));
+  }
+  auto &partial = mergeBuffers.partial;
+  if (partial.size() < std::max<size_t>(workers, 1)) partial.resize(std::max<size_t>(workers, 1));
+  for (size_t w = 0; w < std::max<size_t>(workers, 1); w++) {
+    partial[w].assign(nodes.size(), MergedNode());
+  }
+  if (workers == 0) {
+    for (const auto &thread : threadNodes) {
+      for (size_t id = 0; id < nodes.size(); id++) {
+        partial[0][id].merge(thread[id]);
+      }
+    }
+  } else if (workers == 1) {
+    accumulateGroups(groups, 0, 1, partial[0], now);
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; w++) {
+      threads.emplace_back(accumulateGroups, std::cref(groups), w, workers, std::ref(partial[w]), now);
+    }
+    accumulateGroups(groups, 0, workers, partial[0], now);
+    for (size_t w = 1; w < workers; w++) {
+      threads[w - 1].join();
+      for (size_t id = 0; id < nodes.size(); id++) {
+        partial[0][id].merge(partial[w][id]);
+      }
+    }
+  }
+  // группы держим только на время слияния
+  groups.clear();
+
+  // родитель зарегистрирован раньше детей, поэтому дерево строится за один проход
+  auto &merged = partial[0];
+  auto &out = mergeBuffers.out;
+  out.assign(nodes.size(), nullptr);
+  out[0] = &res;
+  for (size_t id = 1; id < nodes.size(); id++) {
+    const MergedNode &node = merged[id];
+    MeasurementInfoOut *parent = out[nodes[id]->parent];
+    if (!node.used || !parent) continue;
+    auto &child = parent->children[nodes[id]->name];
+    child = std::unique_ptr<MeasurementInfoOut>(new MeasurementInfoOut());
+    child->totalTime = node.totalTime;
+    child->elapsedTime = node.elapsedTime;
+    child->timesExecuted = node.timesExecuted;
+    child->currentRunningTime = node.currentRunningTime;
+    child->maxTime = node.maxTime;
+    child->sumSquares = node.sumSquares;
+    child->budget = node.budget;
+    child->budgetViolations = node.budgetViolations;
+    child->lastTimesTotal = node.lastTimesTotal;
+    child->lastTimesSquares = node.lastTimesSquares;
+    child->lastCount = node.lastCount;
+    child->lastTime = node.lastCount == 0 ? 0.0 : (node.lastTimesTotal / (double)node.lastCount);
+    child->baseline = node.baseline;
+    for (size_t t = 0; t < threadNodes.size(); t++) {
+      const MergedNode &thread = threadNodes[t][id];
+      if (thread.used) {
+        child->threads.push_back({threadNames[t], thread.totalTime, thread.timesExecuted, thread.currentRunningTime});
+      }
+    }
+    parent->childrenTime += node.totalTime;
+    out[id] = child.get();
+  }
+  return res;
+}
+
+static
+std::vector<std::pair<std::string, CounterInfo>> unionCounters() {
+  std::unordered_map<std::string, CounterInfo> merged;
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  snapshotGroups(groups);
+  for (auto &group : groups) {
+    std::lock_guard<std::mutex> groupLock(group->mut);
+    for (const auto &keyVal : group->counters) {
+      merged[keyVal.first].merge(keyVal.second);
+    }
+  }
+  std::vector<std::pair<std::string, CounterInfo>> res(merged.begin(), merged.end());
+  sort(res.begin(), res.end(),
+       [](const std::pair<std::string, CounterInfo> &a, const std::pair<std::string, CounterInfo> &b) -> bool {
+         return a.first < b.first;
+       });
+  return res;
+}
+
+/// Вычитает стоимость вложенных start/stop и собственную внутреннюю часть из времени узлов,
+/// возвращает число вложенных вызовов
+static
+double subtractOverhead(MeasurementInfoOut &info, double overhead, double inside) {
+  double descendantCalls = 0;
+  double childrenTime = 0;
+  for (auto &keyVal : info.children) {
+    descendantCalls += keyVal.second->timesExecuted + subtractOverhead(*keyVal.second, overhead, inside);
+    childrenTime += keyVal.second->totalTime;
+  }
+  if (info.timesExecuted > 0) {
+    double subtracted = std::min(info.totalTime, descendantCalls * overhead + info.timesExecuted * inside);
+    info.lastTime = std::max(0.0, info.lastTime - subtracted / info.timesExecuted);
+    info.totalTime -= subtracted;
+  }
+  info.childrenTime = childrenTime;
+  return descendantCalls;
+}
+
+static
+void sortChildren(MeasurementInfoOut &info) {
+  info.childrenOrder.clear();
+  for (auto &keyVal: info.children) {
+    info.childrenOrder.push_back(keyVal.first);
+  }
+  sort(info.childrenOrder.begin(), info.childrenOrder.end(),
+       [&info](const std::string &a, const std::string &b) -> bool {
+         return info.children.at(a)->totalTime > info.children.at(b)->totalTime;
+       });
+  
+  // recursive
+  for (auto &keyVal: info.children) {
+    if (!keyVal.second->children.empty()) {
+      sortChildren(*keyVal.second);
+    }
+  }
+}
+
+/// Общая с harness.cpp: колонки выравниваются по самой длинной ячейке, первая - влево
+R_FUNC
+void formGrid(const std::vector<std::vector<std::string>> &rows, std::ostream &out) {
+  std::vector<int> maxLengths;
+  for (const std::vector<std::string> &row : rows) {
+    for (size_t i = 0; i < row.size(); i++) {
+      int s = (int)row[i].size();
+      if (i >= maxLengths.size()) {
+        maxLengths.push_back(s);
+      } else if (maxLengths[i] < s){
+        maxLengths[i] = s;
+      }
+    }
+  }
+
+  int border = 1;
+  for (const std::vector<std::string> &row : rows) {
+    for (size_t i = 0; i < row.size(); i++) {
+      auto alignment = i == 0 ? std::left : std::right;
+      out << std::setw(maxLengths[i] + border) << alignment << row[i];
+    }
+    out << "\n";
+  }
+}
+
+template<typename T>
+inline std::string formatString(std::stringstream &ss, T val) {
+  ss.str("");
+  ss << val;
+  return ss.str();
+}
+
+typedef std::vector<std::pair<std::string, CounterInfo>> CountersOut;
+
+/// Строка View::flat: все узлы с одним идентификатором по всем путям и потокам
+struct FlatEntryOut {
+  std::string name;
+  double selfTime = 0;   // без времени вложенных замеров
+  double totalTime = 0;  // рекурсивные вызовы внутри того же идентификатора не учитываются повторно
+  unsigned long timesExecuted = 0;
+};
+
+struct FlatProfileOut {
+  std::vector<FlatEntryOut> entries; // по убыванию selfTime, первые flatViewTop
+  double selfTime = 0;               // всех идентификаторов, для процентов
+  size_t identifiers = 0;            // всего разных идентификаторов
+};
+
+static void generateTableOutput(const MeasurementInfoOut &root, const FlatProfileOut *flat, const CountersOut &counters,
+                                const Field &withoutFields, const std::string *traceSource, std::ostream &out);
+static void generateJsonOutput(const MeasurementInfoOut &root, const FlatProfileOut *flat, const CountersOut &counters,
+                               const Field &withoutFields, const std::string *traceSource, std::ostream &out);
+
+/*!
+ * \brief Плоский профиль за один проход по объединенному дереву: собственное время и число вызовов
+ * каждого идентификатора, сложенные по всем путям.
+ */
+static FlatProfileOut collectFlatProfile(const MeasurementInfoOut &root, size_t top) {
+  FlatProfileOut profile;
+  std::unordered_map<std::string, size_t> indices;
+  std::vector<int> onPath; // сколько раз идентификатор уже открыт выше по пути
+  struct Visit {
+    const MeasurementInfoOut *node;
+    size_t entry;
+    bool leave;
+  };
+  std::vector<Visit> stack;
+  auto pushChildren = [&](const MeasurementInfoOut &node) {
+    for (const auto &keyVal : node.children) {
+      auto inserted = indices.emplace(keyVal.first, profile.entries.size());
+      if (inserted.second) {
+        profile.entries.emplace_back();
+        profile.entries.back().name = keyVal.first;
+        onPath.push_back(0);
+      }
+      stack.push_back({keyVal.second.get(), inserted.first->second, false});
+    }
+  };
+  pushChildren(root);
+  while (!stack.empty()) {
+    Visit visit = stack.back();
+    stack.pop_back();
+    if (visit.leave) {
+      onPath[visit.entry]--;
+      continue;
+    }
+    const MeasurementInfoOut &node = *visit.node;
+    FlatEntryOut &entry = profile.entries[visit.entry];
+    double selfTime = std::max(0.0, node.totalTime - node.childrenTime);
+    entry.selfTime += selfTime;
+    profile.selfTime += selfTime;
+    if (onPath[visit.entry] == 0) entry.totalTime += node.totalTime;
+    entry.timesExecuted += node.timesExecuted;
+    onPath[visit.entry]++;
+    stack.push_back({visit.node, visit.entry, true});
+    pushChildren(node);
+  }
+
+  profile.identifiers = profile.entries.size();
+  auto order = [](const FlatEntryOut &a, const FlatEntryOut &b) -> bool {
+    return a.selfTime != b.selfTime ? a.selfTime > b.selfTime : a.name < b.name;
+  };
+  if (top > 0 && top < profile.entries.size()) {
+    std::partial_sort(profile.entries.begin(), profile.entries.begin() + top, profile.entries.end(), order);
+    profile.entries.resize(top);
+  } else {
+    std::sort(profile.entries.begin(), profile.entries.end(), order);
+  }
+  return profile;
+}
+inline std::string generateError(const std::string &msg, Format format) {
+  std::string result;
+  switch (format) {
+    case Format::table:
+      result += "\n=============== Benchmark Error ===============\n";
+      result += msg;
+      result += "\n===============================================\n";
+      break;
+    case Format::json:
+      result = "{\"error\":\"" + jsonEscaped(msg) + "\"}";
+      break;
   }
+  return result;
+}
+
+/// Общая часть `benchmarkLog` и `benchmarkLogFromTrace`: сортировка дерева и вывод
+/// \param traceSource Описание файла трейсинга, `nullptr` - замеры текущего процесса
+static std::string generateOutput(MeasurementInfoOut &root, const CountersOut &counters, Field withoutFields, Format format,
+                                  View view, const std::string *traceSource, std::ostream *out) {
+  sortChildren(root);
   root.totalTime = 0;
   for (const auto &keyVal : root.children) {
     root.totalTime += keyVal.second->totalTime;
   }
+  FlatProfileOut flat;
+  if (view == View::flat) {
+    flat = collectFlatProfile(root, flatViewTop.load());
+  }
+  const FlatProfileOut *flatOut = view == View::flat ? &flat : nullptr;
   
   std::stringstream result;
   bool returnEmptyString = false;
@@ -391,10 +2115,10 @@ std::string benchmarkLog(Field withoutFields, Format format, std::ostream *out)
   }
   switch (format) {
     case Format::table:
-      generateTableOutput(root, withoutFields, *out);
+      generateTableOutput(root, flatOut, counters, withoutFields, traceSource, *out);
       break;
     case Format::json:
-      generateJsonOutput(root, withoutFields, *out);
+      generateJsonOutput(root, flatOut, counters, withoutFields, traceSource, *out);
       break;
   }
   if (returnEmptyString) {
@@ -402,76 +2126,571 @@ std::string benchmarkLog(Field withoutFields, Format format, std::ostream *out)
   } else {
     return result.str();
   }
+}
+
+struct MeasurementInfoOut;
+std::string benchmarkLog(Field withoutFields, Format format, std::ostream *out, View view) {
+#ifndef BENCHMARK_DISABLED
+  MeasurementInfoOut root = unionMeasurements(view == View::threads);
+  CountersOut counters = unionCounters();
+  if (overheadCompensation) {
+    if (overheadPerCall.load() < 0) {
+      benchmarkCalibrate();
+    }
+    subtractOverhead(root, overheadPerCall.load(), overheadInside.load());
+  }
+  return generateOutput(root, counters, withoutFields, format, view, nullptr, out);
+#else
+  return std::string();
+#endif
+}
+
+#ifndef BENCHMARK_DISABLED
+/// Переносит статистику, восстановленную по трейсу, в дерево вывода
+static void traceStatsToOut(Tracing::TraceStatsNode &stats, const std::map<int32_t, std::string> &threadNames,
+                            MeasurementInfoOut &out) {
+  for (auto &keyVal : stats.children) {
+    Tracing::TraceStatsNode &node = *keyVal.second;
+    auto &child = out.children[keyVal.first];
+    child = std::unique_ptr<MeasurementInfoOut>(new MeasurementInfoOut());
+    child->totalTime = node.totalTime;
+    child->timesExecuted = node.timesExecuted;
+    child->maxTime = node.maxTime;
+    child->sumSquares = node.sumSquares;
+    for (const auto &last : node.last) {
+      child->lastTimesTotal += last.second;
+      child->lastTimesSquares += last.second * last.second;
+    }
+    child->lastCount = node.last.size();
+    child->lastTime = node.last.empty() ? 0.0 : child->lastTimesTotal / (double)child->lastCount;
+    for (const auto &thread : node.threads) {
+      auto name = threadNames.find(thread.first);
+      child->threads.push_back({name != threadNames.end() ? name->second : "thread " + std::to_string(thread.first),
+                                thread.second.first, thread.second.second, 0});
+    }
+    out.childrenTime += node.totalTime;
+    traceStatsToOut(node, threadNames, *child);
+  }
+  stats.children.clear();
+}
+#endif
+
+std::string benchmarkLogFromTrace(const std::string &tracePath, double fromSec, double toSec, Field withoutFields,
+                                  Format format, std::ostream *out, View view, std::string *outError) {
+#ifndef BENCHMARK_DISABLED
+  Tracing::TraceStatsOptions options;
+  options.fromSec = fromSec;
+  options.toSec = toSec;
+  options.lastCount = CAPTURE_LAST_N_TIMES;
+  options.perThread = view == View::threads;
+  Tracing::TraceStats stats;
+  std::string err;
+  if (!Tracing::readTraceStats(tracePath, options, stats, err)) {
+    if (outError) *outError = err;
+    std::string msg = generateError(err, format);
+    if (out) {
+      *out << msg;
+      return "";
+    }
+    return msg;
+  }
+  MeasurementInfoOut root;
+  traceStatsToOut(stats.root, stats.threadNames, root);
+  CountersOut counters;
+  for (const auto &keyVal : stats.counters) {
+    CounterInfo info;
+    info.lastValue = keyVal.second.lastValue;
+    info.minValue = keyVal.second.minValue;
+    info.maxValue = keyVal.second.maxValue;
+    info.sum = keyVal.second.sum;
+    info.count = keyVal.second.count;
+    counters.emplace_back(keyVal.first, info);
+  }
+  std::stringstream source;
+  source << "trace: " << tracePath;
+  if (fromSec > 0 || toSec > 0) {
+    source << std::setprecision(3) << std::fixed << ", " << fromSec << " - ";
+    if (toSec > 0) {
+      source << toSec << " s";
+    } else {
+      source << "end";
+    }
+  }
+  source << ", " << stats.spans << " spans";
+  if (stats.truncated) {
+    source << "\nfile is truncated, spans that were still open are missing";
+  }
+  if (stats.approximated > 0) {
+    source << "\n" << stats.approximated << " spans waited too long for their parent, their nesting is approximate";
+  }
+  std::string sourceString = source.str();
+  return generateOutput(root, counters, withoutFields, format, view, &sourceString, out);
 #else
+  (void)tracePath;
+  (void)fromSec;
+  (void)toSec;
+  (void)withoutFields;
+  (void)format;
+  (void)out;
+  (void)view;
+  (void)outError;
   return std::string();
 #endif
 }
 
-static void generateTableRowsRecursive(const MeasurementInfoOut &root, double totalExecutionTime, int level, const Field &withoutFields, std::vector<std::vector<std::string>> &outRows) {
-  
+/// Строки узла по потокам, самый загруженный поток первым
+static void generateThreadRows(const MeasurementInfoOut &info, int level, const Field &withoutFields, std::vector<std::vector<std::string>> &outRows) {
+  std::vector<const ThreadInfoOut *> threads;
+  for (const auto &thread : info.threads) threads.push_back(&thread);
+  sort(threads.begin(), threads.end(), [](const ThreadInfoOut *a, const ThreadInfoOut *b) -> bool {
+    return a->totalTime > b->totalTime;
+  });
+  std::stringstream ss;
+  for (const auto *thread : threads) {
+    std::vector<std::string> row;
+    row.push_back(std::string(level*2, ' ') + "[" + thread->name + "]:");
+    ss << std::setprecision(2) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::total)) {
+      row.emplace_back("   total:");
+      row.emplace_back(formatString(ss, thread->totalTime / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::times)) {
+      row.emplace_back("   times:");
+      row.emplace_back(formatString(ss, thread->timesExecuted));
+    }
+    if (!static_cast<bool>(withoutFields & Field::average)) {
+      row.emplace_back("   avg:");
+      double avg = thread->timesExecuted == 0 ? 0.0 : (thread->totalTime / (double)thread->timesExecuted);
+      row.emplace_back(formatString(ss, avg / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::running)) {
+      row.emplace_back("   running:");
+      row.emplace_back(formatString(ss, thread->currentRunningTime / 1000.));
+    }
+    ss << std::setprecision(1) << std::fixed;
+    row.emplace_back("   share:");
+    double share = info.totalTime == 0 ? 0 : thread->totalTime / info.totalTime;
+    row.emplace_back(formatString(ss, int(share * 1000) / 10.) + " %");
+    outRows.push_back(std::move(row));
+  }
+}
+
+static void generateTableRowsRecursive(const MeasurementInfoOut &root, double totalExecutionTime, int level, const Field &withoutFields, std::vector<std::vector<std::string>> &outRows) {
+  
+  std::stringstream ss;
+  
+  for (const auto &key: root.childrenOrder) {
+    std::vector<std::string> row;
+    row.push_back(std::string(level*2, ' ') + key + ":");
+    const auto &info = *root.children.at(key);
+    
+    ss << std::setprecision(2) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::total)) {
+      row.emplace_back("   total:");
+      row.emplace_back(formatString(ss, info.totalTime / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::times)) {
+      row.emplace_back("   times:");
+      row.emplace_back(formatString(ss, info.timesExecuted));
+    }
+    if (!static_cast<bool>(withoutFields & Field::average)) {
+      row.emplace_back("   avg:");
+      double avg = info.timesExecuted == 0 ? 0.0 : (info.totalTime / (double)info.timesExecuted);
+      row.emplace_back(formatString(ss, avg / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::lastAverage)) {
+      row.emplace_back("   last avg:");
+      row.emplace_back(formatString(ss, info.lastTime / 1000.));
+    }
+    if (!static_cast<bool>(withoutFields & Field::running)) {
+      row.emplace_back("   running:");
+      row.emplace_back(formatString(ss, info.currentRunningTime / 1000.));
+    }
+    
+    ss << std::setprecision(1) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::percent)) {
+      row.emplace_back("   percent:");
+      double percent = totalExecutionTime == 0 ? 0 : info.totalTime / totalExecutionTime;
+      row.emplace_back(formatString(ss, int(percent * 1000) / 10.) + " %");
+    }
+    if (!static_cast<bool>(withoutFields & Field::percentMissed)) {
+      row.emplace_back("   missed:");
+      double missed = (totalExecutionTime == 0 || info.childrenTime == 0) ? 0 : std::max(0.0, info.totalTime - info.childrenTime) / totalExecutionTime;
+      row.emplace_back(formatString(ss, int(missed * 1000) / 10.) + " %");
+    }
+    if (!static_cast<bool>(withoutFields & Field::budget) && info.budget > 0) {
+      ss << std::setprecision(2) << std::fixed;
+      row.emplace_back("   budget:");
+      row.emplace_back(formatString(ss, info.budget / 1000.));
+      row.emplace_back("   over:");
+      row.emplace_back(formatString(ss, info.budgetViolations));
+      row.emplace_back("   max:");
+      row.emplace_back(formatString(ss, info.maxTime / 1000.));
+    }
+    if (info.elapsedTime > 0 && info.timesExecuted > 0) {
+      ss << std::setprecision(2) << std::fixed;
+      row.emplace_back("   elapsed:");
+      row.emplace_back(formatString(ss, info.elapsedTime / info.timesExecuted / 1000.));
+    }
+    double drift, score;
+    if (!static_cast<bool>(withoutFields & Field::drift) && nodeDrift(info, drift, score)) {
+      ss << std::setprecision(1) << std::fixed << std::showpos;
+      row.emplace_back("   drift:");
+      row.emplace_back(formatString(ss, int(drift * 1000) / 10.) + (score > 0 ? " % !" : " %  "));
+      ss << std::noshowpos;
+    }
+    double threadMin, threadAvg, threadMax;
+    if (threadImbalance(info, threadMin, threadAvg, threadMax)) {
+      ss << std::setprecision(2) << std::fixed;
+      row.emplace_back("   threads:");
+      row.emplace_back(formatString(ss, info.threads.size()));
+      row.emplace_back("   min:");
+      row.emplace_back(formatString(ss, threadMin / 1000.));
+      row.emplace_back("   avg:");
+      row.emplace_back(formatString(ss, threadAvg / 1000.));
+      row.emplace_back("   max:");
+      row.emplace_back(formatString(ss, threadMax / 1000.));
+      row.emplace_back("   imbalance:");
+      row.emplace_back(formatString(ss, threadAvg == 0 ? 1.0 : threadMax / threadAvg));
+    }
+    
+    outRows.push_back(std::move(row));
+    generateThreadRows(info, level + 1, withoutFields, outRows);
+    // мне не нравится рекурсия, но пока так; без рекурсии пока не придумал как меньше кода написать
+    if (!info.children.empty()) {
+      generateTableRowsRecursive(info, totalExecutionTime, level+1, withoutFields, outRows);
+    }
+  }
+}
+
+static void generateCounterRows(const CountersOut &counters, std::vector<std::vector<std::string>> &outRows) {
+  std::stringstream ss;
+  ss << std::setprecision(2) << std::fixed;
+  for (const auto &keyVal : counters) {
+    const CounterInfo &info = keyVal.second;
+    std::vector<std::string> row;
+    row.push_back(keyVal.first + ":");
+    row.emplace_back("   last:");
+    row.emplace_back(formatString(ss, info.lastValue));
+    row.emplace_back("   min:");
+    row.emplace_back(formatString(ss, info.minValue));
+    row.emplace_back("   max:");
+    row.emplace_back(formatString(ss, info.maxValue));
+    row.emplace_back("   avg:");
+    row.emplace_back(formatString(ss, info.count == 0 ? 0.0 : info.sum / (double)info.count));
+    outRows.push_back(std::move(row));
+  }
+}
+
+#ifndef BUDGET_WORST_OFFENDERS
+#define BUDGET_WORST_OFFENDERS 10
+#endif
+
+struct BudgetOffender {
+  std::string path;
+  const MeasurementInfoOut *info;
+};
+
+static void collectBudgetOffenders(const MeasurementInfoOut &root, std::vector<std::string> &path, std::vector<BudgetOffender> &out) {
+  for (const auto &key : root.childrenOrder) {
+    const auto &info = *root.children.at(key);
+    path.push_back(key);
+    if (info.budgetViolations > 0) {
+      out.push_back({joined(path), &info});
+    }
+    collectBudgetOffenders(info, path, out);
+    path.pop_back();
+  }
+}
+
+static void generateBudgetRows(const MeasurementInfoOut &root, std::vector<std::vector<std::string>> &outRows) {
+  std::vector<BudgetOffender> offenders;
+  std::vector<std::string> path;
+  collectBudgetOffenders(root, path, offenders);
+  auto rate = [](const MeasurementInfoOut &info) -> double {
+    return info.timesExecuted == 0 ? 0.0 : info.budgetViolations / (double)info.timesExecuted;
+  };
+  sort(offenders.begin(), offenders.end(), [&rate](const BudgetOffender &a, const BudgetOffender &b) -> bool {
+    return rate(*a.info) > rate(*b.info);
+  });
+  if (offenders.size() > BUDGET_WORST_OFFENDERS) {
+    offenders.resize(BUDGET_WORST_OFFENDERS);
+  }
+
+  std::stringstream ss;
+  for (const auto &offender : offenders) {
+    const auto &info = *offender.info;
+    std::vector<std::string> row;
+    row.push_back(offender.path + ":");
+    ss << std::setprecision(2) << std::fixed;
+    row.emplace_back("   budget:");
+    row.emplace_back(formatString(ss, info.budget / 1000.));
+    row.emplace_back("   over:");
+    row.emplace_back(formatString(ss, info.budgetViolations) + " / " + formatString(ss, info.timesExecuted));
+    row.emplace_back("   max:");
+    row.emplace_back(formatString(ss, info.maxTime / 1000.));
+    ss << std::setprecision(1) << std::fixed;
+    row.emplace_back("   rate:");
+    row.emplace_back(formatString(ss, int(rate(info) * 1000) / 10.) + " %");
+    outRows.push_back(std::move(row));
+  }
+}
+
+struct CardinalityOffender {
+  std::string path;         // путь узла overflowKey
+  size_t kept;              // идентификаторов уровня, попавших в реестр до переполнения
+  unsigned long redirected;
+  std::vector<std::string> examples;
+};
+
+/// Уровни, на которых сработал лимит числа узлов, по убыванию числа перенаправленных замеров
+static std::vector<CardinalityOffender> collectCardinalityOffenders() {
+  std::vector<CardinalityOffender> offenders;
+  std::lock_guard<std::mutex> lock(nodeRegistryMut);
+  for (const auto &keyVal : cardinalityOverflows) {
+    std::vector<std::string> path = {overflowKey};
+    for (uint32_t id = keyVal.first; id != 0 && id < nodeRegistry.size(); id = nodeRegistry[id].parent) {
+      path.insert(path.begin(), nodeRegistry[id].name);
+    }
+    offenders.push_back({joined(path), keyVal.second->kept.size(),
+                         keyVal.second->redirected.load(), keyVal.second->examples});
+  }
+  sort(offenders.begin(), offenders.end(), [](const CardinalityOffender &a, const CardinalityOffender &b) -> bool {
+    return a.redirected > b.redirected;
+  });
+  return offenders;
+}
+
+static void generateCardinalityRows(const std::vector<CardinalityOffender> &offenders, std::vector<std::vector<std::string>> &outRows) {
+  for (const auto &offender : offenders) {
+    std::vector<std::string> row;
+    row.push_back(offender.path + ":");
+    row.emplace_back("   kept:");
+    row.emplace_back(std::to_string(offender.kept));
+    row.emplace_back("   redirected:");
+    row.emplace_back(std::to_string(offender.redirected));
+    std::string examples;
+    for (const auto &example : offender.examples) {
+      examples += (examples.empty() ? "" : ", ") + example;
+    }
+    row.emplace_back("   e.g.: " + examples);
+    outRows.push_back(std::move(row));
+  }
+}
+
+static void generateErrorRows(const std::vector<ErrorReport> &errors, std::vector<std::vector<std::string>> &outRows) {
+  for (const auto &error : errors) {
+    std::vector<std::string> row;
+    row.push_back(std::string(errorKindName(error.kind)) + ":");
+    // сообщения об ошибках файлов многострочные, в таблице нужна одна строка
+    row.push_back(error.detail.empty() ? "" : "   " + singleLine(error.detail));
+    row.push_back(error.file.empty() ? "" : "   " + singleLine(error.file) + ":" + std::to_string(error.line));
+    row.emplace_back("   times:");
+    row.emplace_back(std::to_string(error.count));
+    row.push_back(error.kind == ErrorKind::stopMismatch ? "   unwound: " + std::to_string(error.unwound) : "");
+    outRows.push_back(std::move(row));
+  }
+}
+
+struct SampledFunction {
+  std::string name;
+  unsigned long samples;
+};
+
+struct SampleReport {
+  std::string path;         // путь замера, в котором был поток
+  unsigned long samples;
+  std::vector<SampledFunction> functions; // первые samplerState.topFunctions по числу сэмплов
+};
+
+#ifdef R_BENCHMARK_SAMPLER_SUPPORTED
+/// Имя функции по адресу; без `-rdynamic` функции исполняемого файла выводятся как `файл+смещение`
+static std::string symbolName(void *address) {
+  Dl_info info;
+  if (dladdr(address, &info) == 0) {
+    std::stringstream ss;
+    ss << address;
+    return ss.str();
+  }
+  if (info.dli_sname) {
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    std::string name = (status == 0 && demangled) ? demangled : info.dli_sname;
+    free(demangled);
+    return name;
+  }
+  std::string module = info.dli_fname ? info.dli_fname : "";
+  module = module.substr(module.find_last_of('/') + 1);
+  std::stringstream ss;
+  ss << module << "+0x" << std::hex << (reinterpret_cast<uintptr_t>(address) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+  return ss.str();
+}
+#endif
+
+/// Сэмплы по замерам, по убыванию числа сэмплов; символы ищутся здесь, а не в обработчике сигнала
+static std::vector<SampleReport> collectSampleReports() {
+  std::vector<SampleReport> reports;
+#ifdef R_BENCHMARK_SAMPLER_SUPPORTED
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  snapshotGroups(groups);
+  std::lock_guard<std::mutex> lock(samplerState.mut);
+  for (auto &group : groups) {
+    drainSamplesLocked(*group);
+  }
+  for (const auto &node : samplerState.counts) {
+    SampleReport report;
+    report.samples = 0;
+    {
+      std::lock_guard<std::mutex> registryLock(nodeRegistryMut);
+      std::vector<std::string> path;
+      for (uint32_t id = node.first; id != 0 && id < nodeRegistry.size(); id = nodeRegistry[id].parent) {
+        path.insert(path.begin(), nodeRegistry[id].name);
+      }
+      report.path = joined(path);
+    }
+    std::unordered_map<std::string, unsigned long> byName; // несколько адресов одной функции
+    for (const auto &address : node.second) {
+      auto it = samplerState.symbols.find(address.first);
+      if (it == samplerState.symbols.end()) {
+        it = samplerState.symbols.emplace(address.first, symbolName(address.first)).first;
+      }
+      byName[it->second] += address.second;
+      report.samples += address.second;
+    }
+    for (const auto &function : byName) {
+      report.functions.push_back({function.first, function.second});
+    }
+    sort(report.functions.begin(), report.functions.end(), [](const SampledFunction &a, const SampledFunction &b) -> bool {
+      return a.samples > b.samples || (a.samples == b.samples && a.name < b.name);
+    });
+    if (report.functions.size() > samplerState.topFunctions) {
+      report.functions.resize(samplerState.topFunctions);
+    }
+    reports.push_back(std::move(report));
+  }
+  sort(reports.begin(), reports.end(), [](const SampleReport &a, const SampleReport &b) -> bool {
+    return a.samples > b.samples;
+  });
+#endif
+  return reports;
+}
+
+static void generateSampleRows(const std::vector<SampleReport> &reports, std::vector<std::vector<std::string>> &outRows) {
+  std::stringstream ss;
+  ss << std::setprecision(1) << std::fixed;
+  for (const auto &report : reports) {
+    std::vector<std::string> row;
+    row.push_back(report.path + ":");
+    row.emplace_back("   samples:");
+    row.emplace_back(std::to_string(report.samples));
+    outRows.push_back(std::move(row));
+    for (const auto &function : report.functions) {
+      std::vector<std::string> functionRow;
+      functionRow.push_back("  " + function.name + ":");
+      functionRow.emplace_back("   samples:");
+      functionRow.emplace_back(std::to_string(function.samples));
+      functionRow.emplace_back("   share:");
+      functionRow.emplace_back(formatString(ss, int(function.samples * 1000. / report.samples) / 10.) + " %");
+      outRows.push_back(std::move(functionRow));
+    }
+  }
+}
+
+static void generateFlatRows(const FlatProfileOut &flat, const Field &withoutFields, std::vector<std::vector<std::string>> &outRows) {
   std::stringstream ss;
-  
-  for (const auto &key: root.childrenOrder) {
+  for (const auto &entry : flat.entries) {
     std::vector<std::string> row;
-    row.push_back(std::string(level*2, ' ') + key + ":");
-    const auto &info = *root.children.at(key);
-    
+    row.push_back(entry.name + ":");
     ss << std::setprecision(2) << std::fixed;
+    row.emplace_back("   self:");
+    row.emplace_back(formatString(ss, entry.selfTime / 1000.));
     if (!static_cast<bool>(withoutFields & Field::total)) {
       row.emplace_back("   total:");
-      row.emplace_back(formatString(ss, info.totalTime / 1000.));
+      row.emplace_back(formatString(ss, entry.totalTime / 1000.));
     }
     if (!static_cast<bool>(withoutFields & Field::times)) {
       row.emplace_back("   times:");
-      row.emplace_back(formatString(ss, info.timesExecuted));
+      row.emplace_back(formatString(ss, entry.timesExecuted));
     }
     if (!static_cast<bool>(withoutFields & Field::average)) {
-      row.emplace_back("   avg:");
-      double avg = info.timesExecuted == 0 ? 0.0 : (info.totalTime / (double)info.timesExecuted);
+      row.emplace_back("   avg self:");
+      double avg = entry.timesExecuted == 0 ? 0.0 : (entry.selfTime / (double)entry.timesExecuted);
       row.emplace_back(formatString(ss, avg / 1000.));
     }
-    if (!static_cast<bool>(withoutFields & Field::lastAverage)) {
-      row.emplace_back("   last avg:");
-      row.emplace_back(formatString(ss, info.lastTime / 1000.));
-    }
-    if (!static_cast<bool>(withoutFields & Field::running)) {
-      row.emplace_back("   running:");
-      row.emplace_back(formatString(ss, info.currentRunningTime / 1000.));
-    }
-    
     ss << std::setprecision(1) << std::fixed;
     if (!static_cast<bool>(withoutFields & Field::percent)) {
       row.emplace_back("   percent:");
-      double percent = totalExecutionTime == 0 ? 0 : info.totalTime / totalExecutionTime;
+      double percent = flat.selfTime == 0 ? 0 : entry.selfTime / flat.selfTime;
       row.emplace_back(formatString(ss, int(percent * 1000) / 10.) + " %");
     }
-    if (!static_cast<bool>(withoutFields & Field::percentMissed)) {
-      row.emplace_back("   missed:");
-      double missed = (totalExecutionTime == 0 || info.childrenTime == 0) ? 0 : std::max(0.0, info.totalTime - info.childrenTime) / totalExecutionTime;
-      row.emplace_back(formatString(ss, int(missed * 1000) / 10.) + " %");
-    }
-    
     outRows.push_back(std::move(row));
-    // мне не нравится рекурсия, но пока так; без рекурсии пока не придумал как меньше кода написать
-    if (!info.children.empty()) {
-      generateTableRowsRecursive(info, totalExecutionTime, level+1, withoutFields, outRows);
-    }
   }
 }
 
-static void generateTableOutput(const MeasurementInfoOut &root, const Field &withoutFields, std::ostream &out) {
+static void generateTableOutput(const MeasurementInfoOut &root, const FlatProfileOut *flat, const CountersOut &counters,
+                                const Field &withoutFields, const std::string *traceSource, std::ostream &out) {
   std::vector<std::vector<std::string>> rows;
-  generateTableRowsRecursive(root, root.totalTime, 0, withoutFields, rows);
+  if (flat) {
+    generateFlatRows(*flat, withoutFields, rows);
+  } else {
+    generateTableRowsRecursive(root, root.totalTime, 0, withoutFields, rows);
+  }
 
   out << "\n================== Benchmark ==================\n";
+  double overhead = overheadPerCall.load();
+  if (traceSource) {
+    out << *traceSource << "\n";
+  } else if (overhead >= 0) {
+    std::stringstream ss;
+    ss << std::setprecision(3) << std::fixed << overhead;
+    out << "overhead: " << ss.str() << " us per start/stop" << (overheadCompensation ? " (subtracted)" : "") << "\n";
+  }
+  if (flat) {
+    out << "flat: " << flat->entries.size() << " of " << flat->identifiers << " identifiers by self time\n";
+  }
   formGrid(rows, out);
+  if (!counters.empty()) {
+    std::vector<std::vector<std::string>> counterRows;
+    generateCounterRows(counters, counterRows);
+    out << "------------------- Counters ------------------\n";
+    formGrid(counterRows, out);
+  }
+  std::vector<std::vector<std::string>> budgetRows;
+  if (!static_cast<bool>(withoutFields & Field::budget)) {
+    generateBudgetRows(root, budgetRows);
+  }
+  if (!budgetRows.empty()) {
+    out << "--------------- Budget violations -------------\n";
+    formGrid(budgetRows, out);
+  }
+  // переполнения, сэмплы и ошибки относятся к текущему процессу, а не к трейсу
+  auto offenders = traceSource ? std::vector<CardinalityOffender>() : collectCardinalityOffenders();
+  if (!offenders.empty()) {
+    std::vector<std::vector<std::string>> cardinalityRows;
+    generateCardinalityRows(offenders, cardinalityRows);
+    out << "------------- Cardinality overflow ------------\n";
+    formGrid(cardinalityRows, out);
+  }
+  auto samples = traceSource ? std::vector<SampleReport>() : collectSampleReports();
+  if (!samples.empty()) {
+    std::vector<std::vector<std::string>> sampleRows;
+    generateSampleRows(samples, sampleRows);
+    out << "------------------- Samples -------------------\n";
+    formGrid(sampleRows, out);
+  }
+  auto errors = traceSource ? std::vector<ErrorReport>() : errorSites.collect();
+  if (!errors.empty()) {
+    std::vector<std::vector<std::string>> errorRows;
+    generateErrorRows(errors, errorRows);
+    out << "------------------- Errors --------------------\n";
+    formGrid(errorRows, out);
+  }
   out << "===============================================\n";
 }
 
-static void generateJsonOutput(const MeasurementInfoOut &root, double totalExecutionTime, const Field &withoutFields, std::ostream &out) {
+static void generateJsonItems(const MeasurementInfoOut &root, double totalExecutionTime, const Field &withoutFields, std::ostream &out) {
   std::stringstream ss;
 
-  out << "[";
   for (size_t i = 0; i < root.childrenOrder.size(); i++) {
     const auto &name = root.childrenOrder[i];
     const auto &info = *root.children.at(name);
@@ -491,7 +2710,7 @@ static void generateJsonOutput(const MeasurementInfoOut &root, double totalExecu
                                                                          totalExecutionTime;
 
     ss << std::setprecision(2) << std::fixed;
-    out << "\"name\":\"" << name << "\"";
+    out << "\"name\":\"" << jsonEscaped(name) << "\"";
     if (!static_cast<bool>(withoutFields & Field::total)) {
       out << ",\"total\":" << formatString(ss, totalTime / 1000.);
     }
@@ -515,36 +2734,639 @@ static void generateJsonOutput(const MeasurementInfoOut &root, double totalExecu
     if (!static_cast<bool>(withoutFields & Field::percentMissed)) {
       out << ",\"missed\":" << formatString(ss, int(missed * 1000) / 10.);
     }
+    if (!static_cast<bool>(withoutFields & Field::budget) && info.budget > 0) {
+      ss << std::setprecision(2) << std::fixed;
+      out << ",\"budget\":" << formatString(ss, info.budget / 1000.);
+      out << ",\"over budget\":" << formatString(ss, info.budgetViolations);
+      out << ",\"max\":" << formatString(ss, info.maxTime / 1000.);
+    }
+    if (info.elapsedTime > 0 && info.timesExecuted > 0) {
+      ss << std::setprecision(2) << std::fixed;
+      out << ",\"elapsed\":" << formatString(ss, info.elapsedTime / info.timesExecuted / 1000.);
+    }
+    double drift, score;
+    if (!static_cast<bool>(withoutFields & Field::drift) && nodeDrift(info, drift, score)) {
+      ss << std::setprecision(1) << std::fixed;
+      out << ",\"drift\":" << formatString(ss, int(drift * 1000) / 10.);
+      out << ",\"regression\":" << (score > 0 ? "true" : "false");
+    }
+    double threadMin, threadAvg, threadMax;
+    if (threadImbalance(info, threadMin, threadAvg, threadMax)) {
+      ss << std::setprecision(2) << std::fixed;
+      out << ",\"thread min\":" << formatString(ss, threadMin / 1000.);
+      out << ",\"thread avg\":" << formatString(ss, threadAvg / 1000.);
+      out << ",\"thread max\":" << formatString(ss, threadMax / 1000.);
+      out << ",\"imbalance\":" << formatString(ss, threadAvg == 0 ? 1.0 : threadMax / threadAvg);
+      out << ",\"threads\":[";
+      for (size_t t = 0; t < info.threads.size(); t++) {
+        const auto &thread = info.threads[t];
+        out << (t == 0 ? "{" : ",{") << "\"name\":\"" << jsonEscaped(thread.name) << "\"";
+        out << ",\"total\":" << formatString(ss, thread.totalTime / 1000.);
+        out << ",\"times\":" << formatString(ss, thread.timesExecuted);
+        out << "}";
+      }
+      out << "]";
+    }
 
-    if (info.children.empty()) {
-      out << "}";
-    } else {
-      out << ",\"children\":";
-      generateJsonOutput(info, totalExecutionTime, withoutFields, out);
+    if (!info.children.empty()) {
+      out << ",\"children\":[";
+      generateJsonItems(info, totalExecutionTime, withoutFields, out);
+      out << "]";
+    }
+    out << "}";
+  }
+}
+
+static void generateJsonCounterItems(const CountersOut &counters, bool first, std::ostream &out) {
+  std::stringstream ss;
+  ss << std::setprecision(2) << std::fixed;
+  for (const auto &keyVal : counters) {
+    const CounterInfo &info = keyVal.second;
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(keyVal.first) << "\",\"counter\":true";
+    out << ",\"last\":" << formatString(ss, info.lastValue);
+    out << ",\"min\":" << formatString(ss, info.minValue);
+    out << ",\"max\":" << formatString(ss, info.maxValue);
+    out << ",\"avg\":" << formatString(ss, info.count == 0 ? 0.0 : info.sum / (double)info.count);
+    out << "}";
+  }
+}
+
+static void generateJsonCardinalityItems(const std::vector<CardinalityOffender> &offenders, bool first, std::ostream &out) {
+  for (const auto &offender : offenders) {
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(offender.path) << "\",\"cardinality\":true";
+    out << ",\"kept\":" << offender.kept;
+    out << ",\"redirected\":" << offender.redirected;
+    out << ",\"examples\":[";
+    for (size_t i = 0; i < offender.examples.size(); i++) {
+      out << (i == 0 ? "\"" : ",\"") << jsonEscaped(offender.examples[i]) << "\"";
+    }
+    out << "]}";
+  }
+}
+
+static void generateJsonSampleItems(const std::vector<SampleReport> &reports, bool first, std::ostream &out) {
+  for (const auto &report : reports) {
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(report.path) << "\",\"sampled\":true";
+    out << ",\"samples\":" << report.samples;
+    out << ",\"functions\":[";
+    for (size_t i = 0; i < report.functions.size(); i++) {
+      out << (i == 0 ? "{" : ",{") << "\"name\":\"" << jsonEscaped(report.functions[i].name) << "\",\"samples\":" << report.functions[i].samples << "}";
+    }
+    out << "]}";
+  }
+}
+
+static void generateJsonErrorItems(const std::vector<ErrorReport> &errors, bool first, std::ostream &out) {
+  for (const auto &error : errors) {
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(error.detail) << "\",\"error\":\"" << errorKindName(error.kind) << "\"";
+    out << ",\"file\":\"" << jsonEscaped(error.file) << "\",\"line\":" << error.line;
+    out << ",\"times\":" << error.count;
+    if (error.kind == ErrorKind::stopMismatch) out << ",\"unwound\":" << error.unwound;
+    out << "}";
+  }
+}
+
+/// Строки View::flat помечены "flat": их не читает benchmarkLoadBaseline
+static void generateJsonFlatItems(const FlatProfileOut &flat, const Field &withoutFields, std::ostream &out) {
+  std::stringstream ss;
+  bool first = true;
+  for (const auto &entry : flat.entries) {
+    out << (first ? "{" : ",{");
+    first = false;
+    ss << std::setprecision(2) << std::fixed;
+    out << "\"name\":\"" << jsonEscaped(entry.name) << "\",\"flat\":true";
+    out << ",\"self\":" << formatString(ss, entry.selfTime / 1000.);
+    if (!static_cast<bool>(withoutFields & Field::total)) {
+      out << ",\"total\":" << formatString(ss, entry.totalTime / 1000.);
+    }
+    if (!static_cast<bool>(withoutFields & Field::times)) {
+      out << ",\"times\":" << formatString(ss, entry.timesExecuted);
+    }
+    if (!static_cast<bool>(withoutFields & Field::average)) {
+      double avg = entry.timesExecuted == 0 ? 0.0 : (entry.selfTime / (double)entry.timesExecuted);
+      out << ",\"avg self\":" << formatString(ss, avg / 1000.);
+    }
+    ss << std::setprecision(1) << std::fixed;
+    if (!static_cast<bool>(withoutFields & Field::percent)) {
+      double percent = flat.selfTime == 0 ? 0 : entry.selfTime / flat.selfTime;
+      out << ",\"percent\":" << formatString(ss, int(percent * 1000) / 10.);
     }
+    out << "}";
+  }
+}
+
+static void generateJsonOutput(const MeasurementInfoOut &root, const FlatProfileOut *flat, const CountersOut &counters,
+                               const Field &withoutFields, const std::string *traceSource, std::ostream &out) {
+  out << "[";
+  if (flat) {
+    generateJsonFlatItems(*flat, withoutFields, out);
+  } else {
+    generateJsonItems(root, root.totalTime, withoutFields, out);
   }
+  bool empty = flat ? flat->entries.empty() : root.childrenOrder.empty();
+  // счетчики, переполнения, сэмплы и ошибки добавляем в тот же массив верхнего уровня
+  // с пометкой "counter" / "cardinality" / "sampled" / "error"
+  generateJsonCounterItems(counters, empty, out);
+  auto offenders = traceSource ? std::vector<CardinalityOffender>() : collectCardinalityOffenders();
+  generateJsonCardinalityItems(offenders, empty && counters.empty(), out);
+  auto samples = traceSource ? std::vector<SampleReport>() : collectSampleReports();
+  generateJsonSampleItems(samples, empty && counters.empty() && offenders.empty(), out);
+  auto errors = traceSource ? std::vector<ErrorReport>() : errorSites.collect();
+  generateJsonErrorItems(errors, empty && counters.empty() && offenders.empty() && samples.empty(), out);
   out << "]";
 }
-static void generateJsonOutput(const MeasurementInfoOut &root, const Field &withoutFields, std::ostream &out) {
-  generateJsonOutput(root, root.totalTime, withoutFields, out);
+
+// Baseline
+#ifndef BENCHMARK_DISABLED
+static void generateBaselineItems(const MeasurementInfoOut &root, std::ostream &out) {
+  std::stringstream ss;
+  ss << std::setprecision(3) << std::fixed;
+  bool first = true;
+  for (const auto &keyVal : root.children) {
+    const auto &info = *keyVal.second;
+    double times = static_cast<double>(info.timesExecuted);
+    double avg = times == 0 ? 0.0 : info.totalTime / times;
+    double variance = times > 1 ? std::max(0.0, (info.sumSquares - avg * info.totalTime) / (times - 1)) : 0.0;
+    out << (first ? "{" : ",{");
+    first = false;
+    out << "\"name\":\"" << jsonEscaped(keyVal.first) << "\"";
+    out << ",\"times\":" << info.timesExecuted;
+    out << ",\"avg\":" << formatString(ss, avg / 1000.);
+    out << ",\"std\":" << formatString(ss, std::sqrt(variance) / 1000.);
+    if (!info.children.empty()) {
+      out << ",\"children\":[";
+      generateBaselineItems(info, out);
+      out << "]";
+    }
+    out << "}";
+  }
+}
+
+static void readBaselineItems(const Json::Value &items, std::vector<std::string> &path, BaselineMap &out) {
+  if (items.type != Json::Value::Type::array) return;
+  for (const auto &item : items.items) {
+    if (item.type != Json::Value::Type::object || item.find("counter") || item.find("cardinality") || item.find("sampled") ||
+        item.find("error") || item.find("flat")) continue;
+    path.push_back(item.string("name"));
+    BaselineStat stat;
+    stat.avg = item.number("avg") * 1000.;
+    stat.std = item.number("std") * 1000.;
+    stat.times = item.number("times");
+    out[joined(path)] = stat;
+    const Json::Value *children = item.find("children");
+    if (children) {
+      readBaselineItems(*children, path, out);
+    }
+    path.pop_back();
+  }
+}
+
+static void updateBaselineRecursive(MeasurementMap &map, std::vector<std::string> &path) {
+  for (auto &keyVal : map) {
+    path.push_back(keyVal.first);
+    keyVal.second->baseline = findBaseline(joined(path));
+    updateBaselineRecursive(keyVal.second->children, path);
+    path.pop_back();
+  }
+}
+#endif
+
+bool benchmarkSaveBaseline(const std::string &path, std::string *outError) {
+#ifndef BENCHMARK_DISABLED
+  MeasurementInfoOut root = unionMeasurements();
+  std::ofstream file(path);
+  if (!file.is_open()) {
+    if (outError) *outError = "RBenchmark could not open baseline file:\n" + path;
+    return false;
+  }
+  file << "{\"baseline\":[";
+  generateBaselineItems(root, file);
+  file << "]}";
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool benchmarkLoadBaseline(const std::string &path, std::string *outError) {
+#ifndef BENCHMARK_DISABLED
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    if (outError) *outError = "RBenchmark could not open baseline file:\n" + path;
+    return false;
+  }
+  Json::Value json;
+  Json::Reader reader(file);
+  if (!reader.parse(json)) {
+    if (outError) *outError = reader.error();
+    return false;
+  }
+  const Json::Value *items = json.type == Json::Value::Type::object ? json.find("baseline") : &json;
+  if (!items || items->type != Json::Value::Type::array) {
+    if (outError) *outError = "RBenchmark baseline file has unknown format:\n" + path;
+    return false;
+  }
+
+  std::unique_ptr<BaselineMap> baseline(new BaselineMap());
+  std::vector<std::string> keyPath;
+  readBaselineItems(*items, keyPath, *baseline);
+  {
+    std::lock_guard<std::mutex> lock(baselineMut);
+    activeBaseline = baseline.get();
+    loadedBaselines.push_back(std::move(baseline));
+  }
+
+  std::lock_guard<std::mutex> lock(mut);
+  for (auto &kv : measurementThreadMap) {
+    std::lock_guard<std::mutex> groupLock(kv.second->mut);
+    updateBaselineRecursive(kv.second->map, keyPath);
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void benchmarkSetRegressionThreshold(double minScore, double minDrift) {
+#ifndef BENCHMARK_DISABLED
+  regressionMinScore = minScore;
+  regressionMinDrift = minDrift;
+#endif
+}
+
+void benchmarkSetRegressionCallback(std::function<void(const RegressionInfo &)> callback) {
+#ifndef BENCHMARK_DISABLED
+  std::lock_guard<std::mutex> lock(baselineMut);
+  regressionCallback = std::move(callback);
+#endif
+}
+
+static std::string currentProcessName() {
+#if defined(__linux__)
+  std::ifstream comm("/proc/self/comm");
+  std::string name;
+  if (std::getline(comm, name) && !name.empty()) return name;
+#elif defined(__APPLE__)
+  const char *name = getprogname();
+  if (name) return name;
+#endif
+  return "process";
+}
+
+/// Описания процесса и потоков, пишутся в начале каждой сессии трейсинга и каждого сохранения flight recorder
+static void writeSessionDescriptors(Tracing::Serializer &serializer, const std::vector<std::shared_ptr<MeasurementGroup>> &groups) {
+  serializer.writeProcessName(currentProcessName());
+  for (auto &group : groups) {
+    writeThreadDescriptor(serializer, *group);
+  }
 }
 
 void benchmarkStartTracing(const std::string &writeJsonPath, const std::string &file, int line) {
   std::lock_guard<std::mutex> lock(mut);
   std::string err;
-  tracing = std::unique_ptr<Tracing::Serializer>(new Tracing::Serializer(writeJsonPath, false, err));
+  auto serializer = std::make_shared<Tracing::Serializer>(Tracing::compressedPath(writeJsonPath, tracingCompression),
+                                                          false, err, tracingCompression, true);
   if (!err.empty()) {
-    tracing.reset(nullptr);
-    errorMsg.update(err, file, line);
+    errorSites.update(ErrorKind::io, err.c_str(), file.c_str(), line);
+    return;
   }
+#ifndef BENCHMARK_DISABLED
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  for (auto &kv : measurementThreadMap) groups.push_back(kv.second);
+  writeSessionDescriptors(*serializer, groups);
+#endif
+  // потоки, которые еще пишут в старый serializer, держат его через shared_ptr
+  auto previous = std::atomic_exchange(&tracing, serializer);
+  tracingEnabled = true;
+  if (previous) previous->end();
 }
 void benchmarkStopTracing() {
   std::lock_guard<std::mutex> lock(mut);
-  tracing.reset(nullptr);
+  tracingEnabled = false;
+  auto previous = std::atomic_exchange(&tracing, std::shared_ptr<Tracing::Serializer>());
+  if (previous) previous->end();
+  binaryTracingEnabled = false;
+  // файл закрывается, когда его отпустит последний пишущий поток
+  std::atomic_exchange(&binaryTracing, std::shared_ptr<Tracing::BinaryTraceFile>());
+}
+
+bool benchmarkStartBinaryTracing(const std::string &path, size_t capacityMb, const std::string &file, int line) {
+#ifndef BENCHMARK_DISABLED
+  std::lock_guard<std::mutex> lock(mut);
+  std::string err;
+  auto binary = std::make_shared<Tracing::BinaryTraceFile>(path, capacityMb * 1024 * 1024, get_timestamp(), err);
+  if (!err.empty()) {
+    errorSites.update(ErrorKind::io, err.c_str(), file.c_str(), line);
+    return false;
+  }
+  std::atomic_exchange(&binaryTracing, binary);
+  binaryTracingEnabled = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+TraceCompression benchmarkSetTracingCompression(TraceCompression compression) {
+  std::lock_guard<std::mutex> lock(mut);
+  tracingCompression = Tracing::availableCompression(static_cast<Tracing::Compression>(compression));
+  return static_cast<TraceCompression>(tracingCompression);
+}
+
+void benchmarkThreadName(const std::string &name) {
+#ifndef BENCHMARK_DISABLED
+  auto &group = getMeasurementGroup();
+  {
+    std::lock_guard<std::mutex> lock(group.mut);
+    group.thread.name = name;
+  }
+  auto serializer = activeTracing();
+  if (serializer) writeThreadDescriptor(*serializer, group);
+#endif
 }
 
 void benchmarkTracingThreadName(const std::string &name) {
-  if (tracing) tracing->writeThreadName(std::this_thread::get_id(), name);
+  benchmarkThreadName(name);
+}
+
+// Flight recorder
+#ifndef BENCHMARK_DISABLED
+static std::string flightRecorderDumpPath(unsigned index) {
+  const std::string &path = flightRecorderState.dumpPath;
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = path.size();
+  }
+  return path.substr(0, dot) + "_" + std::to_string(index) + path.substr(dot);
+}
+
+static bool dumpFlightRecorder(const std::string &jsonPath) {
+  std::vector<Tracing::TraceInfo> events;
+  std::vector<std::shared_ptr<MeasurementGroup>> groups;
+  std::string path = jsonPath;
+  Tracing::Compression compression;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (!flightRecorderState.enabled) return false;
+    if (path.empty()) {
+      path = flightRecorderDumpPath(++flightRecorderState.dumpIndex);
+    }
+    compression = tracingCompression;
+    auto now = get_timestamp();
+    auto fromTime = now > flightRecorderState.keepTime ? now - flightRecorderState.keepTime : 0;
+    for (auto &kv : measurementThreadMap) {
+      MeasurementGroup &group = *kv.second;
+      groups.push_back(kv.second);
+      std::lock_guard<std::mutex> groupLock(group.flightRecorderMut);
+      if (group.flightRecorder) {
+        group.flightRecorder->collect(fromTime, events);
+      }
+    }
+  }
+  // пишем файл без глобальной блокировки, остальные потоки продолжают работать
+  std::string err;
+  Tracing::Serializer serializer(Tracing::compressedPath(path, compression), false, err, compression);
+  if (!err.empty()) {
+    errorSites.update(ErrorKind::io, err.c_str(), "", 0);
+    return false;
+  }
+  writeSessionDescriptors(serializer, groups);
+  for (auto &info : events) {
+    serializer.saveTrace(std::move(info));
+  }
+  serializer.end();
+  return true;
+}
+
+static void processFlightRecorder(MeasurementGroup &group, const Tracing::TraceInfo &info) {
+  {
+    std::lock_guard<std::mutex> lock(group.flightRecorderMut);
+    if (!flightRecorderState.enabled) {
+      group.flightRecorder.reset(nullptr);
+      return;
+    }
+    if (!group.flightRecorder) {
+      group.flightRecorder = std::unique_ptr<Tracing::RingBuffer>(new Tracing::RingBuffer(flightRecorderState.eventsPerThread));
+    }
+    group.flightRecorder->push(info);
+  }
+
+  bool dump = flightRecorderState.dumpRequested.exchange(false);
+  auto threshold = flightRecorderState.slowSpanThreshold.load(std::memory_order_relaxed);
+  if (!dump && threshold > 0 && info.duration > threshold) {
+    auto now = get_timestamp();
+    auto lastDump = flightRecorderState.lastDumpTime.load();
+    // не сохраняем повторно тот же участок времени
+    dump = (lastDump == 0 || now - lastDump >= flightRecorderState.keepTime) &&
+           flightRecorderState.lastDumpTime.compare_exchange_strong(lastDump, now);
+  }
+  if (dump) {
+    {
+      std::lock_guard<std::mutex> lock(flightRecorderState.writerMut);
+      flightRecorderState.writerPending = true;
+    }
+    flightRecorderState.writerCv.notify_one();
+  }
+}
+
+/// Сохраняет flight recorder по запросу из benchmarkStop, а также по сигналу, если замеров нет
+static void flightRecorderWriterLoop() {
+  std::unique_lock<std::mutex> lock(flightRecorderState.writerMut);
+  while (!flightRecorderState.writerStop) {
+    flightRecorderState.writerCv.wait_for(lock, std::chrono::milliseconds(R_TRACE_WRITE_INTERVAL_MS), []() {
+      return flightRecorderState.writerPending || flightRecorderState.writerStop;
+    });
+    if (flightRecorderState.writerStop) break;
+    bool dump = flightRecorderState.writerPending || flightRecorderState.dumpRequested.exchange(false);
+    flightRecorderState.writerPending = false;
+    if (!dump) continue;
+    lock.unlock();
+    dumpFlightRecorder("");
+    lock.lock();
+  }
+}
+
+static void startFlightRecorderWriter() {
+  std::lock_guard<std::mutex> controlLock(flightRecorderState.writerControlMut);
+  if (!flightRecorderState.writer.joinable()) {
+    flightRecorderState.writer = std::thread(flightRecorderWriterLoop);
+  }
+}
+
+static void flightRecorderSignalHandler(int) {
+  flightRecorderState.dumpRequested.store(true);
+}
+#endif
+
+void benchmarkStartFlightRecorder(const std::string &dumpJsonPath, double keepSeconds, size_t eventsPerThread) {
+#ifndef BENCHMARK_DISABLED
+  std::unique_lock<std::mutex> lock(mut);
+  flightRecorderState.enabled = false;
+  for (auto &kv : measurementThreadMap) {
+    std::lock_guard<std::mutex> groupLock(kv.second->flightRecorderMut);
+    kv.second->flightRecorder.reset(nullptr);
+  }
+  flightRecorderState.dumpPath = dumpJsonPath;
+  flightRecorderState.keepTime = static_cast<timestamp_t>(keepSeconds * 1000000.);
+  flightRecorderState.eventsPerThread = eventsPerThread;
+  flightRecorderState.dumpIndex = 0;
+  flightRecorderState.lastDumpTime = 0;
+  flightRecorderState.enabled = true;
+  lock.unlock();
+  startFlightRecorderWriter();
+#endif
+}
+
+void benchmarkStopFlightRecorder() {
+#ifndef BENCHMARK_DISABLED
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    flightRecorderState.enabled = false;
+    for (auto &kv : measurementThreadMap) {
+      std::lock_guard<std::mutex> groupLock(kv.second->flightRecorderMut);
+      kv.second->flightRecorder.reset(nullptr);
+    }
+  }
+  flightRecorderState.stopWriter();
+#endif
+}
+
+bool benchmarkDumpFlightRecorder(const std::string &jsonPath) {
+#ifndef BENCHMARK_DISABLED
+  return dumpFlightRecorder(jsonPath);
+#else
+  return false;
+#endif
+}
+
+void benchmarkFlightRecorderDumpOnSignal(int signalNumber) {
+#ifndef BENCHMARK_DISABLED
+  std::signal(signalNumber, flightRecorderSignalHandler);
+#endif
+}
+
+void benchmarkFlightRecorderDumpOnSlowSpan(double thresholdMs) {
+#ifndef BENCHMARK_DISABLED
+  flightRecorderState.slowSpanThreshold = thresholdMs <= 0 ? 0 : static_cast<timestamp_t>(thresholdMs * 1000.);
+#endif
+}
+
+// Sampler
+#if !defined(BENCHMARK_DISABLED) && defined(R_BENCHMARK_SAMPLER_SUPPORTED)
+/// Адрес прерванной инструкции, `nullptr` на неизвестной архитектуре
+static void *interruptedAddress(void *context) {
+  auto *ucontext = static_cast<ucontext_t *>(context);
+#if defined(__linux__) && defined(__x86_64__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__linux__) && defined(__i386__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext.gregs[REG_EIP]);
+#elif defined(__linux__) && defined(__aarch64__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext.pc);
+#elif defined(__APPLE__) && defined(__x86_64__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext->__ss.__rip);
+#elif defined(__APPLE__) && defined(__aarch64__)
+  return reinterpret_cast<void *>(ucontext->uc_mcontext->__ss.__pc);
+#else
+  (void)ucontext;
+  return nullptr;
+#endif
+}
+
+/// Только async-signal-safe действия: чтение ucontext и запись в буфер своего потока без блокировок и выделения памяти
+static void samplerSignalHandler(int, siginfo_t *, void *context) {
+  int savedErrno = errno;
+  MeasurementGroup *group = samplerGroup;
+  SampleBuffer *buffer = group ? group->sampleBuffer.load(std::memory_order_acquire) : nullptr;
+  uint32_t nodeId = group ? group->currentNodeId.load(std::memory_order_relaxed) : 0;
+  void *address = interruptedAddress(context);
+  // вне замеров сэмплы не нужны
+  if (buffer && nodeId != 0 && address && samplerState.enabled.load(std::memory_order_relaxed)) {
+    size_t write = buffer->writeIdx.load(std::memory_order_relaxed);
+    if (write - buffer->readIdx.load(std::memory_order_acquire) >= R_BENCHMARK_SAMPLER_CAPACITY) {
+      buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      Sample &sample = buffer->samples[write % R_BENCHMARK_SAMPLER_CAPACITY];
+      sample.nodeId = nodeId;
+      sample.address = address;
+      buffer->writeIdx.store(write + 1, std::memory_order_release);
+    }
+  }
+  errno = savedErrno;
+}
+#endif
+
+bool benchmarkStartSampler(int frequencyHz, size_t topFunctions) {
+#if !defined(BENCHMARK_DISABLED) && defined(R_BENCHMARK_SAMPLER_SUPPORTED)
+  if (frequencyHz <= 0) return false;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = samplerSignalHandler;
+  action.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, nullptr);
+
+  std::lock_guard<std::mutex> lock(mut);
+  std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+  samplerState.topFunctions = std::max(topFunctions, (size_t)1);
+  samplerState.intervalNs = std::max(1L, 1000000000L / frequencyHz);
+  for (auto &kv : measurementThreadMap) {
+    if (!kv.second->sampleBuffer.load()) kv.second->sampleBuffer = new SampleBuffer();
+  }
+  samplerState.enabled = true;
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  // таймер на каждый зарегистрированный поток, новые потоки получают таймер в getMeasurementGroup
+  for (auto &kv : measurementThreadMap) {
+    if (kv.first == std::thread::id()) continue; // группа завершившихся потоков
+    stopSamplerTimerLocked(*kv.second);
+    startSamplerTimerLocked(*kv.second);
+  }
+#else
+  // ITIMER_PROF считает процессорное время процесса, сигнал получает поток, который сейчас работает
+  long intervalUs = std::max(1L, samplerState.intervalNs / 1000);
+  itimerval timer;
+  timer.it_interval.tv_sec = intervalUs / 1000000;
+  timer.it_interval.tv_usec = intervalUs % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+    samplerState.enabled = false;
+    samplerState.intervalNs = 0;
+    return false;
+  }
+#endif
+  return true;
+#else
+  (void)frequencyHz;
+  (void)topFunctions;
+  return false;
+#endif
+}
+
+void benchmarkStopSampler() {
+#if !defined(BENCHMARK_DISABLED) && defined(R_BENCHMARK_SAMPLER_SUPPORTED)
+  std::lock_guard<std::mutex> lock(mut);
+  std::lock_guard<std::mutex> samplerLock(samplerState.mut);
+#ifdef R_BENCHMARK_SAMPLER_THREAD_TIMERS
+  for (auto &kv : measurementThreadMap) {
+    stopSamplerTimerLocked(*kv.second);
+  }
+#else
+  itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+  samplerState.intervalNs = 0;
+  // обработчик остается: уже отправленный SIGPROF с действием по умолчанию завершил бы процесс
+  samplerState.enabled = false;
+#endif
 }
 
 } // namespace roadar
@@ -0,0 +1,295 @@
+#include "binary_trace.hpp"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <new>
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define R_BINARY_TRACE_SUPPORTED
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+static const char binaryMagic[8] = {'R', 'B', 'T', 'R', 'A', 'C', 'E', '1'};
+static const uint32_t binaryVersion = 1;
+static std::atomic<uint64_t> binarySessions{0};
+
+void BinaryTraceFile::commit(BinaryRecord &record, BinaryRecordType type) {
+  std::atomic_signal_fence(std::memory_order_release);
+  record.type = static_cast<uint8_t>(type);
+}
+
+BinaryTraceFile::BinaryTraceFile(const std::string &path, size_t capacity, uint64_t startTime, std::string &outErrMsg)
+: session_(++binarySessions) {
+#ifdef R_BINARY_TRACE_SUPPORTED
+  const size_t chunkSize = R_BINARY_TRACE_CHUNK;
+  uint32_t chunkCount = (uint32_t)std::max<size_t>(capacity / chunkSize, 1);
+  size_t headerSize = sizeof(BinaryTraceHeader) + chunkCount * sizeof(uint32_t);
+  size_t dataOffset = (headerSize + chunkSize - 1) / chunkSize * chunkSize;
+  size_ = dataOffset + (size_t)chunkCount * chunkSize;
+
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0 || ftruncate(fd_, (off_t)size_) != 0) {
+    outErrMsg = "RBenchmark::Tracing::BinaryTraceFile could not create results file:\n" + path;
+    if (fd_ >= 0) close(fd_);
+    fd_ = -1;
+    return;
+  }
+  void *mapped = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (mapped == MAP_FAILED) {
+    outErrMsg = "RBenchmark::Tracing::BinaryTraceFile could not map results file:\n" + path;
+    close(fd_);
+    fd_ = -1;
+    return;
+  }
+  char *base = static_cast<char *>(mapped);
+  // файл после ftruncate заполнен нулями, заполняем только заголовок
+  header_ = new (base) BinaryTraceHeader();
+  memcpy(header_->magic, binaryMagic, sizeof(binaryMagic));
+  header_->version = binaryVersion;
+  header_->recordSize = sizeof(BinaryRecord);
+  header_->chunkSize = (uint32_t)chunkSize;
+  header_->chunkCount = chunkCount;
+  header_->dataOffset = dataOffset;
+  header_->startTime = startTime;
+  owners_ = reinterpret_cast<uint32_t *>(base + sizeof(BinaryTraceHeader));
+  data_ = base + dataOffset;
+#else
+  (void)path;
+  (void)capacity;
+  (void)startTime;
+  outErrMsg = "RBenchmark::Tracing::BinaryTraceFile is supported only on Linux and macOS";
+#endif
+}
+
+BinaryTraceFile::~BinaryTraceFile() {
+#ifdef R_BINARY_TRACE_SUPPORTED
+  if (!header_) return;
+  uint32_t used = std::min(header_->nextChunk.load(), header_->chunkCount);
+  size_t usedSize = (size_t)header_->dataOffset + (size_t)used * header_->chunkSize;
+  msync(header_, size_, MS_SYNC);
+  munmap(header_, size_);
+  if (ftruncate(fd_, (off_t)usedSize) != 0) {
+    // файл остается полного размера, пустые чанки читатель пропускает
+  }
+  close(fd_);
+#endif
+}
+
+void BinaryTraceFile::attach(BinaryCursor &cursor, const std::string &threadName) {
+  cursor.session = session_;
+  cursor.next = cursor.end = nullptr;
+  cursor.exhausted = false;
+  cursor.namedNodes.clear();
+  cursor.counters.clear();
+  if (!header_) return;
+  cursor.threadIdx = header_->nextThread.fetch_add(1);
+  writeName(cursor, BinaryNameKind::thread, cursor.threadIdx, 0, threadName);
+}
+
+BinaryRecord *BinaryTraceFile::reserve(BinaryCursor &cursor, int count) {
+  if (!header_ || cursor.exhausted) return nullptr;
+  if (cursor.next && cursor.end - cursor.next >= count) {
+    BinaryRecord *records = cursor.next;
+    cursor.next += count;
+    return records;
+  }
+  // остаток чанка остается нулевым, читатель перейдет к следующему чанку потока.
+  // Счетчик не растет дальше chunkCount, иначе после 2^32 отказов он переполнится и выдаст занятые чанки
+  uint32_t chunk = header_->nextChunk.load();
+  do {
+    if (chunk >= header_->chunkCount) {
+      cursor.next = cursor.end = nullptr;
+      cursor.exhausted = true;
+      header_->dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+  } while (!header_->nextChunk.compare_exchange_weak(chunk, chunk + 1));
+  owners_[chunk] = cursor.threadIdx + 1;
+  cursor.next = reinterpret_cast<BinaryRecord *>(data_ + (size_t)chunk * header_->chunkSize);
+  cursor.end = cursor.next + header_->chunkSize / sizeof(BinaryRecord);
+  BinaryRecord *records = cursor.next;
+  cursor.next += count;
+  return records;
+}
+
+void BinaryTraceFile::writeName(BinaryCursor &cursor, BinaryNameKind kind, uint32_t id, uint32_t parent, const std::string &name) {
+  const size_t piece = sizeof(BinaryRecord::text);
+  size_t offset = 0;
+  size_t length;
+  // последний кусок всегда короче sizeof(text), по нему читатель понимает, что имя закончилось
+  do {
+    BinaryRecord *record = reserve(cursor, 1);
+    if (!record) return;
+    length = std::min(piece, name.size() - offset);
+    record->flags = static_cast<uint8_t>(kind);
+    record->depth = (uint16_t)length;
+    record->id = id;
+    record->time = parent;
+    record->offset = offset;
+    memcpy(record->text, name.data() + offset, length);
+    commit(*record, BinaryRecordType::name);
+    offset += length;
+  } while (length == piece);
+}
+
+/// Читатель бинарного трейса: события чанка переводятся в JSON сразу, в памяти только имена
+struct BinaryTraceReader {
+  std::ostream &out;
+  std::map<std::pair<uint32_t, uint32_t>, std::string> nodes;    // (поток, id) -> имя, поток пишет имена сам
+  std::map<std::pair<uint32_t, uint32_t>, std::string> counters; // (поток, id) -> имя
+  std::map<uint32_t, std::string> threads;
+  std::vector<BinaryRecord> args;
+
+  static void appendPiece(std::string &name, const BinaryRecord &record) {
+    if (record.offset == 0) name.clear(); // id узла мог получить новое имя после benchmarkReset
+    size_t length = std::min<size_t>(record.depth, sizeof(record.text));
+    if (name.size() < record.offset + length) name.resize(record.offset + length);
+    memcpy(&name[record.offset], record.text, length);
+  }
+
+  static std::string argText(const char *text) {
+    return std::string(text, strnlen(text, binaryArgTextSize));
+  }
+
+  void readName(uint32_t thread, const BinaryRecord &record) {
+    switch (static_cast<BinaryNameKind>(record.flags)) {
+      case BinaryNameKind::node:
+        appendPiece(nodes[std::make_pair(thread, record.id)], record);
+        break;
+      case BinaryNameKind::counter:
+        appendPiece(counters[std::make_pair(thread, record.id)], record);
+        break;
+      case BinaryNameKind::thread: {
+        std::string &name = threads[record.id];
+        appendPiece(name, record);
+        if (record.depth < sizeof(record.text)) {
+          out << ",{\"cat\":\"function\",\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << record.id
+              << ",\"args\":{\"name\":\"" << Serializer::escape(name) << "\"}}";
+        }
+        break;
+      }
+    }
+  }
+
+  void readEvent(uint32_t thread, const BinaryRecord &record, BinaryRecordType type) {
+    TraceInfo info;
+    std::deque<std::string> strings; // указатели аргументов действительны до форматирования
+    info.args.count = 0;
+    for (const auto &arg : args) {
+      TraceArg traceArg;
+      strings.push_back(argText(arg.text));
+      traceArg.key = strings.back().c_str();
+      traceArg.type = static_cast<ArgType>(arg.flags);
+      if (traceArg.type == ArgType::integer) {
+        traceArg.intValue = arg.intValue;
+      } else if (traceArg.type == ArgType::real) {
+        traceArg.realValue = arg.realValue;
+      } else if (traceArg.type == ArgType::string) {
+        strings.push_back(argText(arg.text + binaryArgTextSize));
+        traceArg.stringValue = strings.back().c_str();
+      }
+      info.args.set(traceArg);
+    }
+    args.clear();
+    info.startTime = record.time;
+    info.stackDepth = record.depth;
+    if (type == BinaryRecordType::span) {
+      info.type = TraceType::span;
+      info.duration = record.duration;
+      info.value = 0;
+      info.name = nodes[std::make_pair(thread, record.id)];
+    } else {
+      info.type = TraceType::counter;
+      info.duration = 0;
+      info.value = record.value;
+      info.name = counters[std::make_pair(thread, record.id)];
+    }
+    Serializer::formatEvent(out, info, (int32_t)thread);
+  }
+
+  void readChunk(uint32_t thread, const char *chunk, size_t size) {
+    args.clear();
+    for (size_t pos = 0; pos + sizeof(BinaryRecord) <= size; pos += sizeof(BinaryRecord)) {
+      BinaryRecord record;
+      memcpy(&record, chunk + pos, sizeof(record));
+      auto type = static_cast<BinaryRecordType>(record.type);
+      switch (type) {
+        case BinaryRecordType::end:
+          return;
+        case BinaryRecordType::name:
+          readName(thread, record);
+          break;
+        case BinaryRecordType::arg:
+          args.push_back(record);
+          break;
+        case BinaryRecordType::span:
+        case BinaryRecordType::counter:
+          readEvent(thread, record, type);
+          break;
+      }
+    }
+  }
+};
+
+bool convertBinaryTrace(const std::string &path, std::ostream &out, std::string &outErrMsg) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    outErrMsg = "could not open " + path;
+    return false;
+  }
+  uint64_t fileSize = (uint64_t)file.tellg();
+  file.seekg(0);
+  std::vector<char> headerBytes(sizeof(BinaryTraceHeader));
+  file.read(headerBytes.data(), headerBytes.size());
+  const BinaryTraceHeader *header = reinterpret_cast<const BinaryTraceHeader *>(headerBytes.data());
+  if (file.gcount() != (std::streamsize)headerBytes.size() || memcmp(header->magic, binaryMagic, sizeof(binaryMagic)) != 0) {
+    outErrMsg = path + " is not a binary trace";
+    return false;
+  }
+  if (header->version != binaryVersion || header->recordSize != sizeof(BinaryRecord) ||
+      header->chunkSize % sizeof(BinaryRecord) != 0) {
+    outErrMsg = path + ": unsupported binary trace version";
+    return false;
+  }
+  uint32_t chunkCount = header->chunkCount;
+  uint32_t used = std::min(header->nextChunk.load(), chunkCount);
+  uint64_t chunkSize = header->chunkSize;
+  uint64_t dataOffset = header->dataOffset;
+  // размеры из испорченного файла не должны приводить к выделению гигабайт: индекс владельцев лежит
+  // до первого чанка, а выданные чанки - в файле (при закрытии он обрезается по последнему выданному)
+  if (chunkSize == 0 || chunkSize > fileSize || dataOffset > fileSize ||
+      sizeof(BinaryTraceHeader) + (uint64_t)chunkCount * sizeof(uint32_t) > dataOffset ||
+      (uint64_t)used * chunkSize > fileSize - dataOffset) {
+    outErrMsg = path + ": binary trace header does not match the file size";
+    return false;
+  }
+  std::vector<uint32_t> owners(chunkCount);
+  file.read(reinterpret_cast<char *>(owners.data()), owners.size() * sizeof(uint32_t));
+
+  out << R"({"otherData": {},"traceEvents":[{})";
+  out << std::setprecision(3) << std::fixed;
+  BinaryTraceReader reader{out, {}, {}, {}, {}};
+  std::vector<char> chunk((size_t)chunkSize);
+  for (uint32_t i = 0; i < used; i++) {
+    if (owners[i] == 0) continue; // чанк выдан, но поток упал раньше, чем записал владельца
+    file.seekg((std::streamoff)(dataOffset + (uint64_t)i * chunkSize));
+    file.read(chunk.data(), chunk.size());
+    reader.readChunk(owners[i] - 1, chunk.data(), (size_t)file.gcount());
+    file.clear(); // обрезанный последний чанк
+  }
+  out << "]}";
+  if (header->dropped.load() > 0) {
+    outErrMsg = "events of " + std::to_string(header->dropped.load()) + " threads did not fit into " + path;
+  }
+  return true;
+}
+
+} // namespace Tracing
+} // namespace roadar
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <roadar/benchmark.hpp> // R_FUNC
+#include <roadar/tracing.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef R_BINARY_TRACE_CHUNK
+#define R_BINARY_TRACE_CHUNK (64 * 1024) // байт на чанк потока, 1024 записи
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+/*!
+ * \brief Бинарный трейс: файл заранее нужного размера отображается в память, каждый поток
+ * забирает себе чанки и пишет в них записи фиксированного размера без блокировок и форматирования.
+ *
+ * Файл: заголовок BinaryTraceHeader, за ним индекс владельцев чанков (uint32 на чанк: индекс
+ * потока + 1, 0 - чанк свободен), с R_BINARY_TRACE_CHUNK-выравниванием - сами чанки.
+ * Чанк читается до первой записи с type == 0: файл создается заполненным нулями, а тип записи
+ * пишется последним, поэтому после падения процесса обрывается только последняя запись потока.
+ */
+enum class BinaryRecordType : uint8_t {
+  end = 0,
+  span,     // id - id узла (registerNode), time/duration
+  counter,  // id - id счетчика потока, time/value
+  arg,      // аргумент следующего span/counter: flags - ArgType, text - ключ и строковое значение
+  name      // flags - BinaryNameKind, id, time - родитель узла, offset - позиция куска в имени
+};
+
+enum class BinaryNameKind : uint8_t {
+  node = 0,  // глобальный id узла
+  counter,   // id счетчика внутри потока-владельца чанка
+  thread     // имя потока-владельца чанка
+};
+
+struct BinaryRecord {
+  uint8_t type;
+  uint8_t flags;
+  uint16_t depth;       // span/counter - глубина вложенности, name - длина куска текста
+  uint32_t id;
+  uint64_t time;        // мкс
+  union {
+    uint64_t duration;
+    double value;
+    long long intValue;
+    double realValue;
+    uint64_t offset;
+  };
+  char text[40];
+};
+static_assert(sizeof(BinaryRecord) == 64, "binary trace record must stay 64 bytes");
+
+/// Длина ключа и строкового значения аргумента в BinaryRecord::text, с завершающим нулем
+static const size_t binaryArgTextSize = 20;
+
+struct BinaryTraceHeader {
+  char magic[8];                       // "RBTRACE1"
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t chunkSize;
+  uint32_t chunkCount;
+  uint64_t dataOffset;                 // начало первого чанка
+  uint64_t startTime;                  // мкс, начало сессии
+  std::atomic<uint32_t> nextChunk;     // сколько чанков выдано, не больше chunkCount
+  std::atomic<uint32_t> nextThread;
+  std::atomic<uint64_t> dropped;       // потоки, которым не хватило чанка: их дальнейшие записи потеряны
+};
+
+/// Позиция потока в его текущем чанке, хранится в группе замеров потока
+struct BinaryCursor {
+  uint64_t session = 0;                // BinaryTraceFile::session(), 0 - не привязан
+  uint32_t threadIdx = 0;
+  BinaryRecord *next = nullptr;
+  BinaryRecord *end = nullptr;
+  bool exhausted = false;              // файл заполнен, до следующей сессии записи отбрасываются без атомиков
+  std::vector<bool> namedNodes;        // узлы, имена которых уже записаны в чанки потока
+  uint64_t registryEpoch = 0;          // перестроение реестра узлов, к которому относятся namedNodes
+  std::unordered_map<std::string, uint32_t> counters;
+};
+
+class BinaryTraceFile {
+public:
+  BinaryTraceFile(const BinaryTraceFile&) = delete;
+
+  /// Создает файл `capacity` байт и отображает его в память
+  BinaryTraceFile(const std::string &path, size_t capacity, uint64_t startTime, std::string &outErrMsg);
+  /// Обрезает файл по последнему выданному чанку и снимает отображение
+  ~BinaryTraceFile();
+
+  uint64_t session() const { return session_; }
+
+  /// Привязывает курсор потока к этой сессии, `threadName` пишется первой записью потока
+  void attach(BinaryCursor &cursor, const std::string &threadName);
+
+  /// `count` подряд идущих записей в чанке потока, nullptr - файл заполнен
+  BinaryRecord *reserve(BinaryCursor &cursor, int count);
+
+  /// Записывает имя кусками по sizeof(BinaryRecord::text)
+  void writeName(BinaryCursor &cursor, BinaryNameKind kind, uint32_t id, uint32_t parent, const std::string &name);
+
+  /// Тип записывается последним: запись без типа читатель считает концом чанка
+  static void commit(BinaryRecord &record, BinaryRecordType type);
+
+private:
+  BinaryTraceHeader *header_ = nullptr;
+  uint32_t *owners_ = nullptr;
+  char *data_ = nullptr;
+  size_t size_ = 0;
+  int fd_ = -1;
+  uint64_t session_;
+};
+
+/// Переводит бинарный трейс в JSON для Perfetto, читая файл по чанку
+R_FUNC
+bool convertBinaryTrace(const std::string &path, std::ostream &out, std::string &outErrMsg);
+
+} // namespace Tracing
+} // namespace roadar
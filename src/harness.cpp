@@ -0,0 +1,212 @@
+#include <roadar/benchmark.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+
+namespace roadar {
+
+typedef std::pair<std::string, std::function<void()>> HarnessEntry;
+
+static std::mutex harnessMut;
+static std::vector<HarnessEntry> harnessEntries;
+
+void benchmarkRegister(const std::string &identifier, std::function<void()> callable) {
+  std::lock_guard<std::mutex> lock(harnessMut);
+  for (auto &entry : harnessEntries) {
+    if (entry.first == identifier) {
+      entry.second = std::move(callable);
+      return;
+    }
+  }
+  harnessEntries.emplace_back(identifier, std::move(callable));
+}
+
+#ifndef BENCHMARK_DISABLED
+/// Таблица с выровненными колонками, как в benchmarkLog
+R_FUNC
+void formGrid(const std::vector<std::vector<std::string>> &rows, std::ostream &out);
+
+/// Пауза замеров потока на время подбора итераций и прогрева, снимается и при исключении из участка
+struct HarnessPause {
+  HarnessPause() {
+    benchmarkPauseThread(true);
+  }
+  ~HarnessPause() {
+    benchmarkPauseThread(false);
+  }
+  HarnessPause(const HarnessPause &) = delete;
+  HarnessPause &operator=(const HarnessPause &) = delete;
+};
+
+/// Время в наносекундах, точнее чем таймер замеров
+static double runIterations(const std::function<void()> &callable, unsigned long iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++) {
+    callable();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+}
+
+static unsigned long chooseIterations(const std::function<void()> &callable, double minTimeNs) {
+  unsigned long iterations = 1;
+  while (true) {
+    double time = runIterations(callable, iterations);
+    if (time >= minTimeNs || iterations >= (1UL << 30)) {
+      return iterations;
+    }
+    // как в google/benchmark: растем с запасом, но не больше чем в 10 раз за шаг
+    double multiplier = time <= 0 ? 10.0 : std::min(10.0, std::max(2.0, minTimeNs * 1.4 / time));
+    iterations = static_cast<unsigned long>(std::ceil(iterations * multiplier));
+  }
+}
+
+static double quantile(const std::vector<double> &sorted, double q) {
+  if (sorted.empty()) return 0;
+  double pos = q * (sorted.size() - 1);
+  size_t idx = static_cast<size_t>(pos);
+  if (idx + 1 >= sorted.size()) return sorted.back();
+  return sorted[idx] + (sorted[idx + 1] - sorted[idx]) * (pos - idx);
+}
+
+/// Критическое значение t-распределения Стьюдента (двусторонний интервал)
+static double studentT(int degreesOfFreedom, double confidence) {
+  static const double t90[] = {6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812,
+                               1.796, 1.782, 1.771, 1.761, 1.753, 1.746, 1.740, 1.734, 1.729, 1.725};
+  static const double t95[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                               2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086};
+  static const double t99[] = {63.657, 9.925, 5.841, 4.604, 4.032, 3.707, 3.499, 3.355, 3.250, 3.169,
+                               3.106, 3.055, 3.012, 2.977, 2.947, 2.921, 2.898, 2.878, 2.861, 2.845};
+  const double *table = t95;
+  double z = 1.960;
+  if (confidence >= 0.985) {
+    table = t99;
+    z = 2.576;
+  } else if (confidence < 0.925) {
+    table = t90;
+    z = 1.645;
+  }
+  if (degreesOfFreedom <= 0) return 0;
+  if (degreesOfFreedom <= 20) return table[degreesOfFreedom - 1];
+  return z;
+}
+
+static HarnessResult runHarnessEntry(const HarnessEntry &entry, const HarnessOptions &options) {
+  const std::string &identifier = entry.first;
+  const std::function<void()> &callable = entry.second;
+
+  unsigned long iterations;
+  {
+    HarnessPause pause;
+    iterations = chooseIterations(callable, options.minTimeMs * 1e6);
+    for (int i = 0; i < options.warmupRepetitions; i++) {
+      runIterations(callable, iterations);
+    }
+  }
+
+  std::vector<double> times; // время одной итерации, нс
+  for (int i = 0; i < std::max(options.repetitions, 1); i++) {
+    benchmarkStart(identifier);
+    double time = runIterations(callable, iterations);
+    benchmarkStopBatch(identifier, iterations);
+    times.push_back(time / iterations);
+  }
+
+  std::vector<double> sorted = times;
+  std::sort(sorted.begin(), sorted.end());
+  int outliers = 0;
+  if (options.outlierIqr > 0 && sorted.size() >= 4) {
+    double q1 = quantile(sorted, 0.25);
+    double q3 = quantile(sorted, 0.75);
+    double low = q1 - options.outlierIqr * (q3 - q1);
+    double high = q3 + options.outlierIqr * (q3 - q1);
+    std::vector<double> kept;
+    for (double time : sorted) {
+      if (time >= low && time <= high) {
+        kept.push_back(time);
+      } else {
+        outliers++;
+      }
+    }
+    sorted.swap(kept);
+  }
+
+  double n = static_cast<double>(sorted.size());
+  double mean = 0;
+  for (double time : sorted) mean += time;
+  mean /= n;
+  double variance = 0;
+  for (double time : sorted) variance += (time - mean) * (time - mean);
+  variance = n > 1 ? variance / (n - 1) : 0;
+  double stdDev = std::sqrt(variance);
+  double halfWidth = studentT((int)sorted.size() - 1, options.confidence) * stdDev / std::sqrt(n);
+
+  HarnessResult result;
+  result.identifier = identifier;
+  result.iterations = iterations;
+  result.repetitions = (int)sorted.size();
+  result.outliers = outliers;
+  result.meanMs = mean / 1e6;
+  result.medianMs = quantile(sorted, 0.5) / 1e6;
+  result.stdMs = stdDev / 1e6;
+  result.ciLowMs = (mean - halfWidth) / 1e6;
+  result.ciHighMs = (mean + halfWidth) / 1e6;
+  return result;
+}
+
+static void printHarnessResults(const std::vector<HarnessResult> &results, const HarnessOptions &options, std::ostream &out) {
+  std::vector<std::vector<std::string>> rows;
+  std::stringstream ss;
+  ss << std::setprecision(6) << std::fixed;
+  auto format = [&ss](double val) -> std::string {
+    ss.str("");
+    ss << val;
+    return ss.str();
+  };
+  for (const auto &result : results) {
+    std::vector<std::string> row;
+    row.push_back(result.identifier + ":");
+    row.push_back("   iterations:");
+    row.push_back(std::to_string(result.iterations));
+    row.push_back("   reps:");
+    row.push_back(std::to_string(result.repetitions) + " (-" + std::to_string(result.outliers) + ")");
+    row.push_back("   mean:");
+    row.push_back(format(result.meanMs));
+    row.push_back("   median:");
+    row.push_back(format(result.medianMs));
+    row.push_back("   std:");
+    row.push_back(format(result.stdMs));
+    row.push_back("   ci " + std::to_string(int(options.confidence * 100 + 0.5)) + "%:");
+    row.push_back(format(result.ciLowMs) + " .. " + format(result.ciHighMs));
+    rows.push_back(std::move(row));
+  }
+
+  out << "\n=================== Harness ===================\n";
+  formGrid(rows, out);
+  out << "===============================================\n";
+}
+#endif
+
+std::vector<HarnessResult> benchmarkRunRegistered(const HarnessOptions &options, const std::string &filter, std::ostream *out) {
+  std::vector<HarnessResult> results;
+#ifndef BENCHMARK_DISABLED
+  std::vector<HarnessEntry> entries;
+  {
+    std::lock_guard<std::mutex> lock(harnessMut);
+    entries = harnessEntries;
+  }
+  for (const auto &entry : entries) {
+    if (!filter.empty() && entry.first.find(filter) == std::string::npos) continue;
+    results.push_back(runHarnessEntry(entry, options));
+  }
+  if (out) {
+    printHarnessResults(results, options, *out);
+  }
+#endif
+  return results;
+}
+
+} // namespace roadar
@@ -0,0 +1,181 @@
+#include "json_reader.hpp"
+#include <cstdlib>
+
+namespace roadar {
+namespace Json {
+
+const Value *Value::find(const std::string &key) const {
+    for (const auto &member : members) {
+        if (member.first == key) return &member.second;
+    }
+    return nullptr;
+}
+
+double Value::number(const std::string &key, double defaultValue) const {
+    const Value *value = find(key);
+    return (value && value->type == Type::number) ? value->numberValue : defaultValue;
+}
+
+std::string Value::string(const std::string &key, const std::string &defaultValue) const {
+    const Value *value = find(key);
+    return (value && value->type == Type::string) ? value->stringValue : defaultValue;
+}
+
+Reader::Reader(std::istream &in)
+: in_(in) {
+}
+
+int Reader::peek() {
+    return in_.peek();
+}
+
+int Reader::get() {
+    return in_.get();
+}
+
+void Reader::skipSpaces() {
+    int c = peek();
+    while (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+        get();
+        c = peek();
+    }
+}
+
+bool Reader::expect(char c) {
+    skipSpaces();
+    if (get() != c) {
+        return fail(std::string("expected '") + c + "'");
+    }
+    return true;
+}
+
+bool Reader::fail(const std::string &msg) {
+    if (error_.empty()) {
+        error_ = "JSON parse error at " + std::to_string((long long)in_.tellg()) + ": " + msg;
+    }
+    return false;
+}
+
+bool Reader::parse(Value &out) {
+    skipSpaces();
+    int c = peek();
+    out = Value();
+    switch (c) {
+        case '{': {
+            get();
+            out.type = Value::Type::object;
+            skipSpaces();
+            if (peek() == '}') {
+                get();
+                return true;
+            }
+            while (true) {
+                std::string key;
+                skipSpaces();
+                if (!parseString(key) || !expect(':')) return false;
+                out.members.emplace_back(std::move(key), Value());
+                if (!parse(out.members.back().second)) return false;
+                skipSpaces();
+                c = get();
+                if (c == '}') return true;
+                if (c != ',') return fail("expected ',' or '}'");
+            }
+        }
+        case '[': {
+            get();
+            out.type = Value::Type::array;
+            skipSpaces();
+            if (peek() == ']') {
+                get();
+                return true;
+            }
+            while (true) {
+                out.items.emplace_back();
+                if (!parse(out.items.back())) return false;
+                skipSpaces();
+                c = get();
+                if (c == ']') return true;
+                if (c != ',') return fail("expected ',' or ']'");
+            }
+        }
+        case '"':
+            out.type = Value::Type::string;
+            return parseString(out.stringValue);
+        case 't':
+            out.type = Value::Type::boolean;
+            out.boolValue = true;
+            return parseLiteral("true");
+        case 'f':
+            out.type = Value::Type::boolean;
+            return parseLiteral("false");
+        case 'n':
+            return parseLiteral("null");
+        default:
+            out.type = Value::Type::number;
+            return parseNumber(out.numberValue);
+    }
+}
+
+bool Reader::parseString(std::string &out) {
+    if (get() != '"') return fail("expected string");
+    out.clear();
+    while (true) {
+        int c = get();
+        if (c == EOF) return fail("unterminated string");
+        if (c == '"') return true;
+        if (c == '\\') {
+            c = get();
+            switch (c) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    // only code points from the basic plane, encoded back to UTF-8
+                    char hex[5] = {};
+                    for (int i = 0; i < 4; i++) hex[i] = (char)get();
+                    unsigned long code = strtoul(hex, nullptr, 16);
+                    if (code < 0x80) {
+                        out += (char)code;
+                    } else if (code < 0x800) {
+                        out += (char)(0xC0 | (code >> 6));
+                        out += (char)(0x80 | (code & 0x3F));
+                    } else {
+                        out += (char)(0xE0 | (code >> 12));
+                        out += (char)(0x80 | ((code >> 6) & 0x3F));
+                        out += (char)(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default: out += (char)c; break;
+            }
+        } else {
+            out += (char)c;
+        }
+    }
+}
+
+bool Reader::parseNumber(double &out) {
+    std::string str;
+    int c = peek();
+    while (c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E' || (c >= '0' && c <= '9')) {
+        str += (char)get();
+        c = peek();
+    }
+    if (str.empty()) return fail("unexpected symbol");
+    char *end = nullptr;
+    out = strtod(str.c_str(), &end);
+    if (end != str.c_str() + str.size()) return fail("bad number \"" + str + "\"");
+    return true;
+}
+
+bool Reader::parseLiteral(const char *literal) {
+    for (const char *p = literal; *p; p++) {
+        if (get() != *p) return fail(std::string("expected ") + literal);
+    }
+    return true;
+}
+
+} // namespace Json
+} // namespace roadar
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <istream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace roadar {
+namespace Json {
+
+/// Minimal JSON value, enough to read back files written by this library
+struct Value {
+  enum class Type {
+    null = 0,
+    boolean,
+    number,
+    string,
+    array,
+    object
+  };
+
+  Type type = Type::null;
+  bool boolValue = false;
+  double numberValue = 0;
+  std::string stringValue;
+  std::vector<Value> items;                             // Type::array
+  std::vector<std::pair<std::string, Value>> members;   // Type::object
+
+  const Value *find(const std::string &key) const;
+  double number(const std::string &key, double defaultValue = 0) const;
+  std::string string(const std::string &key, const std::string &defaultValue = "") const;
+};
+
+class Reader {
+public:
+  explicit Reader(std::istream &in);
+
+  /// Reads one complete value
+  bool parse(Value &out);
+
+  const std::string &error() const { return error_; }
+
+private:
+  std::istream &in_;
+  std::string error_;
+
+  int peek();
+  int get();
+  void skipSpaces();
+  bool expect(char c);
+  bool fail(const std::string &msg);
+  bool parseString(std::string &out);
+  bool parseNumber(double &out);
+  bool parseLiteral(const char *literal);
+};
+
+} // namespace Json
+} // namespace roadar
@@ -0,0 +1,359 @@
+#include "trace_compression.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#ifdef R_BENCHMARK_ZLIB
+#include <zlib.h>
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+static const char lzMagic[4] = {'R', 'L', 'Z', '1'};
+static const size_t lzMinMatch = 4;
+static const int lzHashBits = 14;
+static const size_t lzMaxOffset = 65535;
+static const size_t lzMaxBlock = 64 * 1024 * 1024; // защита от поврежденного заголовка блока
+
+struct ZStream {
+#ifdef R_BENCHMARK_ZLIB
+  z_stream stream;
+#endif
+};
+
+Compression availableCompression(Compression requested) {
+#ifndef R_BENCHMARK_ZLIB
+  if (requested == Compression::gzip) return Compression::lz;
+#endif
+  return requested;
+}
+
+std::string compressedPath(const std::string &path, Compression compression) {
+  std::string extension;
+  switch (compression) {
+    case Compression::gzip: extension = ".gz"; break;
+    case Compression::lz: extension = ".rlz"; break;
+    case Compression::none: return path;
+  }
+  if (path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0) {
+    return path;
+  }
+  return path + extension;
+}
+
+static void writeU32(std::vector<char> &out, uint32_t value) {
+  for (int i = 0; i < 4; i++) out.push_back((char)((value >> (8 * i)) & 0xFF));
+}
+
+static uint32_t readU32(const char *src) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) value |= (uint32_t)(unsigned char)src[i] << (8 * i);
+  return value;
+}
+
+static void lzWriteLength(std::vector<char> &out, size_t length) {
+  while (length >= 255) {
+    out.push_back((char)255);
+    length -= 255;
+  }
+  out.push_back((char)length);
+}
+
+static void lzWriteLiterals(std::vector<char> &out, const char *src, size_t count, size_t matchLength) {
+  size_t extraMatch = matchLength >= lzMinMatch ? matchLength - lzMinMatch : 0;
+  out.push_back((char)((std::min(count, (size_t)15) << 4) | std::min(extraMatch, (size_t)15)));
+  if (count >= 15) lzWriteLength(out, count - 15);
+  out.insert(out.end(), src, src + count);
+}
+
+void lzCompress(const char *src, size_t size, std::vector<char> &out) {
+  out.clear();
+  const unsigned char *in = reinterpret_cast<const unsigned char *>(src);
+  std::vector<uint32_t> table(1 << lzHashBits, UINT32_MAX); // хэш 4 байт -> последняя позиция
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + lzMinMatch <= size) {
+    uint32_t sequence;
+    memcpy(&sequence, in + pos, sizeof(sequence));
+    uint32_t hash = (sequence * 2654435761u) >> (32 - lzHashBits);
+    uint32_t candidate = table[hash];
+    table[hash] = (uint32_t)pos;
+    if (candidate == UINT32_MAX || pos - candidate > lzMaxOffset || memcmp(in + candidate, in + pos, lzMinMatch) != 0) {
+      pos++;
+      continue;
+    }
+    size_t length = lzMinMatch;
+    while (pos + length < size && in[candidate + length] == in[pos + length]) length++;
+    lzWriteLiterals(out, src + anchor, pos - anchor, length);
+    size_t offset = pos - candidate;
+    out.push_back((char)(offset & 0xFF));
+    out.push_back((char)(offset >> 8));
+    if (length - lzMinMatch >= 15) lzWriteLength(out, length - lzMinMatch - 15);
+    pos += length;
+    anchor = pos;
+  }
+  // последняя последовательность - только литералы; если блок закончился совпадением, ее нет
+  if (anchor < size) {
+    lzWriteLiterals(out, src + anchor, size - anchor, 0);
+  }
+}
+
+bool lzDecompress(const char *src, size_t size, char *dst, size_t rawSize) {
+  const unsigned char *in = reinterpret_cast<const unsigned char *>(src);
+  size_t inPos = 0;
+  size_t outPos = 0;
+  auto readLength = [&](size_t length) -> size_t {
+    if (length != 15) return length;
+    while (inPos < size) {
+      unsigned char byte = in[inPos++];
+      length += byte;
+      if (byte != 255) break;
+    }
+    return length;
+  };
+  while (outPos < rawSize) {
+    if (inPos >= size) return false;
+    unsigned char token = in[inPos++];
+    size_t literals = readLength(token >> 4);
+    if (literals > size - inPos || literals > rawSize - outPos) return false;
+    memcpy(dst + outPos, in + inPos, literals);
+    inPos += literals;
+    outPos += literals;
+    if (outPos == rawSize) break;
+    if (inPos + 2 > size) return false;
+    size_t offset = in[inPos] | ((size_t)in[inPos + 1] << 8);
+    inPos += 2;
+    size_t length = readLength(token & 0x0F) + lzMinMatch;
+    if (offset == 0 || offset > outPos || length > rawSize - outPos) return false;
+    // совпадение может перекрывать само себя, копируем по байту
+    for (size_t i = 0; i < length; i++, outPos++) {
+      dst[outPos] = dst[outPos - offset];
+    }
+  }
+  return inPos == size;
+}
+
+CompressBuf::CompressBuf(const std::string &path, Compression compression, std::string &outErrMsg)
+: compression_(availableCompression(compression)), buffer_(R_BENCHMARK_COMPRESS_BLOCK) {
+  file_.open(path, std::ios::binary);
+  if (!file_.is_open()) {
+    outErrMsg = "RBenchmark::Tracing::Serializer could not open results file:\n" + path;
+    return;
+  }
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+  if (compression_ == Compression::lz) {
+    file_.write(lzMagic, sizeof(lzMagic));
+  }
+#ifdef R_BENCHMARK_ZLIB
+  if (compression_ == Compression::gzip) {
+    zstream_.reset(new ZStream());
+    // 15 + 16: окно 32 КБ и заголовок gzip, файл открывается gunzip и Perfetto
+    if (deflateInit2(&zstream_->stream, R_BENCHMARK_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      outErrMsg = "RBenchmark::Tracing::Serializer could not initialize zlib";
+      zstream_.reset();
+      file_.close();
+    }
+  }
+#endif
+}
+
+CompressBuf::~CompressBuf() {
+  finish();
+}
+
+void CompressBuf::finish() {
+  if (!file_.is_open()) return;
+  flushBlock(true);
+  file_.close();
+#ifdef R_BENCHMARK_ZLIB
+  if (zstream_) deflateEnd(&zstream_->stream);
+#endif
+  zstream_.reset();
+}
+
+CompressBuf::int_type CompressBuf::overflow(int_type ch) {
+  if (!file_.is_open()) return traits_type::eof();
+  flushBlock(false);
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+int CompressBuf::sync() {
+  if (!file_.is_open()) return 0;
+  flushBlock(false);
+  file_.flush();
+  return 0;
+}
+
+void CompressBuf::flushBlock(bool final) {
+  size_t size = pptr() - pbase();
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+  switch (compression_) {
+    case Compression::none:
+      file_.write(buffer_.data(), size);
+      break;
+    case Compression::lz: {
+      if (size == 0) break;
+      lzCompress(buffer_.data(), size, compressed_);
+      bool stored = compressed_.size() >= size; // несжимаемый блок хранится как есть
+      std::vector<char> header;
+      writeU32(header, (uint32_t)size);
+      writeU32(header, (uint32_t)(stored ? size : compressed_.size()));
+      file_.write(header.data(), header.size());
+      if (stored) {
+        file_.write(buffer_.data(), size);
+      } else {
+        file_.write(compressed_.data(), compressed_.size());
+      }
+      break;
+    }
+    case Compression::gzip: {
+#ifdef R_BENCHMARK_ZLIB
+      if (!zstream_) break;
+      z_stream &stream = zstream_->stream;
+      stream.next_in = reinterpret_cast<Bytef *>(buffer_.data());
+      stream.avail_in = (uInt)size;
+      compressed_.resize(R_BENCHMARK_COMPRESS_BLOCK);
+      int result;
+      do {
+        stream.next_out = reinterpret_cast<Bytef *>(compressed_.data());
+        stream.avail_out = (uInt)compressed_.size();
+        result = deflate(&stream, final ? Z_FINISH : Z_NO_FLUSH);
+        file_.write(compressed_.data(), compressed_.size() - stream.avail_out);
+      } while (stream.avail_out == 0 || (final && result == Z_OK));
+#else
+      (void)final;
+#endif
+      break;
+    }
+  }
+}
+
+DecompressBuf::DecompressBuf(std::istream &in)
+: in_(in) {
+}
+
+DecompressBuf::~DecompressBuf() {
+#ifdef R_BENCHMARK_ZLIB
+  if (zstream_) inflateEnd(&zstream_->stream);
+#endif
+}
+
+bool DecompressBuf::detect() {
+  char magic[4] = {};
+  in_.read(magic, sizeof(magic));
+  size_t count = (size_t)in_.gcount();
+  if (count == sizeof(magic) && memcmp(magic, lzMagic, sizeof(magic)) == 0) {
+    mode_ = Mode::lz;
+    return true;
+  }
+  if (count >= 2 && (unsigned char)magic[0] == 0x1F && (unsigned char)magic[1] == 0x8B) {
+#ifdef R_BENCHMARK_ZLIB
+    mode_ = Mode::gzip;
+    zstream_.reset(new ZStream());
+    if (inflateInit2(&zstream_->stream, 15 + 32) != Z_OK) { // 15 + 32: заголовок gzip или zlib
+      zstream_.reset();
+      error_ = "could not initialize zlib";
+      return false;
+    }
+    input_.assign(magic, magic + count);
+    zstream_->stream.next_in = reinterpret_cast<Bytef *>(input_.data());
+    zstream_->stream.avail_in = (uInt)input_.size();
+    return true;
+#else
+    error_ = "gzip trace, but the library is built without zlib";
+    return false;
+#endif
+  }
+  // обычный текст: прочитанные байты отдаются первыми
+  mode_ = Mode::plain;
+  buffer_.assign(magic, magic + count);
+  setg(buffer_.data(), buffer_.data(), buffer_.data() + buffer_.size());
+  return true;
+}
+
+bool DecompressBuf::fill() {
+  switch (mode_) {
+    case Mode::unknown:
+      return false;
+    case Mode::plain: {
+      buffer_.resize(R_BENCHMARK_COMPRESS_BLOCK);
+      in_.read(buffer_.data(), buffer_.size());
+      buffer_.resize((size_t)in_.gcount());
+      break;
+    }
+    case Mode::lz: {
+      char header[8];
+      in_.read(header, sizeof(header));
+      if (in_.gcount() == 0) return false;
+      if (in_.gcount() != sizeof(header)) {
+        error_ = "truncated lz block header";
+        return false;
+      }
+      size_t rawSize = readU32(header);
+      size_t size = readU32(header + 4);
+      if (rawSize > lzMaxBlock || size > rawSize) {
+        error_ = "bad lz block header";
+        return false;
+      }
+      input_.resize(size);
+      in_.read(input_.data(), size);
+      if ((size_t)in_.gcount() != size) {
+        error_ = "truncated lz block";
+        return false;
+      }
+      buffer_.resize(rawSize);
+      if (size == rawSize) {
+        buffer_.swap(input_);
+      } else if (!lzDecompress(input_.data(), size, buffer_.data(), rawSize)) {
+        error_ = "corrupted lz block";
+        return false;
+      }
+      break;
+    }
+    case Mode::gzip: {
+#ifdef R_BENCHMARK_ZLIB
+      z_stream &stream = zstream_->stream;
+      buffer_.resize(R_BENCHMARK_COMPRESS_BLOCK);
+      stream.next_out = reinterpret_cast<Bytef *>(buffer_.data());
+      stream.avail_out = (uInt)buffer_.size();
+      while (stream.avail_out == buffer_.size()) {
+        if (stream.avail_in == 0) {
+          input_.resize(R_BENCHMARK_COMPRESS_BLOCK);
+          in_.read(input_.data(), input_.size());
+          input_.resize((size_t)in_.gcount());
+          if (input_.empty()) break;
+          stream.next_in = reinterpret_cast<Bytef *>(input_.data());
+          stream.avail_in = (uInt)input_.size();
+        }
+        int result = inflate(&stream, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) break;
+        if (result != Z_OK) {
+          error_ = "corrupted gzip stream";
+          return false;
+        }
+      }
+      buffer_.resize(buffer_.size() - stream.avail_out);
+#endif
+      break;
+    }
+  }
+  setg(buffer_.data(), buffer_.data(), buffer_.data() + buffer_.size());
+  return !buffer_.empty();
+}
+
+DecompressBuf::int_type DecompressBuf::underflow() {
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  if (mode_ == Mode::unknown) {
+    if (!detect()) return traits_type::eof();
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  }
+  if (!fill()) return traits_type::eof();
+  return traits_type::to_int_type(*gptr());
+}
+
+} // namespace Tracing
+} // namespace roadar
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <roadar/benchmark.hpp> // R_FUNC
+#include <roadar/tracing.hpp>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#ifndef R_BENCHMARK_COMPRESS_BLOCK
+#define R_BENCHMARK_COMPRESS_BLOCK (256 * 1024) // байт текста, сжимаемых за раз
+#endif
+#ifndef R_BENCHMARK_GZIP_LEVEL
+#define R_BENCHMARK_GZIP_LEVEL 3 // быстрее уровня по умолчанию, JSON все равно сжимается в ~10 раз
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+/// Сжатие, которое реально будет использовано: gzip без zlib заменяется на lz
+R_FUNC
+Compression availableCompression(Compression requested);
+
+/// Путь с расширением сжатия (".gz", ".rlz"), если его еще нет
+R_FUNC
+std::string compressedPath(const std::string &path, Compression compression);
+
+/// Формат lz: "RLZ1", затем блоки [размер текста u32][размер данных u32][данные].
+/// Данные блока - последовательности в стиле LZ4: токен (длины литералов и совпадения),
+/// литералы, смещение совпадения (2 байта). Если сжать не удалось, блок хранится как есть.
+R_FUNC
+void lzCompress(const char *src, size_t size, std::vector<char> &out);
+R_FUNC
+bool lzDecompress(const char *src, size_t size, char *dst, size_t rawSize);
+
+struct ZStream;
+
+/// Запись в файл через компрессор, сжимается целыми блоками по R_BENCHMARK_COMPRESS_BLOCK
+class CompressBuf : public std::streambuf {
+public:
+  CompressBuf(const std::string &path, Compression compression, std::string &outErrMsg);
+  ~CompressBuf();
+
+  /// Сжимает остаток и закрывает файл
+  void finish();
+
+protected:
+  int_type overflow(int_type ch) override;
+  int sync() override;
+
+private:
+  std::ofstream file_;
+  Compression compression_;
+  std::vector<char> buffer_;
+  std::vector<char> compressed_;
+  std::unique_ptr<ZStream> zstream_;
+
+  void flushBlock(bool final);
+};
+
+/// Чтение трейса с автоопределением формата: обычный JSON, gzip (нужен zlib) или lz
+class DecompressBuf : public std::streambuf {
+public:
+  explicit DecompressBuf(std::istream &in);
+  ~DecompressBuf();
+
+  /// Ошибка формата, пусто если файл прочитан без ошибок
+  const std::string &error() const { return error_; }
+
+protected:
+  int_type underflow() override;
+
+private:
+  enum class Mode {
+    unknown = 0,
+    plain,
+    gzip,
+    lz
+  };
+
+  std::istream &in_;
+  Mode mode_ = Mode::unknown;
+  std::vector<char> buffer_;
+  std::vector<char> input_;
+  std::unique_ptr<ZStream> zstream_;
+  std::string error_;
+
+  bool detect();
+  bool fill();
+};
+
+} // namespace Tracing
+} // namespace roadar
@@ -0,0 +1,511 @@
+#include "trace_stats.hpp"
+#include "trace_compression.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <limits>
+
+namespace roadar {
+namespace Tracing {
+
+/// Вставляет замер в `last`, если он среди `lastCount` последних по концу
+static void insertLast(std::vector<std::pair<double, double>> &last, double end, double time, size_t lastCount) {
+  if (lastCount == 0 || (last.size() >= lastCount && end < last.front().first)) return;
+  auto position = std::upper_bound(last.begin(), last.end(), std::make_pair(end, time));
+  last.insert(position, std::make_pair(end, time));
+  if (last.size() > lastCount) last.erase(last.begin());
+}
+
+void TraceStatsNode::add(double time, double end, int32_t tid, size_t lastCount, bool perThread) {
+  totalTime += time;
+  timesExecuted++;
+  maxTime = std::max(maxTime, time);
+  sumSquares += time * time;
+  insertLast(last, end, time, lastCount);
+  if (perThread) {
+    auto &thread = threads[tid];
+    thread.first += time;
+    thread.second++;
+  }
+}
+
+void TraceStatsNode::merge(TraceStatsNode &other, size_t lastCount) {
+  totalTime += other.totalTime;
+  timesExecuted += other.timesExecuted;
+  maxTime = std::max(maxTime, other.maxTime);
+  sumSquares += other.sumSquares;
+  if (last.empty()) {
+    last.swap(other.last);
+  } else {
+    for (const auto &item : other.last) insertLast(last, item.first, item.second, lastCount);
+  }
+  for (const auto &keyVal : other.threads) {
+    auto &thread = threads[keyVal.first];
+    thread.first += keyVal.second.first;
+    thread.second += keyVal.second.second;
+  }
+  for (auto &keyVal : other.children) {
+    auto &child = children[keyVal.first];
+    if (!child) {
+      child = std::move(keyVal.second);
+    } else {
+      child->merge(*keyVal.second, lastCount);
+    }
+  }
+  other.children.clear();
+}
+
+/// Поля события, нужные для статистики; остальные пропускаются
+struct TraceEvent {
+  std::string phase;
+  std::string name;
+  int32_t tid = 0;
+  double ts = 0;
+  double dur = 0;
+  double value = 0;        // args.value счетчика, nan - значение записано как null
+  std::string argName;     // args.name описания потока
+};
+
+/// Разбор текста одного события. Json::Reader читает istream по символу, на файлах в гигабайты
+/// это основное время, поэтому событие сначала целиком копируется из streambuf, а разбирается здесь
+class TraceEventParser {
+public:
+  bool parse(const std::string &text, TraceEvent &out) {
+    p_ = text.data();
+    end_ = p_ + text.size();
+    out = TraceEvent();
+    return parseObject(out, false);
+  }
+
+private:
+  const char *p_ = nullptr;
+  const char *end_ = nullptr;
+  std::string key_;
+
+  void skipSpaces() {
+    while (p_ < end_ && (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t')) p_++;
+  }
+
+  bool expect(char c) {
+    skipSpaces();
+    if (p_ >= end_ || *p_ != c) return false;
+    p_++;
+    return true;
+  }
+
+  bool parseString(std::string *out) {
+    if (!expect('"')) return false;
+    if (out) out->clear();
+    while (p_ < end_ && *p_ != '"') {
+      char c = *p_++;
+      if (c == '\\' && p_ < end_) {
+        c = *p_++;
+        switch (c) {
+          case 'n': c = '\n'; break;
+          case 't': c = '\t'; break;
+          case 'r': c = '\r'; break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          default: break; // \uXXXX остается как есть
+        }
+      }
+      if (out) out->push_back(c);
+    }
+    return expect('"');
+  }
+
+  bool parseNumber(double *out) {
+    skipSpaces();
+    char *numberEnd = nullptr;
+    double value = strtod(p_, &numberEnd);
+    if (numberEnd == p_ || numberEnd > end_) return false;
+    p_ = numberEnd;
+    if (out) *out = value;
+    return true;
+  }
+
+  /// Пропускает значение любого типа
+  bool skipValue() {
+    skipSpaces();
+    if (p_ >= end_) return false;
+    if (*p_ == '"') return parseString(nullptr);
+    if (*p_ == '{' || *p_ == '[') {
+      char close = *p_ == '{' ? '}' : ']';
+      p_++;
+      skipSpaces();
+      if (p_ < end_ && *p_ == close) {
+        p_++;
+        return true;
+      }
+      while (true) {
+        if (close == '}' && (!parseString(nullptr) || !expect(':'))) return false;
+        if (!skipValue()) return false;
+        skipSpaces();
+        if (p_ >= end_) return false;
+        char c = *p_++;
+        if (c == close) return true;
+        if (c != ',') return false;
+      }
+    }
+    if (*p_ == '-' || (*p_ >= '0' && *p_ <= '9')) return parseNumber(nullptr);
+    while (p_ < end_ && *p_ >= 'a' && *p_ <= 'z') p_++; // true, false, null
+    return true;
+  }
+
+  bool parseObject(TraceEvent &out, bool args) {
+    if (!expect('{')) return false;
+    skipSpaces();
+    if (p_ < end_ && *p_ == '}') {
+      p_++;
+      return true;
+    }
+    while (true) {
+      if (!parseString(&key_) || !expect(':')) return false;
+      bool parsed;
+      double number = 0;
+      if (args) {
+        if (key_ == "value") {
+          skipSpaces();
+          if (p_ < end_ && *p_ == 'n') {
+            out.value = std::numeric_limits<double>::quiet_NaN();
+            parsed = skipValue();
+          } else {
+            parsed = parseNumber(&out.value);
+          }
+        } else if (key_ == "name") {
+          parsed = parseString(&out.argName);
+        } else {
+          parsed = skipValue();
+        }
+      } else if (key_ == "ph") {
+        parsed = parseString(&out.phase);
+      } else if (key_ == "name") {
+        parsed = parseString(&out.name);
+      } else if (key_ == "tid") {
+        parsed = parseNumber(&number);
+        out.tid = (int32_t)number;
+      } else if (key_ == "ts") {
+        parsed = parseNumber(&out.ts);
+      } else if (key_ == "dur") {
+        parsed = parseNumber(&out.dur);
+      } else if (key_ == "args") {
+        skipSpaces();
+        parsed = p_ < end_ && *p_ == '{' ? parseObject(out, true) : skipValue();
+      } else {
+        parsed = skipValue();
+      }
+      if (!parsed) return false;
+      skipSpaces();
+      if (p_ >= end_) return false;
+      char c = *p_++;
+      if (c == '}') return true;
+      if (c != ',') return false;
+    }
+  }
+};
+
+/// События массива traceEvents по одному, файл целиком в память не читается
+class TraceEventReader {
+public:
+  explicit TraceEventReader(const std::string &path)
+  : file_(path, std::ios::binary), buf_(file_) {
+  }
+
+  /// Переходит к первому событию
+  bool open(const std::string &path, std::string &outErrMsg) {
+    if (!file_.is_open()) {
+      outErrMsg = "could not open " + path;
+      return false;
+    }
+    int c = nextToken();
+    if (c == '{') {
+      // {"otherData": {},"traceEvents":[...]}
+      const std::string key = "\"traceEvents\"";
+      size_t matched = 0;
+      while (matched < key.size() && (c = buf_.sbumpc()) != EOF) {
+        matched = c == key[matched] ? matched + 1 : (c == key[0] ? 1 : 0);
+      }
+      if (matched == key.size() && nextToken() == ':') c = nextToken();
+    }
+    if (c != '[') {
+      outErrMsg = buf_.error().empty() ? "no traceEvents in " + path : buf_.error();
+      return false;
+    }
+    return true;
+  }
+
+  /// `false` - конец массива, конец файла или ошибка формата
+  bool next(TraceEvent &event) {
+    int c;
+    do {
+      c = buf_.sgetc();
+      if (c == ',' || c == ' ' || c == '\n' || c == '\r' || c == '\t') buf_.sbumpc();
+    } while (c == ',' || c == ' ' || c == '\n' || c == '\r' || c == '\t');
+    if (c == ']') return false;
+    if (c == EOF) {
+      truncated_ = true;
+      return false;
+    }
+    if (!readObject()) return false;
+    events_++;
+    if (!parser_.parse(text_, event)) {
+      error_ = "JSON parse error in trace event " + std::to_string(events_);
+      return false;
+    }
+    return true;
+  }
+
+  bool truncated() const { return truncated_; }
+
+  /// Ошибка формата или распаковки, пусто если файл прочитан без ошибок
+  std::string error() const { return buf_.error().empty() ? error_ : buf_.error(); }
+
+private:
+  std::ifstream file_;
+  DecompressBuf buf_;
+  TraceEventParser parser_;
+  std::string text_;
+  unsigned long long events_ = 0;
+  std::string error_;
+  bool truncated_ = false;
+
+  int nextToken() {
+    int c = buf_.sbumpc();
+    while (c == ' ' || c == '\n' || c == '\r' || c == '\t') c = buf_.sbumpc();
+    return c;
+  }
+
+  /// Копирует текст события до парной закрывающей скобки
+  bool readObject() {
+    text_.clear();
+    int depth = 0;
+    bool inString = false;
+    bool escape = false;
+    while (true) {
+      int c = buf_.sbumpc();
+      if (c == EOF) {
+        truncated_ = true;
+        return false;
+      }
+      text_.push_back((char)c);
+      if (inString) {
+        if (escape) {
+          escape = false;
+        } else if (c == '\\') {
+          escape = true;
+        } else if (c == '"') {
+          inString = false;
+        }
+      } else if (c == '"') {
+        inString = true;
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if ((c == '}' || c == ']') && --depth == 0) {
+        return true;
+      }
+    }
+  }
+};
+
+/// Замер потока, для которого еще не известен родитель или не все дети
+struct ThreadSpan {
+  std::string name;
+  double start;
+  double end;
+  double time;         // время внутри окна
+  unsigned long count; // замеров верхнего уровня в группе
+  std::unique_ptr<TraceStatsNode> children; // только дети, создается при первом ребенке
+  bool group;          // несколько соседних замеров, слитых при уплотнении: children - их общий безымянный родитель
+};
+
+struct ThreadNesting {
+  std::vector<ThreadSpan> open;    // каждый следующий внутри предыдущего, в них еще могут прийти дети
+  std::deque<ThreadSpan> pending;  // завершенные замеры без родителя, по времени
+};
+
+class TraceNesting {
+public:
+  TraceNesting(const TraceStatsOptions &options, TraceStats &stats)
+  : options_(options), stats_(stats) {
+  }
+
+  void addSpan(int32_t tid, const std::string &name, double start, double end, double time) {
+    ThreadNesting &thread = threads_[tid];
+    ThreadSpan span{name, start, end, time, 1, nullptr, false};
+    while (!thread.open.empty() && !contains(thread.open.back(), span)) {
+      retire(thread, tid);
+    }
+    thread.open.push_back(std::move(span));
+  }
+
+  void finish() {
+    for (auto &keyVal : threads_) {
+      ThreadNesting &thread = keyVal.second;
+      while (!thread.open.empty()) retire(thread, keyVal.first);
+      for (auto &span : thread.pending) adopt(stats_.root, span, keyVal.first);
+      thread.pending.clear();
+    }
+  }
+
+private:
+  const TraceStatsOptions &options_;
+  TraceStats &stats_;
+  std::map<int32_t, ThreadNesting> threads_;
+
+  static bool contains(const ThreadSpan &outer, const ThreadSpan &inner) {
+    return outer.start <= inner.start && inner.end <= outer.end;
+  }
+
+  /// Добавляет замер и его детей в статистику `parent`: свой узел на каждый замер не выделяется
+  void adopt(TraceStatsNode &parent, ThreadSpan &span, int32_t tid) {
+    if (!span.group) {
+      auto &child = parent.children[span.name];
+      if (!child) child.reset(new TraceStatsNode());
+      child->add(span.time, span.end, tid, options_.lastCount, options_.perThread);
+      if (span.children) child->merge(*span.children, options_.lastCount);
+    } else {
+      parent.merge(*span.children, options_.lastCount);
+    }
+  }
+
+  void adoptChild(ThreadSpan &parent, ThreadSpan &span, int32_t tid) {
+    if (!parent.children) parent.children.reset(new TraceStatsNode());
+    adopt(*parent.children, span, tid);
+  }
+
+  /// Последний открытый замер больше не получит детей
+  void retire(ThreadNesting &thread, int32_t tid) {
+    ThreadSpan span = std::move(thread.open.back());
+    thread.open.pop_back();
+    adoptPending(thread, span, tid);
+    if (!thread.open.empty()) {
+      adoptChild(thread.open.back(), span, tid);
+      return;
+    }
+    if (thread.pending.size() >= R_TRACE_STATS_MAX_PENDING) compact(thread, tid);
+    thread.pending.push_back(std::move(span));
+  }
+
+  /// Замер забирает из pending своих детей, записанных раньше него. Забирает, только когда сам завершен:
+  /// за ним в той же пачке могут прийти вложенные в него долгие замеры, которым эти дети принадлежат ближе
+  void adoptPending(ThreadNesting &thread, ThreadSpan &parent, int32_t tid) {
+    auto &pending = thread.pending;
+    size_t hi = pending.size();
+    while (hi > 0 && pending[hi - 1].start >= parent.end && !contains(parent, pending[hi - 1])) hi--;
+    size_t lo = hi;
+    while (lo > 0) {
+      const ThreadSpan &span = pending[lo - 1];
+      // начинается раньше родителя - только группа: часть ее замеров, возможно, принадлежит не ему
+      bool straddles = span.group && span.start < parent.start && span.end > parent.start && span.end <= parent.end;
+      if (!contains(parent, span) && !straddles) break;
+      if (straddles) stats_.approximated += span.count;
+      lo--;
+    }
+    for (size_t i = lo; i < hi; i++) {
+      adoptChild(parent, pending[i], tid);
+    }
+    pending.erase(pending.begin() + lo, pending.begin() + hi);
+  }
+
+  /// Ограничивает память, если родитель долго не приходит (например, один замер на весь трейс):
+  /// каждые groupSize соседних записей pending сливаются в группу, старые замеры оказываются в группах крупнее.
+  /// Записанный позже родитель забирает группу целиком, поэтому вложенность приблизительна,
+  /// только если он начался внутри группы, и только для замеров этой группы
+  void compact(ThreadNesting &thread, int32_t tid) {
+    const size_t groupSize = 8; // чем больше, тем реже уплотнение и слияние старых групп между собой
+    auto &pending = thread.pending;
+    size_t count = 0;
+    for (size_t i = 0; i < pending.size(); i += groupSize) {
+      size_t end = std::min(i + groupSize, pending.size());
+      ThreadSpan &first = pending[i];
+      if (!first.group && end - i > 1) {
+        ThreadSpan group{std::string(), first.start, first.end, 0, 0,
+                         std::unique_ptr<TraceStatsNode>(new TraceStatsNode()), true};
+        addToGroup(group, first, tid);
+        pending[i] = std::move(group);
+      }
+      for (size_t j = i + 1; j < end; j++) addToGroup(pending[i], pending[j], tid);
+      pending[count++] = std::move(pending[i]);
+    }
+    pending.resize(count);
+  }
+
+  void addToGroup(ThreadSpan &group, ThreadSpan &span, int32_t tid) {
+    group.start = std::min(group.start, span.start);
+    group.end = std::max(group.end, span.end);
+    group.count += span.count;
+    adopt(*group.children, span, tid);
+  }
+};
+
+static void addCounter(TraceStats &stats, const std::string &name, double time, double value) {
+  TraceCounterStats &counter = stats.counters[name];
+  if (counter.count == 0 || value < counter.minValue) counter.minValue = value;
+  if (counter.count == 0 || value > counter.maxValue) counter.maxValue = value;
+  if (counter.count == 0 || time >= counter.lastTime) {
+    counter.lastValue = value;
+    counter.lastTime = time;
+  }
+  counter.sum += value;
+  counter.count++;
+}
+
+/// Самое раннее событие трейса: от него отсчитывается окно
+static bool findStartTime(const std::string &path, double &outStart, std::string &outErrMsg) {
+  TraceEventReader reader(path);
+  if (!reader.open(path, outErrMsg)) return false;
+  TraceEvent event;
+  outStart = std::numeric_limits<double>::max();
+  while (reader.next(event)) {
+    if (event.phase == "X" || event.phase == "C") outStart = std::min(outStart, event.ts);
+  }
+  if (!reader.error().empty()) {
+    outErrMsg = reader.error();
+    return false;
+  }
+  if (outStart == std::numeric_limits<double>::max()) outStart = 0;
+  return true;
+}
+
+bool readTraceStats(const std::string &path, const TraceStatsOptions &options, TraceStats &out, std::string &outErrMsg) {
+  double windowStart = -std::numeric_limits<double>::max();
+  double windowEnd = std::numeric_limits<double>::max();
+  if (options.fromSec > 0 || options.toSec > 0) {
+    if (!findStartTime(path, out.startTime, outErrMsg)) return false;
+    windowStart = out.startTime + options.fromSec * 1e6;
+    if (options.toSec > 0) windowEnd = out.startTime + options.toSec * 1e6;
+  }
+
+  TraceEventReader reader(path);
+  if (!reader.open(path, outErrMsg)) return false;
+  TraceNesting nesting(options, out);
+  TraceEvent event;
+  while (reader.next(event)) {
+    if (event.phase == "X") {
+      double end = event.ts + event.dur;
+      // дети замера вне окна тоже вне окна, такие замеры не нужны и для вложенности
+      if (event.ts >= windowEnd || end < windowStart) continue;
+      double time = std::max(0.0, std::min(end, windowEnd) - std::max(event.ts, windowStart));
+      nesting.addSpan(event.tid, event.name, event.ts, end, time);
+      out.spans++;
+    } else if (event.phase == "C") {
+      if (event.ts < windowStart || event.ts >= windowEnd) continue;
+      if (std::isnan(event.value)) continue; // nan и inf в трейсе записаны как null
+      addCounter(out, event.name, event.ts, event.value);
+    } else if (event.phase == "M" && event.name == "thread_name") {
+      out.threadNames[event.tid] = event.argName;
+    }
+  }
+  if (!reader.error().empty()) {
+    outErrMsg = reader.error();
+    return false;
+  }
+  nesting.finish();
+  out.truncated = reader.truncated();
+  return true;
+}
+
+} // namespace Tracing
+} // namespace roadar
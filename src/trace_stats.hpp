@@ -0,0 +1,76 @@
+#pragma once
+
+#include <roadar/benchmark.hpp> // R_FUNC
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef R_TRACE_STATS_MAX_PENDING
+#define R_TRACE_STATS_MAX_PENDING 65536 // замеров потока, ждущих родителя, до уплотнения
+#endif
+
+namespace roadar {
+namespace Tracing {
+
+/*!
+ * \brief Статистика одного пути замеров, восстановленная по трейсу, время в микросекундах.
+ * Замеры на границах окна обрезаются по окну.
+ */
+struct TraceStatsNode {
+  double totalTime = 0;
+  unsigned long timesExecuted = 0;
+  double maxTime = 0;
+  double sumSquares = 0;
+  std::vector<std::pair<double, double>> last;                   // (конец, время) последних замеров, по возрастанию конца
+  std::map<int32_t, std::pair<double, unsigned long>> threads;    // tid трейса -> (время, число), только с perThread
+  std::unordered_map<std::string, std::unique_ptr<TraceStatsNode>> children;
+
+  void add(double time, double end, int32_t tid, size_t lastCount, bool perThread);
+  /// Забирает статистику и детей `other`
+  void merge(TraceStatsNode &other, size_t lastCount);
+};
+
+struct TraceCounterStats {
+  double lastValue = 0;
+  double minValue = 0;
+  double maxValue = 0;
+  double sum = 0;
+  unsigned long count = 0;
+  double lastTime = 0;
+};
+
+struct TraceStatsOptions {
+  double fromSec = 0;      // окно от самого раннего события трейса
+  double toSec = 0;        // <= 0 - до конца трейса
+  size_t lastCount = 10;   // сколько последних замеров узла хранить для `last avg`
+  bool perThread = false;  // заполнять TraceStatsNode::threads
+};
+
+struct TraceStats {
+  TraceStatsNode root;
+  std::map<std::string, TraceCounterStats> counters;
+  std::map<int32_t, std::string> threadNames;
+  double startTime = 0;              // мкс, самое раннее событие (только если задано окно)
+  unsigned long long spans = 0;      // замеров в окне
+  unsigned long long approximated = 0; // замеров, родитель которых определен по соседям, см. R_TRACE_STATS_MAX_PENDING
+  bool truncated = false;            // файл оборван (процесс упал до R_TRACING_STOP)
+};
+
+/*!
+ * \brief Читает трейс `Serializer` (в том числе сжатый) по одному событию и восстанавливает вложенность
+ * замеров каждого потока по ts/dur.
+ *
+ * Фоновый поток Serializer пишет события пачками: внутри пачки по возрастанию начала (родитель раньше детей),
+ * а долгий родитель попадает в одну из следующих пачек, после своих детей. Поэтому у каждого потока есть
+ * цепочка открытых замеров (в них еще могут прийти дети из той же пачки) и список завершенных замеров без
+ * родителя, которых забирает записанный позже родитель. В памяти только эти два списка и дерево путей.
+ */
+R_FUNC
+bool readTraceStats(const std::string &path, const TraceStatsOptions &options, TraceStats &out, std::string &outErrMsg);
+
+} // namespace Tracing
+} // namespace roadar
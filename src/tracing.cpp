@@ -1,30 +1,145 @@
 #include <roadar/tracing.hpp>
+#include "trace_compression.hpp"
+#include <chrono>
 #include <sstream>
 #include <algorithm>
 #include <iomanip>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_set>
 
 namespace roadar {
 namespace Tracing {
 
-Serializer::Serializer(const std::string& filepath, bool flushOnMeasure, std::string &outErrMsg)
+void TraceArgs::set(const TraceArg &arg) {
+    for (int i = 0; i < count; i++) {
+        if (items[i].key == arg.key || strcmp(items[i].key, arg.key) == 0) {
+            items[i] = arg;
+            return;
+        }
+    }
+    if (count < R_TRACE_MAX_ARGS) {
+        items[count++] = arg;
+    }
+}
+
+RingBuffer::RingBuffer(size_t capacity)
+: data_(std::max(capacity, (size_t)1)) {
+}
+
+void RingBuffer::push(const TraceInfo &info) {
+    data_[next_] = info;
+    next_ = (next_ + 1) % data_.size();
+    if (size_ < data_.size()) size_++;
+}
+
+void RingBuffer::collect(unsigned long long fromTime, std::vector<TraceInfo> &out) const {
+    size_t first = (next_ + data_.size() - size_) % data_.size();
+    for (size_t i = 0; i < size_; i++) {
+        const TraceInfo &info = data_[(first + i) % data_.size()];
+        if (info.startTime + info.duration >= fromTime) {
+            out.push_back(info);
+        }
+    }
+}
+
+void RingBuffer::clear() {
+    next_ = 0;
+    size_ = 0;
+}
+
+const char *Serializer::intern(const std::string &str) {
+    static std::mutex internMutex;
+    static std::unordered_set<std::string> interned;
+    std::lock_guard<std::mutex> lock(internMutex);
+    return interned.insert(str).first->c_str();
+}
+
+std::string Serializer::escape(const std::string &str) {
+    std::string result;
+    result.reserve(str.size());
+    for (char c : str) {
+        switch (c) {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char code[8];
+                    snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+                    result += code;
+                } else {
+                    result += c;
+                }
+        }
+    }
+    return result;
+}
+
+/// Вещественное значение аргумента или счетчика без фиксированных 3 знаков потока: 1e-4 не превращается в 0.000.
+/// nan и inf в JSON не бывает, вместо них null
+static void writeReal(std::ostream &json, double value) {
+    if (!std::isfinite(value)) {
+        json << "null";
+        return;
+    }
+    std::ios::fmtflags flags = json.flags();
+    std::streamsize precision = json.precision();
+    json.unsetf(std::ios::floatfield);
+    json << std::setprecision(std::numeric_limits<double>::digits10) << value;
+    json.flags(flags);
+    json.precision(precision);
+}
+
+static void writeArgs(std::ostream &json, const TraceArgs &args) {
+    json << ",\"args\":{";
+    for (int i = 0; i < args.count; i++) {
+        const TraceArg &arg = args.items[i];
+        if (i > 0) json << ",";
+        json << "\"" << Serializer::escape(arg.key) << "\":";
+        switch (arg.type) {
+            case ArgType::integer:
+                json << arg.intValue;
+                break;
+            case ArgType::real:
+                writeReal(json, arg.realValue);
+                break;
+            case ArgType::string:
+                json << "\"" << Serializer::escape(arg.stringValue) << "\"";
+                break;
+            case ArgType::none:
+                json << "null";
+                break;
+        }
+    }
+    json << "}";
+}
+
+Serializer::Serializer(const std::string& filepath, bool flushOnMeasure, std::string &outErrMsg,
+                       Compression compression, bool background)
 : flushOnMeasure_(flushOnMeasure) {
-    std::lock_guard<std::mutex> lock(mut_);
-    outStream_.open(filepath);
-    
-    if (outStream_.is_open()) {
-        writeHeader();
-    } else {
-        outErrMsg = "RBenchmark::Tracing::Serializer could not open results file:\n" + filepath;
+    std::lock_guard<std::mutex> lock(outMut_);
+    buf_.reset(new CompressBuf(filepath, compression, outErrMsg));
+    if (!outErrMsg.empty()) {
+        buf_.reset();
+        closed_ = true;
+        return;
+    }
+    out_.reset(new std::ostream(buf_.get()));
+    writeHeader();
+    if (background) {
+        writer_ = std::thread(&Serializer::writerLoop, this);
     }
 }
 Serializer::~Serializer() {
     end();
 }
 
-void Serializer::end() {
-    std::lock_guard<std::mutex> lock(mut_);
-    if (!outStream_.is_open()) return;
-    sort(data_.begin(), data_.end(), [](const TraceInfo &a, const TraceInfo &b) -> bool {
+static void sortTraces(std::vector<TraceInfo> &data) {
+    sort(data.begin(), data.end(), [](const TraceInfo &a, const TraceInfo &b) -> bool {
         if (a.startTime == b.startTime) {
             if (a.duration == b.duration) {
                 return a.stackDepth < b.stackDepth;
@@ -35,42 +150,94 @@ void Serializer::end() {
             return a.startTime < b.startTime;
         }
     });
+}
+
+void Serializer::end() {
+    std::vector<TraceInfo> rest;
     {
-        std::lock_guard<std::mutex> lock(threadIdMutex_);
-        for (const auto &d: data_) {
-            write(d, true);
-        }
+        std::lock_guard<std::mutex> lock(mut_);
+        if (closed_) return;
+        closed_ = true;
+        rest.swap(data_);
     }
-    data_.clear();
+    writerCv_.notify_all();
+    if (writer_.joinable()) writer_.join();
+    writeBatch(rest);
+    std::lock_guard<std::mutex> lock(outMut_);
     writeFooter();
-    outStream_.close();
+    out_.reset();
+    buf_->finish();
+}
+
+void Serializer::writerLoop() {
+    std::unique_lock<std::mutex> lock(mut_);
+    while (!closed_) {
+        writerCv_.wait_for(lock, std::chrono::milliseconds(R_TRACE_WRITE_INTERVAL_MS));
+        if (data_.empty()) continue;
+        std::vector<TraceInfo> batch;
+        batch.swap(data_);
+        // форматирование и сжатие без mut_: записывающие потоки только добавляют в data_
+        lock.unlock();
+        writeBatch(batch);
+        lock.lock();
+    }
+}
+
+void Serializer::writeBatch(std::vector<TraceInfo> &batch) {
+    if (batch.empty()) return;
+    sortTraces(batch);
+    std::lock_guard<std::mutex> lock(outMut_);
+    std::lock_guard<std::mutex> idLock(threadIdMutex_);
+    for (const auto &d: batch) {
+        write(d, true);
+    }
 }
 
 
 void Serializer::saveTrace(TraceInfo info) {
     std::lock_guard<std::mutex> lock(mut_);
+    if (closed_) return; // уже вызван end()
     data_.push_back(std::move(info));
 }
 
+void Serializer::formatEvent(std::ostream &json, const TraceInfo &info, int32_t tidIdx) {
+    json << ",{";
+    if (info.type == TraceType::counter) {
+        json << "\"cat\":\"counter\",";
+        json << "\"name\":\"" << escape(info.name) << "\",";
+        json << "\"ph\":\"C\",";
+        json << "\"pid\":0,";
+        json << "\"tid\":" << tidIdx << ",";
+        json << "\"ts\":" << info.startTime << ",";
+        json << "\"args\":{\"value\":";
+        writeReal(json, info.value);
+        json << "}";
+    } else {
+        json << "\"cat\":\"function\",";
+        json << "\"dur\":" << (info.duration) << ',';
+        json << "\"name\":\"" << escape(info.name) << "\",";
+        json << "\"ph\":\"X\",";
+        json << "\"pid\":0,";
+        json << "\"tid\":" << tidIdx << ",";
+        json << "\"ts\":" << info.startTime;
+        if (info.args.count > 0) {
+            writeArgs(json, info.args);
+        }
+    }
+    json << "}";
+}
+
 void Serializer::write(const TraceInfo& info, bool threadSafe) {
     std::stringstream json;
     
-    auto tidIdx = getThreadIdx(info.tid, false);
+    auto tidIdx = getThreadIdx(info.tid, !threadSafe);
     json << std::setprecision(3) << std::fixed;
-    json << ",{";
-    json << "\"cat\":\"function\",";
-    json << "\"dur\":" << (info.duration) << ',';
-    json << "\"name\":\"" << info.name << "\",";
-    json << "\"ph\":\"X\",";
-    json << "\"pid\":0,";
-    json << "\"tid\":" << tidIdx << ",";
-    json << "\"ts\":" << info.startTime;
-    json << "}";
+    formatEvent(json, info, tidIdx);
     
     if (threadSafe) {
         write(json.str(), flushOnMeasure_);
     } else {
-        std::lock_guard<std::mutex> lock(mut_);
+        std::lock_guard<std::mutex> lock(outMut_);
         write(json.str(), flushOnMeasure_);
     }
 }
@@ -86,27 +253,61 @@ void Serializer::writeThreadName(const std::thread::id &tid, const std::string &
     json << "\"ph\":\"M\",";
     json << "\"pid\":0,";
     json << "\"tid\":" << tidIdx << ",";
-    json << "\"args\":{\"name\":\"" << name << "\"}";
+    json << "\"args\":{\"name\":\"" << escape(name) << "\"}";
     json << "}";
     
-    std::lock_guard<std::mutex> lock(mut_);
+    std::lock_guard<std::mutex> lock(outMut_);
+    write(json.str(), flushOnMeasure_);
+}
+
+void Serializer::writeThreadInfo(const std::thread::id &tid, const std::string &name, long long osTid,
+                                 const std::string &affinity, int priority) {
+    std::stringstream json;
+
+    auto tidIdx = getThreadIdx(tid, true);
+    json << ",{";
+    json << "\"cat\":\"function\",";
+    json << "\"name\":\"thread_name\",";
+    json << "\"ph\":\"M\",";
+    json << "\"pid\":0,";
+    json << "\"tid\":" << tidIdx << ",";
+    json << "\"args\":{\"name\":\"" << escape(name) << "\"";
+    if (osTid != 0) json << ",\"os_tid\":" << osTid;
+    if (!affinity.empty()) json << ",\"affinity\":\"" << escape(affinity) << "\"";
+    json << ",\"priority\":" << priority << "}";
+    json << "}";
+
+    std::lock_guard<std::mutex> lock(outMut_);
+    write(json.str(), flushOnMeasure_);
+}
+
+void Serializer::writeProcessName(const std::string &name) {
+    std::stringstream json;
+    json << ",{";
+    json << "\"cat\":\"function\",";
+    json << "\"name\":\"process_name\",";
+    json << "\"ph\":\"M\",";
+    json << "\"pid\":0,";
+    json << "\"args\":{\"name\":\"" << escape(name) << "\"}";
+    json << "}";
+
+    std::lock_guard<std::mutex> lock(outMut_);
     write(json.str(), flushOnMeasure_);
 }
 
 void Serializer::writeHeader() {
-    outStream_ << R"({"otherData": {},"traceEvents":[{})";
-    outStream_.flush();
+    *out_ << R"({"otherData": {},"traceEvents":[{})";
 }
 
 void Serializer::writeFooter() {
-    outStream_ << "]}";
-    outStream_.flush();
+    *out_ << "]}";
+    out_->flush();
 }
 
 void Serializer::write(const std::string &str, bool flush) {
-    if (!outStream_.is_open()) return;
-    outStream_ << str;
-    if(flush) outStream_.flush();
+    if (!out_) return;
+    *out_ << str;
+    if(flush) out_->flush();
 }
 
 int32_t Serializer::getThreadIdx(const std::thread::id &id, bool lock) {
@@ -0,0 +1,108 @@
+//
+// C++20 coroutine spans: time spent suspended in co_await is excluded from the
+// measurement, the coroutine continues on another thread without breaking the
+// thread stacks, and every resumption is a separate slice in the trace.
+//
+// Usage: coroutine_test
+//
+
+
+#include <roadar/benchmark.hpp>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+static int failures = 0;
+
+#define CHECK(_condition_)                                                         \
+  do {                                                                             \
+    if (!(_condition_)) {                                                          \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #_condition_ << std::endl; \
+      failures++;                                                                  \
+    }                                                                              \
+  } while (false)
+
+struct Task {
+  struct promise_type {
+    Task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+/// Продолжает корутину из другого потока через `delay`
+struct ResumeOnThread {
+  std::thread &thread;
+  std::chrono::milliseconds delay;
+
+  bool await_ready() { return false; }
+  void await_suspend(std::coroutine_handle<> handle) {
+    // после запуска потока кадр корутины (и этот объект) может быть уже удален
+    auto delay = this->delay;
+    std::thread &target = thread;
+    target = std::thread([handle, delay]() {
+      std::this_thread::sleep_for(delay);
+      handle.resume();
+    });
+  }
+  void await_resume() {}
+};
+
+static Task readAndParse(std::thread &resumer) {
+  R_BENCHMARK_COROUTINE("io");
+  R_CO_AWAIT(ResumeOnThread{resumer, std::chrono::milliseconds(50)});
+  R_BENCHMARK_SCOPED("parse");
+}
+
+/// Значение поля `key` первого объекта с `"name":"<name>"`
+static double jsonField(const std::string &json, const std::string &name, const std::string &key) {
+  size_t pos = json.find("\"name\":\"" + name + "\"");
+  if (pos == std::string::npos) return -1;
+  pos = json.find("\"" + key + "\":", pos);
+  if (pos == std::string::npos) return -1;
+  return atof(json.c_str() + pos + key.size() + 3);
+}
+
+int main() {
+  const std::string tracePath = "coroutine_trace.json";
+  R_TRACING_START(tracePath);
+  std::thread resumer;
+  readAndParse(resumer);
+  resumer.join();
+  R_TRACING_STOP();
+
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("error") == std::string::npos);
+  CHECK(jsonField(json, "io", "times") == 1);
+  CHECK(jsonField(json, "io", "elapsed") >= 50);
+  CHECK(jsonField(json, "io", "total") < 50);
+  CHECK(jsonField(json, "parse", "times") == 1);
+
+  std::ifstream file(tracePath);
+  std::stringstream trace;
+  trace << file.rdbuf();
+  std::string traceString = trace.str();
+  int slices = 0;
+  for (size_t pos = traceString.find("\"name\":\"io\""); pos != std::string::npos;
+       pos = traceString.find("\"name\":\"io\"", pos + 1)) {
+    slices++;
+  }
+  CHECK(slices == 2);
+  std::remove(tracePath.c_str());
+
+  if (failures > 0) {
+    std::cerr << json << std::endl << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  std::cerr << "ok" << std::endl;
+  return 0;
+}
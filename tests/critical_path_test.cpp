@@ -0,0 +1,100 @@
+//
+// Critical path tool on a producer/consumer trace: the consumer's wait must be
+// attributed to the producer's work on the other thread, not to the wait itself.
+//
+// Usage: critical_path_test path/to/critical_path
+//
+
+
+#include <roadar/benchmark.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+static int failures = 0;
+
+#define CHECK(_condition_)                                                         \
+  do {                                                                             \
+    if (!(_condition_)) {                                                          \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #_condition_ << std::endl; \
+      failures++;                                                                  \
+    }                                                                              \
+  } while (false)
+
+/// Время идентификатора на критическом пути из JSON вывода инструмента, -1 если его там нет
+static double pathTime(const std::string &json, const std::string &name) {
+  size_t pos = json.find("{\"name\":\"" + name + "\",\"time\":");
+  if (pos == std::string::npos) return -1;
+  return atof(json.c_str() + json.find(':', json.find("\"time\"", pos)) + 1);
+}
+
+static void recordTrace(const std::string &path) {
+  std::mutex mut;
+  std::condition_variable cv;
+  bool ready = false;
+  R_TRACING_START(path);
+  std::thread consumer([&]() {
+    R_TRACING_THREAD_NAME("consumer");
+    R_BENCHMARK("wait") {
+      std::unique_lock<std::mutex> lock(mut);
+      cv.wait(lock, [&ready]() { return ready; });
+    }
+    R_BENCHMARK("process") {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  });
+  std::thread producer([&]() {
+    R_TRACING_THREAD_NAME("producer");
+    R_BENCHMARK("produce") {
+      std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      ready = true;
+    }
+    cv.notify_one();
+  });
+  consumer.join();
+  producer.join();
+  R_TRACING_STOP();
+}
+
+int main(int argc, const char * argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: critical_path_test path/to/critical_path" << std::endl;
+    return 2;
+  }
+  const std::string tracePath = "critical_path_trace.json";
+  const std::string outPath = "critical_path_out.json";
+  recordTrace(tracePath);
+
+  std::string command = std::string("\"") + argv[1] + "\" " + tracePath + " --json > " + outPath;
+  CHECK(std::system(command.c_str()) == 0);
+  std::ifstream file(outPath);
+  std::stringstream ss;
+  ss << file.rdbuf();
+  std::string json = ss.str();
+
+  CHECK(pathTime(json, "produce") >= 35);
+  CHECK(pathTime(json, "process") >= 8);
+  CHECK(pathTime(json, "wait") < 10); // ожидание на пути - только задержка пробуждения
+  CHECK(json.find("\"name\":\"producer\"") != std::string::npos);
+  CHECK(json.find("\"name\":\"consumer\"") != std::string::npos);
+
+  std::remove(tracePath.c_str());
+  std::remove(outPath.c_str());
+  if (failures > 0) {
+    std::cerr << json << std::endl;
+    std::cerr << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  std::cerr << "ok" << std::endl;
+  return 0;
+}
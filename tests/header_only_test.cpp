@@ -0,0 +1,29 @@
+//
+// Header-only build check: measurements from different translation units
+// must end up in one tree, not in a separate copy of the library state per file.
+//
+// Usage: header_only_test
+//
+
+
+#include <rbenchmark.hpp>
+#include <iostream>
+#include <string>
+
+void recordInOtherUnit();
+
+int main() {
+  R_BENCHMARK_START("main_unit");
+  recordInOtherUnit();
+  R_BENCHMARK_STOP("main_unit");
+
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  if (json.find("\"name\":\"main_unit\",\"total\"") == std::string::npos ||
+      json.find("\"name\":\"other_unit\",\"total\"") == std::string::npos ||
+      json.find("\"times\":3") == std::string::npos) {
+    std::cerr << "measurements of translation units are not merged:\n" << json << std::endl;
+    return 1;
+  }
+  std::cerr << "ok" << std::endl;
+  return 0;
+}
@@ -0,0 +1,12 @@
+//
+// Second translation unit for header_only_test.
+//
+
+
+#include <rbenchmark.hpp>
+
+void recordInOtherUnit() {
+  for (int i = 0; i < 3; i++) {
+    R_BENCHMARK_SCOPED("other_unit");
+  }
+}
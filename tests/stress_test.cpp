@@ -0,0 +1,978 @@
+//
+// Concurrency stress test: many threads record measurements while other threads
+// log, reset, start/stop tracing and the flight recorder at the same time.
+// Meant to be run under ThreadSanitizer / AddressSanitizer (-DBENCHMARK_SANITIZER=thread|address).
+//
+// Usage: stress_test [--seconds N]
+//
+
+
+#include <roadar/benchmark.hpp>
+#include "binary_trace.hpp"
+#include "json_reader.hpp"
+#include "trace_compression.hpp"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+static int failures = 0;
+
+// allocations made by the current thread while counting is enabled
+static thread_local bool countAllocations = false;
+static thread_local unsigned long allocations = 0;
+
+void *operator new(size_t size) {
+  if (countAllocations) allocations++;
+  void *ptr = malloc(size == 0 ? 1 : size);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  if (countAllocations) allocations++;
+  return malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  free(ptr);
+}
+
+R_BENCHMARK_CATEGORY(stress_off, off, 1)
+R_BENCHMARK_CATEGORY(stress_sampled, sampled, 5)
+
+#define CHECK(_condition_)                                                         \
+  do {                                                                             \
+    if (!(_condition_)) {                                                          \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #_condition_ << std::endl; \
+      failures++;                                                                  \
+    }                                                                              \
+  } while (false)
+
+static void worker(int index, const std::atomic<bool> &stop) {
+  const std::string frame = "frame";
+  const std::string inner = "inner_" + std::to_string(index % 4);
+  long long i = 0;
+  while (!stop) {
+    R_BENCHMARK_START(frame);
+    R_BENCHMARK_ARG("frame", i);
+    {
+      R_BENCHMARK_SCOPED(inner);
+      R_BENCHMARK_ARG("worker", index);
+      R_COUNTER("queue_depth", i % 16);
+    }
+    R_BENCHMARK("batch") {
+      volatile int sum = 0;
+      for (int k = 0; k < 10; k++) sum += k;
+    }
+    R_BENCHMARK_STOP(frame);
+    if (i % 1000 == 0) {
+      R_TRACING_THREAD_NAME("worker_" + std::to_string(index));
+    }
+    i++;
+  }
+}
+
+static void stressConcurrent(double seconds) {
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> threads;
+  unsigned workers = std::max(4u, std::thread::hardware_concurrency());
+  for (unsigned t = 0; t < workers; t++) {
+    threads.emplace_back(worker, (int)t, std::cref(stop));
+  }
+
+  threads.emplace_back([&stop]() {
+    while (!stop) {
+      std::string table = R_BENCHMARK_LOG(roadar::Field::none);
+      std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+      CHECK(!table.empty());
+      CHECK(!json.empty());
+    }
+  });
+  threads.emplace_back([&stop]() {
+    while (!stop) {
+      R_BENCHMARK_RESET();
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  });
+  threads.emplace_back([&stop]() {
+    int i = 0;
+    while (!stop) {
+      auto compression = roadar::benchmarkSetTracingCompression(static_cast<roadar::TraceCompression>(i % 3));
+      bool binary = i % 2 == 0 && R_TRACING_START_BINARY("stress_tracing.rbt", 16);
+      std::string path = "stress_tracing_" + std::to_string(i++ % 2) + ".json";
+      R_TRACING_START(path);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      R_TRACING_STOP();
+      if (binary) std::remove("stress_tracing.rbt");
+      std::remove(roadar::Tracing::compressedPath(path, static_cast<roadar::Tracing::Compression>(compression)).c_str());
+    }
+    roadar::benchmarkSetTracingCompression(roadar::TraceCompression::none);
+  });
+  threads.emplace_back([&stop]() {
+    bool budget = false;
+    while (!stop) {
+      R_FLIGHT_RECORDER_START("stress_flight.json", 1);
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      R_BENCHMARK_BUDGET("inner_0", budget ? 0.001 : 0);
+      budget = !budget;
+      if (R_FLIGHT_RECORDER_DUMP()) {
+        // сжатие переключает поток трейсинга
+        for (const char *path : {"stress_flight_1.json", "stress_flight_1.json.gz", "stress_flight_1.json.rlz"}) {
+          std::remove(path);
+        }
+      }
+      R_FLIGHT_RECORDER_STOP();
+    }
+  });
+
+  threads.emplace_back([&stop]() {
+    // короткоживущие потоки: их замеры переносятся в группу завершившихся потоков
+    while (!stop) {
+      std::thread shortLived([]() {
+        R_THREAD_NAME("short lived");
+        R_BENCHMARK_SCOPED("short_lived");
+        R_COUNTER("short_lived_count", 1);
+      });
+      shortLived.join();
+    }
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds((long long)(seconds * 1000)));
+  stop = true;
+  for (auto &thread : threads) thread.join();
+  R_BENCHMARK_BUDGET("inner_0", 0);
+  R_BENCHMARK_RESET();
+}
+
+/// После конкурентной работы результаты всех потоков должны сходиться точно
+static void checkExactCounts() {
+  const int threadsCount = 8;
+  const int iterations = 1000;
+  R_BENCHMARK_RESET();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadsCount; t++) {
+    threads.emplace_back([]() {
+      for (int i = 0; i < iterations; i++) {
+        R_BENCHMARK_SCOPED("exact");
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("\"times\":" + std::to_string(threadsCount * iterations)) != std::string::npos);
+  R_BENCHMARK_RESET();
+}
+
+/// Идентификаторы сверх лимита попадают в "(other)" и в отчет о переполнении
+static void checkCardinalityLimit() {
+  roadar::benchmarkSetCardinalityLimits(4);
+  R_BENCHMARK_START("cardinality");
+  for (int i = 0; i < 10; i++) {
+    R_BENCHMARK_SCOPED("request_" + std::to_string(i));
+  }
+  R_BENCHMARK_STOP("cardinality");
+  roadar::benchmarkSetCardinalityLimits(0);
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("\"name\":\"(other)\",\"total\"") != std::string::npos);
+  CHECK(json.find("\"name\":\"cardinality » (other)\",\"cardinality\":true,\"kept\":4,\"redirected\":6") != std::string::npos);
+  CHECK(json.find("request_9") == std::string::npos);
+  // после сброса уровень снова принимает новые идентификаторы
+  R_BENCHMARK_RESET();
+  roadar::benchmarkSetCardinalityLimits(4);
+  R_BENCHMARK_START("cardinality");
+  for (int i = 0; i < 4; i++) {
+    R_BENCHMARK_SCOPED("fresh_" + std::to_string(i));
+  }
+  R_BENCHMARK_STOP("cardinality");
+  roadar::benchmarkSetCardinalityLimits(0);
+  json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("\"name\":\"fresh_3\"") != std::string::npos);
+  CHECK(json.find("\"cardinality\":true") == std::string::npos);
+  // узлы калибровки не попадают под лимиты
+  roadar::benchmarkSetCardinalityLimits(1);
+  CHECK(roadar::benchmarkCalibrate(1000) >= 0);
+  roadar::benchmarkSetCardinalityLimits(0);
+  R_BENCHMARK_RESET();
+}
+
+/// Калибровка не попадает в лог и трейсинг пользователя
+static void checkCalibrationIsolated() {
+  R_BENCHMARK_RESET();
+  const char *path = "stress_calibration.json";
+  R_TRACING_START(path);
+  CHECK(roadar::benchmarkCalibrate(1000) >= 0);
+  R_TRACING_STOP();
+  std::ifstream file(path);
+  std::string trace((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  CHECK(!trace.empty());
+  CHECK(trace.find("\"empty\"") == std::string::npos);
+  file.close();
+  std::remove(path);
+  CHECK(R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json).find("calibration") == std::string::npos);
+  R_BENCHMARK_RESET();
+}
+
+/// Чередующиеся соседние замеры с длинными именами после первого прохода не выделяют память
+static void checkSiblingAllocations() {
+  R_BENCHMARK_RESET();
+  const char *names[] = {"sibling_scope_number_one", "sibling_scope_number_two",
+                         "sibling_scope_number_three", "sibling_scope_number_four"};
+  for (int pass = 0; pass < 2; pass++) {
+    countAllocations = pass == 1;
+    R_BENCHMARK_START("siblings_parent");
+    for (int i = 0; i < 100; i++) {
+      for (const char *name : names) {
+        R_BENCHMARK_SCOPED(name);
+      }
+    }
+    R_BENCHMARK_STOP("siblings_parent");
+    countAllocations = false;
+  }
+  CHECK(allocations == 0);
+  R_BENCHMARK_RESET();
+}
+
+/// Медленный замер сохраняет flight recorder в фоновом потоке
+static void checkFlightRecorderSlowSpan() {
+  R_BENCHMARK_RESET();
+  R_FLIGHT_RECORDER_START("stress_slow.json", 10);
+  roadar::benchmarkFlightRecorderDumpOnSlowSpan(1);
+  {
+    R_BENCHMARK_SCOPED("slow_span");
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  std::string trace;
+  for (int i = 0; i < 200 && trace.find("slow_span") == std::string::npos; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::ifstream file("stress_slow_1.json");
+    trace.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  }
+  CHECK(trace.find("slow_span") != std::string::npos);
+  roadar::benchmarkFlightRecorderDumpOnSlowSpan(0);
+  R_FLIGHT_RECORDER_STOP();
+  std::remove("stress_slow_1.json");
+  R_BENCHMARK_RESET();
+}
+
+/// Выключенная категория не создает узлов, выборочная записывает каждый N-й вызов
+static void checkCategories() {
+  R_BENCHMARK_RESET();
+  int evaluated = 0;
+  for (int i = 0; i < 10; i++) {
+    R_BENCHMARK_CAT(stress_off, (evaluated++, "category_off"));
+    R_BENCHMARK_CAT(stress_sampled, "category_sampled");
+  }
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(evaluated == 0);
+  CHECK(json.find("category_off") == std::string::npos);
+  CHECK(json.find("\"name\":\"category_sampled\",\"total\"") != std::string::npos);
+  CHECK(json.find("\"times\":2") != std::string::npos);
+  R_BENCHMARK_RESET();
+}
+
+/// R_BENCHMARK_SCOPED_RESET закрывает текущий замер и открывает следующий на том же уровне
+static void checkScopedReset() {
+  R_BENCHMARK_RESET();
+  for (int i = 0; i < 3; i++) {
+    R_BENCHMARK_SCOPED("scoped_first");
+    R_BENCHMARK_SCOPED_RESET(std::string("scoped_second"));
+  }
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("\"name\":\"scoped_first\",\"total\"") != std::string::npos);
+  CHECK(json.find("\"name\":\"scoped_second\",\"total\"") != std::string::npos);
+  CHECK(json.find("scoped_first » scoped_second") == std::string::npos);
+  CHECK(json.find("\"times\":3") != std::string::npos);
+  R_BENCHMARK_RESET();
+}
+
+/// Непарный stop не сбрасывает статистику: стек раскручивается до своего замера, ошибки считаются по месту вызова
+static void checkMismatchRecovery() {
+  R_BENCHMARK_RESET();
+  for (int i = 0; i < 3; i++) {
+    R_BENCHMARK_START("mismatch_outer");
+    R_BENCHMARK_START("mismatch_forgotten");
+    R_BENCHMARK_START("mismatch_inner");
+    R_BENCHMARK_STOP("mismatch_inner");
+    R_BENCHMARK_STOP("mismatch_outer"); // mismatch_forgotten не закрыт
+  }
+  R_BENCHMARK_STOP("mismatch_unknown");
+  {
+    R_BENCHMARK_SCOPED("mismatch_scoped");
+    R_BENCHMARK_START("mismatch_in_scope");
+  }
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("\"name\":\"mismatch_outer\",\"total\"") != std::string::npos);
+  CHECK(json.find("\"name\":\"mismatch_inner\",\"total\"") != std::string::npos);
+  CHECK(json.find("\"name\":\"mismatch_scoped\",\"total\"") != std::string::npos);
+  CHECK(json.find("\"name\":\"mismatch_outer\",\"error\":\"stop mismatch\"") != std::string::npos);
+  CHECK(json.find("\"times\":3,\"unwound\":3") != std::string::npos);
+  CHECK(json.find("\"name\":\"mismatch_unknown\",\"error\":\"stop not open\"") != std::string::npos);
+  CHECK(json.find("\"name\":\"mismatch_scoped\",\"error\":\"stop mismatch\",\"file\":\"\",\"line\":0,\"times\":1,\"unwound\":1") != std::string::npos);
+  std::string table = R_BENCHMARK_LOG(roadar::Field::none);
+  CHECK(table.find("Errors") != std::string::npos);
+  CHECK(table.find("stress_test.cpp") != std::string::npos);
+  // текст ошибки экранируется при выводе: JSON остается корректным и возвращает исходную строку
+  const std::string quoted = "mismatch \"quoted\"\nsecond line\\";
+  R_BENCHMARK_STOP(quoted);
+  std::stringstream log(R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json));
+  roadar::Json::Value root;
+  roadar::Json::Reader reader(log);
+  CHECK(reader.parse(root));
+  bool found = false;
+  for (const auto &item : root.items) {
+    if (item.string("name") == quoted && item.string("error") == "stop not open") found = true;
+  }
+  CHECK(found);
+  CHECK(R_BENCHMARK_LOG(roadar::Field::none).find("mismatch \"quoted\" second line") != std::string::npos);
+  // статистика и счетчики ошибок живут до явного сброса
+  CHECK(R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json).find("mismatch_outer") != std::string::npos);
+  R_BENCHMARK_RESET();
+  CHECK(R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json).find("\"error\"") == std::string::npos);
+}
+
+/// View::flat складывает собственное время идентификатора по всем путям, рекурсия не удваивает total
+static void checkFlatProfile() {
+  R_BENCHMARK_RESET();
+  for (const char *parent : {"flat_parent_a", "flat_parent_b"}) {
+    R_BENCHMARK_SCOPED(parent);
+    for (int i = 0; i < 2; i++) {
+      R_BENCHMARK_SCOPED("flat_resize");
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  }
+  {
+    R_BENCHMARK_SCOPED("flat_recursive");
+    R_BENCHMARK_SCOPED_L("flat_recursive");
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::stringstream in(R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json, nullptr, roadar::View::flat));
+  roadar::Json::Value root;
+  roadar::Json::Reader reader(in);
+  CHECK(reader.parse(root));
+  // переполнения из checkCardinalityLimit сброс очищает, в логе только строки профиля
+  std::map<std::string, const roadar::Json::Value *> flat;
+  for (const auto &item : root.items) {
+    if (item.find("flat")) flat[item.string("name")] = &item;
+  }
+  CHECK(flat.size() == 4);
+  CHECK(root.items.size() == flat.size());
+  CHECK(!root.items.empty() && root.items.front().string("name") == "flat_resize");
+  CHECK(flat.count("flat_resize") && flat["flat_resize"]->number("times") == 4);
+  CHECK(flat.count("flat_resize") && flat["flat_resize"]->number("self") >= 8);
+  CHECK(flat.count("flat_recursive") && flat["flat_recursive"]->number("times") == 2);
+  CHECK(flat.count("flat_recursive") && flat["flat_recursive"]->number("total") < 2 * flat["flat_recursive"]->number("self"));
+
+  roadar::benchmarkSetFlatViewTop(1);
+  std::string table = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::table, nullptr, roadar::View::flat);
+  CHECK(table.find("flat: 1 of 4 identifiers") != std::string::npos);
+  CHECK(table.find("flat_resize:") != std::string::npos);
+  CHECK(table.find("flat_parent_a") == std::string::npos);
+  roadar::benchmarkSetFlatViewTop(30);
+  R_BENCHMARK_RESET();
+}
+
+/// Сжатый трейс читается обратно целиком, события пишутся фоновым потоком частями
+static void checkCompressedTracing() {
+  const int spans = 20000;
+  long long plainSize = 0;
+  for (auto requested : {roadar::TraceCompression::none, roadar::TraceCompression::gzip, roadar::TraceCompression::lz}) {
+    auto compression = static_cast<roadar::Tracing::Compression>(roadar::benchmarkSetTracingCompression(requested));
+    std::string path = roadar::Tracing::compressedPath("stress_compressed.json", compression);
+    R_TRACING_START("stress_compressed.json");
+    for (int i = 0; i < spans; i++) {
+      R_BENCHMARK_SCOPED("compressed_span");
+      R_BENCHMARK_ARG("index", i);
+      if (i == spans / 2) std::this_thread::sleep_for(std::chrono::milliseconds(2 * R_TRACE_WRITE_INTERVAL_MS));
+    }
+    R_TRACING_STOP();
+
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    CHECK(file.is_open());
+    long long size = (long long)file.tellg();
+    file.seekg(0);
+    roadar::Tracing::DecompressBuf buf(file);
+    std::istream in(&buf);
+    roadar::Json::Value root;
+    roadar::Json::Reader reader(in);
+    CHECK(reader.parse(root));
+    CHECK(buf.error().empty());
+    int count = 0;
+    const roadar::Json::Value *events = root.find("traceEvents");
+    if (events) {
+      for (const auto &event : events->items) {
+        if (event.string("name") == "compressed_span") count++;
+      }
+    }
+    CHECK(count == spans);
+    if (compression == roadar::Tracing::Compression::none) {
+      plainSize = size;
+    } else {
+      CHECK(size * 5 < plainSize);
+    }
+    file.close();
+    std::remove(path.c_str());
+  }
+  roadar::benchmarkSetTracingCompression(roadar::TraceCompression::none);
+  R_BENCHMARK_RESET();
+}
+
+/// Число событий `name` в бинарном трейсе после перевода в JSON
+static int binaryTraceCount(const std::string &path, const std::string &name, std::string &json, std::string &error) {
+  std::stringstream out;
+  CHECK(roadar::Tracing::convertBinaryTrace(path, out, error));
+  json = out.str();
+  roadar::Json::Value root;
+  roadar::Json::Reader reader(out);
+  CHECK(reader.parse(root));
+  int count = 0;
+  const roadar::Json::Value *events = root.find("traceEvents");
+  if (events) {
+    for (const auto &event : events->items) {
+      if (event.string("name") == name) count++;
+    }
+  }
+  return count;
+}
+
+/// Потоки пишут события прямо в отображенный файл, записанное переживает аварийный выход
+static void checkBinaryTracing() {
+  const int threadsCount = 2;
+  const int iterations = 2000;
+  const std::string path = "stress_binary.rbt";
+  std::string json, error;
+  if (!R_TRACING_START_BINARY(path, 4)) return; // платформа без mmap
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadsCount; t++) {
+    threads.emplace_back([t]() {
+      R_THREAD_NAME("binary_" + std::to_string(t));
+      for (int i = 0; i < iterations; i++) {
+        R_BENCHMARK_SCOPED("binary_outer");
+        R_BENCHMARK_ARG("index", i);
+        R_BENCHMARK_ARG("scale", 0.5);
+        R_BENCHMARK_ARG("source", "camera_with_a_long_source_name");
+        R_BENCHMARK_SCOPED_L("binary_inner_identifier_longer_than_one_record_of_text");
+        R_COUNTER("binary_counter", i);
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  R_TRACING_STOP();
+  CHECK(binaryTraceCount(path, "binary_outer", json, error) == threadsCount * iterations);
+  CHECK(error.empty());
+  CHECK(binaryTraceCount(path, "binary_inner_identifier_longer_than_one_record_of_text", json, error) == threadsCount * iterations);
+  CHECK(json.find("\"index\":1999,\"scale\":0.5,\"source\":\"camera_with_a_long_\"") != std::string::npos);
+  CHECK(json.find("\"name\":\"binary_counter\",\"ph\":\"C\"") != std::string::npos);
+  CHECK(json.find("\"args\":{\"name\":\"binary_1\"}") != std::string::npos);
+
+  // файл меньше записанного: лишние события отбрасываются, остальные читаются
+  R_TRACING_START_BINARY(path, 1);
+  for (int i = 0; i < 20000; i++) {
+    R_BENCHMARK_SCOPED("binary_overflow");
+  }
+  R_TRACING_STOP();
+  int written = binaryTraceCount(path, "binary_overflow", json, error);
+  CHECK(written > 0 && written < 20000);
+  CHECK(error.find("did not fit") != std::string::npos);
+
+#if defined(__linux__) || defined(__APPLE__)
+  pid_t child = fork();
+  if (child == 0) {
+    R_TRACING_START_BINARY(path, 4);
+    for (int i = 0; i < 1000; i++) {
+      R_BENCHMARK_SCOPED("binary_crashed");
+    }
+    _exit(0); // без R_TRACING_STOP и деструкторов, как при падении
+  }
+  int status = 0;
+  waitpid(child, &status, 0);
+  error.clear();
+  CHECK(binaryTraceCount(path, "binary_crashed", json, error) == 1000);
+  CHECK(error.empty());
+#endif
+  std::remove(path.c_str());
+  R_BENCHMARK_RESET();
+}
+
+/// Заполненный файл больше не выдает чанков: счетчик не растет, чужие чанки не перезаписываются
+static void checkBinaryTraceFull() {
+  const int threadsCount = 4;
+  const std::string path = "stress_binary_full.rbt";
+  std::string error;
+  {
+    roadar::Tracing::BinaryTraceFile binary(path, R_BINARY_TRACE_CHUNK, 0, error);
+    if (!error.empty()) return; // платформа без mmap
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadsCount; t++) {
+      threads.emplace_back([&binary, t]() {
+        roadar::Tracing::BinaryCursor cursor;
+        binary.attach(cursor, "full_" + std::to_string(t));
+        for (int i = 0; i < 200000; i++) {
+          roadar::Tracing::BinaryRecord *record = binary.reserve(cursor, 1);
+          if (!record) continue;
+          record->id = (uint32_t)t;
+          roadar::Tracing::BinaryTraceFile::commit(*record, roadar::Tracing::BinaryRecordType::counter);
+        }
+        CHECK(cursor.exhausted);
+      });
+    }
+    for (auto &thread : threads) thread.join();
+  }
+  roadar::Tracing::BinaryTraceHeader header;
+  std::ifstream file(path, std::ios::binary);
+  file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  CHECK(file.gcount() == (std::streamsize)sizeof(header));
+  CHECK(header.chunkCount == 1);
+  CHECK(header.nextChunk.load() == 1);
+  CHECK(header.dropped.load() == threadsCount);
+  file.close();
+
+  std::stringstream out;
+  CHECK(roadar::Tracing::convertBinaryTrace(path, out, error));
+  CHECK(error.find("events of 4 threads did not fit") != std::string::npos);
+  std::remove(path.c_str());
+}
+
+/// Заголовок испорченного файла проверяется по размеру файла до выделения памяти под чанки
+static void checkBinaryTraceCorrupted() {
+  const std::string path = "stress_binary_corrupted.rbt";
+  std::string error;
+  {
+    roadar::Tracing::BinaryTraceFile binary(path, R_BINARY_TRACE_CHUNK, 0, error);
+    if (!error.empty()) return; // платформа без mmap
+    roadar::Tracing::BinaryCursor cursor;
+    binary.attach(cursor, "corrupted");
+  }
+  roadar::Tracing::BinaryTraceHeader header;
+  {
+    std::ifstream file(path, std::ios::binary);
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  }
+  std::stringstream out;
+  CHECK(roadar::Tracing::convertBinaryTrace(path, out, error));
+
+  auto convertWith = [&](uint32_t chunkSize, uint32_t chunkCount, uint32_t nextChunk) {
+    roadar::Tracing::BinaryTraceHeader corrupted;
+    memcpy(reinterpret_cast<char *>(&corrupted), reinterpret_cast<const char *>(&header), sizeof(header));
+    corrupted.chunkSize = chunkSize;
+    corrupted.chunkCount = chunkCount;
+    corrupted.nextChunk.store(nextChunk);
+    {
+      std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+      file.write(reinterpret_cast<const char *>(&corrupted), sizeof(corrupted));
+    }
+    std::stringstream json;
+    error.clear();
+    return roadar::Tracing::convertBinaryTrace(path, json, error);
+  };
+  CHECK(!convertWith(0, header.chunkCount, header.nextChunk.load()));
+  CHECK(!convertWith(header.chunkSize, 0xfffffff0u, 0xfffffff0u));
+  CHECK(!convertWith(0xffffffc0u, header.chunkCount, header.nextChunk.load()));
+  CHECK(!convertWith(header.chunkSize, header.chunkCount + 1, header.chunkCount + 1)); // выданный чанк за концом файла
+  CHECK(error.find("does not match the file size") != std::string::npos);
+  std::remove(path.c_str());
+}
+
+/// Событие `name` из разобранного трейса, nullptr - нет такого события
+static const roadar::Json::Value *findTraceEvent(const roadar::Json::Value &root, const std::string &name) {
+  const roadar::Json::Value *events = root.find("traceEvents");
+  if (!events) return nullptr;
+  for (const auto &event : events->items) {
+    if (event.string("name") == name) return &event;
+  }
+  return nullptr;
+}
+
+/// Кавычки и обратная косая черта в аргументах, счетчиках и именах потоков не ломают трейс,
+/// вещественные значения без округления
+static void checkTraceEscaping() {
+  const std::string path = "stress_escaping.json";
+  const std::string binaryPath = "stress_escaping.rbt";
+  for (int binary = 0; binary < 2; binary++) {
+    if (binary) {
+      if (!R_TRACING_START_BINARY(binaryPath, 1)) break; // платформа без mmap
+    } else {
+      R_TRACING_START(path);
+    }
+    {
+      R_BENCHMARK_SCOPED("escaped_span");
+      R_BENCHMARK_ARG("q\"k\\", roadar::benchmarkIntern("C:\\cam \"front\""));
+      R_BENCHMARK_ARG("small", 1e-4);
+      R_BENCHMARK_ARG("nan", std::nan(""));
+      R_COUNTER("gauge \"ratio\"", 1e-4);
+      R_COUNTER("gauge \"ratio\"", std::nan(""));
+    }
+    std::thread named([]() {
+      R_THREAD_NAME("cam \"front\"\\0");
+      R_BENCHMARK_SCOPED("escaped_thread_span");
+    });
+    named.join();
+    R_TRACING_STOP();
+
+    std::stringstream json;
+    std::string error;
+    if (binary) {
+      CHECK(roadar::Tracing::convertBinaryTrace(binaryPath, json, error));
+      std::remove(binaryPath.c_str());
+    } else {
+      std::ifstream file(path);
+      json << file.rdbuf();
+      // null вместо nan пропускается, по трейсу строится лог
+      std::string log = roadar::benchmarkLogFromTrace(path, 0, 0, roadar::Field::none, roadar::Format::json, nullptr,
+                                                      roadar::View::tree, &error);
+      CHECK(error.empty());
+      CHECK(log.find("\"name\":\"gauge \\\"ratio\\\"\",\"counter\":true") != std::string::npos);
+      std::remove(path.c_str());
+    }
+    roadar::Json::Value root;
+    roadar::Json::Reader reader(json);
+    CHECK(reader.parse(root));
+    const roadar::Json::Value *span = findTraceEvent(root, "escaped_span");
+    CHECK(span && span->find("args"));
+    if (!span || !span->find("args")) continue;
+    const roadar::Json::Value &args = *span->find("args");
+    CHECK(args.string("q\"k\\") == "C:\\cam \"front\"");
+    CHECK(args.number("small") == 1e-4);
+    CHECK(args.find("nan") && args.find("nan")->type == roadar::Json::Value::Type::null);
+    // у обоих значений одно время, порядок событий в трейсе не определен
+    int small = 0, nulls = 0;
+    for (const auto &event : root.find("traceEvents")->items) {
+      if (event.string("name") != "gauge \"ratio\"" || !event.find("args")) continue;
+      const roadar::Json::Value *value = event.find("args")->find("value");
+      if (value && value->type == roadar::Json::Value::Type::null) nulls++;
+      if (value && value->type == roadar::Json::Value::Type::number && value->numberValue == 1e-4) small++;
+    }
+    CHECK(small == 1 && nulls == 1);
+    bool threadNamed = false;
+    for (const auto &event : root.find("traceEvents")->items) {
+      if (event.string("name") == "thread_name" && event.find("args") &&
+          event.find("args")->string("name") == "cam \"front\"\\0") {
+        threadNamed = true;
+      }
+    }
+    CHECK(threadNamed);
+  }
+  R_BENCHMARK_RESET();
+}
+
+/// Лог по трейсу совпадает с живым логом, хотя долгие родители записываются в трейс после своих детей
+static void checkTraceStats() {
+  const int threadsCount = 2;
+  const int frames = 200;
+  const std::string path = "stress_trace_stats.json";
+  R_BENCHMARK_RESET();
+  R_TRACING_START(path);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadsCount; t++) {
+    threads.emplace_back([t]() {
+      R_TRACING_THREAD_NAME("stats_" + std::to_string(t));
+      R_BENCHMARK("stats_outer") {
+        for (int i = 0; i < frames; i++) {
+          R_BENCHMARK("stats_frame") {
+            R_BENCHMARK("stats_inner") {
+              if (i == frames / 2) std::this_thread::sleep_for(std::chrono::milliseconds(2 * R_TRACE_WRITE_INTERVAL_MS));
+            }
+          }
+        }
+      }
+      R_BENCHMARK("stats_after") {}
+      R_COUNTER("stats_counter", t);
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  R_TRACING_STOP();
+
+  // сравниваем пути и число замеров: время в логе и в трейсе одно и то же, но округляется по-разному
+  auto fields = roadar::Field::total | roadar::Field::average | roadar::Field::lastAverage | roadar::Field::running |
+                roadar::Field::percent | roadar::Field::percentMissed | roadar::Field::drift;
+  std::string live = R_BENCHMARK_LOG(fields, roadar::Format::json);
+  std::string error;
+  std::string offline = roadar::benchmarkLogFromTrace(path, 0, 0, fields, roadar::Format::json, nullptr,
+                                                      roadar::View::tree, &error);
+  CHECK(error.empty());
+  // переполнения из checkCardinalityLimit сброс очищает, живой лог совпадает с логом по трейсу целиком
+  CHECK(!offline.empty() && live == offline);
+  CHECK(offline.find("{\"name\":\"stats_inner\",\"times\":" + std::to_string(threadsCount * frames) + "}") != std::string::npos);
+  CHECK(offline.find("\"name\":\"stats_counter\",\"counter\":true") != std::string::npos);
+
+  std::string table = roadar::benchmarkLogFromTrace(path, 0, 0, roadar::Field::none, roadar::Format::table, nullptr,
+                                                    roadar::View::threads, &error);
+  CHECK(table.find("[stats_1]:") != std::string::npos);
+  CHECK(table.find("approximate") == std::string::npos);
+
+  // окно до паузы: stats_outer обрезан, stats_after в окно не попал
+  std::string window = roadar::benchmarkLogFromTrace(path, 0, 0.5 * R_TRACE_WRITE_INTERVAL_MS / 1000., fields,
+                                                     roadar::Format::json, nullptr, roadar::View::tree, &error);
+  CHECK(window.find("\"name\":\"stats_outer\"") != std::string::npos);
+  CHECK(window.find("stats_after") == std::string::npos);
+
+  // процесс упал посреди записи: лог строится по целым событиям
+  std::ifstream file(path, std::ios::binary);
+  std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::ofstream(path, std::ios::binary) << text.substr(0, text.size() * 2 / 3);
+  table = roadar::benchmarkLogFromTrace(path, 0, 0, roadar::Field::none, roadar::Format::table, nullptr,
+                                        roadar::View::tree, &error);
+  CHECK(error.empty());
+  CHECK(table.find("file is truncated") != std::string::npos);
+  CHECK(table.find("stats_frame") != std::string::npos);
+
+  // путь с кавычкой и обратной косой чертой попадает в текст ошибки, JSON остается корректным
+  std::string missing = roadar::benchmarkLogFromTrace("stress_\"missing\"\\trace.json", 0, 0, roadar::Field::none,
+                                                      roadar::Format::json, nullptr, roadar::View::tree, &error);
+  CHECK(!error.empty());
+  std::stringstream missingJson(missing);
+  roadar::Json::Value missingRoot;
+  roadar::Json::Reader missingReader(missingJson);
+  CHECK(missingReader.parse(missingRoot));
+  CHECK(missingRoot.string("error").find("stress_\"missing\"\\trace.json") != std::string::npos);
+  std::remove(path.c_str());
+  R_BENCHMARK_RESET();
+}
+
+/// Не static: с -rdynamic имя функции видно в отчете сэмплера
+void stressSpinForSampler(int ms) {
+  auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+  volatile double sum = 0;
+  while (std::chrono::steady_clock::now() < end) {
+    for (int i = 0; i < 1000; i++) sum += i;
+  }
+}
+
+/// Сэмплер относит процессорное время к открытому замеру и функции внутри него
+static void checkSampler() {
+  R_BENCHMARK_RESET();
+  if (!R_SAMPLER_START(1000)) return; // платформа без сэмплера
+  {
+    R_BENCHMARK_SCOPED("sampled_span");
+    stressSpinForSampler(300);
+  }
+  // потоки, начавшие замеры после старта сэмплера, получают свой таймер
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 2; i++) {
+    threads.emplace_back([i]() {
+      R_BENCHMARK_SCOPED("sampled_thread_" + std::to_string(i));
+      stressSpinForSampler(200);
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  R_SAMPLER_STOP();
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("\"name\":\"sampled_span\",\"sampled\":true") != std::string::npos);
+  CHECK(json.find("\"name\":\"sampled_thread_0\",\"sampled\":true") != std::string::npos);
+  CHECK(json.find("\"name\":\"sampled_thread_1\",\"sampled\":true") != std::string::npos);
+  CHECK(json.find("stressSpinForSampler") != std::string::npos);
+  R_BENCHMARK_RESET();
+  CHECK(R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json).find("\"sampled\"") == std::string::npos);
+}
+
+/// Callback бюджета срабатывает только на замерах дольше порога
+static void checkBudgetViolation() {
+  R_BENCHMARK_RESET();
+  std::vector<roadar::BudgetViolation> violations;
+  roadar::benchmarkSetBudgetCallback([&violations](const roadar::BudgetViolation &violation) {
+    violations.push_back(violation);
+  });
+  roadar::benchmarkSetBudget("budget_span", 2);
+  R_BENCHMARK_START("budget_parent");
+  for (int i = 0; i < 5; i++) {
+    R_BENCHMARK_SCOPED("budget_span");
+    stressSpinForSampler(i % 2 == 0 ? 0 : 5);
+  }
+  R_BENCHMARK_STOP("budget_parent");
+  roadar::benchmarkSetBudgetCallback(nullptr);
+  CHECK(violations.size() == 2);
+  for (const auto &violation : violations) {
+    CHECK(violation.identifier == "budget_span");
+    CHECK(violation.path == "budget_parent » budget_span");
+    CHECK(violation.timeMs > violation.budgetMs);
+    CHECK(violation.budgetMs == 2);
+  }
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("\"over budget\":2") != std::string::npos);
+  roadar::benchmarkSetBudget("budget_span", 0);
+  R_BENCHMARK_RESET();
+}
+
+/// Замедление относительно сохраненного baseline помечается один раз, замер быстрее baseline - нет
+static void checkRegressionAgainstBaseline() {
+  R_BENCHMARK_RESET();
+  const char *path = "stress_baseline.json";
+  std::string error;
+  std::vector<roadar::RegressionInfo> regressions;
+  roadar::benchmarkSetRegressionCallback([&regressions](const roadar::RegressionInfo &info) {
+    regressions.push_back(info);
+  });
+  // не медленнее baseline: значения baseline подставлены, замер пустой, а порог по drift такой, что
+  // сработать может только остановка потока на секунды - под ctest -j и санитайзерами проверка не мигает
+  {
+    std::ofstream injected(path);
+    injected << "{\"baseline\":[{\"name\":\"regression_noop\",\"times\":20,\"avg\":1.000,\"std\":0.050}]}";
+  }
+  CHECK(roadar::benchmarkLoadBaseline(path, &error));
+  roadar::benchmarkSetRegressionThreshold(3.0, 100.0);
+  for (int i = 0; i < 20; i++) {
+    R_BENCHMARK_SCOPED("regression_noop");
+  }
+  roadar::benchmarkSetRegressionThreshold();
+  CHECK(regressions.empty());
+  CHECK(R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json).find("\"drift\":-") != std::string::npos);
+  R_BENCHMARK_RESET();
+
+  for (int i = 0; i < 20; i++) {
+    R_BENCHMARK_SCOPED("regression_span");
+    stressSpinForSampler(1);
+  }
+  CHECK(roadar::benchmarkSaveBaseline(path, &error));
+  R_BENCHMARK_RESET();
+  CHECK(roadar::benchmarkLoadBaseline(path, &error));
+  // в 4 раза медленнее: сообщение приходит один раз, пока замедление не пропадет
+  for (int i = 0; i < 30; i++) {
+    R_BENCHMARK_SCOPED("regression_span");
+    stressSpinForSampler(4);
+  }
+  roadar::benchmarkSetRegressionCallback(nullptr);
+  CHECK(regressions.size() == 1);
+  if (!regressions.empty()) {
+    CHECK(regressions[0].path == "regression_span");
+    CHECK(regressions[0].drift > 1);
+    CHECK(regressions[0].score >= 3);
+    CHECK(regressions[0].currentMs > regressions[0].baselineMs);
+  }
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("\"drift\":") != std::string::npos);
+
+  // пустой baseline отключает сравнение
+  {
+    std::ofstream empty(path);
+    empty << "[]";
+  }
+  CHECK(roadar::benchmarkLoadBaseline(path, &error));
+  std::remove(path);
+  R_BENCHMARK_RESET();
+}
+
+/// Harness отбрасывает медленный повтор и строит доверительный интервал по остальным
+static void checkHarnessOutliers() {
+  R_BENCHMARK_RESET();
+  static int calls = 0; // участок остается зарегистрированным после теста
+  // minTimeMs = 0: одна итерация на повтор, вызов 1 - подбор итераций, 2 - прогрев, 3..12 - повторы
+  roadar::benchmarkRegister("harness_outlier", []() {
+    calls++;
+    stressSpinForSampler(calls == 7 ? 50 : 1);
+  });
+  roadar::HarnessOptions options;
+  options.minTimeMs = 0;
+  options.repetitions = 10;
+  auto results = roadar::benchmarkRunRegistered(options, "harness_outlier");
+  CHECK(calls == 12);
+  CHECK(results.size() == 1);
+  if (results.size() == 1) {
+    const roadar::HarnessResult &result = results[0];
+    CHECK(result.iterations == 1);
+    CHECK(result.outliers >= 1);
+    CHECK(result.repetitions + result.outliers == 10);
+    // с выбросом среднее было бы больше 5.9 ms
+    CHECK(result.meanMs >= 1 && result.meanMs < 3);
+    CHECK(result.medianMs >= 1 && result.medianMs < 3);
+    CHECK(result.ciLowMs <= result.meanMs && result.meanMs <= result.ciHighMs);
+    CHECK(result.ciLowMs > 0);
+  }
+  // все повторы, включая выброс, попадают и в обычное дерево замеров
+  std::string json = R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json);
+  CHECK(json.find("\"name\":\"harness_outlier\",\"total\"") != std::string::npos);
+  R_BENCHMARK_RESET();
+}
+
+/// Число узлов дерева JSON лога; `outNegative` - сколько времен и долей missed отрицательны
+static int countLogNodes(const roadar::Json::Value &items, int &outNegative) {
+  int nodes = 0;
+  for (const auto &item : items.items) {
+    nodes++;
+    for (const char *field : {"total", "avg", "last avg", "missed"}) {
+      if (item.number(field) < 0) outNegative++;
+    }
+    const roadar::Json::Value *children = item.find("children");
+    if (children) nodes += countLogNodes(*children, outNegative);
+  }
+  return nodes;
+}
+
+/// Вычитание накладных расходов не делает время отрицательным даже у пустых замеров
+static void checkOverheadSubtraction() {
+  R_BENCHMARK_RESET();
+  CHECK(roadar::benchmarkCalibrate(10000) > 0);
+  roadar::benchmarkSetOverheadCompensation(true);
+  R_BENCHMARK_START("overhead_parent");
+  for (int i = 0; i < 1000; i++) {
+    R_BENCHMARK_SCOPED("overhead_middle");
+    R_BENCHMARK_SCOPED_L("overhead_empty");
+  }
+  R_BENCHMARK_STOP("overhead_parent");
+  std::stringstream log(R_BENCHMARK_LOG(roadar::Field::none, roadar::Format::json));
+  roadar::benchmarkSetOverheadCompensation(false);
+  CHECK(log.str().find(":-") == std::string::npos);
+  roadar::Json::Value root;
+  roadar::Json::Reader reader(log);
+  CHECK(reader.parse(root));
+  int negative = 0;
+  CHECK(countLogNodes(root, negative) == 3);
+  CHECK(negative == 0);
+  R_BENCHMARK_RESET();
+}
+
+int main(int argc, const char * argv[]) {
+  double seconds = 2;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+      seconds = atof(argv[++i]);
+    }
+  }
+
+  stressConcurrent(seconds);
+  checkExactCounts();
+  checkCardinalityLimit();
+  checkCalibrationIsolated();
+  checkSiblingAllocations();
+  checkFlightRecorderSlowSpan();
+  checkScopedReset();
+  checkCategories();
+  checkMismatchRecovery();
+  checkFlatProfile();
+  checkCompressedTracing();
+  checkBinaryTracing();
+  checkBinaryTraceFull();
+  checkBinaryTraceCorrupted();
+  checkTraceEscaping();
+  checkTraceStats();
+  checkSampler();
+  checkBudgetViolation();
+  checkRegressionAgainstBaseline();
+  checkHarnessOutliers();
+  checkOverheadSubtraction();
+
+  if (failures > 0) {
+    std::cerr << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  std::cerr << "ok" << std::endl;
+  return 0;
+}
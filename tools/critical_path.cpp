@@ -0,0 +1,399 @@
+//
+// Offline critical path of a trace written by R_TRACING_START.
+// Walks back from the span that finished last: inside a thread the path follows span nesting,
+// a wait span jumps to the thread that woke it up (the flow event that ends inside it, or else
+// the latest span end / counter sample on another thread before the wait finished).
+// Prints how much of the end-to-end time every identifier contributes to the path.
+//
+// Usage: critical_path trace.json [--wait NAME]... [--top N] [--json]
+//   trace.json can be compressed (.gz, .rlz), see benchmarkSetTracingCompression
+//   --wait NAME  identifier of a blocking span (last path component); default: names containing "wait"
+//
+
+#include "json_reader.hpp"
+#include "trace_compression.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace roadar;
+
+struct Span {
+  std::string name;
+  std::string path; // "parent » child", как в R_BENCHMARK_LOG
+  int tid;
+  double start;     // мкс
+  double end;
+  int parent = -1;
+  bool wait = false;
+};
+
+/// Момент на другом потоке, который мог разбудить ожидание
+struct WakeEvent {
+  double time;
+  int tid;
+};
+
+struct Flow {
+  WakeEvent source;
+  WakeEvent target;
+};
+
+struct Trace {
+  std::vector<Span> spans;
+  std::map<int, std::vector<int>> threadSpans; // индексы spans по возрастанию начала
+  std::map<int, std::string> threadNames;
+  std::vector<WakeEvent> events;               // концы замеров и счетчики, по возрастанию времени
+  std::vector<Flow> flows;
+};
+
+struct Options {
+  std::string path;
+  std::vector<std::string> waitNames;
+  size_t top = 0;
+  bool json = false;
+};
+
+struct Contribution {
+  double time = 0;
+  int segments = 0;
+};
+
+struct CriticalPath {
+  double length = 0;
+  int jumps = 0;
+  std::map<std::string, Contribution> identifiers;
+  std::map<int, double> threads;
+};
+
+static const char *const untrackedName = "(untracked)";
+
+static bool isWaitName(const std::string &name, const Options &options) {
+  if (!options.waitNames.empty()) {
+    return std::find(options.waitNames.begin(), options.waitNames.end(), name) != options.waitNames.end();
+  }
+  std::string lower = name;
+  std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return (char)tolower(c); });
+  return lower.find("wait") != std::string::npos;
+}
+
+static bool readTrace(const Options &options, Trace &trace, std::string &error) {
+  std::ifstream file(options.path, std::ios::binary);
+  if (!file.is_open()) {
+    error = "could not open " + options.path;
+    return false;
+  }
+  Tracing::DecompressBuf buf(file);
+  std::istream in(&buf);
+  Json::Value root;
+  Json::Reader reader(in);
+  if (!reader.parse(root)) {
+    error = buf.error().empty() ? reader.error() : buf.error();
+    return false;
+  }
+  const Json::Value *events = root.type == Json::Value::Type::array ? &root : root.find("traceEvents");
+  if (!events || events->type != Json::Value::Type::array) {
+    error = "no traceEvents in " + options.path;
+    return false;
+  }
+
+  std::map<std::string, Flow> flows; // по id потока событий
+  for (const auto &event : events->items) {
+    std::string phase = event.string("ph");
+    int tid = (int)event.number("tid");
+    double ts = event.number("ts");
+    if (phase == "X") {
+      Span span;
+      span.name = event.string("name");
+      span.tid = tid;
+      span.start = ts;
+      span.end = ts + event.number("dur");
+      span.wait = isWaitName(span.name, options);
+      trace.spans.push_back(span);
+      trace.events.push_back({span.end, tid});
+    } else if (phase == "C") {
+      trace.events.push_back({ts, tid});
+    } else if (phase == "M" && event.string("name") == "thread_name") {
+      const Json::Value *args = event.find("args");
+      if (args) trace.threadNames[tid] = args->string("name");
+    } else if (phase == "s" || phase == "f") {
+      const Json::Value *id = event.find("id");
+      if (!id) continue;
+      std::string key = id->type == Json::Value::Type::string ? id->stringValue : std::to_string(id->numberValue);
+      if (phase == "s") {
+        flows[key].source = {ts, tid};
+      } else {
+        flows[key].target = {ts, tid};
+      }
+    }
+  }
+  for (const auto &keyVal : flows) {
+    if (keyVal.second.source.time > 0 && keyVal.second.target.time > 0) {
+      trace.flows.push_back(keyVal.second);
+    }
+  }
+  std::sort(trace.events.begin(), trace.events.end(), [](const WakeEvent &a, const WakeEvent &b) {
+    return a.time < b.time;
+  });
+
+  // вложенность восстанавливается по времени внутри потока, как в Perfetto
+  for (size_t i = 0; i < trace.spans.size(); i++) {
+    trace.threadSpans[trace.spans[i].tid].push_back((int)i);
+  }
+  for (auto &keyVal : trace.threadSpans) {
+    auto &indices = keyVal.second;
+    std::sort(indices.begin(), indices.end(), [&trace](int a, int b) {
+      const Span &sa = trace.spans[a];
+      const Span &sb = trace.spans[b];
+      if (sa.start == sb.start) return sa.end > sb.end;
+      return sa.start < sb.start;
+    });
+    std::vector<int> stack;
+    for (int idx : indices) {
+      Span &span = trace.spans[idx];
+      while (!stack.empty() && trace.spans[stack.back()].end < span.end) stack.pop_back();
+      span.parent = stack.empty() ? -1 : stack.back();
+      span.path = span.parent < 0 ? span.name : trace.spans[span.parent].path + " » " + span.name;
+      stack.push_back(idx);
+    }
+  }
+  return true;
+}
+
+/// Самый вложенный замер потока, который идет в момент `t` (start < t <= end), или -1.
+/// `last` - последний замер, начавшийся до `t`
+static int activeSpan(const Trace &trace, int tid, double t, int &last) {
+  const auto &indices = trace.threadSpans.at(tid);
+  auto it = std::lower_bound(indices.begin(), indices.end(), t, [&trace](int idx, double time) {
+    return trace.spans[idx].start < time;
+  });
+  if (it == indices.begin()) {
+    last = -1;
+    return -1;
+  }
+  last = *(it - 1);
+  // замеры внутри потока вложены: идущий в момент t замер - предок последнего начавшегося
+  int span = last;
+  while (span >= 0 && trace.spans[span].end < t) span = trace.spans[span].parent;
+  return span;
+}
+
+/// Событие на другом потоке в интервале (from, to], которое разбудило ожидание
+static bool findWaker(const Trace &trace, int tid, double from, double to, WakeEvent &waker) {
+  bool found = false;
+  for (const auto &flow : trace.flows) {
+    if (flow.target.tid == tid && flow.target.time > from && flow.target.time <= to &&
+        flow.source.time > from && flow.source.time <= to && (!found || flow.source.time > waker.time)) {
+      waker = flow.source;
+      found = true;
+    }
+  }
+  if (found) return true;
+  auto it = std::upper_bound(trace.events.begin(), trace.events.end(), to, [](double time, const WakeEvent &event) {
+    return time < event.time;
+  });
+  while (it != trace.events.begin()) {
+    --it;
+    if (it->time <= from) break;
+    if (it->tid != tid) {
+      waker = *it;
+      return true;
+    }
+  }
+  return false;
+}
+
+static CriticalPath computeCriticalPath(const Trace &trace) {
+  CriticalPath result;
+  if (trace.spans.empty()) return result;
+  int tid = trace.spans[0].tid;
+  double t = trace.spans[0].end;
+  double first = trace.spans[0].start;
+  for (const auto &span : trace.spans) {
+    if (span.end > t) {
+      t = span.end;
+      tid = span.tid;
+    }
+    first = std::min(first, span.start);
+  }
+  result.length = t - first;
+
+  auto attribute = [&result](const std::string &name, int tid, double duration) {
+    if (duration <= 0) return;
+    auto &contribution = result.identifiers[name];
+    contribution.time += duration;
+    contribution.segments++;
+    result.threads[tid] += duration;
+  };
+
+  std::set<int> resolvedWaits; // каждое ожидание переходит на другой поток один раз, иначе возможен цикл
+  while (t > first) {
+    int last = -1;
+    int span = activeSpan(trace, tid, t, last);
+    if (last < 0) {
+      // поток еще не начал работу: начало пути раньше, чем его первый замер
+      attribute(untrackedName, tid, t - first);
+      break;
+    }
+    if (span < 0) {
+      // промежуток без замеров до конца последнего корневого замера
+      int root = last;
+      while (trace.spans[root].parent >= 0) root = trace.spans[root].parent;
+      attribute(untrackedName, tid, t - trace.spans[root].end);
+      t = trace.spans[root].end;
+      continue;
+    }
+    const Span &current = trace.spans[span];
+    WakeEvent waker;
+    if (current.wait && !resolvedWaits.count(span) && findWaker(trace, tid, current.start, t, waker)) {
+      resolvedWaits.insert(span);
+      attribute(current.path, tid, t - waker.time);
+      tid = waker.tid;
+      t = waker.time;
+      result.jumps++;
+      continue;
+    }
+    // собственное время замера до конца его последнего ребенка
+    double boundary = current.start;
+    if (last != span) {
+      int child = last;
+      while (trace.spans[child].parent != span) child = trace.spans[child].parent;
+      boundary = trace.spans[child].end;
+    }
+    attribute(current.path, tid, t - boundary);
+    t = boundary;
+  }
+  return result;
+}
+
+static std::string threadName(const Trace &trace, int tid) {
+  auto it = trace.threadNames.find(tid);
+  return it != trace.threadNames.end() ? it->second : "thread " + std::to_string(tid);
+}
+
+static std::string escape(const std::string &str) {
+  std::string out;
+  for (char c : str) {
+    if (c == '"' || c == '\\') out += '\\';
+    out += c;
+  }
+  return out;
+}
+
+/// Ширина строки в символах: "»" в пути занимает два байта UTF-8
+static size_t displayWidth(const std::string &str) {
+  size_t width = 0;
+  for (char c : str) {
+    if ((c & 0xC0) != 0x80) width++;
+  }
+  return width;
+}
+
+static void printTable(const std::vector<std::vector<std::string>> &rows, std::ostream &out) {
+  std::vector<size_t> widths;
+  for (const auto &row : rows) {
+    for (size_t i = 0; i < row.size(); i++) {
+      if (i >= widths.size()) widths.push_back(0);
+      widths[i] = std::max(widths[i], displayWidth(row[i]));
+    }
+  }
+  for (const auto &row : rows) {
+    for (size_t i = 0; i < row.size(); i++) {
+      std::string padding(widths[i] + 1 - displayWidth(row[i]), ' ');
+      out << (i == 0 ? row[i] + padding : padding + row[i]);
+    }
+    out << "\n";
+  }
+}
+
+static void printResult(const Trace &trace, const CriticalPath &path, const Options &options, std::ostream &out) {
+  std::vector<std::pair<std::string, Contribution>> items(path.identifiers.begin(), path.identifiers.end());
+  std::sort(items.begin(), items.end(), [](const std::pair<std::string, Contribution> &a,
+                                           const std::pair<std::string, Contribution> &b) {
+    return a.second.time > b.second.time;
+  });
+  if (options.top > 0 && items.size() > options.top) items.resize(options.top);
+  double length = std::max(path.length, 1e-9);
+
+  std::stringstream ss;
+  ss << std::setprecision(3) << std::fixed;
+  auto format = [&ss](double val) -> std::string {
+    ss.str("");
+    ss << val;
+    return ss.str();
+  };
+
+  if (options.json) {
+    out << "{\"length\":" << format(path.length / 1000) << ",\"jumps\":" << path.jumps << ",\"items\":[";
+    for (size_t i = 0; i < items.size(); i++) {
+      if (i > 0) out << ",";
+      out << "{\"name\":\"" << escape(items[i].first) << "\",\"time\":" << format(items[i].second.time / 1000)
+          << ",\"percent\":" << format(items[i].second.time * 100 / length)
+          << ",\"segments\":" << items[i].second.segments << "}";
+    }
+    out << "],\"threads\":[";
+    bool firstThread = true;
+    for (const auto &keyVal : path.threads) {
+      if (!firstThread) out << ",";
+      firstThread = false;
+      out << "{\"name\":\"" << escape(threadName(trace, keyVal.first)) << "\",\"time\":" << format(keyVal.second / 1000)
+          << ",\"percent\":" << format(keyVal.second * 100 / length) << "}";
+    }
+    out << "]}\n";
+    return;
+  }
+
+  std::vector<std::vector<std::string>> rows;
+  for (const auto &item : items) {
+    rows.push_back({item.first + ":", "   time:", format(item.second.time / 1000),
+                    "   percent:", format(item.second.time * 100 / length),
+                    "   segments:", std::to_string(item.second.segments)});
+  }
+  out << "================ Critical path ================\n";
+  out << "length: " << format(path.length / 1000) << " ms, thread switches: " << path.jumps << "\n";
+  printTable(rows, out);
+  out << "------------------- Threads -------------------\n";
+  rows.clear();
+  for (const auto &keyVal : path.threads) {
+    rows.push_back({threadName(trace, keyVal.first) + ":", "   time:", format(keyVal.second / 1000),
+                    "   percent:", format(keyVal.second * 100 / length)});
+  }
+  printTable(rows, out);
+  out << "===============================================\n";
+}
+
+int main(int argc, const char * argv[]) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--wait") == 0 && i + 1 < argc) {
+      options.waitNames.push_back(argv[++i]);
+    } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+      options.top = (size_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      options.json = true;
+    } else {
+      options.path = argv[i];
+    }
+  }
+  if (options.path.empty()) {
+    std::cerr << "Usage: critical_path trace.json [--wait NAME]... [--top N] [--json]" << std::endl;
+    return 2;
+  }
+
+  Trace trace;
+  std::string error;
+  if (!readTrace(options, trace, error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  printResult(trace, computeCriticalPath(trace), options, std::cout);
+  return 0;
+}
@@ -0,0 +1,49 @@
+//
+// Converts a binary trace written with R_TRACING_START_BINARY to JSON for https://ui.perfetto.dev/.
+// The file is read one chunk at a time, so it also works for traces of a crashed process
+// and for files larger than memory.
+//
+// Usage: trace_convert trace.rbt out.json [--compress gzip|lz]
+//
+
+#include "binary_trace.hpp"
+#include "trace_compression.hpp"
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace roadar;
+
+int main(int argc, const char * argv[]) {
+  std::string inPath, outPath;
+  Tracing::Compression compression = Tracing::Compression::none;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+      std::string name = argv[++i];
+      compression = name == "gzip" ? Tracing::Compression::gzip : Tracing::Compression::lz;
+    } else if (inPath.empty()) {
+      inPath = argv[i];
+    } else {
+      outPath = argv[i];
+    }
+  }
+  if (inPath.empty() || outPath.empty()) {
+    std::cerr << "Usage: trace_convert trace.rbt out.json [--compress gzip|lz]" << std::endl;
+    return 2;
+  }
+
+  std::string error;
+  outPath = Tracing::compressedPath(outPath, Tracing::availableCompression(compression));
+  Tracing::CompressBuf buf(outPath, compression, error);
+  if (!error.empty()) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  std::ostream out(&buf);
+  bool converted = Tracing::convertBinaryTrace(inPath, out, error);
+  buf.finish();
+  if (!error.empty()) std::cerr << error << std::endl;
+  if (!converted) return 1;
+  std::cerr << "written " << outPath << std::endl;
+  return 0;
+}
@@ -0,0 +1,54 @@
+//
+// Benchmark log (the same table as R_BENCHMARK_LOG) rebuilt from a trace written by R_TRACING_START,
+// e.g. a trace brought from the field. Span nesting is restored per thread from ts/dur,
+// the file is streamed one event at a time, so multi-GB traces need little memory.
+//
+// Usage: trace_stats trace.json [--from SEC] [--to SEC] [--threads | --flat] [--json]
+//   trace.json can be compressed (.gz, .rlz), see benchmarkSetTracingCompression
+//   --from, --to  time window in seconds from the earliest event of the trace
+//   --threads     per thread rows for every node, as View::threads
+//   --flat        identifiers by self time summed over all paths and threads, as View::flat
+//
+
+#include <roadar/benchmark.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace roadar;
+
+int main(int argc, const char * argv[]) {
+  std::string path;
+  double fromSec = 0, toSec = 0;
+  Format format = Format::table;
+  View view = View::tree;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+      fromSec = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+      toSec = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      view = View::threads;
+    } else if (strcmp(argv[i], "--flat") == 0) {
+      view = View::flat;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      format = Format::json;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path.empty()) {
+    std::cerr << "Usage: trace_stats trace.json [--from SEC] [--to SEC] [--threads | --flat] [--json]" << std::endl;
+    return 2;
+  }
+
+  std::string error;
+  std::string log = benchmarkLogFromTrace(path, fromSec, toSec, Field::running | Field::drift, format, nullptr, view, &error);
+  if (!error.empty()) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  std::cout << log << std::endl;
+  return 0;
+}
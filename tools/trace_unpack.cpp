@@ -0,0 +1,44 @@
+//
+// Unpacks a trace written with benchmarkSetTracingCompression (gzip or lz) back to JSON,
+// so it can be opened in https://ui.perfetto.dev/. Plain JSON is copied as is.
+//
+// Usage: trace_unpack trace.json.rlz [out.json]
+//   without out.json the result is written to stdout
+//
+
+#include "trace_compression.hpp"
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using namespace roadar;
+
+int main(int argc, const char * argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: trace_unpack trace.json.rlz [out.json]" << std::endl;
+    return 2;
+  }
+  std::ifstream in(argv[1], std::ios::binary);
+  if (!in.is_open()) {
+    std::cerr << "could not open " << argv[1] << std::endl;
+    return 1;
+  }
+  std::ofstream file;
+  if (argc > 2) {
+    file.open(argv[2], std::ios::binary);
+    if (!file.is_open()) {
+      std::cerr << "could not open " << argv[2] << std::endl;
+      return 1;
+    }
+  }
+  std::ostream &out = file.is_open() ? file : std::cout;
+
+  Tracing::DecompressBuf buf(in);
+  std::istream trace(&buf);
+  out << trace.rdbuf();
+  if (!buf.error().empty()) {
+    std::cerr << argv[1] << ": " << buf.error() << std::endl;
+    return 1;
+  }
+  return 0;
+}